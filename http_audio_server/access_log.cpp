@@ -0,0 +1,148 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include <fstream>
+#include <mutex>
+
+#include <http_audio_server/access_log.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Struct AccessLogRecord
+ */
+
+json AccessLogRecord::to_json() const
+{
+	json res;
+	res["time"] = time;
+	res["method"] = method;
+	res["route"] = route;
+	res["uri"] = uri;
+	res["stream"] = stream_id;
+	res["status"] = status;
+	res["bytes"] = bytes_sent;
+	res["decode_us"] = decode_ns / 1000;
+	res["encode_us"] = encode_ns / 1000;
+	res["send_us"] = send_ns / 1000;
+	res["total_us"] = total_ns / 1000;
+	res["bitrate"] = bitrate;
+	return res;
+}
+
+AccessLogRecord AccessLogRecord::from_json(const json &o)
+{
+	AccessLogRecord res;
+	res.time = o.value("time", std::time_t(0));
+	res.method = o.value("method", std::string());
+	res.route = o.value("route", std::string());
+	res.uri = o.value("uri", std::string());
+	res.stream_id = o.value("stream", std::string());
+	res.status = o.value("status", 0);
+	res.bytes_sent = o.value("bytes", uint64_t(0));
+	res.decode_ns = o.value("decode_us", uint64_t(0)) * 1000;
+	res.encode_ns = o.value("encode_us", uint64_t(0)) * 1000;
+	res.send_ns = o.value("send_us", uint64_t(0)) * 1000;
+	res.total_ns = o.value("total_us", uint64_t(0)) * 1000;
+	res.bitrate = o.value("bitrate", size_t(0));
+	return res;
+}
+
+/*
+ * Class AccessLogImpl
+ */
+
+class AccessLogImpl {
+private:
+	std::string m_filename;
+	size_t m_max_size;
+	size_t m_max_files;
+	std::ofstream m_os;
+	size_t m_size = 0;
+	std::mutex m_mtx;
+
+	void open()
+	{
+		m_os.open(m_filename, std::ios::out | std::ios::app);
+		if (!m_os.good()) {
+			throw std::runtime_error("Cannot open access log " + m_filename);
+		}
+		m_os.seekp(0, std::ios::end);
+		m_size = m_os.tellp();
+	}
+
+	void rotate()
+	{
+		m_os.close();
+		for (size_t i = m_max_files; i > 0; i--) {
+			const std::string src =
+			    (i == 1) ? m_filename
+			             : m_filename + "." + std::to_string(i - 1);
+			const std::string tar = m_filename + "." + std::to_string(i);
+			rename(src.c_str(), tar.c_str());
+		}
+		open();
+	}
+
+public:
+	AccessLogImpl(const std::string &filename, size_t max_size,
+	              size_t max_files)
+	    : m_filename(filename), m_max_size(max_size), m_max_files(max_files)
+	{
+		open();
+	}
+
+	void write(const AccessLogRecord &record)
+	{
+		const std::string line = record.to_json().dump() + "\n";
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (m_size + line.size() > m_max_size && m_size > 0) {
+			rotate();
+		}
+		m_os.write(line.data(), line.size());
+		m_size += line.size();
+	}
+
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_os.flush();
+	}
+};
+
+/*
+ * Class AccessLog
+ */
+
+AccessLog::AccessLog(const std::string &filename, size_t max_size,
+                     size_t max_files)
+    : m_impl(std::make_unique<AccessLogImpl>(filename, max_size, max_files))
+{
+}
+
+AccessLog::~AccessLog()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+void AccessLog::write(const AccessLogRecord &record) { m_impl->write(record); }
+void AccessLog::flush() { m_impl->flush(); }
+}
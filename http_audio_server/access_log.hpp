@@ -0,0 +1,91 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file access_log.hpp
+ *
+ * Structured access log writing one JSON object per line and request. The
+ * log files are rotated once they exceed a configurable size.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_ACCESS_LOG_HPP
+#define HTTP_AUDIO_SERVER_ACCESS_LOG_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+
+#include <http_audio_server/json.hpp>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class AccessLogImpl;
+
+/**
+ * A single access log record. All durations are given in nanoseconds.
+ */
+struct AccessLogRecord {
+	std::time_t time = 0;
+	std::string method;
+	std::string route;
+	std::string uri;
+	std::string stream_id;
+	int status = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t decode_ns = 0;
+	uint64_t encode_ns = 0;
+	uint64_t send_ns = 0;
+	uint64_t total_ns = 0;
+	size_t bitrate = 0;
+
+	json to_json() const;
+	static AccessLogRecord from_json(const json &o);
+};
+
+/**
+ * Appends AccessLogRecord instances as JSON lines to a file. Once the file
+ * exceeds the given size it is renamed to "<filename>.1" (older files are
+ * shifted to "<filename>.2" and so on) and a new file is started.
+ */
+class AccessLog {
+private:
+	std::unique_ptr<AccessLogImpl> m_impl;
+
+public:
+	/**
+	 * Opens the given access log file for appending.
+	 *
+	 * @param filename is the name of the access log file.
+	 * @param max_size is the size in bytes after which the file is rotated.
+	 * @param max_files is the number of rotated files that are kept.
+	 */
+	AccessLog(const std::string &filename, size_t max_size = 64 << 20,
+	          size_t max_files = 4);
+	~AccessLog();
+
+	void write(const AccessLogRecord &record);
+	void flush();
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_ACCESS_LOG_HPP */
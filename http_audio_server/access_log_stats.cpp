@@ -0,0 +1,133 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Offline tool aggregating access logs written by http_audio_server into
+ * per-route latency percentiles. Usage:
+ *
+ *     http_audio_server_access_log_stats [FILE...]
+ *
+ * Reads from standard input if no file is given.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/access_log.hpp>
+
+using namespace http_audio_server;
+
+struct RouteStats {
+	std::vector<uint64_t> total;
+	std::vector<uint64_t> decode;
+	std::vector<uint64_t> encode;
+	std::vector<uint64_t> send;
+	uint64_t bytes_sent = 0;
+	size_t n_errors = 0;
+
+	void add(const AccessLogRecord &record)
+	{
+		total.push_back(record.total_ns);
+		decode.push_back(record.decode_ns);
+		encode.push_back(record.encode_ns);
+		send.push_back(record.send_ns);
+		bytes_sent += record.bytes_sent;
+		n_errors += record.status >= 400 ? 1 : 0;
+	}
+};
+
+static double percentile_ms(std::vector<uint64_t> &values, double p)
+{
+	if (values.empty()) {
+		return 0.0;
+	}
+	const size_t idx = std::min(values.size() - 1, size_t(p * values.size()));
+	std::nth_element(values.begin(), values.begin() + idx, values.end());
+	return values[idx] * 1e-6;
+}
+
+static size_t read_log(std::istream &is, std::map<std::string, RouteStats> &stats)
+{
+	size_t n_invalid = 0;
+	std::string line;
+	while (std::getline(is, line)) {
+		if (line.empty()) {
+			continue;
+		}
+		try {
+			const AccessLogRecord record =
+			    AccessLogRecord::from_json(json::parse(line));
+			const std::string route =
+			    record.method + " " +
+			    (record.route.empty() ? std::string("<unmatched>")
+			                          : record.route);
+			stats[route].add(record);
+		}
+		catch (std::exception &) {
+			n_invalid++;
+		}
+	}
+	return n_invalid;
+}
+
+int main(int argc, char *argv[])
+{
+	std::map<std::string, RouteStats> stats;
+	size_t n_invalid = 0;
+	if (argc <= 1) {
+		n_invalid += read_log(std::cin, stats);
+	}
+	for (int i = 1; i < argc; i++) {
+		std::ifstream is(argv[i]);
+		if (!is.good()) {
+			std::cerr << "Cannot open " << argv[i] << std::endl;
+			return 1;
+		}
+		n_invalid += read_log(is, stats);
+	}
+
+	std::cout << std::fixed << std::setprecision(2);
+	for (auto &route : stats) {
+		RouteStats &s = route.second;
+		std::cout << route.first << "\n"
+		          << "    requests: " << s.total.size()
+		          << ", errors: " << s.n_errors
+		          << ", bytes sent: " << s.bytes_sent << "\n";
+		const std::vector<std::pair<const char *, std::vector<uint64_t> *>>
+		    columns{{"total", &s.total},
+		            {"decode", &s.decode},
+		            {"encode", &s.encode},
+		            {"send", &s.send}};
+		for (const auto &column : columns) {
+			std::cout << "    " << std::setw(6) << column.first
+			          << " p50: " << std::setw(10)
+			          << percentile_ms(*column.second, 0.50)
+			          << " ms, p99: " << std::setw(10)
+			          << percentile_ms(*column.second, 0.99) << " ms\n";
+		}
+	}
+	if (n_invalid > 0) {
+		std::cerr << "Skipped " << n_invalid << " invalid lines" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+
+#include <http_audio_server/admission.hpp>
+#include <http_audio_server/metrics.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct AdmissionMetrics {
+	Counter &admitted = global_metrics().counter(
+	    "http_audio_server_admission_admitted_total",
+	    "Number of new streams accepted by the admission controller");
+	Counter &rejected = global_metrics().counter(
+	    "http_audio_server_admission_rejected_total",
+	    "Number of new streams rejected because the server is overloaded");
+};
+
+AdmissionMetrics &admission_metrics()
+{
+	static AdmissionMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * Class AdmissionController
+ */
+
+AdmissionController::AdmissionController(double capacity,
+                                         double degrade_load,
+                                         double max_load)
+    : m_capacity(capacity),
+      m_degrade_load(degrade_load),
+      m_max_load(max_load),
+      m_window_start(Clock::now())
+{
+	m_collector_idx = global_metrics().add_collector([this](std::ostream &os) {
+		os << "# HELP http_audio_server_admission_load Fraction of the "
+		      "stream processing capacity in use\n"
+		   << "# TYPE http_audio_server_admission_load gauge\n"
+		   << "http_audio_server_admission_load " << load() << "\n"
+		   << "# HELP http_audio_server_admission_rtf Processing time per "
+		      "second of audio of a single stream\n"
+		   << "# TYPE http_audio_server_admission_rtf gauge\n"
+		   << "http_audio_server_admission_rtf " << rtf() << "\n"
+		   << "# HELP http_audio_server_admission_bitrate_scale Factor "
+		      "applied to the bitrate of all streams\n"
+		   << "# TYPE http_audio_server_admission_bitrate_scale gauge\n"
+		   << "http_audio_server_admission_bitrate_scale "
+		   << bitrate_scale() << "\n";
+	});
+}
+
+AdmissionController::~AdmissionController()
+{
+	global_metrics().remove_collector(m_collector_idx);
+}
+
+void AdmissionController::update(Clock::time_point now) const
+{
+	// Fold the busy time of the elapsed window into the load. Idle periods
+	// spanning multiple windows decay the load accordingly.
+	const double elapsed =
+	    std::chrono::duration<double>(now - m_window_start).count();
+	if (elapsed < WINDOW) {
+		return;
+	}
+	const double sample = m_busy / (elapsed * m_capacity);
+	const double decay = std::pow(1.0 - ALPHA, elapsed / WINDOW);
+	m_load = decay * m_load + (1.0 - decay) * sample;
+	m_busy = 0.0;
+	m_window_start = now;
+}
+
+void AdmissionController::set_thresholds(double degrade_load,
+                                         double max_load)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_degrade_load = degrade_load;
+	m_max_load = max_load;
+}
+
+void AdmissionController::record(uint64_t processing_ns, double audio_seconds)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	const double processing = processing_ns * 1e-9;
+	m_busy += processing;
+	if (audio_seconds > 0.0) {
+		m_rtf = (1.0 - ALPHA) * m_rtf + ALPHA * (processing / audio_seconds);
+	}
+	update(Clock::now());
+}
+
+double AdmissionController::load() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	update(Clock::now());
+	return m_load;
+}
+
+double AdmissionController::expected_load(size_t n_streams) const
+{
+	update(Clock::now());
+	return std::max(m_load, n_streams * m_rtf / m_capacity);
+}
+
+double AdmissionController::rtf() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_rtf;
+}
+
+double AdmissionController::bitrate_scale() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_quality.bitrate_scale;
+}
+
+Quality AdmissionController::quality(size_t n_streams)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	const double load = expected_load(n_streams);
+	if (load < m_degrade_load) {
+		m_quality = Quality{1.0, 10};
+	}
+	else if (load < m_max_load) {
+		m_quality = Quality{0.75, 5};
+	}
+	else {
+		m_quality = Quality{0.5, 2};
+	}
+	return m_quality;
+}
+
+bool AdmissionController::admit(size_t n_streams, size_t n_waiting)
+{
+	bool res;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		res = n_waiting == 0 &&
+		      expected_load(n_streams) + m_rtf / m_capacity <= m_max_load;
+	}
+	if (res) {
+		admission_metrics().admitted.inc();
+	}
+	else {
+		admission_metrics().rejected.inc();
+	}
+	return res;
+}
+}
@@ -0,0 +1,150 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file admission.hpp
+ *
+ * Admission control for new streams and graceful degradation of the running
+ * streams while the server is close to its capacity.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_ADMISSION_HPP
+#define HTTP_AUDIO_SERVER_ADMISSION_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace http_audio_server {
+/**
+ * Encoder settings streams are produced with. Lowered while the server is
+ * overloaded to reduce the encoding cost per stream.
+ */
+struct Quality {
+	double bitrate_scale = 1.0;
+	int complexity = 10;
+};
+
+/**
+ * The AdmissionController estimates the load of the thread producing the
+ * streams from the time spent per second of wall-clock time and from the
+ * number of streams times the real-time factor of a single stream, i.e. the
+ * processing time per second of audio. The latter reacts immediately to new
+ * streams, the former to streams becoming more expensive. New streams are
+ * only admitted if their expected cost fits into the remaining capacity and
+ * no stream is waiting for its decoder to be launched. Above the
+ * degradation threshold, streams are encoded with a lower bitrate and
+ * complexity so they do not underrun.
+ */
+class AdmissionController {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * Length of the window over which the busy time is accumulated, in
+	 * seconds.
+	 */
+	static constexpr double WINDOW = 1.0;
+
+	/**
+	 * Weight of a new window or advance in the exponential moving averages.
+	 */
+	static constexpr double ALPHA = 0.25;
+
+	mutable std::mutex m_mtx;
+	double m_capacity;
+	double m_degrade_load;
+	double m_max_load;
+	mutable Clock::time_point m_window_start;
+	mutable double m_busy = 0.0;
+	mutable double m_load = 0.0;
+	double m_rtf = 0.0;
+	Quality m_quality;
+	int m_collector_idx;
+
+	void update(Clock::time_point now) const;
+
+	/**
+	 * Returns the larger of the measured load and the load expected from
+	 * the given number of streams.
+	 */
+	double expected_load(size_t n_streams) const;
+
+public:
+	/**
+	 * Creates a new admission controller.
+	 *
+	 * @param capacity is the processing time in seconds available per
+	 * second, i.e. the number of threads producing the streams.
+	 * @param degrade_load is the load above which streams are degraded.
+	 * @param max_load is the load above which new streams are rejected and
+	 * streams are degraded further.
+	 */
+	AdmissionController(double capacity = 1.0, double degrade_load = 0.7,
+	                    double max_load = 0.9);
+	~AdmissionController();
+
+	/**
+	 * Changes the load thresholds.
+	 */
+	void set_thresholds(double degrade_load, double max_load);
+
+	/**
+	 * Records that producing the given number of seconds of audio took
+	 * processing_ns nanoseconds.
+	 */
+	void record(uint64_t processing_ns, double audio_seconds);
+
+	/**
+	 * Returns the smoothed fraction of the capacity in use.
+	 */
+	double load() const;
+
+	/**
+	 * Returns the smoothed real-time factor of a single stream.
+	 */
+	double rtf() const;
+
+	/**
+	 * Returns the bitrate factor returned by the last call to quality().
+	 */
+	double bitrate_scale() const;
+
+	/**
+	 * Returns the settings streams should currently be encoded with.
+	 *
+	 * @param n_streams is the number of running streams.
+	 */
+	Quality quality(size_t n_streams);
+
+	/**
+	 * Returns true if a new stream may be started. Rejected requests are
+	 * counted in the metrics.
+	 *
+	 * @param n_streams is the number of running streams.
+	 * @param n_waiting is the number of streams waiting for their decoder
+	 * to be launched.
+	 */
+	bool admit(size_t n_streams, size_t n_waiting);
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_ADMISSION_HPP */
@@ -0,0 +1,335 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <http_audio_server/config.hpp>
+#include <http_audio_server/segmenter.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Field table
+ */
+
+namespace {
+struct Field {
+	const char *key;
+	const char *help;
+	bool reloadable;
+	bool is_string;
+	std::function<void(Config &, const json &)> set;
+	std::function<json(const Config &)> get;
+	std::function<void(Config &, const Config &)> copy;
+};
+
+template <typename T>
+Field field(const char *key, T Config::*member, bool reloadable,
+            const char *help)
+{
+	return Field{
+	    key, help, reloadable, std::is_same<T, std::string>::value,
+	    [member](Config &cfg, const json &value) {
+		    if (std::is_unsigned<T>::value && value.is_number() &&
+		        value.get<double>() < 0.0) {
+			    throw std::invalid_argument("must not be negative");
+		    }
+		    cfg.*member = value.get<T>();
+		},
+	    [member](const Config &cfg) { return json(cfg.*member); },
+	    [member](Config &cfg, const Config &other) {
+		    cfg.*member = other.*member;
+		}};
+}
+
+const std::vector<Field> &fields()
+{
+	static const std::vector<Field> fields{
+	    field("host", &Config::host, false, "Address the server listens on"),
+	    field("port", &Config::port, false, "Port the server listens on"),
+	    field("tls_cert", &Config::tls_cert, false,
+	          "PEM certificate chain, enables TLS"),
+	    field("tls_key", &Config::tls_key, false,
+	          "PEM private key, defaults to tls_cert"),
+	    field("index", &Config::index, true, "HTML file served at /"),
+	    field("cache_dir", &Config::cache_dir, false,
+	          "Directory holding the transcoded tracks"),
+	    field("loudness_index", &Config::loudness_index, false,
+	          "File the loudness measurements are stored in"),
+	    field("access_log", &Config::access_log, false, "Access log file"),
+	    field("threads", &Config::threads, false,
+	          "Worker threads, zero for one per CPU core"),
+	    field("max_decoders", &Config::max_decoders, true,
+	          "Maximum number of concurrent ffmpeg processes"),
+	    field("read_ahead", &Config::read_ahead, true,
+	          "PCM bytes buffered per decoder"),
+	    field("max_transcodes", &Config::max_transcodes, false,
+	          "Maximum number of concurrent track cache transcodes"),
+	    field("cache_size", &Config::cache_size, false,
+	          "Bytes of transcoded tracks kept in the cache directory"),
+	    field("resampler", &Config::resampler, true,
+	          "Sample rate converter, \"ffmpeg\" or \"internal\""),
+	    field("bitrate", &Config::bitrate, true, "Bitrate of new streams"),
+	    field("live_bitrate", &Config::live_bitrate, true,
+	          "Default bitrate of live channels"),
+	    field("track_bitrate", &Config::track_bitrate, true,
+	          "Default bitrate of track downloads"),
+	    field("advance", &Config::advance, true,
+	          "Seconds of audio sent per stream advance"),
+	    field("segment_duration", &Config::segment_duration, false,
+	          "Nominal duration of DASH segments in seconds"),
+	    field("degrade_load", &Config::degrade_load, true,
+	          "Load above which streams are encoded with lower quality"),
+	    field("max_load", &Config::max_load, true,
+	          "Load above which new streams are rejected"),
+	    field("retry_after", &Config::retry_after, true,
+	          "Retry-After in seconds sent with rejected streams"),
+	};
+	return fields;
+}
+
+const Field &find_field(const std::string &key)
+{
+	for (const Field &f : fields()) {
+		if (key == f.key) {
+			return f;
+		}
+	}
+	throw std::invalid_argument("Unknown configuration key \"" + key + "\"");
+}
+
+std::string normalize_key(std::string key)
+{
+	std::replace(key.begin(), key.end(), '-', '_');
+	return key;
+}
+}
+
+/*
+ * Struct Config
+ */
+
+void Config::set(const std::string &key, const json &value)
+{
+	const Field &f = find_field(key);
+	try {
+		f.set(*this, value);
+	}
+	catch (std::logic_error &e) {
+		throw std::invalid_argument("Invalid value for \"" + key +
+		                            "\": " + e.what());
+	}
+}
+
+void Config::parse(const std::string &key, const std::string &value)
+{
+	if (find_field(key).is_string) {
+		set(key, json(value));
+		return;
+	}
+	json parsed;
+	try {
+		parsed = json::parse(value);
+	}
+	catch (std::invalid_argument &) {
+		throw std::invalid_argument("Invalid value for \"" + key + "\": " +
+		                            value);
+	}
+	if (!parsed.is_number()) {
+		throw std::invalid_argument("Invalid value for \"" + key + "\": " +
+		                            value);
+	}
+	set(key, parsed);
+}
+
+void Config::read_file(const std::string &filename)
+{
+	std::ifstream is(filename);
+	if (!is.good()) {
+		throw std::invalid_argument("Cannot open configuration file " +
+		                            filename);
+	}
+	json o;
+	try {
+		is >> o;
+	}
+	catch (std::invalid_argument &e) {
+		throw std::invalid_argument("Cannot parse configuration file " +
+		                            filename + ": " + e.what());
+	}
+	if (!o.is_object()) {
+		throw std::invalid_argument("Configuration file " + filename +
+		                            " does not contain a JSON object");
+	}
+	for (auto it = o.begin(); it != o.end(); ++it) {
+		set(it.key(), it.value());
+	}
+}
+
+void Config::read_env()
+{
+	for (const Field &f : fields()) {
+		std::string name = std::string("HTTP_AUDIO_SERVER_") + f.key;
+		std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+		if (const char *value = getenv(name.c_str())) {
+			parse(f.key, value);
+		}
+	}
+}
+
+void Config::read_args(int argc, const char *const argv[])
+{
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg.size() < 3 || arg.compare(0, 2, "--") != 0) {
+			throw std::invalid_argument("Unexpected argument \"" + arg + "\"");
+		}
+		std::string key, value;
+		const size_t eq = arg.find('=');
+		if (eq != std::string::npos) {
+			key = normalize_key(arg.substr(2, eq - 2));
+			value = arg.substr(eq + 1);
+		}
+		else if (i + 1 < argc) {
+			key = normalize_key(arg.substr(2));
+			value = argv[++i];
+		}
+		else {
+			throw std::invalid_argument("Missing value for \"" + arg + "\"");
+		}
+		if (key != "config") {
+			parse(key, value);
+		}
+	}
+}
+
+void Config::validate() const
+{
+	if (port == 0 || port > 65535) {
+		throw std::invalid_argument("port must be between 1 and 65535");
+	}
+	if (max_decoders == 0) {
+		throw std::invalid_argument("max_decoders must be positive");
+	}
+	if (read_ahead == 0) {
+		throw std::invalid_argument("read_ahead must be positive");
+	}
+	if (max_transcodes == 0) {
+		throw std::invalid_argument("max_transcodes must be positive");
+	}
+	if (resampler != "ffmpeg" && resampler != "internal") {
+		throw std::invalid_argument(
+		    "resampler must be \"ffmpeg\" or \"internal\"");
+	}
+	const std::pair<const char *, size_t> bitrates[] = {
+	    {"bitrate", bitrate},
+	    {"live_bitrate", live_bitrate},
+	    {"track_bitrate", track_bitrate},
+	};
+	for (const auto &b : bitrates) {
+		if (b.second < Segmenter::MIN_BITRATE ||
+		    b.second > Segmenter::MAX_BITRATE) {
+			throw std::invalid_argument(
+			    std::string(b.first) + " must be between " +
+			    std::to_string(Segmenter::MIN_BITRATE) + " and " +
+			    std::to_string(Segmenter::MAX_BITRATE));
+		}
+	}
+	if (!(advance > 0.0)) {
+		throw std::invalid_argument("advance must be positive");
+	}
+	if (!(segment_duration > 0.0)) {
+		throw std::invalid_argument("segment_duration must be positive");
+	}
+	if (!(degrade_load > 0.0 && degrade_load <= max_load)) {
+		throw std::invalid_argument(
+		    "degrade_load must be positive and not exceed max_load");
+	}
+}
+
+std::vector<std::string> Config::reload(const Config &other)
+{
+	std::vector<std::string> res;
+	for (const Field &f : fields()) {
+		if (f.reloadable) {
+			f.copy(*this, other);
+		}
+		else if (f.get(*this) != f.get(other)) {
+			res.emplace_back(f.key);
+		}
+	}
+	return res;
+}
+
+json Config::to_json() const
+{
+	json res = json::object();
+	for (const Field &f : fields()) {
+		res[f.key] = f.get(*this);
+	}
+	return res;
+}
+
+Config Config::load(int argc, const char *const argv[])
+{
+	// Locate the configuration file first, it has the lowest precedence
+	std::string filename;
+	if (const char *value = getenv("HTTP_AUDIO_SERVER_CONFIG")) {
+		filename = value;
+	}
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg.compare(0, 9, "--config=") == 0) {
+			filename = arg.substr(9);
+		}
+		else if (arg == "--config" && i + 1 < argc) {
+			filename = argv[i + 1];
+		}
+	}
+
+	Config res;
+	if (!filename.empty()) {
+		res.read_file(filename);
+	}
+	res.read_env();
+	res.read_args(argc, argv);
+	res.validate();
+	return res;
+}
+
+void Config::usage(std::ostream &os)
+{
+	const Config defaults;
+	os << "Usage: http_audio_server [--config <file>] [--<key> <value>]...\n"
+	   << "\nKeys (* may be changed on SIGHUP):\n";
+	for (const Field &f : fields()) {
+		std::string key = f.key;
+		std::replace(key.begin(), key.end(), '_', '-');
+		os << "  --" << key << (f.reloadable ? " *" : "") << "\n      "
+		   << f.help << " (default: " << f.get(defaults) << ")\n";
+	}
+}
+}
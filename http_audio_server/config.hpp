@@ -0,0 +1,137 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file config.hpp
+ *
+ * Server configuration read from a JSON file, environment variables and
+ * command line arguments.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_CONFIG_HPP
+#define HTTP_AUDIO_SERVER_CONFIG_HPP
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/json.hpp>
+
+namespace http_audio_server {
+/**
+ * The Config structure holds all tunable values of the server. Each value
+ * can be given (in increasing order of precedence) in the JSON object stored
+ * in the configuration file, as environment variable HTTP_AUDIO_SERVER_<KEY>
+ * or as command line argument --<key>=<value>. Values marked as reloadable
+ * are applied to the running server on SIGHUP.
+ */
+struct Config {
+	/* Listener */
+	std::string host = "0.0.0.0";
+	size_t port = 4851;
+	std::string tls_cert;
+	std::string tls_key;
+
+	/* Files */
+	std::string index = "../static/index.html"; // reloadable
+	std::string cache_dir = "http_audio_server_cache";
+	std::string loudness_index = "http_audio_server_loudness.json";
+	std::string access_log = "http_audio_server_access.log";
+
+	/* Worker threads and child processes */
+	size_t threads = 0;                  // zero selects the number of CPU cores
+	size_t max_decoders = 64;            // reloadable
+	size_t read_ahead = 1 << 20;         // reloadable
+	size_t max_transcodes = 2;
+	size_t cache_size = size_t(4) << 30; // bytes
+	std::string resampler = "ffmpeg";    // reloadable
+
+	/* Encoder defaults */
+	size_t bitrate = 196000;       // reloadable
+	size_t live_bitrate = 128000;  // reloadable
+	size_t track_bitrate = 128000; // reloadable
+	double advance = 5.0;          // reloadable
+	double segment_duration = 4.0;
+
+	/* Admission control */
+	double degrade_load = 0.7; // reloadable
+	double max_load = 0.9;     // reloadable
+	size_t retry_after = 5;    // reloadable
+
+	/**
+	 * Sets the value with the given key. Throws std::invalid_argument if the
+	 * key is unknown or the value has the wrong type.
+	 */
+	void set(const std::string &key, const json &value);
+
+	/**
+	 * Sets the value with the given key from its textual representation as
+	 * used in environment variables and command line arguments.
+	 */
+	void parse(const std::string &key, const std::string &value);
+
+	/**
+	 * Reads the values stored in the JSON object in the given file.
+	 */
+	void read_file(const std::string &filename);
+
+	/**
+	 * Reads the values from HTTP_AUDIO_SERVER_<KEY> environment variables.
+	 */
+	void read_env();
+
+	/**
+	 * Reads the values from --<key>=<value> or --<key> <value> arguments.
+	 * Dashes in the key are treated as underscores. The --config argument is
+	 * ignored.
+	 */
+	void read_args(int argc, const char *const argv[]);
+
+	/**
+	 * Throws std::invalid_argument if a value is out of range.
+	 */
+	void validate() const;
+
+	/**
+	 * Copies the reloadable values from the given configuration and returns
+	 * the keys of the other values that differ, i.e. which only take effect
+	 * after a restart.
+	 */
+	std::vector<std::string> reload(const Config &other);
+
+	json to_json() const;
+
+	/**
+	 * Assembles the configuration from the defaults, the configuration file
+	 * given by --config or HTTP_AUDIO_SERVER_CONFIG, the environment and the
+	 * command line arguments. Throws std::invalid_argument on error.
+	 */
+	static Config load(int argc, const char *const argv[]);
+
+	/**
+	 * Writes a description of the command line arguments to the given
+	 * stream.
+	 */
+	static void usage(std::ostream &os);
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_CONFIG_HPP */
@@ -16,29 +16,145 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <atomic>
-#include <chrono>
+#include <condition_variable>
 #include <cstddef>
-#include <deque>
+#include <cstring>
 #include <exception>
-#include <iostream>
 #include <mutex>
-#include <sstream>
+#include <stdexcept>
 #include <string>
-#include <thread>
 #include <vector>
 
 #include <http_audio_server/decoder.hpp>
+#include <http_audio_server/diagnostics.hpp>
+#include <http_audio_server/metrics.hpp>
 #include <http_audio_server/process.hpp>
+#include <http_audio_server/reactor.hpp>
+#include <http_audio_server/resampler.hpp>
 
 namespace http_audio_server {
 
+/*
+ * Metrics
+ */
+
+namespace {
+struct DecoderMetrics {
+	Histogram &spawn = global_metrics().histogram(
+	    "http_audio_server_decoder_spawn_seconds",
+	    "Time spent launching the ffmpeg decoder process");
+	Histogram &read = global_metrics().histogram(
+	    "http_audio_server_decoder_read_seconds",
+	    "Time spent reading PCM data from the decoder");
+	Counter &bytes_read = global_metrics().counter(
+	    "http_audio_server_decoder_bytes_read_total",
+	    "Number of PCM bytes read from all decoders");
+	Gauge &active = global_metrics().gauge(
+	    "http_audio_server_decoders_active",
+	    "Number of live ffmpeg decoder processes");
+};
+
+DecoderMetrics &decoder_metrics()
+{
+	static DecoderMetrics metrics;
+	return metrics;
+}
+
+/**
+ * Maximum number of PCM bytes read ahead from ffmpeg. Once the buffer is full,
+ * the reactor stops reading and ffmpeg blocks on the pipe.
+ */
+std::atomic<size_t> decoder_read_ahead{1 << 20};
+
+/**
+ * If set, new decoders convert the sample rate with the Resampler class
+ * instead of ffmpeg.
+ */
+std::atomic<bool> decoder_internal_resampler{false};
+
+/**
+ * Time in seconds ffmpeg is given to exit after being asked to terminate
+ * before it is killed.
+ */
+constexpr double TERMINATE_TIMEOUT = 1.0;
+
+/**
+ * Maximum CPU time in seconds ffmpeg may use while decoding a file.
+ */
+constexpr double FILE_CPU_TIME_LIMIT = 600.0;
+
+uint32_t load_le(const uint8_t *p, size_t n_bytes)
+{
+	uint32_t res = 0;
+	for (size_t i = 0; i < n_bytes; i++) {
+		res |= uint32_t(p[i]) << (8 * i);
+	}
+	return res;
+}
+}
+
 class DecoderImpl {
 private:
-	std::unique_ptr<std::istream> m_input;
+	/**
+	 * Number of bytes read from the pipe at once.
+	 */
+	static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+	AudioFormat m_fmt;
+
+	/**
+	 * Set if ffmpeg writes a WAV stream at the native sample rate of the
+	 * track, which is converted by m_resampler.
+	 */
+	bool m_resample;
+
 	Process m_process;
-	std::stringstream m_msgs;
-	std::thread m_msg_thread;
+	int m_stdout_handle;
+	int m_stderr_handle;
+
+	/**
+	 * Mutex protecting the state shared with the reactor thread.
+	 */
+	mutable std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::vector<uint8_t> m_pcm;
+	size_t m_pcm_ptr = 0;
+	bool m_stdout_armed = true;
+	bool m_stdout_eof = false;
+	bool m_discard = false;
+
+	/**
+	 * Diagnostic output of ffmpeg, only written by the reactor thread.
+	 */
+	DecoderDiagnostics m_diagnostics;
+
+	/**
+	 * State of the internal resampler, only accessed by the thread calling
+	 * read().
+	 */
+	bool m_header_read = false;
+	bool m_flushed = false;
+	std::unique_ptr<Resampler> m_resampler;
+	std::vector<float> m_resampled;
+	size_t m_resampled_ptr = 0;
+
+	/**
+	 * The internal resampler works on native 32-bit floats.
+	 */
+	static bool use_resampler(const AudioFormat &output_fmt)
+	{
+		const uint16_t one = 1;
+		const bool host_little_endian = *(const uint8_t *)&one == 1;
+		return decoder_internal_resampler && output_fmt.use_float &&
+		       output_fmt.bit_depth == 32 &&
+		       output_fmt.little_endian == host_little_endian;
+	}
 
 	static std::string ffmpeg_fmt(const AudioFormat &output_fmt)
 	{
@@ -80,90 +196,351 @@ private:
 	}
 
 	static std::vector<std::string> ffmpeg_args(const std::string &filename,
-	                                            float offs,
-	                                            const AudioFormat &output_fmt)
+	                                            double offs,
+	                                            const AudioFormat &output_fmt,
+	                                            bool resample)
 	{
-		std::vector<std::string> res;
+		std::vector<std::string> res{"-hide_banner", "-nostats", "-loglevel",
+		                             "level+info"};
 		if (offs > 0.0) {
 			res.emplace_back("-ss");
 			res.emplace_back(std::to_string(offs));
 		}
 
-		res.emplace_back("-i");
-		res.emplace_back(filename);
+		// Capture devices are given as "alsa:<device>", e.g. the capture side
+		// of an ALSA loopback device "alsa:hw:Loopback,1"
+		if (filename.compare(0, 5, "alsa:") == 0) {
+			res.emplace_back("-f");
+			res.emplace_back("alsa");
+			res.emplace_back("-i");
+			res.emplace_back(filename.substr(5));
+		}
+		else {
+			res.emplace_back("-i");
+			res.emplace_back(filename);
+		}
 
 		res.emplace_back("-ac");
 		res.emplace_back(std::to_string(output_fmt.n_channels));
 
-		res.emplace_back("-ar");
-		res.emplace_back(std::to_string(output_fmt.rate));
-
-		res.emplace_back("-f");
-		res.emplace_back(ffmpeg_fmt(output_fmt));
+		// Keep the native sample rate if the samples are resampled
+		// internally. The WAV header tells which rate that is.
+		if (resample) {
+			res.emplace_back("-c:a");
+			res.emplace_back("pcm_" + ffmpeg_fmt(output_fmt));
+			res.emplace_back("-f");
+			res.emplace_back("wav");
+		}
+		else {
+			res.emplace_back("-ar");
+			res.emplace_back(std::to_string(output_fmt.rate));
+			res.emplace_back("-f");
+			res.emplace_back(ffmpeg_fmt(output_fmt));
+		}
 		res.emplace_back("-");
 
 		return res;
 	}
 
+	/**
+	 * Called on the reactor thread whenever PCM data is available.
+	 */
+	bool on_stdout()
+	{
+		const int fd = m_process.child_stdout_fd();
+		std::lock_guard<std::mutex> lock(m_mtx);
+		while (true) {
+			// Stop reading if the read-ahead buffer is full, read() rearms
+			// the file descriptor once data has been consumed
+			if (!m_discard && m_pcm.size() - m_pcm_ptr >= decoder_read_ahead) {
+				m_stdout_armed = false;
+				return false;
+			}
+
+			// Move the unconsumed data to the front of the buffer
+			if (m_pcm_ptr > 0 && m_pcm_ptr >= m_pcm.size() - m_pcm_ptr) {
+				m_pcm.erase(m_pcm.begin(), m_pcm.begin() + m_pcm_ptr);
+				m_pcm_ptr = 0;
+			}
+
+			const size_t old_size = m_pcm.size();
+			m_pcm.resize(old_size + CHUNK_SIZE);
+			const ssize_t n = ::read(fd, &m_pcm[old_size], CHUNK_SIZE);
+			m_pcm.resize(old_size + std::max<ssize_t>(0, n));
+			if (n > 0) {
+				if (m_discard) {
+					m_pcm.clear();
+					m_pcm_ptr = 0;
+				}
+				m_cv.notify_all();
+			}
+			else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+				return true;
+			}
+			else {
+				m_stdout_eof = true;
+				m_cv.notify_all();
+				return false;
+			}
+		}
+	}
+
+	/**
+	 * Called on the reactor thread whenever ffmpeg writes diagnostic output.
+	 */
+	bool on_stderr()
+	{
+		const int fd = m_process.child_stderr_fd();
+		char buf[4096];
+		while (true) {
+			const ssize_t n = ::read(fd, buf, sizeof(buf));
+			if (n > 0) {
+				m_diagnostics.feed(buf, n);
+			}
+			else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+				return true;
+			}
+			else {
+				m_diagnostics.finish();
+				return false;
+			}
+		}
+	}
+
 public:
-	DecoderImpl(const std::string &filename, float offs,
-	            const AudioFormat &output_fmt)
-	    : m_process("ffmpeg", ffmpeg_args(filename, offs, output_fmt)),
-	      m_msg_thread(Process::generic_pipe,
-	                   std::ref(m_process.child_stderr()), std::ref(m_msgs))
+	DecoderImpl(const std::string &filename, double offs,
+	            const AudioFormat &output_fmt, const ProcessLimits &limits)
+	    : m_fmt(output_fmt),
+	      m_resample(use_resampler(output_fmt)),
+	      m_process("ffmpeg",
+	                ffmpeg_args(filename, offs, output_fmt, m_resample), true,
+	                limits),
+	      m_diagnostics(filename)
 	{
 		m_process.close_child_stdin();
+		m_stdout_handle =
+		    global_reactor().add(m_process.child_stdout_fd(), false,
+		                         [this] { return on_stdout(); });
+		m_stderr_handle =
+		    global_reactor().add(m_process.child_stderr_fd(), false,
+		                         [this] { return on_stderr(); });
+		decoder_metrics().active.inc();
 	}
 
 	~DecoderImpl()
 	{
-		// Kill the process and wait for its completion
-		wait();
+		// Detach from the reactor before the pipes are closed
+		global_reactor().remove(m_stdout_handle);
+		global_reactor().remove(m_stderr_handle);
+
+		// Close the pipes and let the reaper thread terminate ffmpeg, do not
+		// block the calling thread
+		m_process.detach(TERMINATE_TIMEOUT);
 
-		// Join with the read and the messages thread
-		m_msg_thread.join();
+		decoder_metrics().active.dec();
 	}
 
-	std::string messages() const { return m_msgs.str(); }
+	std::string messages() const { return m_diagnostics.messages(); }
+
+	std::vector<Diagnostic> diagnostics() const
+	{
+		return m_diagnostics.lines();
+	}
+
+	void cancel() { m_process.signal(SIGKILL); }
 
 	int wait()
 	{
 		// Kill the process by sending SIGINT
-		m_process.signal(2);
+		m_process.signal(SIGINT);
 
-		// Wait for the read() method to return zero
-		std::vector<uint8_t> null;
-		while (read(4096, null)) {
-			null.clear();
-		};
+		// Discard all remaining output and wait for ffmpeg to close its end
+		// of the pipe
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			m_discard = true;
+			m_pcm.clear();
+			m_pcm_ptr = 0;
+			if (!m_stdout_armed && !m_stdout_eof) {
+				m_stdout_armed = true;
+				global_reactor().rearm(m_stdout_handle);
+			}
+			m_cv.wait(lock, [this] { return m_stdout_eof; });
+		}
 
 		return m_process.wait();
 	}
 
-	size_t read(size_t n_bytes, std::vector<uint8_t> &tar)
+	/**
+	 * Copies up to n_bytes bytes of the output of ffmpeg to tar. Blocks
+	 * until the bytes are available or the stream ends.
+	 */
+	size_t read_pcm(size_t n_bytes, std::vector<uint8_t> &tar)
 	{
 		const size_t old_size = tar.size();
+		tar.resize(old_size + n_bytes);
 
 		size_t n_bytes_read = 0;
-		auto &is = m_process.child_stdout();
-		if (is.good()) {
-			tar.resize(old_size + n_bytes);
-			is.read((char*)&tar[old_size], n_bytes);
-			n_bytes_read = is.gcount();
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while (n_bytes_read < n_bytes) {
+			// Wait for the reactor to deliver data
+			m_cv.wait(lock, [this] {
+				return m_pcm_ptr < m_pcm.size() || m_stdout_eof;
+			});
+
+			// Copy the data from the read-ahead buffer, abort at the end of
+			// the stream
+			const size_t n =
+			    std::min(n_bytes - n_bytes_read, m_pcm.size() - m_pcm_ptr);
+			if (n == 0) {
+				break;
+			}
+			std::copy(m_pcm.begin() + m_pcm_ptr, m_pcm.begin() + m_pcm_ptr + n,
+			          tar.begin() + old_size + n_bytes_read);
+			n_bytes_read += n;
+			m_pcm_ptr += n;
+			if (m_pcm_ptr == m_pcm.size()) {
+				m_pcm.clear();
+				m_pcm_ptr = 0;
+			}
+
+			// Continue reading from ffmpeg if the reactor stopped because
+			// the buffer was full
+			if (!m_stdout_armed && !m_stdout_eof) {
+				m_stdout_armed = true;
+				global_reactor().rearm(m_stdout_handle);
+			}
 		}
 		tar.resize(old_size + n_bytes_read);
 		return n_bytes_read;
 	}
+
+	/**
+	 * Skips the WAV header written by ffmpeg up to the sample data and
+	 * creates the resampler if the native rate differs from the requested
+	 * one. Returns false if the stream is not a WAV stream in the requested
+	 * format.
+	 */
+	bool read_header()
+	{
+		std::vector<uint8_t> buf;
+		if (read_pcm(12, buf) != 12 || memcmp(&buf[0], "RIFF", 4) != 0 ||
+		    memcmp(&buf[8], "WAVE", 4) != 0) {
+			return false;
+		}
+		int n_channels = 0, rate = 0;
+		while (true) {
+			buf.clear();
+			if (read_pcm(8, buf) != 8) {
+				return false;
+			}
+			if (memcmp(&buf[0], "data", 4) == 0) {
+				break;
+			}
+			const bool fmt = memcmp(&buf[0], "fmt ", 4) == 0;
+			const uint32_t size = load_le(&buf[4], 4);
+			const size_t n = size + (size & 1);
+			buf.clear();
+			if (read_pcm(n, buf) != n) {
+				return false;
+			}
+			if (fmt && n >= 8) {
+				n_channels = load_le(&buf[2], 2);
+				rate = load_le(&buf[4], 4);
+			}
+		}
+		if (n_channels != m_fmt.n_channels || rate <= 0) {
+			return false;
+		}
+		if (rate != m_fmt.rate) {
+			m_resampler =
+			    std::make_unique<Resampler>(rate, m_fmt.rate, n_channels);
+		}
+		return true;
+	}
+
+	/**
+	 * Reads the WAV stream written by ffmpeg and converts it to the
+	 * requested sample rate. Only reads as many frames from ffmpeg as are
+	 * needed, so live sources are not delayed.
+	 */
+	size_t read_resampled(size_t n_bytes, std::vector<uint8_t> &tar)
+	{
+		if (!m_header_read) {
+			m_header_read = true;
+			m_flushed = !read_header();
+		}
+
+		const size_t frame_size = m_fmt.n_channels * sizeof(float);
+		std::vector<uint8_t> buf;
+		while ((m_resampled.size() - m_resampled_ptr) * sizeof(float) <
+		           n_bytes &&
+		       !m_flushed) {
+			if (m_resampled_ptr > 0) {
+				m_resampled.erase(m_resampled.begin(),
+				                  m_resampled.begin() + m_resampled_ptr);
+				m_resampled_ptr = 0;
+			}
+
+			// Read the number of frames corresponding to the missing output
+			const size_t n_missing =
+			    (n_bytes - m_resampled.size() * sizeof(float) + frame_size -
+			     1) /
+			    frame_size;
+			size_t n_frames = n_missing;
+			if (m_resampler) {
+				n_frames = (uint64_t(n_missing) * m_resampler->src_rate() +
+				            m_resampler->tar_rate() - 1) /
+				           m_resampler->tar_rate();
+			}
+			n_frames = std::min(n_frames, CHUNK_SIZE / frame_size);
+			buf.clear();
+			const size_t n_read = read_pcm(n_frames * frame_size, buf);
+			const float *src = reinterpret_cast<const float *>(buf.data());
+			if (m_resampler) {
+				m_resampler->process(src, n_read / frame_size, m_resampled);
+			}
+			else {
+				m_resampled.insert(m_resampled.end(), src,
+				                   src + n_read / sizeof(float));
+			}
+			if (n_read < n_frames * frame_size) {
+				if (m_resampler) {
+					m_resampler->flush(m_resampled);
+				}
+				m_flushed = true;
+			}
+		}
+
+		const size_t n = std::min(
+		    n_bytes, (m_resampled.size() - m_resampled_ptr) * sizeof(float));
+		const uint8_t *src =
+		    reinterpret_cast<const uint8_t *>(&m_resampled[m_resampled_ptr]);
+		tar.insert(tar.end(), src, src + n);
+		m_resampled_ptr += n / sizeof(float);
+		return n;
+	}
+
+	size_t read(size_t n_bytes, std::vector<uint8_t> &tar)
+	{
+		ScopedTimer timer(decoder_metrics().read);
+		const size_t n_bytes_read = m_resample ? read_resampled(n_bytes, tar)
+		                                       : read_pcm(n_bytes, tar);
+		decoder_metrics().bytes_read.inc(n_bytes_read);
+		return n_bytes_read;
+	}
 };
 
 /*
  * Class Decoder
  */
 
-Decoder::Decoder(const std::string &filename, float offs,
-                 const AudioFormat &output_fmt)
-    : m_impl(std::make_unique<DecoderImpl>(filename, offs, output_fmt))
+Decoder::Decoder(const std::string &filename, double offs,
+                 const AudioFormat &output_fmt, const ProcessLimits &limits)
 {
+	ScopedTimer timer(decoder_metrics().spawn);
+	m_impl =
+	    std::make_unique<DecoderImpl>(filename, offs, output_fmt, limits);
 }
 
 Decoder::~Decoder()
@@ -172,10 +549,36 @@ Decoder::~Decoder()
 }
 
 std::string Decoder::messages() const { return m_impl->messages(); }
+std::vector<Diagnostic> Decoder::diagnostics() const
+{
+	return m_impl->diagnostics();
+}
 int Decoder::wait() { return m_impl->wait(); }
+void Decoder::cancel() { m_impl->cancel(); }
 size_t Decoder::read(size_t n_bytes, std::vector<uint8_t> &tar)
 {
 	return m_impl->read(n_bytes, tar);
 }
+
+void Decoder::set_read_ahead(size_t n_bytes) { decoder_read_ahead = n_bytes; }
+
+void Decoder::set_internal_resampler(bool enable)
+{
+	decoder_internal_resampler = enable;
 }
 
+ProcessLimits Decoder::file_limits()
+{
+	ProcessLimits res;
+	res.cpu_time = FILE_CPU_TIME_LIMIT;
+	res.kill_timeout = TERMINATE_TIMEOUT;
+	return res;
+}
+
+ProcessLimits Decoder::live_limits()
+{
+	ProcessLimits res;
+	res.kill_timeout = TERMINATE_TIMEOUT;
+	return res;
+}
+}
@@ -22,8 +22,12 @@
 #include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include <http_audio_server/diagnostics.hpp>
+#include <http_audio_server/supervisor.hpp>
+
 namespace http_audio_server {
 
 /*
@@ -50,16 +54,66 @@ private:
 	std::unique_ptr<DecoderImpl> m_impl;
 
 public:
-	Decoder(const std::string &filename, float offs = 0.0,
-	        const AudioFormat &output_fmt = AudioFormat());
+	/**
+	 * Launches ffmpeg decoding the given file or live source.
+	 *
+	 * @param limits are the resource limits applied to ffmpeg, see
+	 * file_limits() and live_limits().
+	 */
+	Decoder(const std::string &filename, double offs = 0.0,
+	        const AudioFormat &output_fmt = AudioFormat(),
+	        const ProcessLimits &limits = file_limits());
 
 	~Decoder();
 
+	/**
+	 * Returns the most recent lines written by ffmpeg to stderr. Only a fixed
+	 * number of lines is kept.
+	 */
 	std::string messages() const;
 
+	/**
+	 * Returns the most recent lines written by ffmpeg together with their
+	 * severity.
+	 */
+	std::vector<Diagnostic> diagnostics() const;
+
 	int wait();
 
+	/**
+	 * Kills ffmpeg. Pending and future calls to read() return once the
+	 * remaining output has been consumed. Used to abort reading from live
+	 * sources which may block indefinitely.
+	 */
+	void cancel();
+
 	size_t read(size_t n_bytes, std::vector<uint8_t> &tar);
+
+	/**
+	 * Sets the maximum number of PCM bytes buffered per decoder before ffmpeg
+	 * is blocked. Affects all decoders, including running ones.
+	 */
+	static void set_read_ahead(size_t n_bytes);
+
+	/**
+	 * Selects whether decoders started afterwards let ffmpeg convert the
+	 * sample rate or receive the native rate from ffmpeg and convert it
+	 * with the Resampler class. Only applies to 32-bit float output.
+	 */
+	static void set_internal_resampler(bool enable);
+
+	/**
+	 * Returns the limits used for files. Decoding even very long files is far
+	 * below the CPU time limit, it only guards against ffmpeg getting stuck
+	 * on broken input.
+	 */
+	static ProcessLimits file_limits();
+
+	/**
+	 * Returns the limits used for live sources, which run for an unbounded
+	 * time and thus have no CPU time limit.
+	 */
+	static ProcessLimits live_limits();
 };
 }
 
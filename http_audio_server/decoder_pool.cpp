@@ -0,0 +1,268 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <deque>
+#include <stdexcept>
+#include <thread>
+
+#include <http_audio_server/decoder_pool.hpp>
+#include <http_audio_server/metrics.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct DecoderPoolMetrics {
+	Gauge &queued = global_metrics().gauge(
+	    "http_audio_server_decoder_pool_queued",
+	    "Number of decoder requests waiting for a free slot");
+	Histogram &wait = global_metrics().histogram(
+	    "http_audio_server_decoder_pool_wait_seconds",
+	    "Time between requesting a decoder and the decoder being launched");
+};
+
+DecoderPoolMetrics &decoder_pool_metrics()
+{
+	static DecoderPoolMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * Class DecoderJob
+ */
+
+DecoderJob::DecoderJob(const std::string &filename, double offs,
+                       const AudioFormat &fmt, const ProcessLimits &limits)
+    : m_filename(filename), m_offs(offs), m_fmt(fmt), m_limits(limits)
+{
+}
+
+void DecoderJob::complete(std::shared_ptr<Decoder> decoder,
+                          std::exception_ptr error)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_decoder = std::move(decoder);
+		m_error = error;
+		m_done = true;
+	}
+	m_cv.notify_all();
+}
+
+bool DecoderJob::ready() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_done;
+}
+
+bool DecoderJob::failed() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_done && m_error;
+}
+
+bool DecoderJob::wait(double timeout)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	return m_cv.wait_for(lock, std::chrono::duration<double>(timeout),
+	                     [this] { return m_done; });
+}
+
+std::shared_ptr<Decoder> DecoderJob::decoder()
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+	return m_decoder;
+}
+
+/*
+ * Class DecoderPoolImpl
+ */
+
+class DecoderPoolImpl : public std::enable_shared_from_this<DecoderPoolImpl> {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	size_t m_max_decoders;
+	size_t m_active = 0;
+	bool m_stop = false;
+	std::deque<std::pair<std::shared_ptr<DecoderJob>, Clock::time_point>>
+	    m_queue;
+	mutable std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::thread m_spawner_thread;
+
+	void release()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_active--;
+		}
+		m_cv.notify_one();
+	}
+
+	void spawner_thread()
+	{
+		while (true) {
+			// Wait for a job and a free slot
+			std::shared_ptr<DecoderJob> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				m_cv.wait(lock, [this] {
+					return m_stop ||
+					       (!m_queue.empty() && m_active < m_max_decoders);
+				});
+				if (m_stop) {
+					break;
+				}
+				job = std::move(m_queue.front().first);
+				const Clock::time_point t_submit = m_queue.front().second;
+				m_queue.pop_front();
+				decoder_pool_metrics().queued.dec();
+
+				// Skip jobs nobody is interested in anymore
+				if (job.use_count() == 1) {
+					continue;
+				}
+				m_active++;
+				decoder_pool_metrics().wait.record(
+				    std::chrono::duration_cast<std::chrono::nanoseconds>(
+				        Clock::now() - t_submit)
+				        .count());
+			}
+
+			// Launch the decoder outside of the lock. The deleter returns the
+			// slot to the pool once the decoder is destroyed.
+			try {
+				auto self = shared_from_this();
+				std::shared_ptr<Decoder> decoder(
+				    new Decoder(job->m_filename, job->m_offs, job->m_fmt,
+				                job->m_limits),
+				    [self](Decoder *decoder) {
+					    delete decoder;
+					    self->release();
+					});
+				job->complete(std::move(decoder), nullptr);
+			}
+			catch (...) {
+				release();
+				job->complete(nullptr, std::current_exception());
+			}
+		}
+
+		// Fail all remaining jobs
+		std::lock_guard<std::mutex> lock(m_mtx);
+		for (auto &entry : m_queue) {
+			entry.first->complete(
+			    nullptr, std::make_exception_ptr(std::runtime_error(
+			                 "Decoder pool has been shut down")));
+			decoder_pool_metrics().queued.dec();
+		}
+		m_queue.clear();
+	}
+
+public:
+	DecoderPoolImpl(size_t max_decoders) : m_max_decoders(max_decoders) {}
+
+	void start()
+	{
+		m_spawner_thread = std::thread(&DecoderPoolImpl::spawner_thread, this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		m_spawner_thread.join();
+	}
+
+	std::shared_ptr<DecoderJob> submit(const std::string &filename,
+	                                   double offs,
+	                                   const AudioFormat &output_fmt,
+	                                   const ProcessLimits &limits)
+	{
+		auto job =
+		    std::make_shared<DecoderJob>(filename, offs, output_fmt, limits);
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_queue.emplace_back(job, Clock::now());
+			decoder_pool_metrics().queued.inc();
+		}
+		m_cv.notify_one();
+		return job;
+	}
+
+	void set_max_decoders(size_t max_decoders)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_max_decoders = max_decoders;
+		}
+		m_cv.notify_all();
+	}
+
+	size_t active() const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_active;
+	}
+
+	size_t queued() const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_queue.size();
+	}
+};
+
+/*
+ * Class DecoderPool
+ */
+
+DecoderPool::DecoderPool(size_t max_decoders)
+    : m_impl(std::make_shared<DecoderPoolImpl>(max_decoders))
+{
+	m_impl->start();
+}
+
+DecoderPool::~DecoderPool() { m_impl->stop(); }
+std::shared_ptr<DecoderJob> DecoderPool::submit(const std::string &filename,
+                                                double offs,
+                                                const AudioFormat &output_fmt,
+                                                const ProcessLimits &limits)
+{
+	return m_impl->submit(filename, offs, output_fmt, limits);
+}
+
+void DecoderPool::set_max_decoders(size_t max_decoders)
+{
+	m_impl->set_max_decoders(max_decoders);
+}
+
+size_t DecoderPool::active() const { return m_impl->active(); }
+size_t DecoderPool::queued() const { return m_impl->queued(); }
+}
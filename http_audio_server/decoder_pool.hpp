@@ -0,0 +1,148 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file decoder_pool.hpp
+ *
+ * Manages the ffmpeg decoder processes. Decoders are launched on a background
+ * thread, so callers can request them ahead of time, and the number of
+ * concurrently running decoders is capped. Requests exceeding the cap are
+ * queued until a decoder exits.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_DECODER_POOL_HPP
+#define HTTP_AUDIO_SERVER_DECODER_POOL_HPP
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <http_audio_server/decoder.hpp>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class DecoderPoolImpl;
+
+/**
+ * Handle representing a single request for a decoder. Dropping the last
+ * reference to a job which has not been started yet cancels it.
+ */
+class DecoderJob {
+private:
+	friend class DecoderPoolImpl;
+
+	std::string m_filename;
+	double m_offs;
+	AudioFormat m_fmt;
+	ProcessLimits m_limits;
+
+	mutable std::mutex m_mtx;
+	std::condition_variable m_cv;
+	bool m_done = false;
+	std::shared_ptr<Decoder> m_decoder;
+	std::exception_ptr m_error;
+
+	void complete(std::shared_ptr<Decoder> decoder, std::exception_ptr error);
+
+public:
+	DecoderJob(const std::string &filename, double offs,
+	           const AudioFormat &fmt,
+	           const ProcessLimits &limits = Decoder::file_limits());
+
+	/**
+	 * Returns true if the decoder has been launched or launching it failed.
+	 */
+	bool ready() const;
+
+	/**
+	 * Returns true if launching the decoder failed, in which case decoder()
+	 * throws.
+	 */
+	bool failed() const;
+
+	/**
+	 * Waits at most the given number of seconds for the job to become ready.
+	 * Returns ready().
+	 */
+	bool wait(double timeout);
+
+	/**
+	 * Returns the decoder instance or nullptr if the job is not ready yet.
+	 * Rethrows the exception which occurred while launching the decoder.
+	 */
+	std::shared_ptr<Decoder> decoder();
+};
+
+/**
+ * The DecoderPool class launches decoders on a background thread and makes
+ * sure no more than a given number of decoders are alive at the same time.
+ */
+class DecoderPool {
+private:
+	std::shared_ptr<DecoderPoolImpl> m_impl;
+
+public:
+	/**
+	 * Creates a new decoder pool.
+	 *
+	 * @param max_decoders is the maximum number of concurrently running
+	 * decoder processes.
+	 */
+	DecoderPool(size_t max_decoders = 64);
+
+	/**
+	 * Stops the background thread. Queued jobs fail, decoders which already
+	 * have been launched stay valid.
+	 */
+	~DecoderPool();
+
+	/**
+	 * Queues a request for a decoder reading the given file. The limits are
+	 * passed to the Decoder.
+	 */
+	std::shared_ptr<DecoderJob> submit(
+	    const std::string &filename, double offs = 0.0,
+	    const AudioFormat &output_fmt = AudioFormat(),
+	    const ProcessLimits &limits = Decoder::file_limits());
+
+	/**
+	 * Changes the maximum number of concurrently running decoder processes.
+	 * Lowering the limit does not terminate running decoders, new decoders
+	 * are launched once enough of them have finished.
+	 */
+	void set_max_decoders(size_t max_decoders);
+
+	/**
+	 * Returns the number of live decoders.
+	 */
+	size_t active() const;
+
+	/**
+	 * Returns the number of jobs waiting for a free slot.
+	 */
+	size_t queued() const;
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_DECODER_POOL_HPP */
@@ -0,0 +1,324 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#include <http_audio_server/diagnostics.hpp>
+#include <http_audio_server/metrics.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Class DiagnosticRing
+ */
+
+constexpr size_t DiagnosticRing::N_SLOTS;
+constexpr size_t DiagnosticRing::MAX_LINE_LENGTH;
+
+void DiagnosticRing::push(LogSeverity severity, const char *text,
+                          size_t length)
+{
+	length = std::min(length, MAX_LINE_LENGTH);
+
+	// Mark the slot as being written by setting the sequence number to an odd
+	// value
+	const uint64_t idx = m_n_lines.load(std::memory_order_relaxed);
+	Slot &slot = m_slots[idx % N_SLOTS];
+	slot.seq.store(2 * idx + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.severity.store(severity, std::memory_order_relaxed);
+	slot.length.store(length, std::memory_order_relaxed);
+	for (size_t i = 0; i < N_WORDS; i++) {
+		uint64_t word = 0;
+		if (i * sizeof(word) < length) {
+			memcpy(&word, text + i * sizeof(word),
+			       std::min(sizeof(word), length - i * sizeof(word)));
+		}
+		slot.words[i].store(word, std::memory_order_relaxed);
+	}
+
+	slot.seq.store(2 * idx + 2, std::memory_order_release);
+	m_n_lines.store(idx + 1, std::memory_order_release);
+}
+
+std::vector<Diagnostic> DiagnosticRing::snapshot() const
+{
+	std::vector<Diagnostic> res;
+	const uint64_t n_lines = m_n_lines.load(std::memory_order_acquire);
+	const uint64_t first = n_lines > N_SLOTS ? n_lines - N_SLOTS : 0;
+	for (uint64_t idx = first; idx < n_lines; idx++) {
+		const Slot &slot = m_slots[idx % N_SLOTS];
+		const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+		if (seq != 2 * idx + 2) {
+			continue;  // Slot has already been overwritten
+		}
+
+		char text[MAX_LINE_LENGTH];
+		const LogSeverity severity =
+		    LogSeverity(slot.severity.load(std::memory_order_relaxed));
+		const size_t length = slot.length.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < N_WORDS; i++) {
+			const uint64_t word = slot.words[i].load(std::memory_order_relaxed);
+			memcpy(text + i * sizeof(word), &word, sizeof(word));
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) != seq) {
+			continue;  // Slot has been overwritten while copying
+		}
+		res.emplace_back(Diagnostic{severity, std::string(text, length)});
+	}
+	return res;
+}
+
+/*
+ * Class DecoderDiagnostics
+ */
+
+DecoderDiagnostics::DecoderDiagnostics(const std::string &filename)
+    : m_filename(filename)
+{
+}
+
+void DecoderDiagnostics::line(const char *text, size_t length)
+{
+	std::string str(text, length);
+
+	// Lines ending with a carriage return are progress updates
+	if (!str.empty() && str.back() == '\r') {
+		str.pop_back();
+	}
+	if (str.empty()) {
+		return;
+	}
+
+	const LogSeverity severity = parse_ffmpeg_severity(str);
+	m_ring.push(severity, str.data(), str.size());
+	global_diagnostic_stats().record(m_filename, severity);
+}
+
+void DecoderDiagnostics::feed(const char *data, size_t size)
+{
+	const char *end = data + size;
+	while (data < end) {
+		const char *nl = std::find(data, end, '\n');
+		if (nl == end) {
+			// Keep the incomplete line, but do not let it grow without bounds
+			m_partial.append(data, end - data);
+			if (m_partial.size() >= DiagnosticRing::MAX_LINE_LENGTH) {
+				line(m_partial.data(), m_partial.size());
+				m_partial.clear();
+			}
+			break;
+		}
+		if (m_partial.empty()) {
+			line(data, nl - data);
+		}
+		else {
+			m_partial.append(data, nl - data);
+			line(m_partial.data(), m_partial.size());
+			m_partial.clear();
+		}
+		data = nl + 1;
+	}
+}
+
+void DecoderDiagnostics::finish()
+{
+	if (!m_partial.empty()) {
+		line(m_partial.data(), m_partial.size());
+		m_partial.clear();
+	}
+}
+
+std::string DecoderDiagnostics::messages() const
+{
+	std::string res;
+	for (const Diagnostic &diagnostic : lines()) {
+		res += diagnostic.text;
+		res += '\n';
+	}
+	return res;
+}
+
+/*
+ * Functions
+ */
+
+LogSeverity parse_ffmpeg_severity(std::string &line)
+{
+	static const std::pair<const char *, LogSeverity> TAGS[] = {
+	    {"[panic] ", LogSeverity::FATAL_ERROR},
+	    {"[fatal] ", LogSeverity::FATAL_ERROR},
+	    {"[error] ", LogSeverity::ERROR},
+	    {"[warning] ", LogSeverity::WARNING},
+	    {"[info] ", LogSeverity::INFO},
+	    {"[verbose] ", LogSeverity::DEBUG},
+	    {"[debug] ", LogSeverity::DEBUG},
+	    {"[trace] ", LogSeverity::DEBUG},
+	};
+
+	// The level tag is either at the start of the line or directly follows
+	// the "[component @ 0x...] " prefix. Tags elsewhere are part of the
+	// message, e.g. in file names or metadata.
+	size_t pos = 0;
+	if (line.compare(0, 1, "[") == 0) {
+		const size_t end = line.find("] ");
+		const size_t at = line.find(" @ 0x");
+		if (end != std::string::npos && at != std::string::npos && at < end) {
+			pos = end + 2;
+		}
+	}
+	for (const auto &tag : TAGS) {
+		if (line.compare(pos, strlen(tag.first), tag.first) == 0) {
+			line.erase(pos, strlen(tag.first));
+			return tag.second;
+		}
+	}
+	return LogSeverity::INFO;
+}
+
+/*
+ * Class DiagnosticStatsImpl
+ */
+
+class DiagnosticStatsImpl {
+private:
+	mutable std::mutex m_mtx;
+	std::map<std::string, DiagnosticCounts> m_counts;
+	int m_collector;
+
+	static std::string escape_label(const std::string &str)
+	{
+		std::string res;
+		for (char c : str) {
+			switch (c) {
+				case '\\':
+					res += "\\\\";
+					break;
+				case '"':
+					res += "\\\"";
+					break;
+				case '\n':
+					res += "\\n";
+					break;
+				default:
+					res += c;
+					break;
+			}
+		}
+		return res;
+	}
+
+	void collect(std::ostream &os) const
+	{
+		static const char *NAME = "http_audio_server_decoder_diagnostics_total";
+		std::lock_guard<std::mutex> lock(m_mtx);
+		os << "# HELP " << NAME
+		   << " Number of ffmpeg warnings and errors per input file\n"
+		   << "# TYPE " << NAME << " counter\n";
+		for (const auto &entry : m_counts) {
+			const std::string file = escape_label(entry.first);
+			const DiagnosticCounts &counts = entry.second;
+			os << NAME << "{file=\"" << file << "\",severity=\"warning\"} "
+			   << counts.warnings << "\n"
+			   << NAME << "{file=\"" << file << "\",severity=\"error\"} "
+			   << counts.errors << "\n"
+			   << NAME << "{file=\"" << file << "\",severity=\"fatal\"} "
+			   << counts.fatal_errors << "\n";
+		}
+	}
+
+public:
+	DiagnosticStatsImpl()
+	{
+		m_collector = global_metrics().add_collector(
+		    [this](std::ostream &os) { collect(os); });
+	}
+
+	~DiagnosticStatsImpl() { global_metrics().remove_collector(m_collector); }
+
+	void record(const std::string &filename, LogSeverity severity)
+	{
+		if (severity < LogSeverity::WARNING) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto it = m_counts.find(filename);
+		if (it == m_counts.end()) {
+			const bool full = m_counts.size() >= DiagnosticStats::MAX_FILES;
+			it = m_counts.emplace(full ? "other" : filename, DiagnosticCounts())
+			         .first;
+		}
+		if (severity >= LogSeverity::FATAL_ERROR) {
+			it->second.fatal_errors++;
+		}
+		else if (severity >= LogSeverity::ERROR) {
+			it->second.errors++;
+		}
+		else {
+			it->second.warnings++;
+		}
+	}
+
+	DiagnosticCounts counts(const std::string &filename) const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto it = m_counts.find(filename);
+		return it == m_counts.end() ? DiagnosticCounts() : it->second;
+	}
+};
+
+/*
+ * Class DiagnosticStats
+ */
+
+constexpr size_t DiagnosticStats::MAX_FILES;
+
+DiagnosticStats::DiagnosticStats()
+    : m_impl(std::make_unique<DiagnosticStatsImpl>())
+{
+}
+
+DiagnosticStats::~DiagnosticStats()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+void DiagnosticStats::record(const std::string &filename, LogSeverity severity)
+{
+	m_impl->record(filename, severity);
+}
+
+DiagnosticCounts DiagnosticStats::counts(const std::string &filename) const
+{
+	return m_impl->counts(filename);
+}
+
+DiagnosticStats &global_diagnostic_stats()
+{
+	static DiagnosticStats stats;
+	return stats;
+}
+}
@@ -0,0 +1,192 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file diagnostics.hpp
+ *
+ * Bounded storage for the diagnostic output of the ffmpeg decoder processes.
+ * Each decoder keeps the most recent lines in a fixed-size ring, while
+ * warnings and errors are aggregated per input file.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_DIAGNOSTICS_HPP
+#define HTTP_AUDIO_SERVER_DIAGNOSTICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/logger.hpp>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class DiagnosticStatsImpl;
+
+/**
+ * A single line of diagnostic output.
+ */
+struct Diagnostic {
+	LogSeverity severity;
+	std::string text;
+};
+
+/**
+ * Fixed-size ring holding the most recent diagnostic lines. There must be at
+ * most one writer, but any number of threads may read from the ring without
+ * taking a lock. Each slot is protected by a sequence counter; readers discard
+ * slots which are overwritten while they are being copied.
+ */
+class DiagnosticRing {
+public:
+	static constexpr size_t N_SLOTS = 32;
+	static constexpr size_t MAX_LINE_LENGTH = 248;
+
+private:
+	static constexpr size_t N_WORDS = MAX_LINE_LENGTH / sizeof(uint64_t);
+
+	struct Slot {
+		std::atomic<uint64_t> seq{0};
+		std::atomic<int32_t> severity{0};
+		std::atomic<uint32_t> length{0};
+		std::atomic<uint64_t> words[N_WORDS];
+	};
+
+	std::atomic<uint64_t> m_n_lines{0};
+	Slot m_slots[N_SLOTS];
+
+public:
+	/**
+	 * Appends a line to the ring, overwriting the oldest line if the ring is
+	 * full. Lines longer than MAX_LINE_LENGTH are truncated.
+	 */
+	void push(LogSeverity severity, const char *text, size_t length);
+
+	/**
+	 * Returns a copy of the lines currently stored in the ring, oldest first.
+	 */
+	std::vector<Diagnostic> snapshot() const;
+
+	/**
+	 * Returns the total number of lines ever pushed.
+	 */
+	uint64_t n_lines() const
+	{
+		return m_n_lines.load(std::memory_order_relaxed);
+	}
+};
+
+/**
+ * Splits the diagnostic output of a single ffmpeg process into lines,
+ * determines their severity and stores them in a DiagnosticRing. Warnings and
+ * errors are reported to global_diagnostic_stats().
+ */
+class DecoderDiagnostics {
+private:
+	std::string m_filename;
+	std::string m_partial;
+	DiagnosticRing m_ring;
+
+	void line(const char *text, size_t length);
+
+public:
+	DecoderDiagnostics(const std::string &filename);
+
+	/**
+	 * Feeds data read from the stderr of the ffmpeg process. Must always be
+	 * called from the same thread.
+	 */
+	void feed(const char *data, size_t size);
+
+	/**
+	 * Processes an incomplete last line. Must be called from the same thread as
+	 * feed().
+	 */
+	void finish();
+
+	/**
+	 * Returns the most recent diagnostic lines. May be called from any thread.
+	 */
+	std::vector<Diagnostic> lines() const { return m_ring.snapshot(); }
+
+	/**
+	 * Returns the most recent diagnostic lines as a single string.
+	 */
+	std::string messages() const;
+};
+
+/**
+ * Parses a single line of ffmpeg output written with "-loglevel level+...".
+ * Returns the severity of the line and removes the "[level]" tag from the
+ * given string. The tag is only recognised at the start of the line or right
+ * after the "[component @ 0x...]" prefix. Lines without tag are treated as
+ * informational.
+ */
+LogSeverity parse_ffmpeg_severity(std::string &line);
+
+/**
+ * Number of warnings and errors reported while decoding a file.
+ */
+struct DiagnosticCounts {
+	uint64_t warnings = 0;
+	uint64_t errors = 0;
+	uint64_t fatal_errors = 0;
+};
+
+/**
+ * Aggregates the number of warnings and errors per input file. The counters
+ * are exported as http_audio_server_decoder_diagnostics_total metric family.
+ */
+class DiagnosticStats {
+private:
+	std::unique_ptr<DiagnosticStatsImpl> m_impl;
+
+public:
+	/**
+	 * Maximum number of distinct files tracked. Further files are counted
+	 * under a single "other" label.
+	 */
+	static constexpr size_t MAX_FILES = 1024;
+
+	DiagnosticStats();
+	~DiagnosticStats();
+
+	/**
+	 * Records a diagnostic message of the given severity for the given file.
+	 * Messages below LogSeverity::WARNING are ignored.
+	 */
+	void record(const std::string &filename, LogSeverity severity);
+
+	/**
+	 * Returns the counters for the given file.
+	 */
+	DiagnosticCounts counts(const std::string &filename) const;
+};
+
+/**
+ * Returns the DiagnosticStats instance used by all decoders.
+ */
+DiagnosticStats &global_diagnostic_stats();
+}
+
+#endif /* HTTP_AUDIO_SERVER_DIAGNOSTICS_HPP */
@@ -0,0 +1,401 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <http_audio_server/dsp.hpp>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HTTP_AUDIO_SERVER_DSP_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HTTP_AUDIO_SERVER_DSP_NEON
+#include <arm_neon.h>
+#endif
+
+namespace http_audio_server {
+
+/*
+ * Kernels
+ */
+
+void apply_ramp(float *buf, size_t n_frames, size_t n_channels, float g0,
+                float step)
+{
+	size_t i = 0;
+#if defined(HTTP_AUDIO_SERVER_DSP_SSE2)
+	// Two stereo frames per vector, the gains are computed from the frame
+	// index so the result matches the scalar loop below
+	if (n_channels == 2) {
+		const __m128 g0v = _mm_set1_ps(g0), stepv = _mm_set1_ps(step);
+		const __m128 two = _mm_set1_ps(2.0f);
+		__m128 idx = _mm_set_ps(1.0f, 1.0f, 0.0f, 0.0f);
+		for (; i + 2 <= n_frames; i += 2) {
+			const __m128 g = _mm_add_ps(g0v, _mm_mul_ps(idx, stepv));
+			const __m128 x = _mm_loadu_ps(buf + 2 * i);
+			_mm_storeu_ps(buf + 2 * i, _mm_mul_ps(x, g));
+			idx = _mm_add_ps(idx, two);
+		}
+	}
+#elif defined(HTTP_AUDIO_SERVER_DSP_NEON)
+	if (n_channels == 2) {
+		const float32x4_t g0v = vdupq_n_f32(g0), stepv = vdupq_n_f32(step);
+		const float32x4_t two = vdupq_n_f32(2.0f);
+		const float init[4] = {0.0f, 0.0f, 1.0f, 1.0f};
+		float32x4_t idx = vld1q_f32(init);
+		for (; i + 2 <= n_frames; i += 2) {
+			const float32x4_t g = vaddq_f32(g0v, vmulq_f32(idx, stepv));
+			vst1q_f32(buf + 2 * i, vmulq_f32(vld1q_f32(buf + 2 * i), g));
+			idx = vaddq_f32(idx, two);
+		}
+	}
+#endif
+	for (; i < n_frames; i++) {
+		const float g = g0 + float(i) * step;
+		for (size_t c = 0; c < n_channels; c++) {
+			buf[i * n_channels + c] *= g;
+		}
+	}
+}
+
+void mix_ramp(float *tar, const float *src, size_t n_frames,
+              size_t n_channels, float g0, float step)
+{
+	// tar * (1 - g) + src * g is computed as tar + (src - tar) * g
+	size_t i = 0;
+#if defined(HTTP_AUDIO_SERVER_DSP_SSE2)
+	if (n_channels == 2) {
+		const __m128 g0v = _mm_set1_ps(g0), stepv = _mm_set1_ps(step);
+		const __m128 two = _mm_set1_ps(2.0f);
+		__m128 idx = _mm_set_ps(1.0f, 1.0f, 0.0f, 0.0f);
+		for (; i + 2 <= n_frames; i += 2) {
+			const __m128 g = _mm_add_ps(g0v, _mm_mul_ps(idx, stepv));
+			const __m128 a = _mm_loadu_ps(tar + 2 * i);
+			const __m128 b = _mm_loadu_ps(src + 2 * i);
+			_mm_storeu_ps(tar + 2 * i,
+			              _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), g)));
+			idx = _mm_add_ps(idx, two);
+		}
+	}
+#elif defined(HTTP_AUDIO_SERVER_DSP_NEON)
+	if (n_channels == 2) {
+		const float32x4_t g0v = vdupq_n_f32(g0), stepv = vdupq_n_f32(step);
+		const float32x4_t two = vdupq_n_f32(2.0f);
+		const float init[4] = {0.0f, 0.0f, 1.0f, 1.0f};
+		float32x4_t idx = vld1q_f32(init);
+		for (; i + 2 <= n_frames; i += 2) {
+			const float32x4_t g = vaddq_f32(g0v, vmulq_f32(idx, stepv));
+			const float32x4_t a = vld1q_f32(tar + 2 * i);
+			const float32x4_t b = vld1q_f32(src + 2 * i);
+			vst1q_f32(tar + 2 * i, vaddq_f32(a, vmulq_f32(vsubq_f32(b, a), g)));
+			idx = vaddq_f32(idx, two);
+		}
+	}
+#endif
+	for (; i < n_frames; i++) {
+		const float g = g0 + float(i) * step;
+		for (size_t c = 0; c < n_channels; c++) {
+			const float a = tar[i * n_channels + c];
+			const float b = src[i * n_channels + c];
+			tar[i * n_channels + c] = a + (b - a) * g;
+		}
+	}
+}
+
+/*
+ * Class DspNode
+ */
+
+DspNode::~DspNode()
+{
+	// Do nothing here, just required for the vtable
+}
+
+/*
+ * Class GainNode
+ */
+
+GainNode::GainNode(size_t n_channels, double gain_db)
+    : m_n_channels(n_channels), m_gain(std::pow(10.0, gain_db / 20.0))
+{
+}
+
+void GainNode::process(float *buf, size_t n_frames)
+{
+	apply_ramp(buf, n_frames, m_n_channels, m_gain, 0.0f);
+}
+
+/*
+ * Class BiquadNode
+ */
+
+BiquadNode::Type BiquadNode::parse_type(const std::string &name)
+{
+	if (name == "lowpass") {
+		return Type::LOWPASS;
+	}
+	else if (name == "highpass") {
+		return Type::HIGHPASS;
+	}
+	else if (name == "bandpass") {
+		return Type::BANDPASS;
+	}
+	else if (name == "peaking") {
+		return Type::PEAKING;
+	}
+	else if (name == "low_shelf") {
+		return Type::LOW_SHELF;
+	}
+	else if (name == "high_shelf") {
+		return Type::HIGH_SHELF;
+	}
+	throw std::invalid_argument("Unknown filter type \"" + name + "\"");
+}
+
+BiquadNode::BiquadNode(int rate, size_t n_channels, Type type, double freq,
+                       double q, double gain_db)
+    : m_n_channels(n_channels), m_z1(n_channels, 0.0f), m_z2(n_channels, 0.0f)
+{
+	if (!(freq > 0.0 && freq < 0.5 * rate) || !(q > 0.0)) {
+		throw std::invalid_argument("Invalid filter parameters");
+	}
+
+	const double A = std::pow(10.0, gain_db / 40.0);
+	const double w0 = 2.0 * M_PI * freq / rate;
+	const double cs = std::cos(w0);
+	const double alpha = std::sin(w0) / (2.0 * q);
+	const double sq = 2.0 * std::sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+	switch (type) {
+		case Type::LOWPASS:
+			b0 = b2 = (1.0 - cs) / 2.0;
+			b1 = 1.0 - cs;
+			a0 = 1.0 + alpha, a1 = -2.0 * cs, a2 = 1.0 - alpha;
+			break;
+		case Type::HIGHPASS:
+			b0 = b2 = (1.0 + cs) / 2.0;
+			b1 = -(1.0 + cs);
+			a0 = 1.0 + alpha, a1 = -2.0 * cs, a2 = 1.0 - alpha;
+			break;
+		case Type::BANDPASS:
+			b0 = alpha, b1 = 0.0, b2 = -alpha;
+			a0 = 1.0 + alpha, a1 = -2.0 * cs, a2 = 1.0 - alpha;
+			break;
+		case Type::PEAKING:
+			b0 = 1.0 + alpha * A, b1 = -2.0 * cs, b2 = 1.0 - alpha * A;
+			a0 = 1.0 + alpha / A, a1 = -2.0 * cs, a2 = 1.0 - alpha / A;
+			break;
+		case Type::LOW_SHELF:
+			b0 = A * ((A + 1.0) - (A - 1.0) * cs + sq);
+			b1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * cs);
+			b2 = A * ((A + 1.0) - (A - 1.0) * cs - sq);
+			a0 = (A + 1.0) + (A - 1.0) * cs + sq;
+			a1 = -2.0 * ((A - 1.0) + (A + 1.0) * cs);
+			a2 = (A + 1.0) + (A - 1.0) * cs - sq;
+			break;
+		case Type::HIGH_SHELF:
+		default:
+			b0 = A * ((A + 1.0) + (A - 1.0) * cs + sq);
+			b1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * cs);
+			b2 = A * ((A + 1.0) + (A - 1.0) * cs - sq);
+			a0 = (A + 1.0) - (A - 1.0) * cs + sq;
+			a1 = 2.0 * ((A - 1.0) - (A + 1.0) * cs);
+			a2 = (A + 1.0) - (A - 1.0) * cs - sq;
+			break;
+	}
+	m_b0 = b0 / a0, m_b1 = b1 / a0, m_b2 = b2 / a0;
+	m_a1 = a1 / a0, m_a2 = a2 / a0;
+}
+
+void BiquadNode::process(float *buf, size_t n_frames)
+{
+	// The filter is recursive in time, so stereo signals are vectorised
+	// across the two channels instead
+	size_t c0 = 0;
+#if defined(HTTP_AUDIO_SERVER_DSP_SSE2)
+	if (m_n_channels == 2) {
+		const __m128 b0 = _mm_set1_ps(m_b0), b1 = _mm_set1_ps(m_b1),
+		             b2 = _mm_set1_ps(m_b2), a1 = _mm_set1_ps(m_a1),
+		             a2 = _mm_set1_ps(m_a2);
+		__m128 z1 = _mm_setr_ps(m_z1[0], m_z1[1], 0.0f, 0.0f);
+		__m128 z2 = _mm_setr_ps(m_z2[0], m_z2[1], 0.0f, 0.0f);
+		for (size_t i = 0; i < n_frames; i++) {
+			// __m64 may alias the samples, a double pointer may not
+			__m64 *frame = reinterpret_cast<__m64 *>(buf + 2 * i);
+			const __m128 x = _mm_loadl_pi(_mm_setzero_ps(), frame);
+			const __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+			z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)),
+			                z2);
+			z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+			_mm_storel_pi(frame, y);
+		}
+		float tmp[4];
+		_mm_storeu_ps(tmp, z1);
+		m_z1[0] = tmp[0], m_z1[1] = tmp[1];
+		_mm_storeu_ps(tmp, z2);
+		m_z2[0] = tmp[0], m_z2[1] = tmp[1];
+		c0 = 2;
+	}
+#elif defined(HTTP_AUDIO_SERVER_DSP_NEON)
+	if (m_n_channels == 2) {
+		float32x2_t z1 = vld1_f32(&m_z1[0]), z2 = vld1_f32(&m_z2[0]);
+		for (size_t i = 0; i < n_frames; i++) {
+			const float32x2_t x = vld1_f32(buf + 2 * i);
+			const float32x2_t y = vmla_n_f32(z1, x, m_b0);
+			z1 = vmls_n_f32(vmla_n_f32(z2, x, m_b1), y, m_a1);
+			z2 = vmls_n_f32(vmul_n_f32(x, m_b2), y, m_a2);
+			vst1_f32(buf + 2 * i, y);
+		}
+		vst1_f32(&m_z1[0], z1);
+		vst1_f32(&m_z2[0], z2);
+		c0 = 2;
+	}
+#endif
+	for (size_t c = c0; c < m_n_channels; c++) {
+		float z1 = m_z1[c], z2 = m_z2[c];
+		for (size_t i = 0; i < n_frames; i++) {
+			float &s = buf[i * m_n_channels + c];
+			const float x = s;
+			const float y = m_b0 * x + z1;
+			z1 = m_b1 * x - m_a1 * y + z2;
+			z2 = m_b2 * x - m_a2 * y;
+			s = y;
+		}
+		m_z1[c] = z1, m_z2[c] = z2;
+	}
+
+	// Flush the state to zero once the signal decayed, denormal numbers are
+	// very slow on most CPUs
+	for (size_t c = 0; c < m_n_channels; c++) {
+		if (std::abs(m_z1[c]) < 1e-20f && std::abs(m_z2[c]) < 1e-20f) {
+			m_z1[c] = m_z2[c] = 0.0f;
+		}
+	}
+}
+
+/*
+ * Class FadeNode
+ */
+
+FadeNode::FadeNode(int rate, size_t n_channels, double fade_in,
+                   double fade_out, double duration)
+    : m_n_channels(n_channels),
+      m_fade_in(std::max(0.0, fade_in) * rate),
+      m_fade_out(std::max(0.0, fade_out) * rate),
+      m_length(duration > 0.0 ? size_t(duration * rate) : 0)
+{
+	if (m_length == 0) {
+		m_fade_out = 0;
+	}
+}
+
+void FadeNode::process(float *buf, size_t n_frames)
+{
+	const size_t end = m_pos + n_frames;
+
+	// Fade-in ramp from zero to one over the first m_fade_in frames
+	if (m_pos < m_fade_in) {
+		const size_t n = std::min(end, m_fade_in) - m_pos;
+		const float step = 1.0f / float(m_fade_in);
+		apply_ramp(buf, n, m_n_channels, float(m_pos) * step, step);
+	}
+
+	// Fade-out ramp from one to zero over the last m_fade_out frames
+	if (m_fade_out > 0) {
+		const size_t start = m_length > m_fade_out ? m_length - m_fade_out : 0;
+		const size_t first = std::max(m_pos, start);
+		if (first < end) {
+			const float step = 1.0f / float(m_fade_out);
+			const float g0 = 1.0f - float(first - start) * step;
+			apply_ramp(buf + (first - m_pos) * m_n_channels, end - first,
+			           m_n_channels, g0, -step);
+		}
+	}
+
+	m_pos = end;
+}
+
+/*
+ * Class DspGraph
+ */
+
+constexpr size_t DspGraph::BLOCK_SIZE;
+
+DspGraph::DspGraph(size_t n_channels) : m_n_channels(n_channels) {}
+
+DspGraph::DspGraph(const json &config, int rate, size_t n_channels,
+                   double duration)
+    : m_n_channels(n_channels)
+{
+	if (config.is_null()) {
+		return;
+	}
+	if (!config.is_array()) {
+		throw std::invalid_argument("DSP configuration must be an array");
+	}
+	try {
+		for (const json &node : config) {
+			const std::string type = node.at("type");
+			if (type == "gain") {
+				add(std::make_unique<GainNode>(n_channels,
+				                               node.value("gain", 0.0)));
+			}
+			else if (type == "biquad") {
+				add(std::make_unique<BiquadNode>(
+				    rate, n_channels,
+				    BiquadNode::parse_type(node.at("filter")), node.at("freq"),
+				    node.value("q", 0.7071), node.value("gain", 0.0)));
+			}
+			else if (type == "fade") {
+				add(std::make_unique<FadeNode>(
+				    rate, n_channels, node.value("in", 0.0),
+				    node.value("out", 0.0), duration));
+			}
+			else {
+				throw std::invalid_argument("Unknown DSP node \"" + type +
+				                            "\"");
+			}
+		}
+	}
+	catch (std::invalid_argument &) {
+		throw;
+	}
+	catch (std::logic_error &e) {
+		// Missing keys or values of the wrong type
+		throw std::invalid_argument(std::string("Invalid DSP node: ") +
+		                            e.what());
+	}
+}
+
+void DspGraph::add(std::unique_ptr<DspNode> node)
+{
+	m_nodes.emplace_back(std::move(node));
+}
+
+void DspGraph::process(float *buf, size_t n_frames)
+{
+	for (size_t i = 0; i < n_frames; i += BLOCK_SIZE) {
+		const size_t n = std::min(BLOCK_SIZE, n_frames - i);
+		for (auto &node : m_nodes) {
+			node->process(buf + i * m_n_channels, n);
+		}
+	}
+}
+}
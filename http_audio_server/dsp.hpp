@@ -0,0 +1,185 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file dsp.hpp
+ *
+ * Contains a small DSP graph which is applied to the decoded PCM data before
+ * it is passed to the encoder, as well as the vectorised gain and crossfade
+ * kernels used by the graph and the stream pipeline.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_DSP_HPP
+#define HTTP_AUDIO_SERVER_DSP_HPP
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <http_audio_server/json.hpp>
+
+namespace http_audio_server {
+
+/**
+ * Abstract base class of a node in the DSP graph. Nodes process interleaved
+ * float samples in place and must not allocate memory in process().
+ */
+class DspNode {
+public:
+	virtual ~DspNode();
+
+	/**
+	 * Processes the given interleaved frames in place.
+	 */
+	virtual void process(float *buf, size_t n_frames) = 0;
+};
+
+/**
+ * Multiplies the signal with a constant gain.
+ */
+class GainNode : public DspNode {
+private:
+	size_t m_n_channels;
+	float m_gain;
+
+public:
+	GainNode(size_t n_channels, double gain_db);
+
+	void process(float *buf, size_t n_frames) override;
+};
+
+/**
+ * Second order IIR filter with the coefficients from the "Audio EQ Cookbook"
+ * by Robert Bristow-Johnson.
+ */
+class BiquadNode : public DspNode {
+public:
+	enum class Type {
+		LOWPASS,
+		HIGHPASS,
+		BANDPASS,
+		PEAKING,
+		LOW_SHELF,
+		HIGH_SHELF
+	};
+
+	/**
+	 * Parses the filter type from its name, e.g. "peaking" or "low_shelf".
+	 * Throws std::invalid_argument if the name is unknown.
+	 */
+	static Type parse_type(const std::string &name);
+
+private:
+	size_t m_n_channels;
+	float m_b0, m_b1, m_b2, m_a1, m_a2;
+
+	/**
+	 * Filter state of the transposed direct form II, one value per channel.
+	 */
+	std::vector<float> m_z1;
+	std::vector<float> m_z2;
+
+public:
+	BiquadNode(int rate, size_t n_channels, Type type, double freq,
+	           double q = 0.7071, double gain_db = 0.0);
+
+	void process(float *buf, size_t n_frames) override;
+};
+
+/**
+ * Fades the signal in at its beginning and out at its end. The fade-out is
+ * only applied if the length of the signal is known.
+ */
+class FadeNode : public DspNode {
+private:
+	size_t m_n_channels;
+	size_t m_fade_in;
+	size_t m_fade_out;
+	size_t m_length;
+	size_t m_pos = 0;
+
+public:
+	/**
+	 * @param fade_in is the length of the fade-in in seconds.
+	 * @param fade_out is the length of the fade-out in seconds.
+	 * @param duration is the length of the signal in seconds or a negative
+	 * value if the length is not known.
+	 */
+	FadeNode(int rate, size_t n_channels, double fade_in, double fade_out,
+	         double duration);
+
+	void process(float *buf, size_t n_frames) override;
+};
+
+/**
+ * Linear chain of DSP nodes. The signal is processed in blocks of BLOCK_SIZE
+ * frames, so the data stays in the cache while it passes through the nodes.
+ */
+class DspGraph {
+private:
+	size_t m_n_channels;
+	std::vector<std::unique_ptr<DspNode>> m_nodes;
+
+public:
+	static constexpr size_t BLOCK_SIZE = 256;
+
+	explicit DspGraph(size_t n_channels = 2);
+
+	/**
+	 * Creates the graph from a JSON array of node descriptions, e.g.
+	 *
+	 * [{"type": "gain", "gain": -3},
+	 *  {"type": "biquad", "filter": "peaking", "freq": 100, "q": 0.7,
+	 *   "gain": 4},
+	 *  {"type": "fade", "in": 1.0, "out": 2.0}]
+	 *
+	 * Throws std::invalid_argument if the description is invalid.
+	 *
+	 * @param duration is the length of the signal in seconds, negative if
+	 * unknown.
+	 */
+	DspGraph(const json &config, int rate, size_t n_channels,
+	         double duration = -1.0);
+
+	void add(std::unique_ptr<DspNode> node);
+	bool empty() const { return m_nodes.empty(); }
+
+	/**
+	 * Runs the interleaved frames in place through all nodes.
+	 */
+	void process(float *buf, size_t n_frames);
+};
+
+/**
+ * Multiplies each frame i of the interleaved signal with the gain
+ * g0 + i * step.
+ */
+void apply_ramp(float *buf, size_t n_frames, size_t n_channels, float g0,
+                float step);
+
+/**
+ * Crossfades src into tar: tar = tar * (1 - g) + src * g, where the gain g
+ * of frame i is g0 + i * step.
+ */
+void mix_ramp(float *tar, const float *src, size_t n_frames,
+              size_t n_channels, float g0, float step);
+}
+
+#endif /* HTTP_AUDIO_SERVER_DSP_HPP */
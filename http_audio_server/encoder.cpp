@@ -17,45 +17,80 @@
  */
 
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <opus/opus.h>
 
-#include <mkvmuxer/mkvmuxer.h>
-
 #include <http_audio_server/encoder.hpp>
+#include <http_audio_server/metrics.hpp>
 
 namespace http_audio_server {
 
-using namespace mkvmuxer;
+/*
+ * Metrics
+ */
 
-class BufferMkvWriter : public IMkvWriter {
-private:
-	std::vector<uint8_t> m_buf;
-	size_t m_bytes_written = 0;
+namespace {
+struct EncoderMetrics {
+	Histogram &encode = global_metrics().histogram(
+	    "http_audio_server_encoder_encode_seconds",
+	    "Time spent encoding a single Opus frame");
+	Histogram &mux = global_metrics().histogram(
+	    "http_audio_server_encoder_mux_seconds",
+	    "Time spent muxing a single Opus frame into the container");
+	Counter &frames = global_metrics().counter(
+	    "http_audio_server_encoder_frames_total",
+	    "Number of encoded Opus frames");
+	Counter &bytes = global_metrics().counter(
+	    "http_audio_server_encoder_bytes_total",
+	    "Number of encoded Opus bytes");
+};
 
-public:
-	int32 Write(const void *buf, uint32 len) override
-	{
-		m_buf.insert(m_buf.end(), (uint8_t *)buf, (uint8_t *)buf + len);
-		m_bytes_written += len;
-		return 0;
-	}
+EncoderMetrics &encoder_metrics()
+{
+	static EncoderMetrics metrics;
+	return metrics;
+}
 
-	int64 Position() const override { return m_bytes_written; }
-	int32 Position(int64) override { return -1; }
-	bool Seekable() const override { return false; }
-	void ElementStartNotify(uint64, int64) override {}
-	BufferMkvWriter() {}
-	~BufferMkvWriter() override{};
+/**
+ * Per-container statistics. The framing overhead in bytes per second is
+ * (bytes - payload_bytes) / samples * rate.
+ */
+struct ContainerMetrics {
+	Counter &bytes;
+	Counter &payload_bytes;
+	Counter &samples;
 
-	void dump(std::ostream &os)
+	explicit ContainerMetrics(const std::string &name)
+	    : bytes(global_metrics().counter(
+	          "http_audio_server_muxer_" + name + "_bytes_total",
+	          "Number of bytes written by the " + name + " muxer")),
+	      payload_bytes(global_metrics().counter(
+	          "http_audio_server_muxer_" + name + "_payload_bytes_total",
+	          "Number of Opus bytes passed to the " + name + " muxer")),
+	      samples(global_metrics().counter(
+	          "http_audio_server_muxer_" + name + "_samples_total",
+	          "Number of samples passed to the " + name + " muxer"))
 	{
-		os.write((char *)&m_buf[0], m_buf.size());
-		m_buf.clear();
 	}
 };
 
+ContainerMetrics &container_metrics(Container container)
+{
+	static ContainerMetrics webm("webm"), ogg("ogg"), raw("raw");
+	switch (container) {
+		case Container::OGG:
+			return ogg;
+		case Container::RAW:
+			return raw;
+		default:
+			return webm;
+	}
+}
+}
+
 class EncoderImpl {
 private:
 	static constexpr size_t BUF_SIZE = 1 << 16;
@@ -66,68 +101,68 @@ private:
 	std::vector<float> m_buf;
 	size_t m_buf_ptr;
 	uint64_t m_granule = 0;
+	uint64_t m_preroll = 0;
 	bool m_done = false;
 
-	BufferMkvWriter m_mkv_writer;
-	Segment m_mkv_segment;
-	uint64_t m_mkv_track_id;
-	AudioTrack *m_mkv_audio_track;
-
 	int m_enc_error;
 	OpusEncoder *m_enc = nullptr;
 
-#pragma pack(push)
-#pragma pack(1)
-	struct OpusMkvCodecPrivate {
-		uint8_t head[8] = {0x4f, 0x70, 0x75, 0x73, 0x48, 0x65, 0x61, 0x64};
-		uint8_t version = 1;
-		uint8_t channel_count;
-		uint16_t pre_skip = 0;
-		uint32_t sample_rate;
-		uint16_t gain = 0;
-		uint8_t mapping_family = 0;
-
-		OpusMkvCodecPrivate(uint8_t channel_count, uint32_t sample_rate)
-		    : channel_count(channel_count), sample_rate(sample_rate)
-		{
-		}
-	};
-#pragma pack(pop)
+	Container m_container;
+	std::unique_ptr<Muxer> m_muxer;
 
 public:
-	EncoderImpl(size_t rate, size_t n_channels)
+	EncoderImpl(size_t rate, size_t n_channels, Container container,
+	            const std::string &filename)
 	    : m_rate(rate),
 	      m_n_channels(n_channels),
 	      m_frame_size(rate / 25),
 	      m_buf(m_frame_size * m_n_channels),
-	      m_buf_ptr(0)
+	      m_buf_ptr(0),
+	      m_container(container)
 	{
-		// Initialize the mkv segment
-		m_mkv_segment.Init(&m_mkv_writer);
-		m_mkv_segment.set_mode(Segment::kLive);
-
-		// Add a single audio track
-		m_mkv_track_id = m_mkv_segment.AddAudioTrack(rate, n_channels, 0);
-		m_mkv_audio_track = static_cast<AudioTrack *>(
-		    m_mkv_segment.GetTrackByNumber(m_mkv_track_id));
-		m_mkv_audio_track->set_codec_id(Tracks::kOpusCodecId);
-		m_mkv_audio_track->set_bit_depth(16);
-
-		// Write the Opus private data
-		OpusMkvCodecPrivate private_data(n_channels, rate);
-		m_mkv_audio_track->SetCodecPrivate((uint8_t *)&private_data,
-		                                   sizeof(OpusMkvCodecPrivate));
-
 		// Initialize the encoder
 		m_enc = opus_encoder_create(rate, n_channels, OPUS_APPLICATION_AUDIO,
 		                            &m_enc_error);
+
+		// The pre-skip is the encoder delay at 48 kHz
+		opus_int32 lookahead = 0;
+		if (m_enc) {
+			opus_encoder_ctl(m_enc, OPUS_GET_LOOKAHEAD(&lookahead));
+		}
+		const uint16_t pre_skip = lookahead * 48000 / rate;
+
+		// Create the muxer, only WebM files are supported
+		if (filename.empty()) {
+			m_muxer = create_muxer(container, rate, n_channels, m_frame_size,
+			                       pre_skip);
+		}
+		else if (container == Container::WEBM) {
+			m_muxer = std::make_unique<WebmMuxer>(rate, n_channels,
+			                                      m_frame_size, filename);
+		}
+		else {
+			throw std::invalid_argument("Files must use the WebM container");
+		}
 	}
 
-	void encode(float *pcm, size_t n_samples, size_t bitrate, std::ostream &os,
-	            bool flush)
+	~EncoderImpl()
 	{
-		// Do nothing if we're already done!
-		if (m_done) {
+		if (m_enc) {
+			opus_encoder_destroy(m_enc);
+		}
+	}
+
+	/**
+	 * Encodes the given samples into Opus frames and passes the resulting
+	 * packets to the given sink. Frames belonging to the pre-roll are
+	 * dropped.
+	 */
+	template <typename Sink>
+	void encode_frames(float *pcm, size_t n_samples, size_t bitrate,
+	                   bool flush, Sink sink)
+	{
+		// There is nothing to flush if no samples are buffered
+		if (flush && n_samples == 0 && m_buf_ptr == 0) {
 			return;
 		}
 
@@ -156,34 +191,133 @@ public:
 			}
 
 			// If enough data for a frame has been gathered encode a frame and
-			// write it into the mkv/webm stream
+			// hand it to the sink
 			if (m_buf_ptr == m_buf.size()) {
-				opus_encoder_ctl(m_enc, OPUS_SET_BITRATE(bitrate));
-				int size = opus_encode_float(m_enc, &m_buf[0], m_frame_size,
-				                             buf, BUF_SIZE);
-				if (size > 0) {
-					uint64_t ts = (m_granule * 1000ULL * 1000ULL * 1000ULL) / m_rate;
-					m_mkv_segment.AddFrame(buf, size, m_mkv_track_id, ts, true);
+				int size;
+				{
+					ScopedTimer timer(encoder_metrics().encode);
+					opus_encoder_ctl(m_enc, OPUS_SET_BITRATE(bitrate));
+					size = opus_encode_float(m_enc, &m_buf[0], m_frame_size,
+					                         buf, BUF_SIZE);
 				}
 				m_buf_ptr = 0;
-				m_granule += m_frame_size;
+				if (m_preroll > 0) {
+					// Only used to prime the encoder state, drop the packet
+					m_preroll -= m_frame_size;
+					continue;
+				}
+				sink(buf, size);
 			}
 		} while (n_samples > 0);
+	}
+
+	/**
+	 * Writes a single Opus packet into the container. A negative size
+	 * denotes a frame which could not be encoded.
+	 */
+	void mux(const uint8_t *buf, int size)
+	{
+		{
+			ScopedTimer timer(encoder_metrics().mux);
+			m_muxer->write(buf, std::max(size, 0), m_granule);
+		}
+		if (size > 0) {
+			encoder_metrics().frames.inc();
+			encoder_metrics().bytes.inc(size);
+			container_metrics(m_container).payload_bytes.inc(size);
+		}
+		container_metrics(m_container).samples.inc(m_frame_size);
+		m_granule += m_frame_size;
+	}
+
+	/**
+	 * Writes the container data to the output stream.
+	 */
+	void dump(std::ostream &os, bool flush)
+	{
+		const size_t n = flush ? m_muxer->finalize(os) : m_muxer->flush(os);
+		container_metrics(m_container).bytes.inc(n);
+	}
+
+	void encode(float *pcm, size_t n_samples, size_t bitrate, std::ostream &os,
+	            bool flush)
+	{
+		// Do nothing if we're already done!
+		if (m_done) {
+			return;
+		}
 
-		// If the stream was flushed, reset the state
+		encode_frames(pcm, n_samples, bitrate, flush,
+		              [this](const uint8_t *buf, int size) { mux(buf, size); });
+
+		// Dump all buffered data into the given output stream. If the stream
+		// was flushed, reset the state.
+		dump(os, flush);
 		if (flush) {
-			m_mkv_segment.Finalize();
 			m_granule = 0;
 			m_done = true;
 		}
+	}
+
+	void encode_packets(float *pcm, size_t n_samples, size_t bitrate,
+	                    std::vector<std::string> &packets)
+	{
+		encode_frames(pcm, n_samples, bitrate, false,
+		              [&packets](const uint8_t *buf, int size) {
+			              packets.emplace_back((const char *)buf,
+			                                   std::max(size, 0));
+			          });
+	}
+
+	void mux_packets(const std::vector<std::string> &packets, std::ostream &os)
+	{
+		if (m_done) {
+			return;
+		}
+		for (const std::string &packet : packets) {
+			mux((const uint8_t *)packet.data(), packet.size());
+		}
+		dump(os, false);
+	}
 
-		// Dump all buffered data into the given output stream
-		m_mkv_writer.dump(os);
+	void set_cluster_duration(double seconds)
+	{
+		m_muxer->set_cluster_duration(seconds);
+	}
+
+	void set_complexity(int complexity)
+	{
+		if (m_enc) {
+			opus_encoder_ctl(m_enc, OPUS_SET_COMPLEXITY(complexity));
+		}
+	}
+
+	void set_position(uint64_t n_samples) { m_granule = n_samples; }
+
+	void set_preroll(uint64_t n_samples)
+	{
+		if (n_samples % m_frame_size != 0) {
+			throw std::invalid_argument(
+			    "Pre-roll must be a multiple of the frame size");
+		}
+		m_preroll = n_samples;
+	}
+
+	std::vector<uint64_t> cluster_starts()
+	{
+		return m_muxer->cluster_starts();
 	}
 };
 
-Encoder::Encoder(size_t rate, size_t n_channels)
-    : m_impl(std::make_unique<EncoderImpl>(rate, n_channels))
+Encoder::Encoder(size_t rate, size_t n_channels, Container container)
+    : m_impl(std::make_unique<EncoderImpl>(rate, n_channels, container,
+                                           std::string()))
+{
+}
+
+Encoder::Encoder(size_t rate, size_t n_channels, const std::string &filename)
+    : m_impl(std::make_unique<EncoderImpl>(rate, n_channels, Container::WEBM,
+                                           filename))
 {
 }
 
@@ -202,4 +336,41 @@ void Encoder::finalize(size_t bitrate, std::ostream &os)
 {
 	m_impl->encode(nullptr, 0, bitrate, os, true);
 }
+
+void Encoder::encode_packets(float *pcm, size_t n_samples, size_t bitrate,
+                             std::vector<std::string> &packets)
+{
+	m_impl->encode_packets(pcm, n_samples, bitrate, packets);
+}
+
+void Encoder::mux_packets(const std::vector<std::string> &packets,
+                          std::ostream &os)
+{
+	m_impl->mux_packets(packets, os);
+}
+
+void Encoder::set_cluster_duration(double seconds)
+{
+	m_impl->set_cluster_duration(seconds);
+}
+
+void Encoder::set_complexity(int complexity)
+{
+	m_impl->set_complexity(complexity);
+}
+
+void Encoder::set_position(uint64_t n_samples)
+{
+	m_impl->set_position(n_samples);
+}
+
+void Encoder::set_preroll(uint64_t n_samples)
+{
+	m_impl->set_preroll(n_samples);
+}
+
+std::vector<uint64_t> Encoder::cluster_starts()
+{
+	return m_impl->cluster_starts();
+}
 }
@@ -16,8 +16,13 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/muxer.hpp>
 
 namespace http_audio_server {
 
@@ -28,11 +33,75 @@ private:
 	std::unique_ptr<EncoderImpl> m_impl;
 
 public:
-	Encoder(size_t rate, size_t n_channels);
+	/**
+	 * Creates an encoder writing a live stream in the given container.
+	 */
+	Encoder(size_t rate, size_t n_channels,
+	        Container container = Container::WEBM);
+
+	/**
+	 * Creates an encoder writing a seekable WebM file with Cues, SeekHead and
+	 * Duration instead of a live stream. Nothing is written to the output
+	 * streams passed to the other member functions; the file is complete
+	 * once finalize() returns, which throws if writing the file failed.
+	 */
+	Encoder(size_t rate, size_t n_channels, const std::string &filename);
 	~Encoder();
 
 	void feed(float *pcm, size_t n_samples, size_t bitrate, std::ostream &os);
 	void finalize(size_t bitrate, std::ostream &os);
+
+	/**
+	 * Encodes the given samples into raw Opus packets without muxing them,
+	 * one packet per frame. Samples not filling a whole frame are kept for
+	 * the next call.
+	 */
+	void encode_packets(float *pcm, size_t n_samples, size_t bitrate,
+	                    std::vector<std::string> &packets);
+
+	/**
+	 * Muxes packets produced by encode_packets() of an encoder with the same
+	 * rate and channel count into the container. Each packet advances the
+	 * timestamp by one frame. Allows to encode parts of a track in parallel
+	 * and to mux them in order.
+	 */
+	void mux_packets(const std::vector<std::string> &packets,
+	                 std::ostream &os);
+
+	/**
+	 * Starts a new WebM cluster at least every given number of seconds. Live
+	 * channels use short clusters as join points for new listeners. Does
+	 * nothing for the other containers.
+	 */
+	void set_cluster_duration(double seconds);
+
+	/**
+	 * Sets the Opus encoder complexity between 0 and 10. Lower values trade
+	 * quality for encoding speed, may be changed at any time.
+	 */
+	void set_complexity(int complexity);
+
+	/**
+	 * Sets the timestamp of the next encoded frame in samples. Used to encode
+	 * a part of a track starting at a given position, must be called before
+	 * the first call to feed().
+	 */
+	void set_position(uint64_t n_samples);
+
+	/**
+	 * Encodes the given number of samples at the beginning of the stream
+	 * without writing them to the output. Priming the encoder with the audio
+	 * preceding a segment makes independently encoded segments play back
+	 * seamlessly. Must be a multiple of the frame size and must be called
+	 * before the first call to feed().
+	 */
+	void set_preroll(uint64_t n_samples);
+
+	/**
+	 * Returns the byte offsets in the output stream at which clusters started
+	 * since the last call. Always empty for containers other than WebM.
+	 */
+	std::vector<uint64_t> cluster_starts();
 };
 
 }
@@ -0,0 +1,418 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <http_audio_server/decoder.hpp>
+#include <http_audio_server/dsp.hpp>
+#include <http_audio_server/encoder.hpp>
+#include <http_audio_server/live.hpp>
+#include <http_audio_server/logger.hpp>
+#include <http_audio_server/metrics.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct LiveMetrics {
+	Gauge &channels = global_metrics().gauge(
+	    "http_audio_server_live_channels", "Number of live channels");
+	Counter &underruns = global_metrics().counter(
+	    "http_audio_server_live_underruns_total",
+	    "Number of times a live channel ran out of input");
+	Counter &overruns = global_metrics().counter(
+	    "http_audio_server_live_overruns_total",
+	    "Number of times input was dropped because a live channel's jitter "
+	    "buffer overflowed");
+	Counter &restarts = global_metrics().counter(
+	    "http_audio_server_live_source_restarts_total",
+	    "Number of times the source of a live channel ended");
+	Histogram &tick = global_metrics().histogram(
+	    "http_audio_server_live_tick_seconds",
+	    "Time spent producing and encoding a single tick of a live channel");
+};
+
+LiveMetrics &live_metrics()
+{
+	static LiveMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * Class LiveChannelImpl
+ */
+
+class LiveChannelImpl {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr int RATE = 48000;
+	static constexpr size_t N_CHANNELS = 2;
+
+	/**
+	 * Number of frames produced per clock tick (20 ms).
+	 */
+	static constexpr size_t TICK_FRAMES = 960;
+
+	/**
+	 * Length of the fades at the edges of an underrun (5 ms).
+	 */
+	static constexpr size_t FADE_FRAMES = 240;
+
+	/**
+	 * Maximum amount of data in seconds the jitter buffer may hold on top of
+	 * the target latency before old data is dropped.
+	 */
+	static constexpr double MAX_EXCESS = 2.0;
+
+	/**
+	 * Maximum time in seconds the clock may lag behind before ticks are
+	 * skipped instead of being produced in a burst.
+	 */
+	static constexpr double MAX_LAG = 1.0;
+
+	static constexpr double CLUSTER_DURATION = 1.0;
+	static constexpr size_t MAX_CLUSTERS = 16;
+	static constexpr double RESTART_DELAY = 1.0;
+
+	std::string m_name;
+	std::string m_source;
+	LiveChannel::Producer m_producer;
+	size_t m_bitrate;
+	size_t m_latency;
+
+	/**
+	 * Jitter buffer, a ring buffer of interleaved frames.
+	 */
+	mutable std::mutex m_ring_mtx;
+	std::vector<float> m_ring;
+	size_t m_ring_read = 0;
+	size_t m_ring_fill = 0;
+	bool m_playing = false;
+	uint64_t m_underruns = 0;
+	uint64_t m_overruns = 0;
+
+	/**
+	 * State of the clock thread.
+	 */
+	Encoder m_encoder;
+	std::vector<float> m_tick_buf;
+	std::vector<json> m_tick_metadata;
+
+	/**
+	 * Encoded output shared by all listeners.
+	 */
+	SegmentRing m_segments;
+
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	bool m_stop = false;
+	Decoder *m_decoder = nullptr;
+	std::thread m_clock_thread;
+	std::thread m_source_thread;
+
+	size_t capacity() const { return m_ring.size() / N_CHANNELS; }
+
+	size_t take(float *tar, size_t n_frames, bool &fade_in)
+	{
+		std::lock_guard<std::mutex> lock(m_ring_mtx);
+
+		// Wait for the buffer to reach the target latency before playback
+		// starts or resumes
+		if (!m_playing) {
+			if (m_ring_fill < m_latency || m_ring_fill == 0) {
+				return 0;
+			}
+			m_playing = true;
+			fade_in = true;
+		}
+
+		const size_t n = std::min(n_frames, m_ring_fill);
+		for (size_t i = 0; i < n; i++) {
+			const size_t j = (m_ring_read + i) % capacity();
+			std::copy(&m_ring[j * N_CHANNELS], &m_ring[(j + 1) * N_CHANNELS],
+			          tar + i * N_CHANNELS);
+		}
+		m_ring_read = (m_ring_read + n) % capacity();
+		m_ring_fill -= n;
+		if (n < n_frames) {
+			m_playing = false;
+			m_underruns++;
+			live_metrics().underruns.inc();
+		}
+		return n;
+	}
+
+	void tick()
+	{
+		ScopedTimer timer(live_metrics().tick);
+		float *buf = &m_tick_buf[0];
+		if (m_producer) {
+			m_tick_metadata.clear();
+			m_producer(buf, TICK_FRAMES, m_tick_metadata);
+			for (const json &metadata : m_tick_metadata) {
+				m_segments.annotate(metadata);
+			}
+			encode(buf);
+			return;
+		}
+
+		// Fetch the data from the jitter buffer, fade in after an underrun and
+		// out in front of a gap, which is filled with silence
+		bool fade_in = false;
+		const size_t n = take(buf, TICK_FRAMES, fade_in);
+		if (fade_in) {
+			apply_ramp(buf, std::min(n, FADE_FRAMES), N_CHANNELS, 0.0f,
+			           1.0f / float(FADE_FRAMES));
+		}
+		if (n < TICK_FRAMES) {
+			const size_t n_fade = std::min(n, FADE_FRAMES);
+			if (n_fade > 0) {
+				apply_ramp(buf + (n - n_fade) * N_CHANNELS, n_fade, N_CHANNELS,
+				           1.0f, -1.0f / float(n_fade));
+			}
+			std::fill(buf + n * N_CHANNELS, buf + TICK_FRAMES * N_CHANNELS,
+			          0.0f);
+		}
+
+		encode(buf);
+	}
+
+	void encode(float *buf)
+	{
+		std::ostringstream os;
+		m_encoder.feed(buf, TICK_FRAMES, m_bitrate, os);
+		m_segments.write(os.str(), m_encoder.cluster_starts());
+	}
+
+	void clock_thread()
+	{
+		const auto tick_duration = std::chrono::duration_cast<Clock::duration>(
+		    std::chrono::duration<double>(double(TICK_FRAMES) / RATE));
+		const auto max_lag = std::chrono::duration<double>(MAX_LAG);
+		Clock::time_point next = Clock::now();
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while (true) {
+			next += tick_duration;
+			if (m_cv.wait_until(lock, next, [this] { return m_stop; })) {
+				break;
+			}
+			lock.unlock();
+			if (Clock::now() - next > max_lag) {
+				global_logger().warn("live", "Clock of channel " + m_name +
+				                                 " lags behind");
+				next = Clock::now();
+			}
+			tick();
+			lock.lock();
+		}
+	}
+
+	void source_thread()
+	{
+		const size_t chunk = TICK_FRAMES * N_CHANNELS * sizeof(float);
+		std::vector<uint8_t> buf;
+		while (true) {
+			std::unique_ptr<Decoder> decoder;
+			try {
+				// The source runs indefinitely, so ffmpeg must not be
+				// subject to the CPU time limit of file decoders
+				decoder = std::make_unique<Decoder>(
+				    m_source, 0.0, AudioFormat(), Decoder::live_limits());
+			}
+			catch (std::exception &e) {
+				global_logger().error("live", "Cannot open source of channel " +
+				                                  m_name + ": " + e.what());
+			}
+
+			if (decoder) {
+				{
+					std::lock_guard<std::mutex> lock(m_mtx);
+					if (m_stop) {
+						break;
+					}
+					m_decoder = decoder.get();
+				}
+
+				// Forward the decoded data until the source ends
+				while (true) {
+					buf.clear();
+					const size_t n = decoder->read(chunk, buf);
+					ingest(reinterpret_cast<const float *>(buf.data()),
+					       buf.size() / (N_CHANNELS * sizeof(float)));
+					if (n < chunk) {
+						break;
+					}
+				}
+
+				std::lock_guard<std::mutex> lock(m_mtx);
+				m_decoder = nullptr;
+				if (!m_stop) {
+					live_metrics().restarts.inc();
+					global_logger().warn("live", "Source of channel " + m_name +
+					                                 " ended, restarting");
+				}
+			}
+
+			std::unique_lock<std::mutex> lock(m_mtx);
+			const std::chrono::duration<double> delay(RESTART_DELAY);
+			if (m_cv.wait_for(lock, delay, [this] { return m_stop; })) {
+				break;
+			}
+		}
+	}
+
+public:
+	LiveChannelImpl(const std::string &name, const std::string &source,
+	                LiveChannel::Producer producer, size_t bitrate,
+	                double latency)
+	    : m_name(name),
+	      m_source(source),
+	      m_producer(std::move(producer)),
+	      m_bitrate(bitrate),
+	      m_latency(std::max(0.0, latency) * RATE),
+	      m_ring((m_latency + size_t(MAX_EXCESS * RATE) + TICK_FRAMES) *
+	             N_CHANNELS),
+	      m_encoder(RATE, N_CHANNELS),
+	      m_tick_buf(TICK_FRAMES * N_CHANNELS),
+	      m_segments(MAX_CLUSTERS)
+	{
+		m_encoder.set_cluster_duration(CLUSTER_DURATION);
+		m_clock_thread = std::thread(&LiveChannelImpl::clock_thread, this);
+		if (!m_source.empty()) {
+			m_source_thread =
+			    std::thread(&LiveChannelImpl::source_thread, this);
+		}
+		live_metrics().channels.inc();
+	}
+
+	~LiveChannelImpl()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+			if (m_decoder) {
+				m_decoder->cancel();
+			}
+		}
+		m_cv.notify_all();
+		m_clock_thread.join();
+		if (m_source_thread.joinable()) {
+			m_source_thread.join();
+		}
+		live_metrics().channels.dec();
+	}
+
+	const std::string &name() const { return m_name; }
+
+	void ingest(const float *pcm, size_t n_frames)
+	{
+		std::lock_guard<std::mutex> lock(m_ring_mtx);
+
+		// If the source runs ahead of the clock, drop the oldest data so that
+		// the buffer is back at the target latency
+		if (m_ring_fill + n_frames > capacity()) {
+			const size_t n_drop = m_ring_fill + n_frames - m_latency;
+			const size_t n_drop_ring = std::min(n_drop, m_ring_fill);
+			m_ring_read = (m_ring_read + n_drop_ring) % capacity();
+			m_ring_fill -= n_drop_ring;
+			pcm += (n_drop - n_drop_ring) * N_CHANNELS;
+			n_frames -= n_drop - n_drop_ring;
+			m_overruns++;
+			live_metrics().overruns.inc();
+		}
+
+		for (size_t i = 0; i < n_frames; i++) {
+			const size_t j = (m_ring_read + m_ring_fill + i) % capacity();
+			std::copy(pcm + i * N_CHANNELS, pcm + (i + 1) * N_CHANNELS,
+			          &m_ring[j * N_CHANNELS]);
+		}
+		m_ring_fill += n_frames;
+	}
+
+	bool read(uint64_t &cursor, std::vector<SegmentRing::Data> &data,
+	          std::vector<json> &metadata) const
+	{
+		return m_segments.read(cursor, data, metadata);
+	}
+
+	LiveChannel::Stats stats() const
+	{
+		LiveChannel::Stats res;
+		{
+			std::lock_guard<std::mutex> lock(m_ring_mtx);
+			res.underruns = m_underruns;
+			res.overruns = m_overruns;
+			res.buffered = double(m_ring_fill) / RATE;
+		}
+		res.clusters = m_segments.n_segments();
+		return res;
+	}
+};
+
+constexpr size_t LiveChannelImpl::TICK_FRAMES;
+constexpr size_t LiveChannelImpl::FADE_FRAMES;
+
+/*
+ * Class LiveChannel
+ */
+
+LiveChannel::LiveChannel(const std::string &name, const std::string &source,
+                         size_t bitrate, double latency)
+    : m_impl(std::make_unique<LiveChannelImpl>(name, source, nullptr, bitrate,
+                                               latency))
+{
+}
+
+LiveChannel::LiveChannel(const std::string &name, Producer producer,
+                         size_t bitrate)
+    : m_impl(std::make_unique<LiveChannelImpl>(name, "", std::move(producer),
+                                               bitrate, 0.0))
+{
+}
+
+LiveChannel::~LiveChannel()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+const std::string &LiveChannel::name() const { return m_impl->name(); }
+
+void LiveChannel::ingest(const float *pcm, size_t n_frames)
+{
+	m_impl->ingest(pcm, n_frames);
+}
+
+bool LiveChannel::read(uint64_t &cursor, std::vector<SegmentRing::Data> &data,
+                       std::vector<json> &metadata) const
+{
+	return m_impl->read(cursor, data, metadata);
+}
+
+LiveChannel::Stats LiveChannel::stats() const { return m_impl->stats(); }
+}
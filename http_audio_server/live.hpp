@@ -0,0 +1,120 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file live.hpp
+ *
+ * Contains the LiveChannel class, which restreams a live source (a named
+ * pipe, an HTTP stream, an ALSA capture device or PCM pushed via the ingest
+ * API) or a playlist in real time. The source is encoded once and the
+ * encoded stream is shared by all listeners of the channel.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_LIVE_HPP
+#define HTTP_AUDIO_SERVER_LIVE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/json.hpp>
+#include <http_audio_server/segment_ring.hpp>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class LiveChannelImpl;
+
+/**
+ * The LiveChannel class buffers the incoming PCM data in a jitter buffer,
+ * takes it out in fixed ticks driven by a steady clock and encodes it to
+ * WebM/Opus. Underruns are concealed with silence, with short fades at the
+ * edges of the gap. Alternatively, a producer callback renders the data for
+ * each tick. The encoded stream is kept in a SegmentRing, each WebM cluster
+ * is a possible join point for a new listener.
+ */
+class LiveChannel {
+private:
+	std::unique_ptr<LiveChannelImpl> m_impl;
+
+public:
+	struct Stats {
+		uint64_t underruns = 0;
+		uint64_t overruns = 0;
+		uint64_t clusters = 0;
+		double buffered = 0.0;
+	};
+
+	/**
+	 * Callback rendering exactly n_frames interleaved 48 kHz stereo float
+	 * frames into buf. Metadata entries describing the rendered data are
+	 * appended to metadata. Called on the clock thread.
+	 */
+	using Producer = std::function<void(float *buf, size_t n_frames,
+	                                    std::vector<json> &metadata)>;
+
+	/**
+	 * Creates a new live channel and starts its clock.
+	 *
+	 * @param name is the name of the channel.
+	 * @param source is the source passed to ffmpeg, e.g. the path of a named
+	 * pipe, an HTTP URL or "alsa:<device>". If empty, the channel is only fed
+	 * via ingest(). ffmpeg is restarted if the source ends.
+	 * @param bitrate is the Opus bitrate in bits per second.
+	 * @param latency is the amount of data in seconds the jitter buffer
+	 * gathers before playback starts or resumes after an underrun.
+	 */
+	LiveChannel(const std::string &name, const std::string &source = "",
+	            size_t bitrate = 128000, double latency = 0.5);
+
+	/**
+	 * Creates a new channel whose data is rendered by the given producer,
+	 * e.g. a playlist which is broadcast to all listeners.
+	 */
+	LiveChannel(const std::string &name, Producer producer,
+	            size_t bitrate = 128000);
+
+	/**
+	 * Stops the clock and the source.
+	 */
+	~LiveChannel();
+
+	const std::string &name() const;
+
+	/**
+	 * Pushes interleaved 48 kHz stereo float samples into the jitter buffer.
+	 */
+	void ingest(const float *pcm, size_t n_frames);
+
+	/**
+	 * Collects the encoded segments following the given cursor, see
+	 * SegmentRing::read().
+	 */
+	bool read(uint64_t &cursor, std::vector<SegmentRing::Data> &data,
+	          std::vector<json> &metadata) const;
+
+	Stats stats() const;
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_LIVE_HPP */
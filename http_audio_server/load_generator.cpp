@@ -0,0 +1,350 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Synthetic load generator for http_audio_server. Opens new streams at a
+ * fixed rate and plays each of them back in real time like the web player,
+ * keeping ten seconds of audio buffered. Reports the number of admitted and
+ * rejected streams and the underruns of the admitted ones. Usage:
+ *
+ *     http_audio_server_load_generator [--url URL] [--rate STREAMS/S]
+ *                                      [--duration SECONDS] FILE...
+ *
+ * The files are appended to the streams in turn. The streams use the raw
+ * container, so the received audio can be counted without parsing WebM.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/json.hpp>
+#include <lib/mongoose.h>
+
+using namespace http_audio_server;
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Duration of an Opus frame written by the server in seconds.
+ */
+static constexpr double FRAME_DURATION = 0.04;
+
+/**
+ * Amount of audio each listener keeps buffered in seconds.
+ */
+static constexpr double BUFFER_SIZE = 10.0;
+
+using Callback = std::function<void(int status, const std::string &body)>;
+
+static void event_handler(mg_connection *nc, int ev, void *ev_data)
+{
+	Callback *cb = static_cast<Callback *>(nc->user_data);
+	if (!cb) {
+		return;
+	}
+	if (ev == MG_EV_HTTP_REPLY) {
+		http_message *hm = static_cast<http_message *>(ev_data);
+		(*cb)(hm->resp_code, std::string(hm->body.p, hm->body.len));
+		nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+	}
+	else if (ev == MG_EV_CLOSE) {
+		(*cb)(0, std::string());
+	}
+	else {
+		return;
+	}
+	delete cb;
+	nc->user_data = nullptr;
+}
+
+static void post(mg_mgr *mgr, const std::string &url, const std::string &body,
+                 Callback cb)
+{
+	mg_connection *nc = mg_connect_http(
+	    mgr, event_handler, url.c_str(),
+	    "Content-Type: application/json\r\n", body.c_str());
+	if (!nc) {
+		cb(0, std::string());
+		return;
+	}
+	nc->user_data = new Callback(std::move(cb));
+}
+
+/**
+ * Returns the seconds of audio in the data segment of an advance response.
+ */
+static double audio_seconds(const std::string &body)
+{
+	size_t n_frames = 0;
+	size_t cur = 0;
+	while (cur + 8 <= body.size()) {
+		uint32_t size;
+		memcpy(&size, body.data() + cur + 4, sizeof(size));
+		if (body.compare(cur, 4, "data") == 0) {
+			// Raw packets are preceded by their 16 bit little endian size,
+			// the first packet of the stream is the OpusHead header
+			const size_t end = std::min(body.size(), cur + 8 + size);
+			for (size_t p = cur + 8; p + 2 <= end;) {
+				const size_t len = uint8_t(body[p]) | uint8_t(body[p + 1]) << 8;
+				if (body.compare(p + 2, 8, "OpusHead") != 0) {
+					n_frames++;
+				}
+				p += 2 + len;
+			}
+		}
+		cur += 8 + size;
+	}
+	return n_frames * FRAME_DURATION;
+}
+
+struct Listener {
+	std::string id;
+	bool pending = false;
+	bool playing = false;
+	Clock::time_point t_start;
+	double buffered = 0.0;
+	bool underrun = false;
+	size_t n_underruns = 0;
+	double underrun_seconds = 0.0;
+
+	double position(Clock::time_point now) const
+	{
+		return playing ? std::chrono::duration<double>(now - t_start).count()
+		               : 0.0;
+	}
+};
+
+struct Stats {
+	size_t n_created = 0;
+	size_t n_rejected = 0;
+	size_t n_failed = 0;
+	size_t n_underruns = 0;
+	std::vector<double> advance_ms;
+};
+
+static double percentile(std::vector<double> values, double p)
+{
+	if (values.empty()) {
+		return 0.0;
+	}
+	const size_t idx = std::min(values.size() - 1, size_t(p * values.size()));
+	std::nth_element(values.begin(), values.begin() + idx, values.end());
+	return values[idx];
+}
+
+int main(int argc, char *argv[])
+{
+	std::string url = "http://127.0.0.1:4851";
+	double rate = 1.0;
+	double duration = 60.0;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg == "--url" && i + 1 < argc) {
+			url = argv[++i];
+		}
+		else if (arg == "--rate" && i + 1 < argc) {
+			rate = std::stod(argv[++i]);
+		}
+		else if (arg == "--duration" && i + 1 < argc) {
+			duration = std::stod(argv[++i]);
+		}
+		else if (arg.compare(0, 2, "--") == 0) {
+			std::cerr << "Unknown argument " << arg << std::endl;
+			return 1;
+		}
+		else {
+			files.push_back(arg);
+		}
+	}
+	if (files.empty() || !(rate > 0.0)) {
+		std::cerr << "Usage: " << argv[0]
+		          << " [--url URL] [--rate STREAMS/S] [--duration SECONDS] "
+		             "FILE..."
+		          << std::endl;
+		return 1;
+	}
+
+	mg_mgr mgr;
+	mg_mgr_init(&mgr, nullptr);
+
+	std::list<Listener> listeners;
+	Stats stats;
+	const Clock::time_point t0 = Clock::now();
+	const Clock::time_point t_end =
+	    t0 + std::chrono::duration_cast<Clock::duration>(
+	             std::chrono::duration<double>(duration));
+	Clock::time_point t_next_create = t0;
+	Clock::time_point t_next_report = t0 + std::chrono::seconds(1);
+	size_t n_requests_pending = 0;
+	bool stopping = false;
+
+	const auto destroy = [&](const std::string &id) {
+		n_requests_pending++;
+		post(&mgr, url + "/stream/" + id + "/destroy", "",
+		     [&](int, const std::string &) { n_requests_pending--; });
+	};
+
+	const auto advance = [&](Listener &l) {
+		l.pending = true;
+		const Clock::time_point t_request = Clock::now();
+		post(&mgr, url + "/stream/" + l.id + "/advance", "",
+		     [&, t_request](int status, const std::string &body) {
+			     const Clock::time_point now = Clock::now();
+			     l.pending = false;
+			     if (status != 200) {
+				     stats.n_failed++;
+				     return;
+			     }
+			     stats.advance_ms.push_back(
+			         std::chrono::duration<double>(now - t_request).count() *
+			         1e3);
+			     const double seconds = audio_seconds(body);
+			     if (seconds > 0.0 && !l.playing) {
+				     l.playing = true;
+				     l.t_start = now;
+			     }
+			     l.buffered += seconds;
+			 });
+	};
+
+	const auto create = [&] {
+		n_requests_pending++;
+		const std::string file = files[stats.n_created % files.size()];
+		post(&mgr, url + "/stream/create", json{{"container", "raw"}}.dump(),
+		     [&, file](int status, const std::string &body) {
+			     n_requests_pending--;
+			     if (status == 503) {
+				     stats.n_rejected++;
+				     return;
+			     }
+			     if (status != 200) {
+				     stats.n_failed++;
+				     return;
+			     }
+			     stats.n_created++;
+			     const std::string id =
+			         body.substr(0, body.find_first_of("\r\n"));
+			     if (stopping) {
+				     destroy(id);
+				     return;
+			     }
+			     listeners.emplace_back();
+			     Listener &l = listeners.back();
+			     l.id = id;
+			     l.pending = true;
+			     post(&mgr, url + "/stream/" + l.id + "/append",
+			          json{{"filename", file}}.dump(),
+			          [&](int status, const std::string &) {
+				          l.pending = false;
+				          if (status != 200) {
+					          stats.n_failed++;
+				          }
+				      });
+			 });
+	};
+
+	std::cout << std::fixed << std::setprecision(1);
+	while (Clock::now() < t_end) {
+		mg_mgr_poll(&mgr, 10);
+		const Clock::time_point now = Clock::now();
+
+		// Open new streams at the given rate
+		while (t_next_create <= now) {
+			create();
+			t_next_create += std::chrono::duration_cast<Clock::duration>(
+			    std::chrono::duration<double>(1.0 / rate));
+		}
+
+		// Play back the streams and keep their buffers filled
+		for (Listener &l : listeners) {
+			const double pos = l.position(now);
+			const bool underrun = l.playing && pos > l.buffered;
+			if (underrun && !l.underrun) {
+				l.n_underruns++;
+				stats.n_underruns++;
+			}
+			if (underrun) {
+				// Playback stalls until new data arrives
+				const double gap = pos - l.buffered;
+				l.underrun_seconds += gap;
+				l.t_start += std::chrono::duration_cast<Clock::duration>(
+				    std::chrono::duration<double>(gap));
+			}
+			l.underrun = underrun;
+			if (!l.pending && l.buffered - pos < BUFFER_SIZE) {
+				advance(l);
+			}
+		}
+
+		if (now >= t_next_report) {
+			t_next_report += std::chrono::seconds(1);
+			std::cout << std::setw(6)
+			          << std::chrono::duration<double>(now - t0).count()
+			          << " s: streams " << listeners.size() << ", rejected "
+			          << stats.n_rejected << ", failed " << stats.n_failed
+			          << ", underruns " << stats.n_underruns
+			          << ", advance p50 "
+			          << percentile(stats.advance_ms, 0.5) << " ms, p99 "
+			          << percentile(stats.advance_ms, 0.99) << " ms"
+			          << std::endl;
+		}
+	}
+
+	// Tear the streams down and wait for the outstanding requests, streams
+	// created in the meantime are destroyed right away
+	stopping = true;
+	for (const Listener &l : listeners) {
+		destroy(l.id);
+	}
+	const Clock::time_point t_drain = Clock::now() + std::chrono::seconds(5);
+	while (Clock::now() < t_drain) {
+		mg_mgr_poll(&mgr, 10);
+		bool pending = n_requests_pending > 0;
+		for (const Listener &l : listeners) {
+			pending = pending || l.pending;
+		}
+		if (!pending) {
+			break;
+		}
+	}
+	mg_mgr_free(&mgr);
+
+	double underrun_seconds = 0.0;
+	size_t n_affected = 0;
+	for (const Listener &l : listeners) {
+		underrun_seconds += l.underrun_seconds;
+		n_affected += l.n_underruns > 0 ? 1 : 0;
+	}
+	std::cout << "Created " << stats.n_created << " streams, rejected "
+	          << stats.n_rejected << ", failed requests " << stats.n_failed
+	          << "\n"
+	          << "Underruns: " << stats.n_underruns << " in " << n_affected
+	          << " streams, " << underrun_seconds << " s in total\n"
+	          << "Advance latency p50: " << percentile(stats.advance_ms, 0.5)
+	          << " ms, p99: " << percentile(stats.advance_ms, 0.99) << " ms"
+	          << std::endl;
+	return 0;
+}
@@ -22,9 +22,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include <http_audio_server/string_utils.hpp>
@@ -52,8 +55,9 @@ public:
 	{
 		{
 			char time_str[41];
+			std::tm tm;
 			std::strftime(time_str, 40, "%Y-%m-%d %H:%M:%S",
-			              std::localtime(&time));
+			              localtime_r(&time, &tm));
 			m_os << m_terminal.italic() << time_str << m_terminal.reset();
 		}
 
@@ -128,6 +132,129 @@ LogFileBackend::LogFileBackend(const std::string &prefix)
 }
 
 LogFileBackend::~LogFileBackend() {}
+/*
+ * Class LogQueue
+ */
+
+/**
+ * Bounded multi-producer single-consumer queue holding log records. Based on
+ * Dmitry Vyukov's bounded MPMC queue: each slot carries a sequence number which
+ * tells producers and the consumer whether the slot is free or filled, so
+ * neither side ever takes a lock.
+ */
+class LogQueue {
+public:
+	struct Record {
+		LogSeverity lvl;
+		std::time_t time;
+		std::string module;
+		std::string message;
+	};
+
+private:
+	struct Slot {
+		std::atomic<size_t> seq;
+		Record record;
+	};
+
+	static size_t next_pow2(size_t n)
+	{
+		size_t res = 1;
+		while (res < n) {
+			res <<= 1;
+		}
+		return res;
+	}
+
+	std::unique_ptr<Slot[]> m_slots;
+	size_t m_mask;
+	alignas(64) std::atomic<size_t> m_enqueue_pos{0};
+	alignas(64) std::atomic<size_t> m_dequeue_pos{0};
+
+public:
+	explicit LogQueue(size_t capacity)
+	    : m_slots(new Slot[next_pow2(capacity)]),
+	      m_mask(next_pow2(capacity) - 1)
+	{
+		for (size_t i = 0; i <= m_mask; i++) {
+			m_slots[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Moves the given record into the queue. Returns false and leaves the
+	 * record untouched if the queue is full. May be called from any thread.
+	 */
+	bool push(Record &record)
+	{
+		size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		Slot *slot;
+		while (true) {
+			slot = &m_slots[pos & m_mask];
+			const size_t seq = slot->seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(
+				        pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false;  // The queue is full
+			}
+			else {
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		slot->record = std::move(record);
+		slot->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Moves the oldest record out of the queue. Returns false if the queue is
+	 * empty. Must only be called from the consumer thread.
+	 */
+	bool pop(Record &record)
+	{
+		const size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		Slot &slot = m_slots[pos & m_mask];
+		if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+			return false;
+		}
+		record = std::move(slot.record);
+		slot.seq.store(pos + m_mask + 1, std::memory_order_release);
+		m_dequeue_pos.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Returns true if the consumer has no record to pop.
+	 */
+	bool empty() const
+	{
+		const size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		return m_slots[pos & m_mask].seq.load(std::memory_order_acquire) !=
+		       pos + 1;
+	}
+
+	/**
+	 * Number of slots claimed by producers so far.
+	 */
+	size_t enqueued() const
+	{
+		return m_enqueue_pos.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Number of records popped by the consumer so far.
+	 */
+	size_t dequeued() const
+	{
+		return m_dequeue_pos.load(std::memory_order_acquire);
+	}
+};
+
 /*
  * Class LoggerImpl
  */
@@ -140,6 +267,16 @@ private:
 	LogSeverity m_min_level = LogSeverity::INFO;
 	std::map<LogSeverity, size_t> m_counts;
 
+	std::unique_ptr<LogQueue> m_queue;
+	LogOverflowPolicy m_policy = LogOverflowPolicy::DROP;
+	std::thread m_sink_thread;
+	std::mutex m_sink_mtx;
+	std::condition_variable m_sink_cv;
+	std::condition_variable m_drained_cv;
+	std::atomic<bool> m_sink_stop{false};
+	std::atomic<bool> m_sink_idle{false};
+	std::atomic<size_t> m_n_dropped{0};
+
 	size_t backend_idx(int idx) const
 	{
 		idx = (idx < 0) ? int(m_backends.size()) + idx : idx;
@@ -149,7 +286,71 @@ private:
 		return idx;
 	}
 
+	/**
+	 * Passes a record to all backends. m_logger_mtx must be held.
+	 */
+	void dispatch(LogSeverity lvl, std::time_t time, const std::string &module,
+	              const std::string &message)
+	{
+		// Update the statistics
+		auto it = m_counts.find(lvl);
+		if (it != m_counts.end()) {
+			it->second++;
+		}
+		else {
+			m_counts.emplace(lvl, 1);
+		}
+
+		// Actually issue the elements
+		for (auto &backend : m_backends) {
+			if (lvl >= std::get<1>(backend)) {
+				std::get<0>(backend)->log(lvl, time, module, message);
+			}
+		}
+	}
+
+	void wake_sink()
+	{
+		std::lock_guard<std::mutex> lock(m_sink_mtx);
+		m_sink_cv.notify_one();
+	}
+
+	void sink_thread()
+	{
+		LogQueue::Record record;
+		while (true) {
+			// Drain the queue. Read the stop flag first, so all records pushed
+			// before stop_async() was called are handled by this iteration.
+			const bool stop = m_sink_stop.load();
+			{
+				std::lock_guard<std::mutex> lock(m_logger_mtx);
+				while (m_queue->pop(record)) {
+					dispatch(record.lvl, record.time, record.module,
+					         record.message);
+				}
+			}
+
+			std::unique_lock<std::mutex> lock(m_sink_mtx);
+			m_drained_cv.notify_all();
+			if (stop) {
+				break;
+			}
+
+			// Go to sleep until a producer wakes us up. The fence pairs with
+			// the one in log(), so either the producer sees m_sink_idle or we
+			// see the new record.
+			m_sink_idle.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			m_sink_cv.wait_for(lock, std::chrono::milliseconds(100), [this] {
+				return m_sink_stop.load() || !m_queue->empty();
+			});
+			m_sink_idle.store(false);
+		}
+	}
+
 public:
+	~LoggerImpl() { stop_async(); }
+
 	size_t backend_count() const { return m_backends.size(); }
 	int add_backend(std::shared_ptr<LogBackend> backend, LogSeverity lvl)
 	{
@@ -168,26 +369,66 @@ public:
 		return std::get<1>(m_backends[backend_idx(idx)]);
 	}
 
-	void log(LogSeverity lvl, std::time_t time, const std::string &module,
-	         const std::string &message)
+	void start_async(size_t capacity, LogOverflowPolicy policy)
 	{
-		std::lock_guard<std::mutex> lock(m_logger_mtx);
+		stop_async();
+		m_queue = std::make_unique<LogQueue>(capacity);
+		m_policy = policy;
+		m_sink_stop = false;
+		m_sink_thread = std::thread(&LoggerImpl::sink_thread, this);
+	}
 
-		// Update the statistics
-		auto it = m_counts.find(lvl);
-		if (it != m_counts.end()) {
-			it->second++;
+	void stop_async()
+	{
+		if (!m_queue) {
+			return;
 		}
-		else {
-			m_counts.emplace(lvl, 1);
+		m_sink_stop = true;
+		wake_sink();
+		m_sink_thread.join();
+		m_queue = nullptr;
+	}
+
+	void flush()
+	{
+		if (!m_queue) {
+			return;
 		}
+		const size_t target = m_queue->enqueued();
+		std::unique_lock<std::mutex> lock(m_sink_mtx);
+		m_sink_cv.notify_one();
+		m_drained_cv.wait(lock,
+		                  [&] { return m_queue->dequeued() >= target; });
+	}
 
-		// Actually issue the elements
-		for (auto &backend : m_backends) {
-			if (lvl >= std::get<1>(backend)) {
-				std::get<0>(backend)->log(lvl, time, module, message);
+	size_t dropped() const { return m_n_dropped.load(); }
+
+	void log(LogSeverity lvl, std::time_t time, const std::string &module,
+	         const std::string &message)
+	{
+		// In asynchronous mode hand the record over to the sink thread. Fatal
+		// errors are written synchronously, as the program is likely to exit
+		// right afterwards.
+		if (m_queue && lvl < LogSeverity::FATAL_ERROR) {
+			LogQueue::Record record{lvl, time, module, message};
+			while (!m_queue->push(record)) {
+				if (m_policy == LogOverflowPolicy::DROP) {
+					m_n_dropped++;
+					return;
+				}
+				wake_sink();
+				std::this_thread::yield();
+			}
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_sink_idle.load()) {
+				wake_sink();
 			}
+			return;
 		}
+
+		flush();
+		std::lock_guard<std::mutex> lock(m_logger_mtx);
+		dispatch(lvl, time, module, message);
 	}
 
 	void log(LogSeverity lvl, const std::string &module,
@@ -217,6 +458,11 @@ Logger::Logger(std::shared_ptr<LogBackend> backend, LogSeverity lvl) : Logger()
 	add_backend(std::move(backend), lvl);
 }
 
+Logger::~Logger()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
 size_t Logger::backend_count() const { return m_impl->backend_count(); }
 size_t Logger::count(LogSeverity lvl) const { return m_impl->count(lvl); }
 int Logger::add_backend(std::shared_ptr<LogBackend> backend, LogSeverity lvl)
@@ -230,6 +476,14 @@ void Logger::min_level(LogSeverity lvl, int idx)
 }
 
 LogSeverity Logger::min_level(int idx) { return m_impl->min_level(idx); }
+void Logger::start_async(size_t capacity, LogOverflowPolicy policy)
+{
+	m_impl->start_async(capacity, policy);
+}
+
+void Logger::stop_async() { m_impl->stop_async(); }
+void Logger::flush() { m_impl->flush(); }
+size_t Logger::dropped() const { return m_impl->dropped(); }
 void Logger::log(LogSeverity lvl, std::time_t time, const std::string &module,
                  const std::string &message)
 {
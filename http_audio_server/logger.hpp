@@ -54,6 +54,23 @@ enum LogSeverity : int32_t {
 	FATAL_ERROR = 50
 };
 
+/**
+ * The LogOverflowPolicy enum determines what an asynchronous Logger does if
+ * its record queue is full.
+ */
+enum class LogOverflowPolicy {
+	/**
+	 * Discard the new record and increment the drop counter. The calling
+	 * thread never blocks.
+	 */
+	DROP,
+
+	/**
+	 * Wait until the background thread has made room for the new record.
+	 */
+	BLOCK
+};
+
 /**
  * The Backend class is the abstract base class that must be implemented by
  * any log backend.
@@ -119,6 +136,11 @@ public:
 	Logger(std::shared_ptr<LogBackend> backend,
 	       LogSeverity lvl = LogSeverity::INFO);
 
+	/**
+	 * Destroys the logger, passes all queued records to the backends.
+	 */
+	~Logger();
+
 	/**
 	 * Returns the number of attached backends.
 	 */
@@ -150,6 +172,33 @@ public:
 	 */
 	size_t count(LogSeverity lvl = LogSeverity::DEBUG) const;
 
+	/**
+	 * Switches the logger into asynchronous mode. Log records are pushed into
+	 * a lock-free queue with the given capacity (rounded up to the next power
+	 * of two) and passed to the backends by a background thread. Fatal errors
+	 * are always logged synchronously.
+	 */
+	void start_async(size_t capacity = 4096,
+	                 LogOverflowPolicy policy = LogOverflowPolicy::DROP);
+
+	/**
+	 * Passes all queued records to the backends, stops the background thread
+	 * and switches the logger back into synchronous mode.
+	 */
+	void stop_async();
+
+	/**
+	 * Blocks until all records queued so far have been passed to the
+	 * backends. Does nothing in synchronous mode.
+	 */
+	void flush();
+
+	/**
+	 * Returns the number of records which were discarded because the queue
+	 * was full.
+	 */
+	size_t dropped() const;
+
 	void log(LogSeverity lvl, std::time_t time, const std::string &module,
 	         const std::string &message);
 	void debug(const std::string &module, const std::string &message);
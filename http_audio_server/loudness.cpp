@@ -0,0 +1,639 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#include <http_audio_server/decoder_pool.hpp>
+#include <http_audio_server/json.hpp>
+#include <http_audio_server/logger.hpp>
+#include <http_audio_server/loudness.hpp>
+#include <http_audio_server/metadata.hpp>
+#include <http_audio_server/metrics.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Class TruePeakMeter
+ */
+
+constexpr size_t TruePeakMeter::N_PHASES;
+constexpr size_t TruePeakMeter::N_TAPS;
+
+namespace {
+/**
+ * Returns the interpolation filter of the true peak meter. The filter is
+ * stored per phase with the taps in reverse order, so it can be applied
+ * directly to the history buffer. Phase zero reproduces the input delayed by
+ * N_TAPS / 2 samples.
+ */
+template <size_t N_PHASES, size_t N_TAPS>
+const std::vector<float> &true_peak_filter()
+{
+	static const std::vector<float> filter = [] {
+		std::vector<float> res(N_PHASES * N_TAPS);
+		const double centre = N_PHASES * N_TAPS / 2;
+		for (size_t p = 0; p < N_PHASES; p++) {
+			double sum = 0.0;
+			for (size_t j = 0; j < N_TAPS; j++) {
+				// Position of the tap in the oversampled domain
+				const double t = double(p + N_PHASES * j) - centre;
+				const double x = t / double(N_PHASES);
+				const double sinc =
+				    (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+				const double window =
+				    0.5 + 0.5 * std::cos(M_PI * t / (centre + 1.0));
+				res[p * N_TAPS + (N_TAPS - 1 - j)] = sinc * window;
+				sum += sinc * window;
+			}
+			for (size_t j = 0; j < N_TAPS; j++) {
+				res[p * N_TAPS + j] /= sum;
+			}
+		}
+		return res;
+	}();
+	return filter;
+}
+}
+
+TruePeakMeter::TruePeakMeter(size_t n_channels) : m_n_channels(n_channels)
+{
+	reset();
+}
+
+void TruePeakMeter::process(const float *src, float *tar, size_t n_frames)
+{
+	const std::vector<float> &filter = true_peak_filter<N_PHASES, N_TAPS>();
+	for (size_t i = 0; i < n_frames; i++) {
+		float peak = 0.0f;
+		for (size_t c = 0; c < m_n_channels; c++) {
+			// Write the sample to both copies of the history, the N_TAPS
+			// samples starting at m_pos + 1 are the most recent ones
+			float *hist = &m_history[c * 2 * N_TAPS];
+			const float x = src[i * m_n_channels + c];
+			hist[m_pos] = x;
+			hist[m_pos + N_TAPS] = x;
+			const float *window = hist + m_pos + 1;
+			for (size_t p = 0; p < N_PHASES; p++) {
+				const float *h = &filter[p * N_TAPS];
+				float y = 0.0f;
+				for (size_t j = 0; j < N_TAPS; j++) {
+					y += h[j] * window[j];
+				}
+				peak = std::max(peak, std::abs(y));
+			}
+		}
+		tar[i] = peak;
+		m_pos = (m_pos + 1) % N_TAPS;
+	}
+}
+
+void TruePeakMeter::reset()
+{
+	m_history.assign(m_n_channels * 2 * N_TAPS, 0.0f);
+	m_pos = 0;
+}
+
+/*
+ * Class LoudnessMeter
+ */
+
+LoudnessMeter::LoudnessMeter(int rate, size_t n_channels)
+    : m_rate(rate),
+      m_n_channels(n_channels),
+      m_state(4 * n_channels, 0.0),
+      m_true_peak_meter(n_channels),
+      m_sub_block(n_channels, 0.0),
+      m_sub_block_len(rate / 10)
+{
+	// K-weighting filter coefficients for arbitrary sample rates, see
+	// ITU-R BS.1770-4 and the derivation used by libebur128
+	{
+		const double f0 = 1681.974450955533, G = 3.999843853973347,
+		             Q = 0.7071752369554196;
+		const double K = std::tan(M_PI * f0 / rate);
+		const double Vh = std::pow(10.0, G / 20.0);
+		const double Vb = std::pow(Vh, 0.4996667741545416);
+		const double a0 = 1.0 + K / Q + K * K;
+		m_shelf = Biquad{(Vh + Vb * K / Q + K * K) / a0,
+		                 2.0 * (K * K - Vh) / a0,
+		                 (Vh - Vb * K / Q + K * K) / a0,
+		                 2.0 * (K * K - 1.0) / a0,
+		                 (1.0 - K / Q + K * K) / a0};
+	}
+	{
+		const double f0 = 38.13547087602444, Q = 0.5003270373238773;
+		const double K = std::tan(M_PI * f0 / rate);
+		const double a0 = 1.0 + K / Q + K * K;
+		m_highpass = Biquad{1.0, -2.0, 1.0, 2.0 * (K * K - 1.0) / a0,
+		                    (1.0 - K / Q + K * K) / a0};
+	}
+}
+
+void LoudnessMeter::finish_sub_block()
+{
+	// Channel weights; for 5.1 the LFE channel is ignored and the surround
+	// channels are weighted with +1.5 dB
+	double energy = 0.0;
+	for (size_t c = 0; c < m_n_channels; c++) {
+		double weight = 1.0;
+		if (m_n_channels == 6) {
+			weight = (c == 3) ? 0.0 : ((c >= 4) ? 1.41 : 1.0);
+		}
+		energy += weight * m_sub_block[c] / double(m_sub_block_len);
+		m_sub_block[c] = 0.0;
+	}
+	m_sub_block_pos = 0;
+
+	// Gating blocks are 400 ms long and overlap by 75%
+	m_recent.push_back(energy);
+	if (m_recent.size() > 4) {
+		m_recent.pop_front();
+	}
+	if (m_recent.size() == 4) {
+		m_blocks.push_back(
+		    (m_recent[0] + m_recent[1] + m_recent[2] + m_recent[3]) / 4.0);
+	}
+}
+
+void LoudnessMeter::process(const float *src, size_t n_frames)
+{
+	for (size_t i = 0; i < n_frames; i++) {
+		// Apply the two K-weighting biquads (transposed direct form II) to
+		// each channel and accumulate the energy
+		for (size_t c = 0; c < m_n_channels; c++) {
+			double *z = &m_state[4 * c];
+			const double x = src[i * m_n_channels + c];
+			const double y0 = m_shelf.b0 * x + z[0];
+			z[0] = m_shelf.b1 * x - m_shelf.a1 * y0 + z[1];
+			z[1] = m_shelf.b2 * x - m_shelf.a2 * y0;
+			const double y1 = m_highpass.b0 * y0 + z[2];
+			z[2] = m_highpass.b1 * y0 - m_highpass.a1 * y1 + z[3];
+			z[3] = m_highpass.b2 * y0 - m_highpass.a2 * y1;
+			m_sub_block[c] += y1 * y1;
+		}
+		if (++m_sub_block_pos == m_sub_block_len) {
+			finish_sub_block();
+		}
+	}
+
+	m_peaks.resize(n_frames);
+	m_true_peak_meter.process(src, m_peaks.data(), n_frames);
+	for (float peak : m_peaks) {
+		m_true_peak = std::max(m_true_peak, peak);
+	}
+}
+
+double LoudnessMeter::integrated() const
+{
+	// Absolute gate at -70 LUFS
+	const double abs_gate = std::pow(10.0, (-70.0 + 0.691) / 10.0);
+	double sum = 0.0;
+	size_t n = 0;
+	for (double block : m_blocks) {
+		if (block > abs_gate) {
+			sum += block;
+			n++;
+		}
+	}
+	if (n == 0) {
+		return -std::numeric_limits<double>::infinity();
+	}
+
+	// Relative gate 10 LU below the loudness of the blocks above the
+	// absolute gate
+	const double rel_gate = std::max(abs_gate, 0.1 * sum / double(n));
+	sum = 0.0;
+	n = 0;
+	for (double block : m_blocks) {
+		if (block > rel_gate) {
+			sum += block;
+			n++;
+		}
+	}
+	if (n == 0) {
+		return -std::numeric_limits<double>::infinity();
+	}
+	return -0.691 + 10.0 * std::log10(sum / double(n));
+}
+
+/*
+ * Class TruePeakLimiter
+ */
+
+TruePeakLimiter::TruePeakLimiter(int rate, size_t n_channels,
+                                 double ceiling_db, double lookahead,
+                                 double release)
+    : m_n_channels(n_channels),
+      m_lookahead(std::max<size_t>(1, std::round(lookahead * rate))),
+      m_ceiling(std::pow(10.0, ceiling_db / 20.0)),
+      m_release(1.0 - std::exp(-1.0 / (release * rate))),
+      m_true_peak_meter(n_channels),
+      m_delay_len(m_lookahead + TruePeakMeter::latency())
+{
+	reset();
+}
+
+void TruePeakLimiter::reset()
+{
+	m_true_peak_meter.reset();
+	m_delay.assign(m_delay_len * m_n_channels, 0.0f);
+	m_min_queue.clear();
+	m_box.assign(m_lookahead + 1, 1.0f);
+	m_box_sum = m_lookahead + 1;
+	m_env = 1.0f;
+	m_pos = 0;
+}
+
+void TruePeakLimiter::process(float *buf, size_t n_frames, float gain)
+{
+	// Apply the gain and estimate the true peak of each frame
+	if (gain != 1.0f) {
+		for (size_t i = 0; i < n_frames * m_n_channels; i++) {
+			buf[i] *= gain;
+		}
+	}
+	m_peaks.resize(n_frames);
+	m_true_peak_meter.process(buf, m_peaks.data(), n_frames);
+
+	for (size_t i = 0; i < n_frames; i++, m_pos++) {
+		// Gain required to keep the current peak below the ceiling. The
+		// minimum over the look-ahead window is held, so the envelope reaches
+		// it before the peak leaves the delay line.
+		const float peak = m_peaks[i];
+		const float g = (peak > m_ceiling) ? m_ceiling / peak : 1.0f;
+		while (!m_min_queue.empty() && m_min_queue.back().second >= g) {
+			m_min_queue.pop_back();
+		}
+		m_min_queue.emplace_back(m_pos, g);
+		while (m_min_queue.front().first + m_lookahead < m_pos) {
+			m_min_queue.pop_front();
+		}
+		const float m = m_min_queue.front().second;
+
+		// Instant attack, exponential release, smoothed by the box filter
+		m_env = (m < m_env) ? m : m_env + (m - m_env) * m_release;
+		float &box = m_box[m_pos % m_box.size()];
+		m_box_sum += m_env - box;
+		box = m_env;
+		const float env = std::min(1.0, m_box_sum / double(m_box.size()));
+
+		// Exchange the current frame with the delayed one
+		float *frame = buf + i * m_n_channels;
+		float *delayed = &m_delay[(m_pos % m_delay_len) * m_n_channels];
+		for (size_t c = 0; c < m_n_channels; c++) {
+			const float x = frame[c];
+			frame[c] = delayed[c] * env;
+			delayed[c] = x;
+		}
+	}
+}
+
+void TruePeakLimiter::flush(std::vector<float> &tar)
+{
+	if (m_pos == 0) {
+		return;
+	}
+	const size_t old_size = tar.size();
+	tar.resize(old_size + m_delay_len * m_n_channels, 0.0f);
+	process(&tar[old_size], m_delay_len);
+	reset();
+}
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct LoudnessMetrics {
+	Histogram &analysis = global_metrics().histogram(
+	    "http_audio_server_loudness_analysis_seconds",
+	    "Time spent measuring the loudness of a file");
+	Counter &analysed = global_metrics().counter(
+	    "http_audio_server_loudness_analysed_total",
+	    "Number of files whose loudness has been measured");
+};
+
+LoudnessMetrics &loudness_metrics()
+{
+	static LoudnessMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * Class LoudnessIndexImpl
+ */
+
+class LoudnessIndexImpl {
+private:
+	struct Entry {
+		LoudnessInfo info;
+		int64_t size;
+		int64_t mtime;
+	};
+
+	DecoderPool &m_pool;
+	std::string m_filename;
+	mutable std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::unordered_map<std::string, Entry> m_entries;
+	std::deque<std::string> m_queue;
+	std::set<std::string> m_queued;
+	bool m_stop = false;
+	std::thread m_thread;
+
+	static bool stat_file(const std::string &filename, int64_t &size,
+	                      int64_t &mtime)
+	{
+		struct stat st;
+		if (stat(filename.c_str(), &st) != 0) {
+			return false;
+		}
+		size = st.st_size;
+		mtime = st.st_mtime;
+		return true;
+	}
+
+	static json number_or_null(double x)
+	{
+		return std::isfinite(x) ? json(x) : json(nullptr);
+	}
+
+	static double number_or_inf(const json &o, const char *key)
+	{
+		auto it = o.find(key);
+		if (it == o.end() || !it->is_number()) {
+			return -std::numeric_limits<double>::infinity();
+		}
+		return it->get<double>();
+	}
+
+	static std::string entry_to_line(const std::string &filename,
+	                                 const Entry &entry)
+	{
+		return json{{"file", filename},
+		            {"size", entry.size},
+		            {"mtime", entry.mtime},
+		            {"integrated", number_or_null(entry.info.integrated)},
+		            {"true_peak", number_or_null(entry.info.true_peak)}}
+		    .dump();
+	}
+
+	void load()
+	{
+		std::ifstream is(m_filename);
+		std::string line;
+		size_t n_lines = 0;
+		while (std::getline(is, line)) {
+			n_lines++;
+			try {
+				const json o = json::parse(line);
+				Entry entry{LoudnessInfo{number_or_inf(o, "integrated"),
+				                         number_or_inf(o, "true_peak")},
+				            o.value("size", int64_t(-1)),
+				            o.value("mtime", int64_t(-1))};
+				m_entries[o.value("file", std::string())] = entry;
+			}
+			catch (std::invalid_argument &) {
+				// Skip truncated lines
+			}
+		}
+
+		// Re-measured files append a new line each time, rewrite the file
+		// with only the latest entries once it contains outdated ones
+		if (n_lines > m_entries.size()) {
+			compact();
+		}
+	}
+
+	void compact()
+	{
+		const std::string tmp = m_filename + ".tmp";
+		std::ofstream os(tmp);
+		for (const auto &entry : m_entries) {
+			os << entry_to_line(entry.first, entry.second) << "\n";
+		}
+		os.close();
+		if (os.fail() || rename(tmp.c_str(), m_filename.c_str()) != 0) {
+			global_logger().warn("loudness", "Cannot compact " + m_filename);
+			unlink(tmp.c_str());
+		}
+	}
+
+	bool should_stop() const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_stop;
+	}
+
+	void analyze_file(const std::string &filename)
+	{
+		// Files with ReplayGain tags do not need to be measured
+		if (metadata_from_file(filename).has_replaygain) {
+			return;
+		}
+
+		// Take the decoder from the pool so the analysis counts towards
+		// max_decoders, wait for a free slot as long as the index is alive
+		const AudioFormat fmt;
+		auto job = m_pool.submit(filename, 0.0, fmt);
+		while (!job->wait(0.1)) {
+			if (should_stop()) {
+				return;
+			}
+		}
+		std::shared_ptr<Decoder> decoder = job->decoder();
+
+		ScopedTimer timer(loudness_metrics().analysis);
+		LoudnessMeter meter(fmt.rate, fmt.n_channels);
+		std::vector<uint8_t> buf;
+		const size_t chunk = fmt.rate * fmt.n_channels * sizeof(float);
+		while (!should_stop() && decoder->read(chunk, buf) > 0) {
+			meter.process(reinterpret_cast<const float *>(buf.data()),
+			              buf.size() / (fmt.n_channels * sizeof(float)));
+			buf.clear();
+		}
+		if (!should_stop()) {
+			store(filename,
+			      LoudnessInfo{meter.integrated(), meter.true_peak()});
+			loudness_metrics().analysed.inc();
+		}
+	}
+
+	void worker()
+	{
+		while (true) {
+			std::string filename;
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+				if (m_stop) {
+					break;
+				}
+				filename = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+
+			try {
+				analyze_file(filename);
+			}
+			catch (std::exception &e) {
+				global_logger().warn("loudness", "Cannot analyse " + filename +
+				                                     ": " + e.what());
+			}
+
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_queued.erase(filename);
+		}
+	}
+
+public:
+	LoudnessIndexImpl(DecoderPool &pool, const std::string &filename)
+	    : m_pool(pool), m_filename(filename)
+	{
+		if (!m_filename.empty()) {
+			load();
+		}
+		m_thread = std::thread(&LoudnessIndexImpl::worker, this);
+	}
+
+	~LoudnessIndexImpl()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		m_thread.join();
+	}
+
+	bool lookup(const std::string &filename, LoudnessInfo &info) const
+	{
+		int64_t size, mtime;
+		if (!stat_file(filename, size, mtime)) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto it = m_entries.find(filename);
+		if (it == m_entries.end() || it->second.size != size ||
+		    it->second.mtime != mtime) {
+			return false;
+		}
+		info = it->second.info;
+		return true;
+	}
+
+	void analyze(const std::string &filename)
+	{
+		LoudnessInfo info;
+		if (lookup(filename, info)) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			if (!m_queued.insert(filename).second) {
+				return;
+			}
+			m_queue.push_back(filename);
+		}
+		m_cv.notify_one();
+	}
+
+	void store(const std::string &filename, const LoudnessInfo &info)
+	{
+		int64_t size, mtime;
+		if (!stat_file(filename, size, mtime)) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mtx);
+		const Entry entry{info, size, mtime};
+		m_entries[filename] = entry;
+		if (!m_filename.empty()) {
+			std::ofstream os(m_filename, std::ios::app);
+			os << entry_to_line(filename, entry) << "\n";
+		}
+	}
+};
+
+/*
+ * Class LoudnessIndex
+ */
+
+LoudnessIndex::LoudnessIndex(DecoderPool &pool, const std::string &filename)
+    : m_impl(std::make_unique<LoudnessIndexImpl>(pool, filename))
+{
+}
+
+LoudnessIndex::~LoudnessIndex()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+bool LoudnessIndex::lookup(const std::string &filename,
+                           LoudnessInfo &info) const
+{
+	return m_impl->lookup(filename, info);
+}
+
+void LoudnessIndex::analyze(const std::string &filename)
+{
+	m_impl->analyze(filename);
+}
+
+void LoudnessIndex::store(const std::string &filename, const LoudnessInfo &info)
+{
+	m_impl->store(filename, info);
+}
+
+/*
+ * Functions
+ */
+
+float normalization_gain(const std::string &filename, const Metadata &meta,
+                         const LoudnessIndex &index)
+{
+	// Limit the gain applied to very quiet tracks, the limiter takes care of
+	// the peaks
+	static constexpr double MAX_GAIN_DB = 12.0;
+
+	double gain_db;
+	LoudnessInfo info;
+	if (meta.has_replaygain) {
+		gain_db = meta.replaygain_track_gain;
+	}
+	else if (index.lookup(filename, info) && std::isfinite(info.integrated)) {
+		gain_db = TARGET_LOUDNESS - info.integrated;
+	}
+	else {
+		return 1.0f;
+	}
+	return std::pow(10.0, std::min(gain_db, MAX_GAIN_DB) / 20.0);
+}
+}
@@ -0,0 +1,272 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file loudness.hpp
+ *
+ * Loudness measurement according to ITU-R BS.1770 / EBU R128, a true-peak
+ * limiter and a persistent index of per-file loudness measurements used to
+ * normalise tracks without ReplayGain tags.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_LOUDNESS_HPP
+#define HTTP_AUDIO_SERVER_LOUDNESS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class DecoderPool;
+class LoudnessIndexImpl;
+struct Metadata;
+
+/**
+ * Loudness all tracks are normalised to in LUFS. This corresponds to the
+ * ReplayGain 2.0 reference level, so ReplayGain track gains can be applied
+ * directly.
+ */
+constexpr double TARGET_LOUDNESS = -18.0;
+
+/**
+ * Estimates the true peak of a signal by oversampling it four times, as
+ * described in ITU-R BS.1770-4 Annex 2.
+ */
+class TruePeakMeter {
+private:
+	static constexpr size_t N_PHASES = 4;
+	static constexpr size_t N_TAPS = 12;
+
+	size_t m_n_channels;
+
+	/**
+	 * Last N_TAPS samples of each channel, stored twice so the filter can be
+	 * applied to a contiguous range.
+	 */
+	std::vector<float> m_history;
+	size_t m_pos = 0;
+
+public:
+	TruePeakMeter(size_t n_channels);
+
+	/**
+	 * Number of frames the peak estimate lags behind the input.
+	 */
+	static constexpr size_t latency() { return N_TAPS / 2; }
+
+	/**
+	 * Returns the absolute true peak of each frame, maximised over all
+	 * channels.
+	 *
+	 * @param src points at n_frames interleaved frames.
+	 * @param tar points at a buffer of n_frames floats.
+	 */
+	void process(const float *src, float *tar, size_t n_frames);
+
+	void reset();
+};
+
+/**
+ * Measures the gated integrated loudness and the true peak of a signal.
+ */
+class LoudnessMeter {
+private:
+	struct Biquad {
+		double b0, b1, b2, a1, a2;
+	};
+
+	int m_rate;
+	size_t m_n_channels;
+	Biquad m_shelf;
+	Biquad m_highpass;
+	std::vector<double> m_state;
+	TruePeakMeter m_true_peak_meter;
+	std::vector<float> m_peaks;
+
+	/**
+	 * Mean square per channel of the current 100 ms sub-block.
+	 */
+	std::vector<double> m_sub_block;
+	size_t m_sub_block_pos = 0;
+	size_t m_sub_block_len;
+
+	/**
+	 * Weighted energy of the last four sub-blocks and of all 400 ms blocks.
+	 */
+	std::deque<double> m_recent;
+	std::vector<double> m_blocks;
+	float m_true_peak = 0.0f;
+
+	void finish_sub_block();
+
+public:
+	LoudnessMeter(int rate, size_t n_channels);
+
+	/**
+	 * Feeds n_frames interleaved frames into the meter.
+	 */
+	void process(const float *src, size_t n_frames);
+
+	/**
+	 * Returns the gated integrated loudness in LUFS, or -infinity if the
+	 * signal is too short or silent.
+	 */
+	double integrated() const;
+
+	/**
+	 * Returns the linear true peak of the signal.
+	 */
+	double true_peak() const { return m_true_peak; }
+};
+
+/**
+ * Look-ahead limiter keeping the true peak of the output below a ceiling. The
+ * output is delayed by latency() frames.
+ */
+class TruePeakLimiter {
+private:
+	size_t m_n_channels;
+	size_t m_lookahead;
+	float m_ceiling;
+	float m_release;
+	TruePeakMeter m_true_peak_meter;
+
+	/**
+	 * Delay line compensating the look-ahead and the latency of the true
+	 * peak meter.
+	 */
+	std::vector<float> m_delay;
+	size_t m_delay_len;
+
+	/**
+	 * Sliding window minimum of the required gain reduction.
+	 */
+	std::deque<std::pair<uint64_t, float>> m_min_queue;
+
+	/**
+	 * Box filter smoothing the gain envelope over the look-ahead time.
+	 */
+	std::vector<float> m_box;
+	double m_box_sum;
+
+	float m_env;
+	uint64_t m_pos;
+	std::vector<float> m_peaks;
+
+	void reset();
+
+public:
+	/**
+	 * Creates a new limiter.
+	 *
+	 * @param rate is the sample rate in Hz.
+	 * @param n_channels is the number of interleaved channels.
+	 * @param ceiling_db is the maximum true peak in dBTP.
+	 * @param lookahead is the look-ahead time in seconds.
+	 * @param release is the release time constant in seconds.
+	 */
+	TruePeakLimiter(int rate, size_t n_channels, double ceiling_db = -1.0,
+	                double lookahead = 0.005, double release = 0.1);
+
+	/**
+	 * Multiplies n_frames interleaved frames with the given gain and limits
+	 * them in place. The first latency() frames produced are silence.
+	 */
+	void process(float *buf, size_t n_frames, float gain = 1.0f);
+
+	/**
+	 * Appends the latency() frames still held in the delay line to tar and
+	 * resets the limiter.
+	 */
+	void flush(std::vector<float> &tar);
+
+	size_t latency() const { return m_delay_len; }
+};
+
+/**
+ * Result of a loudness measurement.
+ */
+struct LoudnessInfo {
+	double integrated;
+	double true_peak;
+};
+
+/**
+ * Persistent cache of loudness measurements. Files are analysed on a
+ * background thread and the results are appended to a JSON lines file, which
+ * is compacted on load if files have been measured more than once. Entries
+ * are invalidated if the size or the modification time of the file changes.
+ */
+class LoudnessIndex {
+private:
+	std::unique_ptr<LoudnessIndexImpl> m_impl;
+
+public:
+	/**
+	 * Creates a new index.
+	 *
+	 * @param pool is the decoder pool the decoders used for the analysis are
+	 * taken from.
+	 * @param filename is the file the measurements are read from and written
+	 * to. If empty, measurements are only kept in memory.
+	 */
+	LoudnessIndex(DecoderPool &pool,
+	              const std::string &filename = std::string());
+
+	/**
+	 * Stops the background thread. Pending analysis requests are dropped.
+	 */
+	~LoudnessIndex();
+
+	/**
+	 * Looks up the measurement for the given file.
+	 *
+	 * @return true if a valid measurement has been found.
+	 */
+	bool lookup(const std::string &filename, LoudnessInfo &info) const;
+
+	/**
+	 * Queues the given file for analysis unless it has been analysed already
+	 * or carries ReplayGain tags.
+	 */
+	void analyze(const std::string &filename);
+
+	/**
+	 * Adds a measurement to the index.
+	 */
+	void store(const std::string &filename, const LoudnessInfo &info);
+};
+
+/**
+ * Returns the linear gain normalising the given file to TARGET_LOUDNESS.
+ * ReplayGain tags take precedence over measurements in the index. Returns one
+ * if the loudness of the file is not known.
+ */
+float normalization_gain(const std::string &filename, const Metadata &meta,
+                         const LoudnessIndex &index);
+}
+
+#endif /* HTTP_AUDIO_SERVER_LOUDNESS_HPP */
@@ -16,23 +16,38 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
 #include <chrono>
 #include <csignal>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <list>
 #include <random>
+#include <regex>
 #include <sstream>
 #include <thread>
 
+#include <http_audio_server/access_log.hpp>
+#include <http_audio_server/admission.hpp>
+#include <http_audio_server/config.hpp>
 #include <http_audio_server/decoder.hpp>
+#include <http_audio_server/decoder_pool.hpp>
+#include <http_audio_server/dsp.hpp>
 #include <http_audio_server/encoder.hpp>
 #include <http_audio_server/json.hpp>
+#include <http_audio_server/live.hpp>
 #include <http_audio_server/logger.hpp>
+#include <http_audio_server/loudness.hpp>
 #include <http_audio_server/metadata.hpp>
+#include <http_audio_server/metrics.hpp>
+#include <http_audio_server/muxer.hpp>
 #include <http_audio_server/process.hpp>
+#include <http_audio_server/segmenter.hpp>
 #include <http_audio_server/server.hpp>
 #include <http_audio_server/string_utils.hpp>
+#include <http_audio_server/thread_pool.hpp>
+#include <http_audio_server/track_cache.hpp>
 
 using namespace http_audio_server;
 
@@ -45,104 +60,520 @@ void signal_handler(int)
 	cancel = true;
 }
 
+bool reload = false;
+void reload_handler(int) { reload = true; }
+
+static bool binary_available(const std::string &cmd)
+{
+	try {
+		return std::get<0>(Process::exec(cmd, {"-version"})) == 0;
+	}
+	catch (std::runtime_error &) {
+		return false;
+	}
+}
+
+/**
+ * Maximum number of bytes sent per event loop iteration while a download is
+ * following a running transcode.
+ */
+static constexpr size_t TRACK_CHUNK_SIZE = 1 << 16;
+
 class Stream {
+public:
+	/**
+	 * Accumulated per-stream statistics, exported via the /metrics endpoint.
+	 */
+	struct Stats {
+		uint64_t decode_ns = 0;
+		uint64_t encode_ns = 0;
+		uint64_t dsp_ns = 0;
+		uint64_t advance_count = 0;
+	};
+
 private:
-	std::list<std::tuple<std::string, double, std::shared_ptr<Decoder>>>
-	    m_decoders;
+	/**
+	 * Counters behind stats(). They are updated on the clock thread of a
+	 * broadcast and read by the metrics collector without taking m_mtx.
+	 */
+	struct Counters {
+		std::atomic<uint64_t> decode_ns{0};
+		std::atomic<uint64_t> encode_ns{0};
+		std::atomic<uint64_t> dsp_ns{0};
+		std::atomic<uint64_t> advance_count{0};
+	};
+
+	/**
+	 * Number of seconds before the end of the current track at which the
+	 * decoder for the next track is requested.
+	 */
+	static constexpr double PREWARM_SECONDS = 15.0;
+
+	struct Entry {
+		std::string filename;
+		double offs;
+		std::shared_ptr<DecoderJob> job;
+		bool started = false;
+		double duration = -1.0;
+		size_t start_sample = 0;
+		float gain = 1.0f;
+
+		/**
+		 * Number of samples this entry overlaps with the end of the previous
+		 * entry.
+		 */
+		size_t crossfade;
+
+		/**
+		 * Description of the DSP graph, the graph itself is created once the
+		 * duration of the entry is known.
+		 */
+		json dsp;
+		std::unique_ptr<DspGraph> graph;
+
+		Entry(const std::string &filename, double offs, size_t crossfade,
+		      const json &dsp)
+		    : filename(filename), offs(offs), crossfade(crossfade), dsp(dsp)
+		{
+		}
+	};
+
+	DecoderPool &m_pool;
+	std::list<Entry> m_decoders;
 	Encoder m_encoder;
 	size_t m_bytes_tranferred = 0;
 	size_t m_n_samples = 0;
 	std::vector<uint8_t> m_buf;
+	std::vector<uint8_t> m_crossfade_buf;
 	size_t m_bitrate;
+	Quality m_quality;
+	Container m_container;
+	Counters m_stats;
 
-	static std::ostringstream::pos_type size_of_stream(
-	    const std::ostringstream &ss)
-	{
-		std::streambuf *buf = ss.rdbuf();
-		std::ostringstream::pos_type original =
-		    buf->pubseekoff(0, ss.cur, ss.out);
-		std::ostringstream::pos_type end = buf->pubseekoff(0, ss.end, ss.out);
-		buf->pubseekpos(original, ss.out);
-		return end;
-	}
+	/**
+	 * Loudness index used to normalise the tracks, nullptr if normalisation
+	 * is disabled for this stream.
+	 */
+	LoudnessIndex *m_loudness;
+	TruePeakLimiter m_limiter;
 
-public:
-	Stream(size_t m_bitrate) : m_encoder(48000, 2), m_bitrate(m_bitrate) {}
-	void append(const std::string &filename, double offs = 0.0)
+	/**
+	 * Live channel this stream listens to, nullptr for playlist streams.
+	 */
+	std::shared_ptr<LiveChannel> m_live;
+	uint64_t m_live_cursor = 0;
+
+	/**
+	 * Serialises access to the playlist, which is rendered on the clock
+	 * thread of the channel if the stream is broadcast.
+	 */
+	std::mutex m_mtx;
+
+	template <typename Data>
+	void write_chunk(std::ostream &os, const std::vector<json> &metadata,
+	                 const std::vector<Data> &data)
 	{
-		m_decoders.emplace_back(filename, offs, nullptr);
+		// Dump the metadata segment and its size
+		const std::string smeta = json(metadata).dump();
+		const uint32_t smeta_size = smeta.size();
+		os << "meta";
+		os.write((char *)&smeta_size, sizeof(smeta_size));
+		os << smeta;
+
+		// Dump the data segment and its size
+		uint32_t data_size = 0;
+		for (const auto &part : data) {
+			data_size += part->size();
+		}
+		os << "data";
+		os.write((char *)&data_size, sizeof(data_size));
+		for (const auto &part : data) {
+			os.write(part->data(), part->size());
+		}
+
+		m_bytes_tranferred += 16 + smeta_size + data_size;
 	}
 
-	void advance(double seconds, std::ostream &os)
+	void advance_live(std::ostream &os)
 	{
+		// The live channel is paced by its own clock, deliver whatever has
+		// been encoded since the last call. The segments are shared with the
+		// other listeners and written without copying them.
 		std::vector<json> metadata;
-		size_t samples = seconds * 48000;
-		size_t n_bytes = samples * 2 * sizeof(float);
+		std::vector<SegmentRing::Data> data;
+		const uint64_t cursor = m_live_cursor;
+		m_live->read(m_live_cursor, data, metadata);
+		if (cursor == 0 && m_live_cursor != 0 && metadata.empty()) {
+			metadata.emplace_back(json{
+			    {"start", 0.0},
+			    {"filename", m_live->name()},
+			    {"meta", {{"title", m_live->name()}, {"live", true}}},
+			});
+		}
+		write_chunk(os, metadata, data);
+	}
 
-		std::ostringstream os_buf_data;
+	/**
+	 * Decodes and processes up to n_samples samples from the playlist and
+	 * passes them to the sink in one or more chunks.
+	 */
+	template <typename Sink>
+	void produce(size_t n_samples, std::vector<json> &metadata, Sink sink)
+	{
+		const double seconds = double(n_samples) / 48000.0;
+		size_t n_bytes = n_samples * 2 * sizeof(float);
 		while (n_bytes > 0 && !m_decoders.empty()) {
-			// Lazily create the decoder if it does not exist yet
-			auto &entry = m_decoders.front();
-			const std::string &fn = std::get<0>(entry);
-			const double offs = std::get<1>(entry);
-			std::shared_ptr<Decoder> &dec = std::get<2>(entry);
-			if (!dec) {
-				dec = std::make_shared<Decoder>(fn, offs);
-				metadata.emplace_back(json{
-				    {"start", double(m_n_samples) / 48000.0},
-				    {"filename", fn},
-				    {"meta", metadata_from_file(fn).to_json()},
-				});
-			}
-
-			// Read the data
-			if (dec->read(n_bytes, m_buf)) {
-				const size_t n_samples_read = m_buf.size() / sizeof(float) / 2;
-				n_bytes -= m_buf.size();
-				m_encoder.feed((float *)(&m_buf[0]), n_samples_read, m_bitrate,
-				               os_buf_data);
+			// Lazily request the decoder if this has not been done yet
+			Entry &entry = m_decoders.front();
+			if (!entry.job) {
+				entry.job = m_pool.submit(entry.filename, entry.offs);
+			}
+
+			// Never wait for the decoder to be launched, this runs on the
+			// event loop or on the clock thread of a broadcast. Deliver what
+			// we have and try again in the next call; broadcasts fill the gap
+			// with silence.
+			if (!entry.job->ready()) {
+				global_logger().debug("stream", "Decoder for " +
+				                                    entry.filename +
+				                                    " is not ready yet");
+				break;
+			}
+			// Skip entries whose decoder could not be launched, otherwise
+			// every further call would fail on the same entry
+			std::shared_ptr<Decoder> dec;
+			try {
+				dec = entry.job->decoder();
+			}
+			catch (std::exception &e) {
+				global_logger().error("stream", "Cannot decode " +
+				                                    entry.filename + ": " +
+				                                    e.what());
+				m_decoders.pop_front();
+				continue;
+			}
+			if (!entry.started) {
+				start_entry(entry, m_n_samples, metadata);
+			}
+
+			// Launch the decoder for the next track ahead of time once the
+			// end of the current track comes into reach
+			const double pos =
+			    double(m_n_samples - entry.start_sample) / 48000.0;
+			if (m_decoders.size() > 1 && entry.duration >= 0.0) {
+				Entry &next = *std::next(m_decoders.begin());
+				const double lead =
+				    PREWARM_SECONDS + double(next.crossfade) / 48000.0;
+				if (!next.job && pos + seconds + lead >= entry.duration) {
+					next.job = m_pool.submit(next.filename, next.offs);
+				}
+			}
+
+			// Read the data, a short read marks the end of the file
+			Stopwatch decode_watch;
+			const size_t n_bytes_read = dec->read(n_bytes, m_buf);
+			m_stats.decode_ns += decode_watch.elapsed();
+			bool done = n_bytes_read < n_bytes;
+			size_t n_samples_read = m_buf.size() / sizeof(float) / 2;
+			if (n_samples_read) {
+				// Run the DSP stage in place on the decoded samples
+				float *buf = (float *)(&m_buf[0]);
+				process_entry(entry, buf, n_samples_read);
+				const size_t fade_pos = m_n_samples - entry.start_sample;
+				if (fade_pos < entry.crossfade) {
+					// Finish the fade-in if the previous entry ended before the
+					// crossfade was complete
+					const size_t len = entry.crossfade;
+					apply_ramp(buf, std::min(n_samples_read, len - fade_pos), 2,
+					           float(fade_pos) / float(len), 1.0f / float(len));
+				}
+				n_samples_read =
+				    crossfade(entry, buf, n_samples_read, done, metadata);
+				if (m_loudness) {
+					Stopwatch dsp_watch;
+					m_limiter.process(buf, n_samples_read);
+					m_stats.dsp_ns += dsp_watch.elapsed();
+				}
+				n_bytes -= n_samples_read * 2 * sizeof(float);
+				sink(buf, n_samples_read);
 				m_n_samples += n_samples_read;
 			}
 
 			// Remove the current decoder if we're at the end of the file
-			if (m_buf.size() < n_bytes) {
+			if (done) {
 				m_decoders.pop_front();
 			}
 			m_buf.clear();
 		}
+	}
+
+	void start_entry(Entry &entry, size_t start_sample,
+	                 std::vector<json> &metadata)
+	{
+		const Metadata meta = metadata_from_file(entry.filename);
+		entry.started = true;
+		entry.duration = meta.duration - entry.offs;
+		entry.start_sample = start_sample;
+		entry.graph =
+		    std::make_unique<DspGraph>(entry.dsp, 48000, 2, entry.duration);
+		if (m_loudness) {
+			entry.gain = normalization_gain(entry.filename, meta, *m_loudness);
+		}
+		metadata.emplace_back(json{
+		    {"start", double(start_sample) / 48000.0},
+		    {"filename", entry.filename},
+		    {"meta", meta.to_json()},
+		});
+	}
+
+	void process_entry(Entry &entry, float *buf, size_t n_samples)
+	{
+		Stopwatch dsp_watch;
+		entry.graph->process(buf, n_samples);
+		if (entry.gain != 1.0f) {
+			apply_ramp(buf, n_samples, 2, entry.gain, 0.0f);
+		}
+		m_stats.dsp_ns += dsp_watch.elapsed();
+	}
+
+	/**
+	 * Mixes the beginning of the entry following the given one into the
+	 * samples in buf if they fall into the crossfade window. Returns the
+	 * number of valid samples in buf and sets done to true once the
+	 * crossfade is complete; the remainder of the current entry is dropped.
+	 */
+	size_t crossfade(Entry &entry, float *buf, size_t n_samples, bool &done,
+	                 std::vector<json> &metadata)
+	{
+		if (m_decoders.size() < 2 || entry.duration < 0.0) {
+			return n_samples;
+		}
+		Entry &next = *std::next(m_decoders.begin());
+		const size_t len = next.crossfade;
+		const size_t end = entry.start_sample + entry.duration * 48000.0;
+		const size_t first = std::max(end > len ? end - len : 0, m_n_samples);
+		if (len == 0 || first >= m_n_samples + n_samples) {
+			return n_samples;
+		}
+
+		// Start the next entry at the beginning of the window. If its decoder
+		// is not ready, the crossfade is shortened. Entries whose decoder
+		// failed are skipped by produce() once they are the current entry.
+		if (!next.started) {
+			if (!next.job) {
+				next.job = m_pool.submit(next.filename, next.offs);
+			}
+			if (!next.job->ready() || next.job->failed()) {
+				return n_samples;
+			}
+			start_entry(next, first, metadata);
+		}
+		const size_t offs = std::max(first, next.start_sample) - m_n_samples;
+		const size_t pos = m_n_samples + offs - next.start_sample;
+		const size_t n = std::min(n_samples - offs, len - pos);
+
+		// Read and process the same number of samples from the next entry. A
+		// short read means the next entry is shorter than the crossfade; pad
+		// it with silence so the window stays aligned with the timeline and
+		// the current entry keeps fading out.
+		Stopwatch decode_watch;
+		m_crossfade_buf.clear();
+		next.job->decoder()->read(n * 2 * sizeof(float), m_crossfade_buf);
+		m_stats.decode_ns += decode_watch.elapsed();
+		const size_t n_read = m_crossfade_buf.size() / sizeof(float) / 2;
+		m_crossfade_buf.resize(n * 2 * sizeof(float), 0);
+		float *src = (float *)(&m_crossfade_buf[0]);
+		process_entry(next, src, n_read);
+
+		Stopwatch dsp_watch;
+		mix_ramp(buf + 2 * offs, src, n, 2, float(pos) / float(len),
+		         1.0f / float(len));
+		m_stats.dsp_ns += dsp_watch.elapsed();
+		if (pos + n >= len) {
+			done = true;
+			return offs + n;
+		}
+		return n_samples;
+	}
+
+public:
+	Stream(DecoderPool &pool, size_t m_bitrate,
+	       LoudnessIndex *loudness = nullptr,
+	       Container container = Container::WEBM)
+	    : m_pool(pool),
+	      m_encoder(48000, 2, container),
+	      m_bitrate(m_bitrate),
+	      m_container(container),
+	      m_loudness(loudness),
+	      m_limiter(48000, 2)
+	{
+		active_streams_gauge().inc();
+	}
+
+	~Stream() { active_streams_gauge().dec(); }
+
+	static Gauge &active_streams_gauge()
+	{
+		static Gauge &gauge = global_metrics().gauge(
+		    "http_audio_server_streams_active", "Number of active streams");
+		return gauge;
+	}
+
+	/**
+	 * Returns a snapshot of the accumulated statistics.
+	 */
+	Stats stats() const
+	{
+		Stats res;
+		res.decode_ns = m_stats.decode_ns;
+		res.encode_ns = m_stats.encode_ns;
+		res.dsp_ns = m_stats.dsp_ns;
+		res.advance_count = m_stats.advance_count;
+		return res;
+	}
+
+	Container container() const { return m_container; }
+	size_t bytes_transferred() const { return m_bytes_tranferred; }
+	size_t n_samples() const { return m_n_samples; }
+	bool live() const { return bool(m_live); }
+
+	/**
+	 * Returns true if the stream is waiting for the decoder of its current
+	 * entry to be launched.
+	 */
+	bool waiting_for_decoder()
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return !m_decoders.empty() && m_decoders.front().job &&
+		       !m_decoders.front().job->ready();
+	}
+
+	/**
+	 * Returns the bitrate the stream is currently encoded with, which is
+	 * lowered while the server is overloaded.
+	 */
+	size_t bitrate() const
+	{
+		return std::max<size_t>(Segmenter::MIN_BITRATE,
+		                        m_bitrate * m_quality.bitrate_scale);
+	}
+
+	/**
+	 * Sets the encoder settings used for the following calls to advance().
+	 */
+	void set_quality(const Quality &quality)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_quality = quality;
+		m_encoder.set_complexity(quality.complexity);
+	}
+
+	/**
+	 * Appends a file to the stream. Throws std::invalid_argument if the DSP
+	 * graph description is invalid.
+	 *
+	 * @param crossfade is the duration in seconds over which the file fades
+	 * in over the end of the previous file.
+	 * @param dsp is the description of the DSP graph applied to the file.
+	 */
+	void append(const std::string &filename, double offs = 0.0,
+	            double crossfade = 0.0, const json &dsp = json())
+	{
+		if (m_live) {
+			throw std::invalid_argument("Cannot append to a live stream");
+		}
+		DspGraph validate(dsp, 48000, 2);
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_decoders.emplace_back(filename, offs,
+		                        std::max(0.0, crossfade) * 48000.0, dsp);
+		if (m_loudness) {
+			m_loudness->analyze(filename);
+		}
+	}
+
+	/**
+	 * Turns this stream into a listener of the given live channel.
+	 */
+	void attach(std::shared_ptr<LiveChannel> live) { m_live = std::move(live); }
+
+	void advance(double seconds, std::ostream &os)
+	{
+		static Histogram &advance_hist = global_metrics().histogram(
+		    "http_audio_server_stream_advance_seconds",
+		    "Time spent producing a single chunk of a stream");
+		ScopedTimer timer(advance_hist);
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_stats.advance_count++;
+		if (m_live) {
+			advance_live(os);
+			return;
+		}
+
+		const size_t bitrate = this->bitrate();
+		std::vector<json> metadata;
+		std::ostringstream os_buf_data;
+		produce(seconds * 48000, metadata, [&](float *buf, size_t n_samples) {
+			Stopwatch encode_watch;
+			m_encoder.feed(buf, n_samples, bitrate, os_buf_data);
+			m_stats.encode_ns += encode_watch.elapsed();
+		});
+
 		// Finalise the encoder if this stream is done
 		if (m_decoders.empty()) {
-			m_encoder.finalize(m_bitrate, os_buf_data);
+			if (m_loudness) {
+				std::vector<float> tail;
+				m_limiter.flush(tail);
+				m_encoder.feed(tail.data(), tail.size() / 2, bitrate,
+				               os_buf_data);
+			}
+			m_encoder.finalize(bitrate, os_buf_data);
 		}
+		const std::string data = os_buf_data.str();
+		write_chunk(os, metadata, std::vector<const std::string *>{&data});
+	}
 
-		// Dump the metadata segment and its size
-		const std::string smeta = json(metadata).dump();
-		const uint32_t smeta_size = smeta.size();
-		os << "meta";
-		os.write((char *)&smeta_size, sizeof(smeta_size));
-		os << smeta;
-
-		// Dump the data segment and its size
-		const uint32_t data_size = size_of_stream(os_buf_data);
-		os << "data";
-		os.write((char *)&data_size, sizeof(data_size));
-		os << os_buf_data.str();
+	/**
+	 * Renders exactly n_samples processed samples into tar. Used by broadcast
+	 * channels, which encode the data themselves. Missing data, e.g. because
+	 * the playlist is empty, is filled with silence.
+	 */
+	void render(float *tar, size_t n_samples, std::vector<json> &metadata)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		size_t offs = 0;
+		produce(n_samples, metadata, [&](float *buf, size_t n) {
+			std::copy(buf, buf + 2 * n, tar + 2 * offs);
+			offs += n;
+		});
+		std::fill(tar + 2 * offs, tar + 2 * n_samples, 0.0f);
+		m_n_samples += n_samples - offs;
 	}
 };
 
-int main()
+int main(int argc, char *argv[])
 {
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--help" || std::string(argv[i]) == "-h") {
+			Config::usage(std::cout);
+			return 0;
+		}
+	}
+
 	signal(SIGINT, signal_handler);
+	signal(SIGHUP, reload_handler);
+
+	// Do not block the event loop on log I/O
+	global_logger().start_async();
 
 	// Make sure ffmpeg and ffprobe are found
-	if (std::get<0>(Process::exec("ffmpeg", {"-version"})) != 0) {
+	if (!binary_available("ffmpeg")) {
 		global_logger().fatal_error(
 		    "main",
 		    "ffmpeg binary not found. Please make sure a reasonably recent "
 		    "version of ffmpeg is installed.");
 		return 1;
 	}
-	if (std::get<0>(Process::exec("ffprobe", {"-version"})) != 0) {
+	if (!binary_available("ffprobe")) {
 		global_logger().fatal_error(
 		    "main",
 		    "ffprobe binary not found. Please make sure a reasonably recent "
@@ -150,33 +581,190 @@ int main()
 		return 1;
 	}
 
+	Config config;
+	try {
+		config = Config::load(argc, argv);
+	}
+	catch (std::invalid_argument &e) {
+		global_logger().fatal_error("main", e.what());
+		return 1;
+	}
+
+	global_thread_pool(config.threads);
+	Decoder::set_read_ahead(config.read_ahead);
+	Decoder::set_internal_resampler(config.resampler == "internal");
+	DecoderPool decoder_pool(config.max_decoders);
+	LoudnessIndex loudness_index(decoder_pool, config.loudness_index);
+	Segmenter segmenter(decoder_pool, config.segment_duration);
+	TrackCache track_cache(segmenter, config.cache_dir, config.max_transcodes,
+	                       config.cache_size);
+	AdmissionController admission(1.0, config.degrade_load, config.max_load);
+	std::unordered_map<std::string, std::shared_ptr<LiveChannel>>
+	    live_channels;
+	std::unordered_map<std::string, std::shared_ptr<Stream>> playlists;
 	std::unordered_map<std::string, std::shared_ptr<Stream>> streams;
 
-	auto handle_index = [](const Request &, Response &res) {
+	auto handle_index = [&config](const Request &, Response &res) {
 		res.header(200, {{"Content-Type", "text/html; charset=utf-8"}});
-		std::ifstream is("../static/index.html");
+		std::ifstream is(config.index);
 		Process::generic_pipe(is, res.stream());
 	};
 
-	auto handle_stream_create = [&](const Request &, Response &res) {
+	auto handle_metrics = [](const Request &, Response &res) {
+		res.header(200, {{"Content-Type", "text/plain; version=0.0.4"}});
+		global_metrics().dump(res.stream());
+	};
+
+	auto collect_stream_metrics = [&streams](std::ostream &os) {
+		const auto family = [&](const char *name, const char *type,
+		                        const char *help, auto value) {
+			os << "# HELP " << name << " " << help << "\n";
+			os << "# TYPE " << name << " " << type << "\n";
+			for (const auto &stream : streams) {
+				os << name << "{stream=\"" << stream.first << "\"} "
+				   << value(*stream.second) << "\n";
+			}
+		};
+		family("http_audio_server_stream_samples_total", "counter",
+		       "Number of samples produced per stream",
+		       [](const Stream &s) { return s.n_samples(); });
+		family("http_audio_server_stream_bytes_sent_total", "counter",
+		       "Number of bytes sent per stream",
+		       [](const Stream &s) { return s.bytes_transferred(); });
+		family("http_audio_server_stream_advance_total", "counter",
+		       "Number of advance requests per stream",
+		       [](const Stream &s) { return s.stats().advance_count; });
+		family("http_audio_server_stream_decode_seconds_total", "counter",
+		       "Time spent reading from the decoder per stream",
+		       [](const Stream &s) { return s.stats().decode_ns * 1e-9; });
+		family("http_audio_server_stream_encode_seconds_total", "counter",
+		       "Time spent encoding per stream",
+		       [](const Stream &s) { return s.stats().encode_ns * 1e-9; });
+		family("http_audio_server_stream_dsp_seconds_total", "counter",
+		       "Time spent in the DSP stage per stream",
+		       [](const Stream &s) { return s.stats().dsp_ns * 1e-9; });
+	};
+	const int collector_idx =
+	    global_metrics().add_collector(collect_stream_metrics);
+	const int log_collector_idx =
+	    global_metrics().add_collector([](std::ostream &os) {
+		    os << "# HELP http_audio_server_log_dropped_total Number of log "
+		          "records dropped because the queue was full\n"
+		       << "# TYPE http_audio_server_log_dropped_total counter\n"
+		       << "http_audio_server_log_dropped_total "
+		       << global_logger().dropped() << "\n";
+		});
+
+	const int live_collector_idx =
+	    global_metrics().add_collector([&live_channels](std::ostream &os) {
+		    os << "# HELP http_audio_server_live_buffer_seconds Amount of data "
+		          "in the jitter buffer of a live channel\n"
+		       << "# TYPE http_audio_server_live_buffer_seconds gauge\n";
+		    for (const auto &channel : live_channels) {
+			    os << "http_audio_server_live_buffer_seconds{channel=\""
+			       << channel.first << "\"} "
+			       << channel.second->stats().buffered << "\n";
+		    }
+		});
+
+	// Listeners of live channels only copy the broadcast, only the other
+	// streams count towards the load estimated by the admission controller
+	auto n_encoding_streams = [&streams] {
+		return std::count_if(streams.begin(), streams.end(),
+		                     [](const auto &entry) {
+			                     return !entry.second->live();
+			                 });
+	};
+
+	// Decoder requests of background transcodes and abandoned requests do
+	// not reflect the stream load, only count the streams which wait
+	auto n_waiting_streams = [&streams] {
+		return std::count_if(streams.begin(), streams.end(),
+		                     [](const auto &entry) {
+			                     return entry.second->waiting_for_decoder();
+			                 });
+	};
+
+	auto handle_stream_create = [&](const Request &req, Response &res) {
+		// Loudness normalisation can be requested with {"normalize": true},
+		// listening to a live channel with {"live": "<name>"} and the
+		// container with {"container": "webm" | "ogg" | "raw"}
+		bool normalize = false;
+		Container container = Container::WEBM;
+		std::shared_ptr<LiveChannel> live;
+		if (!req.body.empty()) {
+			const json options = json::parse(req.body);
+			normalize = options.value("normalize", false);
+			try {
+				container =
+				    parse_container(options.value("container", "webm"));
+			}
+			catch (std::logic_error &e) {
+				res.error(400, e.what());
+				return;
+			}
+			const std::string live_name = options.value("live", "");
+			if (!live_name.empty()) {
+				auto it = live_channels.find(live_name);
+				if (it == live_channels.end()) {
+					res.error(404,
+					          "Live channel \"" + live_name + "\" not found");
+					return;
+				}
+				if (container != Container::WEBM) {
+					res.error(400, "Live channels only support WebM");
+					return;
+				}
+				live = it->second;
+			}
+		}
+
+		// Shed load before it makes the running streams underrun. Listeners
+		// of live channels are always admitted.
+		if (!live &&
+		    !admission.admit(n_encoding_streams(), n_waiting_streams())) {
+			res.error(503, "Server is overloaded, try again later",
+			          {{"Retry-After", std::to_string(config.retry_after)}});
+			return;
+		}
+
 		std::string stream_id = random_alphanum_string();
-		streams.emplace(stream_id, std::make_shared<Stream>(196000));
+		auto stream = std::make_shared<Stream>(
+		    decoder_pool, config.bitrate, normalize ? &loudness_index : nullptr,
+		    container);
+		if (live) {
+			stream->attach(live);
+		}
+		streams.emplace(stream_id, stream);
+		res.trace().stream_id = stream_id;
 		res.header(200, {{"Content-Type", "text/plain"}});
 		res.stream() << stream_id << std::endl;
 	};
 
+	auto append = [](Stream &stream, const Request &req, Response &res) {
+		json resource = json::parse(req.body);
+		auto fn = resource.find("filename");
+		if (fn == resource.end()) {
+			res.error(400, "Invalid query");
+			return;
+		}
+		try {
+			stream.append(*fn, 0.0, resource.value("crossfade", 0.0),
+			              resource.value("dsp", json()));
+		}
+		catch (std::logic_error &e) {
+			res.error(400, e.what());
+			return;
+		}
+		res.ok(200, "Appended file " + fn->get<std::string>());
+	};
+
 	auto handle_stream_append = [&](const Request &req, Response &res) {
 		const std::string stream_id = req.matcher[1];
+		res.trace().stream_id = stream_id;
 		auto it = streams.find(stream_id);
 		if (it != streams.end()) {
-			json resource = json::parse(req.body);
-			auto fn = resource.find("filename");
-			if (fn == resource.end()) {
-				res.error(400, "Invalid query");
-				return;
-			}
-			res.ok(200, "Appended file " + fn->get<std::string>());
-			it->second->append(*fn);
+			append(*it->second, req, res);
 		}
 		else {
 			res.error(404, "Stream id \"" + stream_id + "\" not found");
@@ -187,8 +775,28 @@ int main()
 		const std::string stream_id = req.matcher[1];
 		auto it = streams.find(stream_id);
 		if (it != streams.end()) {
-			res.header(200, {{"Content-Type", "audio/webm"}});
-			it->second->advance(5.0, res.stream());
+			const Stream::Stats stats = it->second->stats();
+			const size_t n_samples = it->second->n_samples();
+			res.header(200, {{"Content-Type",
+			                  container_mime_type(it->second->container())}});
+			it->second->set_quality(admission.quality(n_encoding_streams()));
+			it->second->advance(config.advance, res.stream());
+
+			// Only the processing time counts towards the load, not the time
+			// spent waiting for ffmpeg, and only the audio actually produced
+			const Stream::Stats cur = it->second->stats();
+			if (!it->second->live()) {
+				admission.record(
+				    (cur.encode_ns - stats.encode_ns) +
+				        (cur.dsp_ns - stats.dsp_ns),
+				    double(it->second->n_samples() - n_samples) / 48000.0);
+			}
+
+			Response::Trace &trace = res.trace();
+			trace.stream_id = stream_id;
+			trace.decode_ns = cur.decode_ns - stats.decode_ns;
+			trace.encode_ns = cur.encode_ns - stats.encode_ns;
+			trace.bitrate = it->second->bitrate();
 		}
 		else {
 			res.error(404, "Stream id \"" + stream_id + "\" not found");
@@ -197,6 +805,7 @@ int main()
 
 	auto handle_stream_destroy = [&](const Request &req, Response &res) {
 		const std::string stream_id = req.matcher[1];
+		res.trace().stream_id = stream_id;
 		auto it = streams.find(stream_id);
 		if (it != streams.end()) {
 			res.ok(200, {"Stream successfully erased"});
@@ -207,19 +816,282 @@ int main()
 		}
 	};
 
+	auto handle_live_create = [&](const Request &req, Response &res) {
+		const json options = json::parse(req.body);
+		const std::string name = options.value("name", "");
+		if (!std::regex_match(name, std::regex("[A-Za-z0-9_-]+"))) {
+			res.error(400, "Invalid channel name");
+			return;
+		}
+		if (live_channels.count(name)) {
+			res.error(409, "Live channel \"" + name + "\" already exists");
+			return;
+		}
+		const size_t bitrate = options.value("bitrate", config.live_bitrate);
+		if (options.value("playlist", false)) {
+			// Broadcast a playlist: a single stream renders the audio on the
+			// clock of the channel, files are added via /live/<name>/append
+			auto stream = std::make_shared<Stream>(
+			    decoder_pool, bitrate,
+			    options.value("normalize", false) ? &loudness_index : nullptr);
+			live_channels.emplace(
+			    name, std::make_shared<LiveChannel>(
+			              name,
+			              [stream](float *buf, size_t n_frames,
+			                       std::vector<json> &metadata) {
+				              stream->render(buf, n_frames, metadata);
+				          },
+			              bitrate));
+			playlists.emplace(name, stream);
+		}
+		else {
+			live_channels.emplace(
+			    name, std::make_shared<LiveChannel>(
+			              name, options.value("source", ""), bitrate,
+			              options.value("latency", 0.5)));
+		}
+		res.ok(200, "Created live channel " + name);
+	};
+
+	auto handle_live_append = [&](const Request &req, Response &res) {
+		const std::string name = req.matcher[1];
+		auto it = playlists.find(name);
+		if (it != playlists.end()) {
+			append(*it->second, req, res);
+		}
+		else {
+			res.error(404, "Playlist channel \"" + name + "\" not found");
+		}
+	};
+
+	auto handle_live_ingest = [&](const Request &req, Response &res) {
+		// The body contains raw interleaved 48 kHz stereo float samples
+		const std::string name = req.matcher[1];
+		auto it = live_channels.find(name);
+		if (it != live_channels.end()) {
+			it->second->ingest(reinterpret_cast<const float *>(req.body.data()),
+			                   req.body.size() / (2 * sizeof(float)));
+			res.ok(200, "Ingested " + std::to_string(req.body.size()) +
+			                " bytes");
+		}
+		else {
+			res.error(404, "Live channel \"" + name + "\" not found");
+		}
+	};
+
+	auto handle_live_destroy = [&](const Request &req, Response &res) {
+		// Listeners keep the channel alive until they are destroyed
+		const std::string name = req.matcher[1];
+		playlists.erase(name);
+		if (live_channels.erase(name)) {
+			res.ok(200, "Live channel successfully erased");
+		}
+		else {
+			res.error(404, "Live channel \"" + name + "\" not found");
+		}
+	};
+
+	// Media segment URLs contain the version of the source file and the
+	// init segment only depends on the output format, allow caches to keep
+	// them forever
+	const Response::Headers segment_headers{
+	    {"Content-Type", "audio/webm"},
+	    {"Cache-Control", "public, max-age=31536000, immutable"}};
+
+	auto handle_track_manifest = [&](const Request &req, Response &res) {
+		std::string filename;
+		try {
+			filename = base64url_decode(req.matcher[1]);
+		}
+		catch (std::logic_error &e) {
+			res.error(400, e.what());
+			return;
+		}
+		std::ostringstream ss;
+		if (!segmenter.write_manifest(filename, ss)) {
+			res.error(404, "Track not found");
+			return;
+		}
+		// The manifest refers to the current version of the file, make
+		// caches revalidate it
+		res.header(200, {{"Content-Type", "application/dash+xml"},
+		                 {"Cache-Control", "public, no-cache"},
+		                 {"ETag", "\"" + file_version(filename) + "\""}});
+		res.stream() << ss.str();
+	};
+
+	auto handle_track_init = [&](const Request &, Response &res) {
+		res.header(200, segment_headers);
+		segmenter.write_init(res.stream());
+	};
+
+	auto handle_track_segment = [&](const Request &req, Response &res) {
+		std::string filename;
+		size_t idx, bitrate;
+		try {
+			filename = base64url_decode(req.matcher[1]);
+			idx = std::stoul(req.matcher[4]);
+			bitrate = std::stoul(req.matcher[3]);
+			if (bitrate < Segmenter::MIN_BITRATE ||
+			    bitrate > Segmenter::MAX_BITRATE) {
+				throw std::invalid_argument("Bitrate out of range");
+			}
+		}
+		catch (std::logic_error &e) {
+			res.error(400, e.what());
+			return;
+		}
+
+		// Segments of a replaced file must not end up in caches under the
+		// URLs of the old version
+		const std::string version = req.matcher[2];
+		if (file_version(filename) != version) {
+			res.error(404, "Segment not found");
+			return;
+		}
+
+		// Decoding and encoding the segment must not block the event loop.
+		// Encode it on the thread pool and only send the status once it is
+		// ready, so failed segments never carry the immutable headers.
+		auto segment = std::make_shared<std::future<std::string>>(
+		    global_thread_pool().submit([&segmenter, filename, version, idx,
+		                                 bitrate] {
+			    std::ostringstream ss;
+			    if (!segmenter.write_segment(filename, idx, bitrate, ss)) {
+				    throw std::out_of_range("Segment not found");
+			    }
+			    if (file_version(filename) != version) {
+				    throw std::runtime_error("Track changed while encoding");
+			    }
+			    return ss.str();
+			}));
+		res.defer_reply([segment, &segment_headers](Response &res) {
+			if (segment->wait_for(std::chrono::seconds(0)) !=
+			    std::future_status::ready) {
+				return true;
+			}
+			std::string data;
+			try {
+				data = segment->get();
+			}
+			catch (std::out_of_range &e) {
+				res.error(404, e.what());
+				return false;
+			}
+			res.header(200, segment_headers);
+			res.stream() << data;
+			return false;
+		});
+	};
+
+	auto handle_track = [&](const Request &req, Response &res) {
+		// Serve complete transcodes from the cache, otherwise follow the
+		// transcode while it is being written
+		std::string path;
+		std::shared_ptr<TrackCacheReader> reader;
+		try {
+			const std::string filename = base64url_decode(req.matcher[1]);
+			auto it = req.get.find("bitrate");
+			const size_t bitrate =
+			    (it == req.get.end()) ? config.track_bitrate
+			                          : std::stoul(it->second);
+			path = track_cache.get(filename, bitrate, reader);
+		}
+		catch (std::logic_error &e) {
+			res.error(400, e.what());
+			return;
+		}
+		// The download URL does not change with the file, make caches
+		// revalidate it
+		const Response::Headers headers{{"Content-Type", "audio/webm"},
+		                                {"Cache-Control", "public, no-cache"}};
+		if (!path.empty()) {
+			res.file(path, "audio/webm",
+			         {{"Cache-Control", headers.at("Cache-Control")}});
+		}
+		else if (reader) {
+			res.header(200, headers);
+			res.defer([reader](std::ostream &os) {
+				return reader->read(os, TRACK_CHUNK_SIZE);
+			});
+		}
+		else {
+			res.error(404, "Track not found");
+		}
+	};
+
+	TLSConfig tls;
+	tls.cert = config.tls_cert;
+	tls.key = config.tls_key;
+
 	HTTPServer server(
 	    {RequestMapEntry("GET", "^/(index.html)?$", handle_index),
+	     RequestMapEntry("GET", "^/metrics$", handle_metrics),
 	     RequestMapEntry("POST", "^/stream/create$", handle_stream_create),
 	     RequestMapEntry("POST", "^/stream/([A-Za-z0-9]+)/append$",
 	                     handle_stream_append),
 	     RequestMapEntry("POST", "^/stream/([A-Za-z0-9]+)/advance$",
 	                     handle_stream_advance),
 	     RequestMapEntry("POST", "^/stream/([A-Za-z0-9]+)/destroy$",
-	                     handle_stream_destroy)}, "0.0.0.0");
+	                     handle_stream_destroy),
+	     RequestMapEntry("POST", "^/live/create$", handle_live_create),
+	     RequestMapEntry("POST", "^/live/([A-Za-z0-9_-]+)/ingest$",
+	                     handle_live_ingest),
+	     RequestMapEntry("POST", "^/live/([A-Za-z0-9_-]+)/append$",
+	                     handle_live_append),
+	     RequestMapEntry("POST", "^/live/([A-Za-z0-9_-]+)/destroy$",
+	                     handle_live_destroy),
+	     RequestMapEntry("GET", "^/track/([A-Za-z0-9_-]+)/manifest\\.mpd$",
+	                     handle_track_manifest),
+	     RequestMapEntry("GET", "^/track/([A-Za-z0-9_-]+)/init\\.webm$",
+	                     handle_track_init),
+	     RequestMapEntry("GET",
+	                     "^/track/([A-Za-z0-9_-]+)/([0-9a-f]{16})/([0-9]+)/"
+	                     "([0-9]+)\\.webm$",
+	                     handle_track_segment),
+	     RequestMapEntry("GET", "^/track/([A-Za-z0-9_-]+)\\.webm$",
+	                     handle_track)},
+	    config.host, config.port, tls);
+	try {
+		server.access_log(std::make_shared<AccessLog>(config.access_log));
+	}
+	catch (std::runtime_error &e) {
+		global_logger().fatal_error("main", e.what());
+		return 1;
+	}
 
 	while (!cancel) {
 		server.poll(1000);
+
+		// Apply the reloadable values on SIGHUP, running streams keep their
+		// settings
+		if (reload) {
+			reload = false;
+			try {
+				const Config next = Config::load(argc, argv);
+				for (const std::string &key : config.reload(next)) {
+					global_logger().warn(
+					    "main", "Change of \"" + key +
+					                "\" requires a restart, ignoring");
+				}
+				Decoder::set_read_ahead(config.read_ahead);
+				Decoder::set_internal_resampler(config.resampler ==
+				                                "internal");
+				decoder_pool.set_max_decoders(config.max_decoders);
+				admission.set_thresholds(config.degrade_load,
+				                         config.max_load);
+				global_logger().info("main", "Configuration reloaded");
+			}
+			catch (std::invalid_argument &e) {
+				global_logger().error(
+				    "main", std::string("Cannot reload configuration: ") +
+				                e.what());
+			}
+		}
 	}
 
+	global_metrics().remove_collector(live_collector_idx);
+	global_metrics().remove_collector(log_collector_idx);
+	global_metrics().remove_collector(collector_idx);
 	return 0;
 }
@@ -16,11 +16,16 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstdio>
 #include <map>
 #include <regex>
 #include <string>
 
 #include <http_audio_server/metadata.hpp>
+#include <http_audio_server/metrics.hpp>
 #include <http_audio_server/process.hpp>
 
 namespace http_audio_server {
@@ -38,6 +43,10 @@ json Metadata::to_json() const
 	res["disc_total"] = disc_total;
 	res["duration"] = duration;
 	res["format"] = format;
+	if (has_replaygain) {
+		res["replaygain_track_gain"] = replaygain_track_gain;
+		res["replaygain_track_peak"] = replaygain_track_peak;
+	}
 	return res;
 }
 
@@ -99,10 +108,39 @@ static std::string get_string(const std::regex &regex,
 	return default_value;
 }
 
+std::string file_version(const std::string &filename)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0) {
+		return std::string();
+	}
+
+	// 64 bit FNV-1a hash of the source file identity
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const auto update = [&hash](const std::string &str) {
+		for (unsigned char c : str) {
+			hash = (hash ^ c) * 0x100000001b3ULL;
+		}
+		hash = (hash ^ 0) * 0x100000001b3ULL;
+	};
+	update(filename);
+	update(std::to_string(st.st_size));
+	update(std::to_string(st.st_mtime));
+
+	char res[17];
+	snprintf(res, sizeof(res), "%016llx", (unsigned long long)hash);
+	return res;
+}
+
 Metadata metadata_from_file(const std::string &filename)
 {
 	using namespace std::regex_constants;
 
+	static Histogram &probe_hist = global_metrics().histogram(
+	    "http_audio_server_metadata_probe_seconds",
+	    "Time spent reading metadata using ffprobe");
+	ScopedTimer timer(probe_hist);
+
 	Metadata res;
 
 	auto pres = Process::exec(
@@ -128,6 +166,24 @@ Metadata metadata_from_file(const std::string &filename)
 		    get_number(std::regex("format::tags::disc_total", icase), data, -1);
 		res.duration =
 		    get_number(std::regex("format::duration", icase), data, -1.0);
+
+		// ReplayGain values are stored as strings such as "-6.50 dB"
+		const std::string rg_gain = get_string(
+		    std::regex("format::tags::replaygain_track_gain", icase), data);
+		const std::string rg_peak = get_string(
+		    std::regex("format::tags::replaygain_track_peak", icase), data);
+		try {
+			if (!rg_gain.empty()) {
+				res.replaygain_track_gain = std::stod(rg_gain);
+				res.has_replaygain = true;
+			}
+			if (!rg_peak.empty()) {
+				res.replaygain_track_peak = std::stod(rg_peak);
+			}
+		}
+		catch (std::logic_error &) {
+			// Ignore malformed tags
+		}
 	}
 
 	return res;
@@ -34,8 +34,23 @@ struct Metadata {
 	int disc_total = -1;
 	double duration = -1.0;
 
+	/**
+	 * ReplayGain track gain in dB relative to -18 LUFS and the linear track
+	 * peak. Only valid if has_replaygain is true.
+	 */
+	bool has_replaygain = false;
+	double replaygain_track_gain = 0.0;
+	double replaygain_track_peak = 1.0;
+
 	json to_json() const;
 };
 
 Metadata metadata_from_file(const std::string &filename);
+
+/**
+ * Returns a hash of the name, size and modification time of the given file as
+ * 16 hexadecimal digits, which changes whenever the file is replaced. Returns
+ * an empty string if the file does not exist.
+ */
+std::string file_version(const std::string &filename);
 }
@@ -0,0 +1,256 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <http_audio_server/metrics.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Class Counter
+ */
+
+uint64_t Counter::value() const
+{
+	uint64_t res = 0;
+	for (const Shard &shard : m_shards) {
+		res += shard.value.load(std::memory_order_relaxed);
+	}
+	return res;
+}
+
+/*
+ * Class Histogram
+ */
+
+Histogram::Histogram()
+{
+	for (auto &bucket : m_buckets) {
+		bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t Histogram::bucket_upper_bound(size_t idx)
+{
+	if (idx < SUB_COUNT) {
+		return idx + 1;
+	}
+	const size_t shift = idx / SUB_COUNT - 1;
+	const uint64_t sub = idx % SUB_COUNT + SUB_COUNT + 1;
+	if (shift + SUB_BITS + 1 >= 64 && sub == 2 * SUB_COUNT) {
+		return std::numeric_limits<uint64_t>::max();
+	}
+	return sub << shift;
+}
+
+/*
+ * Class MetricsImpl
+ */
+
+class MetricsImpl {
+private:
+	/**
+	 * Range of the exported histogram bucket boundaries as powers of two in
+	 * nanoseconds. 2^10 ns is about one microsecond, 2^36 ns about one minute.
+	 */
+	static constexpr size_t MIN_LE_EXP = 10;
+	static constexpr size_t MAX_LE_EXP = 36;
+
+	struct Entry {
+		std::string name;
+		std::string help;
+		std::unique_ptr<Counter> counter;
+		std::unique_ptr<Gauge> gauge;
+		std::unique_ptr<Histogram> histogram;
+	};
+
+	mutable std::mutex m_mtx;
+	std::vector<std::unique_ptr<Entry>> m_entries;
+	std::map<std::string, Entry *> m_index;
+	std::map<int, Metrics::Collector> m_collectors;
+	int m_next_collector_idx = 0;
+
+	Entry &entry(const std::string &name, const std::string &help)
+	{
+		auto it = m_index.find(name);
+		if (it != m_index.end()) {
+			return *it->second;
+		}
+		m_entries.emplace_back(std::make_unique<Entry>());
+		Entry &res = *m_entries.back();
+		res.name = name;
+		res.help = help;
+		m_index.emplace(name, &res);
+		return res;
+	}
+
+	static void dump_histogram(std::ostream &os, const std::string &name,
+	                           const Histogram &hist)
+	{
+		uint64_t cum = 0;
+		size_t idx = 0;
+		for (size_t exp = MIN_LE_EXP; exp <= MAX_LE_EXP; exp++) {
+			const uint64_t le = uint64_t(1) << exp;
+			for (; idx < Histogram::N_BUCKETS &&
+			       Histogram::bucket_upper_bound(idx) <= le;
+			     idx++) {
+				cum += hist.bucket(idx);
+			}
+			os << name << "_bucket{le=\"" << double(le) * 1e-9 << "\"} " << cum
+			   << "\n";
+		}
+		os << name << "_bucket{le=\"+Inf\"} " << hist.count() << "\n";
+		os << name << "_sum " << double(hist.sum()) * 1e-9 << "\n";
+		os << name << "_count " << hist.count() << "\n";
+	}
+
+	static void dump_process(std::ostream &os)
+	{
+		// The second field in /proc/self/statm is the resident set size in
+		// pages
+		std::ifstream is("/proc/self/statm");
+		size_t size = 0, resident = 0;
+		if (is >> size >> resident) {
+			os << "# HELP process_resident_memory_bytes Resident memory size "
+			      "in bytes\n"
+			   << "# TYPE process_resident_memory_bytes gauge\n"
+			   << "process_resident_memory_bytes "
+			   << resident * size_t(sysconf(_SC_PAGESIZE)) << "\n";
+		}
+	}
+
+public:
+	Counter &counter(const std::string &name, const std::string &help)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		Entry &e = entry(name, help);
+		if (!e.counter) {
+			e.counter = std::make_unique<Counter>();
+		}
+		return *e.counter;
+	}
+
+	Gauge &gauge(const std::string &name, const std::string &help)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		Entry &e = entry(name, help);
+		if (!e.gauge) {
+			e.gauge = std::make_unique<Gauge>();
+		}
+		return *e.gauge;
+	}
+
+	Histogram &histogram(const std::string &name, const std::string &help)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		Entry &e = entry(name, help);
+		if (!e.histogram) {
+			e.histogram = std::make_unique<Histogram>();
+		}
+		return *e.histogram;
+	}
+
+	int add_collector(Metrics::Collector collector)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_collectors.emplace(m_next_collector_idx, std::move(collector));
+		return m_next_collector_idx++;
+	}
+
+	void remove_collector(int idx)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_collectors.erase(idx);
+	}
+
+	void dump(std::ostream &os) const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		for (const auto &e : m_entries) {
+			os << "# HELP " << e->name << " " << e->help << "\n";
+			if (e->counter) {
+				os << "# TYPE " << e->name << " counter\n";
+				os << e->name << " " << e->counter->value() << "\n";
+			}
+			else if (e->gauge) {
+				os << "# TYPE " << e->name << " gauge\n";
+				os << e->name << " " << e->gauge->value() << "\n";
+			}
+			else if (e->histogram) {
+				os << "# TYPE " << e->name << " histogram\n";
+				dump_histogram(os, e->name, *e->histogram);
+			}
+		}
+		dump_process(os);
+		for (const auto &collector : m_collectors) {
+			collector.second(os);
+		}
+	}
+};
+
+/*
+ * Class Metrics
+ */
+
+Metrics::Metrics() : m_impl(std::make_unique<MetricsImpl>()) {}
+Metrics::~Metrics()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+Counter &Metrics::counter(const std::string &name, const std::string &help)
+{
+	return m_impl->counter(name, help);
+}
+
+Gauge &Metrics::gauge(const std::string &name, const std::string &help)
+{
+	return m_impl->gauge(name, help);
+}
+
+Histogram &Metrics::histogram(const std::string &name, const std::string &help)
+{
+	return m_impl->histogram(name, help);
+}
+
+int Metrics::add_collector(Collector collector)
+{
+	return m_impl->add_collector(std::move(collector));
+}
+
+void Metrics::remove_collector(int idx) { m_impl->remove_collector(idx); }
+void Metrics::dump(std::ostream &os) const { m_impl->dump(os); }
+
+/*
+ * Functions
+ */
+
+Metrics &global_metrics()
+{
+	static Metrics metrics;
+	return metrics;
+}
+}
@@ -0,0 +1,246 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file metrics.hpp
+ *
+ * Low-overhead counters, gauges and latency histograms used to instrument the
+ * hot paths of the server. The collected metrics can be dumped in the
+ * Prometheus text exposition format.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_METRICS_HPP
+#define HTTP_AUDIO_SERVER_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class MetricsImpl;
+
+/**
+ * Monotonically increasing counter. The counter is split into a number of
+ * cache-line aligned shards, each thread increments its own shard. This avoids
+ * cache-line ping-pong between threads updating the same counter.
+ */
+class Counter {
+private:
+	static constexpr size_t N_SHARDS = 16;
+
+	struct alignas(64) Shard {
+		std::atomic<uint64_t> value{0};
+	};
+
+	Shard m_shards[N_SHARDS];
+
+	static size_t shard_idx()
+	{
+		static std::atomic<size_t> next_idx{0};
+		static thread_local size_t idx = next_idx++ % N_SHARDS;
+		return idx;
+	}
+
+public:
+	/**
+	 * Increments the counter by the given amount.
+	 */
+	void inc(uint64_t n = 1)
+	{
+		m_shards[shard_idx()].value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Returns the sum over all shards.
+	 */
+	uint64_t value() const;
+};
+
+/**
+ * Value which may go up and down, such as the number of active streams.
+ */
+class Gauge {
+private:
+	std::atomic<int64_t> m_value{0};
+
+public:
+	void inc(int64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+	void dec(int64_t n = 1) { m_value.fetch_sub(n, std::memory_order_relaxed); }
+	void set(int64_t v) { m_value.store(v, std::memory_order_relaxed); }
+	int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+};
+
+/**
+ * HDR-style latency histogram with a fixed relative precision. Values are
+ * recorded in nanoseconds. Each power-of-two range is split into 2^SUB_BITS
+ * linear sub-buckets, so recording a value is a handful of integer operations
+ * and a single relaxed atomic increment.
+ */
+class Histogram {
+public:
+	static constexpr size_t SUB_BITS = 3;
+	static constexpr size_t SUB_COUNT = size_t(1) << SUB_BITS;
+	static constexpr size_t N_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+private:
+	std::atomic<uint64_t> m_buckets[N_BUCKETS];
+	std::atomic<uint64_t> m_count{0};
+	std::atomic<uint64_t> m_sum{0};
+
+public:
+	Histogram();
+
+	/**
+	 * Returns the index of the bucket the given value falls into.
+	 */
+	static size_t bucket_idx(uint64_t value)
+	{
+		if (value < SUB_COUNT) {
+			return value;
+		}
+		const size_t msb = 63 - __builtin_clzll(value);
+		const size_t shift = msb - SUB_BITS;
+		return (shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT);
+	}
+
+	/**
+	 * Returns the exclusive upper bound of the bucket with the given index.
+	 */
+	static uint64_t bucket_upper_bound(size_t idx);
+
+	/**
+	 * Records a single value, given in nanoseconds.
+	 */
+	void record(uint64_t value)
+	{
+		m_buckets[bucket_idx(value)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+	uint64_t bucket(size_t idx) const
+	{
+		return m_buckets[idx].load(std::memory_order_relaxed);
+	}
+};
+
+/**
+ * Measures the time elapsed since its construction.
+ */
+class Stopwatch {
+private:
+	std::chrono::steady_clock::time_point m_t0;
+
+public:
+	Stopwatch() : m_t0(std::chrono::steady_clock::now()) {}
+
+	/**
+	 * Returns the number of nanoseconds elapsed since the stopwatch was
+	 * created.
+	 */
+	uint64_t elapsed() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		           std::chrono::steady_clock::now() - m_t0)
+		    .count();
+	}
+};
+
+/**
+ * Records the time between construction and destruction of the ScopedTimer
+ * instance in the given histogram.
+ */
+class ScopedTimer {
+private:
+	Histogram &m_hist;
+	Stopwatch m_watch;
+
+public:
+	explicit ScopedTimer(Histogram &hist) : m_hist(hist) {}
+	~ScopedTimer() { m_hist.record(m_watch.elapsed()); }
+};
+
+/**
+ * Registry holding all metrics. Metrics are created on first access and live
+ * as long as the registry, so references returned by the counter(), gauge()
+ * and histogram() methods may be cached by the caller.
+ */
+class Metrics {
+private:
+	std::unique_ptr<MetricsImpl> m_impl;
+
+public:
+	/**
+	 * Callback which is invoked whenever the metrics are dumped. Can be used
+	 * to export values which are not tracked by the registry itself.
+	 */
+	using Collector = std::function<void(std::ostream &os)>;
+
+	Metrics();
+	~Metrics();
+
+	/**
+	 * Returns a reference at the counter with the given name, creates it if
+	 * it does not exist yet.
+	 */
+	Counter &counter(const std::string &name, const std::string &help);
+
+	/**
+	 * Returns a reference at the gauge with the given name, creates it if
+	 * it does not exist yet.
+	 */
+	Gauge &gauge(const std::string &name, const std::string &help);
+
+	/**
+	 * Returns a reference at the histogram with the given name, creates it if
+	 * it does not exist yet. Histograms are exported in seconds.
+	 */
+	Histogram &histogram(const std::string &name, const std::string &help);
+
+	/**
+	 * Registers an additional collector and returns its index.
+	 */
+	int add_collector(Collector collector);
+
+	/**
+	 * Removes the collector with the given index.
+	 */
+	void remove_collector(int idx);
+
+	/**
+	 * Writes all metrics in the Prometheus text exposition format to the
+	 * given stream.
+	 */
+	void dump(std::ostream &os) const;
+};
+
+Metrics &global_metrics();
+}
+
+#endif /* HTTP_AUDIO_SERVER_METRICS_HPP */
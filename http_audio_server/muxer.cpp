@@ -0,0 +1,539 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#include <common/webmids.h>
+#include <mkvmuxer/mkvmuxer.h>
+
+#include <http_audio_server/muxer.hpp>
+
+namespace http_audio_server {
+
+using namespace mkvmuxer;
+
+/*
+ * Helper functions
+ */
+
+namespace {
+void append_le(std::string &buf, uint64_t value, size_t n_bytes)
+{
+	for (size_t i = 0; i < n_bytes; i++) {
+		buf.push_back(char((value >> (8 * i)) & 0xFF));
+	}
+}
+
+/**
+ * CRC-32 used by Ogg: polynomial 0x04c11db7, no reflection, initial value
+ * and final XOR of zero.
+ */
+uint32_t ogg_crc(const std::string &buf)
+{
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> res(256);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t r = i << 24;
+			for (int j = 0; j < 8; j++) {
+				r = (r & 0x80000000U) ? (r << 1) ^ 0x04c11db7U : (r << 1);
+			}
+			res[i] = r;
+		}
+		return res;
+	}();
+
+	uint32_t crc = 0;
+	for (unsigned char c : buf) {
+		crc = (crc << 8) ^ table[((crc >> 24) & 0xFF) ^ c];
+	}
+	return crc;
+}
+}
+
+/*
+ * Functions
+ */
+
+Container parse_container(const std::string &name)
+{
+	if (name == "webm") {
+		return Container::WEBM;
+	}
+	else if (name == "ogg") {
+		return Container::OGG;
+	}
+	else if (name == "raw") {
+		return Container::RAW;
+	}
+	throw std::invalid_argument("Unknown container \"" + name + "\"");
+}
+
+const char *container_name(Container container)
+{
+	switch (container) {
+		case Container::WEBM:
+			return "webm";
+		case Container::OGG:
+			return "ogg";
+		case Container::RAW:
+			return "raw";
+	}
+	return "";
+}
+
+const char *container_mime_type(Container container)
+{
+	switch (container) {
+		case Container::WEBM:
+			return "audio/webm";
+		case Container::OGG:
+			return "audio/ogg";
+		case Container::RAW:
+			return "application/octet-stream";
+	}
+	return "";
+}
+
+std::string opus_head(size_t rate, size_t n_channels, uint16_t pre_skip)
+{
+	std::string res("OpusHead");
+	append_le(res, 1, 1);           // Version
+	append_le(res, n_channels, 1);  // Channel count
+	append_le(res, pre_skip, 2);    // Pre-skip
+	append_le(res, rate, 4);        // Input sample rate
+	append_le(res, 0, 2);           // Output gain
+	append_le(res, 0, 1);           // Channel mapping family
+	return res;
+}
+
+std::unique_ptr<Muxer> create_muxer(Container container, size_t rate,
+                                    size_t n_channels, size_t frame_size,
+                                    uint16_t pre_skip)
+{
+	switch (container) {
+		case Container::WEBM:
+			return std::make_unique<WebmMuxer>(rate, n_channels, frame_size);
+		case Container::OGG:
+			return std::make_unique<OggMuxer>(rate, n_channels, frame_size,
+			                                  pre_skip);
+		case Container::RAW:
+			return std::make_unique<RawMuxer>(rate, n_channels, pre_skip);
+	}
+	throw std::invalid_argument("Unknown container");
+}
+
+/*
+ * Class Muxer
+ */
+
+Muxer::~Muxer()
+{
+	// Do nothing here, just required for the vtable
+}
+
+std::vector<uint64_t> Muxer::cluster_starts() { return {}; }
+void Muxer::set_cluster_duration(double) {}
+
+/*
+ * Class BufferMkvWriter
+ */
+
+namespace {
+class BufferMkvWriter : public IMkvWriter {
+private:
+	std::vector<uint8_t> m_buf;
+	size_t m_bytes_written = 0;
+	std::vector<uint64_t> m_cluster_starts;
+
+public:
+	int32 Write(const void *buf, uint32 len) override
+	{
+		m_buf.insert(m_buf.end(), (uint8_t *)buf, (uint8_t *)buf + len);
+		m_bytes_written += len;
+		return 0;
+	}
+
+	int64 Position() const override { return m_bytes_written; }
+	int32 Position(int64) override { return -1; }
+	bool Seekable() const override { return false; }
+	void ElementStartNotify(uint64 element_id, int64 position) override
+	{
+		if (element_id == libwebm::kMkvCluster) {
+			m_cluster_starts.push_back(position);
+		}
+	}
+	BufferMkvWriter() {}
+	~BufferMkvWriter() override{};
+
+	size_t dump(std::ostream &os)
+	{
+		const size_t size = m_buf.size();
+		if (!m_buf.empty()) {
+			os.write((char *)&m_buf[0], m_buf.size());
+			m_buf.clear();
+		}
+		return size;
+	}
+
+	std::vector<uint64_t> cluster_starts()
+	{
+		std::vector<uint64_t> res;
+		std::swap(res, m_cluster_starts);
+		return res;
+	}
+};
+
+/*
+ * Class FileMkvWriter
+ */
+
+class FileMkvWriter : public IMkvWriter {
+private:
+	FILE *m_file;
+	size_t m_bytes_written = 0;
+
+public:
+	explicit FileMkvWriter(const std::string &filename)
+	    : m_file(fopen(filename.c_str(), "wb"))
+	{
+		if (!m_file) {
+			throw std::runtime_error("Cannot create " + filename);
+		}
+	}
+
+	~FileMkvWriter() override
+	{
+		if (m_file) {
+			fclose(m_file);
+		}
+	}
+
+	int32 Write(const void *buf, uint32 len) override
+	{
+		m_bytes_written += len;
+		return (fwrite(buf, 1, len, m_file) == len) ? 0 : -1;
+	}
+
+	int64 Position() const override { return ftello(m_file); }
+	int32 Position(int64 position) override
+	{
+		return fseeko(m_file, position, SEEK_SET);
+	}
+	bool Seekable() const override { return true; }
+	void ElementStartNotify(uint64, int64) override {}
+
+	/**
+	 * Returns the number of bytes written since the last call.
+	 */
+	size_t dump()
+	{
+		const size_t res = m_bytes_written;
+		m_bytes_written = 0;
+		return res;
+	}
+
+	/**
+	 * Closes the file, returns false if any write failed.
+	 */
+	bool close()
+	{
+		const bool ok = !ferror(m_file);
+		const bool closed = fclose(m_file) == 0;
+		m_file = nullptr;
+		return ok && closed;
+	}
+};
+}
+
+/*
+ * Class WebmMuxerImpl
+ */
+
+class WebmMuxerImpl {
+private:
+	static constexpr uint64_t SEEK_PRE_ROLL_NS = 80000000;
+
+	/**
+	 * Maximum cluster duration in files, each cluster is a seek point.
+	 */
+	static constexpr uint64_t FILE_CLUSTER_DURATION_NS = 5000000000;
+
+	uint64_t m_rate;
+	bool m_done = false;
+
+	BufferMkvWriter m_mkv_writer;
+	std::unique_ptr<FileMkvWriter> m_mkv_file_writer;
+	std::string m_filename;
+	Segment m_mkv_segment;
+	uint64_t m_mkv_track_id;
+	AudioTrack *m_mkv_audio_track;
+
+public:
+	WebmMuxerImpl(size_t rate, size_t n_channels, const std::string &filename)
+	    : m_rate(rate), m_filename(filename)
+	{
+		// Initialize the mkv segment. Files are seekable, which allows
+		// libwebm to write the Cues, the SeekHead and the Duration.
+		if (filename.empty()) {
+			m_mkv_segment.Init(&m_mkv_writer);
+			m_mkv_segment.set_mode(Segment::kLive);
+		}
+		else {
+			m_mkv_file_writer = std::make_unique<FileMkvWriter>(filename);
+			m_mkv_segment.Init(m_mkv_file_writer.get());
+			m_mkv_segment.set_mode(Segment::kFile);
+			m_mkv_segment.set_max_cluster_duration(FILE_CLUSTER_DURATION_NS);
+		}
+
+		// Add a single audio track
+		m_mkv_track_id = m_mkv_segment.AddAudioTrack(rate, n_channels, 0);
+		m_mkv_audio_track = static_cast<AudioTrack *>(
+		    m_mkv_segment.GetTrackByNumber(m_mkv_track_id));
+		m_mkv_audio_track->set_codec_id(Tracks::kOpusCodecId);
+		m_mkv_audio_track->set_bit_depth(16);
+
+		// Opus decoders need 80 ms to converge after seeking
+		m_mkv_audio_track->set_seek_pre_roll(SEEK_PRE_ROLL_NS);
+		if (m_mkv_file_writer) {
+			m_mkv_segment.CuesTrack(m_mkv_track_id);
+		}
+
+		// Write the Opus private data
+		const std::string private_data = opus_head(rate, n_channels, 0);
+		m_mkv_audio_track->SetCodecPrivate((const uint8_t *)private_data.data(),
+		                                   private_data.size());
+	}
+
+	void write(const uint8_t *buf, size_t size, uint64_t granule)
+	{
+		if (size > 0 && !m_done) {
+			uint64_t ts = (granule * 1000ULL * 1000ULL * 1000ULL) / m_rate;
+			m_mkv_segment.AddFrame(buf, size, m_mkv_track_id, ts, true);
+		}
+	}
+
+	size_t flush(std::ostream &os)
+	{
+		if (m_mkv_file_writer) {
+			return m_mkv_file_writer->dump();
+		}
+		return m_mkv_writer.dump(os);
+	}
+
+	size_t finalize(std::ostream &os)
+	{
+		if (!m_done) {
+			m_mkv_segment.Finalize();
+			m_done = true;
+		}
+		const size_t res = flush(os);
+		if (m_mkv_file_writer && !m_mkv_file_writer->close()) {
+			throw std::runtime_error("Error while writing " + m_filename);
+		}
+		return res;
+	}
+
+	std::vector<uint64_t> cluster_starts()
+	{
+		return m_mkv_writer.cluster_starts();
+	}
+
+	void set_cluster_duration(double seconds)
+	{
+		m_mkv_segment.set_max_cluster_duration(seconds * 1e9);
+	}
+};
+
+/*
+ * Class WebmMuxer
+ */
+
+WebmMuxer::WebmMuxer(size_t rate, size_t n_channels, size_t,
+                     const std::string &filename)
+    : m_impl(std::make_unique<WebmMuxerImpl>(rate, n_channels, filename))
+{
+}
+
+WebmMuxer::~WebmMuxer()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+void WebmMuxer::write(const uint8_t *buf, size_t size, uint64_t granule)
+{
+	m_impl->write(buf, size, granule);
+}
+
+size_t WebmMuxer::flush(std::ostream &os) { return m_impl->flush(os); }
+size_t WebmMuxer::finalize(std::ostream &os) { return m_impl->finalize(os); }
+std::vector<uint64_t> WebmMuxer::cluster_starts()
+{
+	return m_impl->cluster_starts();
+}
+
+void WebmMuxer::set_cluster_duration(double seconds)
+{
+	m_impl->set_cluster_duration(seconds);
+}
+
+/*
+ * Class OggMuxer
+ */
+
+OggMuxer::OggMuxer(size_t rate, size_t n_channels, size_t frame_size,
+                   uint16_t pre_skip)
+    : m_rate(rate),
+      m_frame_size(frame_size),
+      m_pre_skip(pre_skip),
+      m_serial(std::random_device()())
+{
+	// The identification and the comment header each occupy a page of their
+	// own, the first page starts the logical bitstream
+	Packet head{opus_head(rate, n_channels, pre_skip), 0};
+	page(&head, 1, 0x02, 0);
+
+	Packet tags{"OpusTags", 0};
+	const std::string vendor = "http_audio_server";
+	append_le(tags.data, vendor.size(), 4);
+	tags.data += vendor;
+	append_le(tags.data, 0, 4);  // Number of user comments
+	page(&tags, 1, 0x00, 0);
+}
+
+void OggMuxer::page(const Packet *packets, size_t n_packets, uint8_t flags,
+                    uint64_t granule)
+{
+	// Assemble the lacing values: each packet is split into 255 byte
+	// segments followed by a shorter (possibly empty) one
+	std::string lacing;
+	for (size_t i = 0; i < n_packets; i++) {
+		const size_t size = packets[i].data.size();
+		lacing.append(size / 255, char(255));
+		lacing.push_back(char(size % 255));
+	}
+
+	std::string page("OggS");
+	append_le(page, 0, 1);  // Version
+	append_le(page, flags, 1);
+	append_le(page, granule, 8);
+	append_le(page, m_serial, 4);
+	append_le(page, m_page_idx++, 4);
+	append_le(page, 0, 4);  // CRC, filled in below
+	append_le(page, lacing.size(), 1);
+	page += lacing;
+	for (size_t i = 0; i < n_packets; i++) {
+		page += packets[i].data;
+	}
+
+	const uint32_t crc = ogg_crc(page);
+	for (size_t i = 0; i < 4; i++) {
+		page[22 + i] = char((crc >> (8 * i)) & 0xFF);
+	}
+	m_buf += page;
+}
+
+void OggMuxer::pages(size_t n_packets, bool eos)
+{
+	// Pack the packets into pages holding at most 255 lacing values and one
+	// second of audio
+	const size_t max_packets = std::max<size_t>(1, m_rate / m_frame_size);
+	size_t i = 0;
+	while (i < n_packets) {
+		size_t n = 0, n_lacing = 0;
+		while (i + n < n_packets && n < max_packets) {
+			const size_t lacing = m_packets[i + n].data.size() / 255 + 1;
+			if (n > 0 && n_lacing + lacing > 255) {
+				break;
+			}
+			n_lacing += lacing;
+			n++;
+		}
+		const bool last = eos && (i + n == n_packets);
+		page(&m_packets[i], n, last ? 0x04 : 0x00,
+		     m_packets[i + n - 1].granule);
+		i += n;
+	}
+	m_packets.erase(m_packets.begin(), m_packets.begin() + n_packets);
+}
+
+size_t OggMuxer::dump(std::ostream &os)
+{
+	const size_t size = m_buf.size();
+	os.write(m_buf.data(), m_buf.size());
+	m_buf.clear();
+	return size;
+}
+
+void OggMuxer::write(const uint8_t *buf, size_t size, uint64_t granule)
+{
+	// Granule positions count 48 kHz samples at the end of the packet,
+	// including the pre-skip
+	const uint64_t end = (granule + m_frame_size) * 48000 / m_rate;
+	m_packets.emplace_back(
+	    Packet{std::string((const char *)buf, size), end + m_pre_skip});
+}
+
+size_t OggMuxer::flush(std::ostream &os)
+{
+	if (m_packets.size() > 1) {
+		pages(m_packets.size() - 1, false);
+	}
+	return dump(os);
+}
+
+size_t OggMuxer::finalize(std::ostream &os)
+{
+	pages(m_packets.size(), true);
+	return dump(os);
+}
+
+/*
+ * Class RawMuxer
+ */
+
+RawMuxer::RawMuxer(size_t rate, size_t n_channels, uint16_t pre_skip)
+{
+	const std::string head = opus_head(rate, n_channels, pre_skip);
+	packet((const uint8_t *)head.data(), head.size());
+}
+
+void RawMuxer::packet(const uint8_t *buf, size_t size)
+{
+	append_le(m_buf, size, 2);
+	m_buf.append((const char *)buf, size);
+}
+
+void RawMuxer::write(const uint8_t *buf, size_t size, uint64_t)
+{
+	packet(buf, size);
+}
+
+size_t RawMuxer::flush(std::ostream &os)
+{
+	const size_t size = m_buf.size();
+	os.write(m_buf.data(), m_buf.size());
+	m_buf.clear();
+	return size;
+}
+
+size_t RawMuxer::finalize(std::ostream &os) { return flush(os); }
+}
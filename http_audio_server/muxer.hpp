@@ -0,0 +1,217 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file muxer.hpp
+ *
+ * Contains the container formats the encoded Opus packets can be wrapped in:
+ * WebM, Ogg and a minimal length-prefixed packet framing.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_MUXER_HPP
+#define HTTP_AUDIO_SERVER_MUXER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class WebmMuxerImpl;
+
+/**
+ * Container formats supported by the encoder.
+ */
+enum class Container { WEBM, OGG, RAW };
+
+/**
+ * Parses the container from its name, i.e. "webm", "ogg" or "raw". Throws
+ * std::invalid_argument if the name is unknown.
+ */
+Container parse_container(const std::string &name);
+
+/**
+ * Returns the name of the given container as accepted by parse_container().
+ */
+const char *container_name(Container container);
+
+/**
+ * Returns the MIME type of the given container.
+ */
+const char *container_mime_type(Container container);
+
+/**
+ * Returns the Opus identification header ("OpusHead") of a stream with the
+ * given properties as described in RFC 7845.
+ */
+std::string opus_head(size_t rate, size_t n_channels, uint16_t pre_skip);
+
+/**
+ * Abstract base class of a container format. Muxers receive the Opus packets
+ * in order and buffer the container data until flush() is called.
+ */
+class Muxer {
+public:
+	virtual ~Muxer();
+
+	/**
+	 * Appends a single Opus packet.
+	 *
+	 * @param buf points at the packet data.
+	 * @param size is the size of the packet in bytes, zero if the frame could
+	 * not be encoded.
+	 * @param granule is the position of the first sample of the packet in
+	 * samples.
+	 */
+	virtual void write(const uint8_t *buf, size_t size, uint64_t granule) = 0;
+
+	/**
+	 * Writes the container data produced so far to the given output stream
+	 * and returns the number of bytes written.
+	 */
+	virtual size_t flush(std::ostream &os) = 0;
+
+	/**
+	 * Ends the stream and writes the remaining data to the given output
+	 * stream. Returns the number of bytes written.
+	 */
+	virtual size_t finalize(std::ostream &os) = 0;
+
+	/**
+	 * Returns the byte offsets in the output stream at which a listener can
+	 * join the stream since the last call. Returns an empty list if the
+	 * container has no such points.
+	 */
+	virtual std::vector<uint64_t> cluster_starts();
+
+	/**
+	 * Sets the maximum distance between join points in seconds, does
+	 * nothing if the container has no join points.
+	 */
+	virtual void set_cluster_duration(double seconds);
+};
+
+/**
+ * Muxes the packets into a WebM stream. Live streams are written with
+ * unknown-size clusters; files are seekable and contain Cues, a SeekHead and
+ * the Duration of the stream.
+ */
+class WebmMuxer : public Muxer {
+private:
+	std::unique_ptr<WebmMuxerImpl> m_impl;
+
+public:
+	/**
+	 * Creates a new WebM muxer.
+	 *
+	 * @param filename is the file the data is written to. If empty, the data
+	 * is written to the stream passed to flush() instead.
+	 */
+	WebmMuxer(size_t rate, size_t n_channels, size_t frame_size,
+	          const std::string &filename = std::string());
+	~WebmMuxer() override;
+
+	void write(const uint8_t *buf, size_t size, uint64_t granule) override;
+	size_t flush(std::ostream &os) override;
+	size_t finalize(std::ostream &os) override;
+	std::vector<uint64_t> cluster_starts() override;
+	void set_cluster_duration(double seconds) override;
+};
+
+/**
+ * Muxes the packets into an Ogg/Opus stream as described in RFC 7845. Pages
+ * hold at most one second of audio. The last packet is held back until the
+ * next flush() or finalize(), so it can be marked as the end of the stream.
+ */
+class OggMuxer : public Muxer {
+private:
+	struct Packet {
+		std::string data;
+		uint64_t granule;
+	};
+
+	size_t m_rate;
+	size_t m_frame_size;
+	uint16_t m_pre_skip;
+	uint32_t m_serial;
+	uint32_t m_page_idx = 0;
+	std::vector<Packet> m_packets;
+	std::string m_buf;
+
+	/**
+	 * Appends a page containing the given packets to the output buffer.
+	 */
+	void page(const Packet *packets, size_t n_packets, uint8_t flags,
+	          uint64_t granule);
+
+	/**
+	 * Packs the first n_packets buffered packets into pages.
+	 */
+	void pages(size_t n_packets, bool eos);
+
+	size_t dump(std::ostream &os);
+
+public:
+	OggMuxer(size_t rate, size_t n_channels, size_t frame_size,
+	         uint16_t pre_skip);
+
+	void write(const uint8_t *buf, size_t size, uint64_t granule) override;
+	size_t flush(std::ostream &os) override;
+	size_t finalize(std::ostream &os) override;
+};
+
+/**
+ * Writes each packet preceded by its size as 16 bit little endian integer.
+ * The first packet is the OpusHead header, all following packets are audio
+ * frames of the fixed frame size. Frames which could not be encoded are
+ * written as empty packets, so their position stays implicit.
+ */
+class RawMuxer : public Muxer {
+private:
+	std::string m_buf;
+
+	void packet(const uint8_t *buf, size_t size);
+
+public:
+	RawMuxer(size_t rate, size_t n_channels, uint16_t pre_skip);
+
+	void write(const uint8_t *buf, size_t size, uint64_t granule) override;
+	size_t flush(std::ostream &os) override;
+	size_t finalize(std::ostream &os) override;
+};
+
+/**
+ * Creates a muxer for the given container.
+ *
+ * @param frame_size is the number of samples per packet.
+ * @param pre_skip is the number of samples the decoder should discard at the
+ * beginning of the stream.
+ */
+std::unique_ptr<Muxer> create_muxer(Container container, size_t rate,
+                                    size_t n_channels, size_t frame_size,
+                                    uint16_t pre_skip);
+}
+
+#endif /* HTTP_AUDIO_SERVER_MUXER_HPP */
@@ -0,0 +1,879 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <http_audio_server/pcm.hpp>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HTTP_AUDIO_SERVER_PCM_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define HTTP_AUDIO_SERVER_PCM_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HTTP_AUDIO_SERVER_PCM_NEON
+#include <arm_neon.h>
+#endif
+
+namespace http_audio_server {
+
+namespace {
+/*
+ * Constants
+ */
+
+constexpr float S16_SCALE = 1.0f / 32768.0f;
+constexpr float S24_SCALE = 1.0f / 8388608.0f;
+constexpr float S32_SCALE = 1.0f / 2147483648.0f;
+
+/**
+ * Largest float which can be converted to a 32-bit integer without overflow.
+ */
+constexpr float S32_MAX = 2147483520.0f;
+
+/**
+ * Mixing coefficient of the centre and surround channels in a 5.1 to stereo
+ * downmix (-3 dB).
+ */
+constexpr float DOWNMIX_COEFF = 0.70710678f;
+
+/*
+ * Scalar reference implementation. The vectorized kernels below must produce
+ * exactly the same results; in particular clipping uses the semantics of the
+ * SSE min/max instructions.
+ */
+
+template <typename T>
+T load(const void *src, size_t i)
+{
+	T res;
+	memcpy(&res, static_cast<const uint8_t *>(src) + i * sizeof(T), sizeof(T));
+	return res;
+}
+
+float clip(float x, float lo, float hi)
+{
+	x = (x > lo) ? x : lo;
+	return (x < hi) ? x : hi;
+}
+
+int16_t f32_to_s16_sample(float x)
+{
+	return int16_t(std::lrint(clip(x * 32768.0f, -32768.0f, 32767.0f)));
+}
+
+void s16_to_f32_scalar(const int16_t *src, float *tar, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		tar[i] = float(load<int16_t>(src, i)) * S16_SCALE;
+	}
+}
+
+void s32_to_f32_scalar(const int32_t *src, float *tar, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		tar[i] = float(load<int32_t>(src, i)) * S32_SCALE;
+	}
+}
+
+void f64_to_f32_scalar(const double *src, float *tar, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		tar[i] = float(load<double>(src, i));
+	}
+}
+
+void f32_to_s16_scalar(const float *src, int16_t *tar, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		tar[i] = f32_to_s16_sample(src[i]);
+	}
+}
+
+void stereo_to_mono_scalar(const float *src, float *tar, size_t n_frames)
+{
+	for (size_t i = 0; i < n_frames; i++) {
+		tar[i] = (src[2 * i] + src[2 * i + 1]) * 0.5f;
+	}
+}
+
+void mono_to_stereo_scalar(const float *src, float *tar, size_t n_frames)
+{
+	for (size_t i = 0; i < n_frames; i++) {
+		tar[2 * i] = src[i];
+		tar[2 * i + 1] = src[i];
+	}
+}
+
+void deinterleave_stereo_scalar(const float *src, float *l, float *r,
+                                size_t n_frames)
+{
+	for (size_t i = 0; i < n_frames; i++) {
+		l[i] = src[2 * i];
+		r[i] = src[2 * i + 1];
+	}
+}
+
+void interleave_stereo_scalar(const float *l, const float *r, float *tar,
+                              size_t n_frames)
+{
+	for (size_t i = 0; i < n_frames; i++) {
+		tar[2 * i] = l[i];
+		tar[2 * i + 1] = r[i];
+	}
+}
+
+/**
+ * Table of the kernels used for a particular instruction set.
+ */
+struct PcmKernels {
+	const char *name;
+	void (*s16_to_f32)(const int16_t *src, float *tar, size_t n);
+	void (*s32_to_f32)(const int32_t *src, float *tar, size_t n);
+	void (*f64_to_f32)(const double *src, float *tar, size_t n);
+	void (*f32_to_s16)(const float *src, int16_t *tar, size_t n);
+	void (*stereo_to_mono)(const float *src, float *tar, size_t n_frames);
+	void (*mono_to_stereo)(const float *src, float *tar, size_t n_frames);
+	void (*deinterleave_stereo)(const float *src, float *l, float *r,
+	                            size_t n_frames);
+	void (*interleave_stereo)(const float *l, const float *r, float *tar,
+	                          size_t n_frames);
+};
+
+const PcmKernels SCALAR_KERNELS{
+    "scalar",
+    s16_to_f32_scalar,
+    s32_to_f32_scalar,
+    f64_to_f32_scalar,
+    f32_to_s16_scalar,
+    stereo_to_mono_scalar,
+    mono_to_stereo_scalar,
+    deinterleave_stereo_scalar,
+    interleave_stereo_scalar};
+
+#ifdef HTTP_AUDIO_SERVER_PCM_SSE2
+/*
+ * SSE2 kernels
+ */
+
+void s16_to_f32_sse2(const int16_t *src, float *tar, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(S16_SCALE);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(tar + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(tar + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	s16_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+void s32_to_f32_sse2(const int32_t *src, float *tar, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_ps(tar + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+	}
+	s32_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+void f64_to_f32_sse2(const double *src, float *tar, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+		const __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+		_mm_storeu_ps(tar + i, _mm_movelh_ps(lo, hi));
+	}
+	f64_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+void f32_to_s16_sse2(const float *src, int16_t *tar, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	const __m128 lo = _mm_set1_ps(-32768.0f);
+	const __m128 hi = _mm_set1_ps(32767.0f);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		const __m128i res =
+		    _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storeu_si128((__m128i *)(tar + i), res);
+	}
+	f32_to_s16_scalar(src + i, tar + i, n - i);
+}
+
+void stereo_to_mono_sse2(const float *src, float *tar, size_t n_frames)
+{
+	const __m128 half = _mm_set1_ps(0.5f);
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const __m128 a = _mm_loadu_ps(src + 2 * i);
+		const __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+		const __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(tar + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+	}
+	stereo_to_mono_scalar(src + 2 * i, tar + i, n_frames - i);
+}
+
+void mono_to_stereo_sse2(const float *src, float *tar, size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const __m128 x = _mm_loadu_ps(src + i);
+		_mm_storeu_ps(tar + 2 * i, _mm_unpacklo_ps(x, x));
+		_mm_storeu_ps(tar + 2 * i + 4, _mm_unpackhi_ps(x, x));
+	}
+	mono_to_stereo_scalar(src + i, tar + 2 * i, n_frames - i);
+}
+
+void deinterleave_stereo_sse2(const float *src, float *l, float *r,
+                              size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const __m128 a = _mm_loadu_ps(src + 2 * i);
+		const __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	deinterleave_stereo_scalar(src + 2 * i, l + i, r + i, n_frames - i);
+}
+
+void interleave_stereo_sse2(const float *l, const float *r, float *tar,
+                            size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const __m128 a = _mm_loadu_ps(l + i);
+		const __m128 b = _mm_loadu_ps(r + i);
+		_mm_storeu_ps(tar + 2 * i, _mm_unpacklo_ps(a, b));
+		_mm_storeu_ps(tar + 2 * i + 4, _mm_unpackhi_ps(a, b));
+	}
+	interleave_stereo_scalar(l + i, r + i, tar + 2 * i, n_frames - i);
+}
+
+const PcmKernels SSE2_KERNELS{
+    "sse2",
+    s16_to_f32_sse2,
+    s32_to_f32_sse2,
+    f64_to_f32_sse2,
+    f32_to_s16_sse2,
+    stereo_to_mono_sse2,
+    mono_to_stereo_sse2,
+    deinterleave_stereo_sse2,
+    interleave_stereo_sse2};
+#endif /* HTTP_AUDIO_SERVER_PCM_SSE2 */
+
+#ifdef HTTP_AUDIO_SERVER_PCM_AVX2
+/*
+ * AVX2 kernels, only called if the CPU supports AVX2
+ */
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+TARGET_AVX2 void s16_to_f32_avx2(const int16_t *src, float *tar, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(S16_SCALE);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i x = _mm256_cvtepi16_epi32(
+		    _mm_loadu_si128((const __m128i *)(src + i)));
+		_mm256_storeu_ps(tar + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	s16_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+TARGET_AVX2 void s32_to_f32_avx2(const int32_t *src, float *tar, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_ps(tar + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	s32_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+TARGET_AVX2 void f64_to_f32_avx2(const double *src, float *tar, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(src + i));
+		const __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(src + i + 4));
+		_mm256_storeu_ps(tar + i, _mm256_set_m128(hi, lo));
+	}
+	f64_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+TARGET_AVX2 void f32_to_s16_avx2(const float *src, int16_t *tar, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(32768.0f);
+	const __m256 lo = _mm256_set1_ps(-32768.0f);
+	const __m256 hi = _mm256_set1_ps(32767.0f);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+
+		// packs operates on 128-bit lanes, restore the sample order afterwards
+		const __m256i res = _mm256_packs_epi32(_mm256_cvtps_epi32(a),
+		                                       _mm256_cvtps_epi32(b));
+		_mm256_storeu_si256(
+		    (__m256i *)(tar + i),
+		    _mm256_permute4x64_epi64(res, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	f32_to_s16_scalar(src + i, tar + i, n - i);
+}
+
+TARGET_AVX2 void stereo_to_mono_avx2(const float *src, float *tar,
+                                     size_t n_frames)
+{
+	const __m256 half = _mm256_set1_ps(0.5f);
+	size_t i = 0;
+	for (; i + 8 <= n_frames; i += 8) {
+		const __m256 a = _mm256_loadu_ps(src + 2 * i);
+		const __m256 b = _mm256_loadu_ps(src + 2 * i + 8);
+		const __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		const __m256 res = _mm256_mul_ps(_mm256_add_ps(l, r), half);
+		_mm256_storeu_ps(tar + i,
+		                 _mm256_castpd_ps(_mm256_permute4x64_pd(
+		                     _mm256_castps_pd(res), _MM_SHUFFLE(3, 1, 2, 0))));
+	}
+	stereo_to_mono_scalar(src + 2 * i, tar + i, n_frames - i);
+}
+
+TARGET_AVX2 void mono_to_stereo_avx2(const float *src, float *tar,
+                                     size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 8 <= n_frames; i += 8) {
+		const __m256 x = _mm256_loadu_ps(src + i);
+		const __m256 lo = _mm256_unpacklo_ps(x, x);
+		const __m256 hi = _mm256_unpackhi_ps(x, x);
+		_mm256_storeu_ps(tar + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(tar + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	mono_to_stereo_scalar(src + i, tar + 2 * i, n_frames - i);
+}
+
+TARGET_AVX2 void deinterleave_stereo_avx2(const float *src, float *l, float *r,
+                                          size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 8 <= n_frames; i += 8) {
+		const __m256 a = _mm256_loadu_ps(src + 2 * i);
+		const __m256 b = _mm256_loadu_ps(src + 2 * i + 8);
+		const __m256d even = _mm256_castps_pd(
+		    _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		const __m256d odd = _mm256_castps_pd(
+		    _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		_mm256_storeu_ps(l + i, _mm256_castpd_ps(_mm256_permute4x64_pd(
+		                            even, _MM_SHUFFLE(3, 1, 2, 0))));
+		_mm256_storeu_ps(r + i, _mm256_castpd_ps(_mm256_permute4x64_pd(
+		                            odd, _MM_SHUFFLE(3, 1, 2, 0))));
+	}
+	deinterleave_stereo_scalar(src + 2 * i, l + i, r + i, n_frames - i);
+}
+
+TARGET_AVX2 void interleave_stereo_avx2(const float *l, const float *r,
+                                        float *tar, size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 8 <= n_frames; i += 8) {
+		const __m256 a = _mm256_loadu_ps(l + i);
+		const __m256 b = _mm256_loadu_ps(r + i);
+		const __m256 lo = _mm256_unpacklo_ps(a, b);
+		const __m256 hi = _mm256_unpackhi_ps(a, b);
+		_mm256_storeu_ps(tar + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(tar + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	interleave_stereo_scalar(l + i, r + i, tar + 2 * i, n_frames - i);
+}
+
+#undef TARGET_AVX2
+
+const PcmKernels AVX2_KERNELS{
+    "avx2",
+    s16_to_f32_avx2,
+    s32_to_f32_avx2,
+    f64_to_f32_avx2,
+    f32_to_s16_avx2,
+    stereo_to_mono_avx2,
+    mono_to_stereo_avx2,
+    deinterleave_stereo_avx2,
+    interleave_stereo_avx2};
+#endif /* HTTP_AUDIO_SERVER_PCM_AVX2 */
+
+#ifdef HTTP_AUDIO_SERVER_PCM_NEON
+/*
+ * NEON kernels
+ */
+
+void s16_to_f32_neon(const int16_t *src, float *tar, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const int16x8_t x = vld1q_s16(src + i);
+		const float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+		const float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+		vst1q_f32(tar + i, vmulq_n_f32(lo, S16_SCALE));
+		vst1q_f32(tar + i + 4, vmulq_n_f32(hi, S16_SCALE));
+	}
+	s16_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+void s32_to_f32_neon(const int32_t *src, float *tar, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const float32x4_t x = vcvtq_f32_s32(vld1q_s32(src + i));
+		vst1q_f32(tar + i, vmulq_n_f32(x, S32_SCALE));
+	}
+	s32_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+void f64_to_f32_neon(const double *src, float *tar, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const float32x2_t lo = vcvt_f32_f64(vld1q_f64(src + i));
+		const float32x2_t hi = vcvt_f32_f64(vld1q_f64(src + i + 2));
+		vst1q_f32(tar + i, vcombine_f32(lo, hi));
+	}
+	f64_to_f32_scalar(src + i, tar + i, n - i);
+}
+
+void f32_to_s16_neon(const float *src, int16_t *tar, size_t n)
+{
+	const float32x4_t lo = vdupq_n_f32(-32768.0f);
+	const float32x4_t hi = vdupq_n_f32(32767.0f);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		// Select instead of vmaxq/vminq to match the NaN handling of clip()
+		float32x4_t x = vmulq_n_f32(vld1q_f32(src + i), 32768.0f);
+		x = vbslq_f32(vcgtq_f32(x, lo), x, lo);
+		x = vbslq_f32(vcltq_f32(x, hi), x, hi);
+		vst1_s16(tar + i, vqmovn_s32(vcvtnq_s32_f32(x)));
+	}
+	f32_to_s16_scalar(src + i, tar + i, n - i);
+}
+
+void stereo_to_mono_neon(const float *src, float *tar, size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const float32x4x2_t x = vld2q_f32(src + 2 * i);
+		vst1q_f32(tar + i, vmulq_n_f32(vaddq_f32(x.val[0], x.val[1]), 0.5f));
+	}
+	stereo_to_mono_scalar(src + 2 * i, tar + i, n_frames - i);
+}
+
+void mono_to_stereo_neon(const float *src, float *tar, size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const float32x4_t x = vld1q_f32(src + i);
+		vst2q_f32(tar + 2 * i, (float32x4x2_t{{x, x}}));
+	}
+	mono_to_stereo_scalar(src + i, tar + 2 * i, n_frames - i);
+}
+
+void deinterleave_stereo_neon(const float *src, float *l, float *r,
+                              size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		const float32x4x2_t x = vld2q_f32(src + 2 * i);
+		vst1q_f32(l + i, x.val[0]);
+		vst1q_f32(r + i, x.val[1]);
+	}
+	deinterleave_stereo_scalar(src + 2 * i, l + i, r + i, n_frames - i);
+}
+
+void interleave_stereo_neon(const float *l, const float *r, float *tar,
+                            size_t n_frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= n_frames; i += 4) {
+		vst2q_f32(tar + 2 * i,
+		          (float32x4x2_t{{vld1q_f32(l + i), vld1q_f32(r + i)}}));
+	}
+	interleave_stereo_scalar(l + i, r + i, tar + 2 * i, n_frames - i);
+}
+
+const PcmKernels NEON_KERNELS{
+    "neon",
+    s16_to_f32_neon,
+    s32_to_f32_neon,
+    f64_to_f32_neon,
+    f32_to_s16_neon,
+    stereo_to_mono_neon,
+    mono_to_stereo_neon,
+    deinterleave_stereo_neon,
+    interleave_stereo_neon};
+#endif /* HTTP_AUDIO_SERVER_PCM_NEON */
+
+/*
+ * Runtime dispatch
+ */
+
+std::vector<const PcmKernels *> supported_kernels()
+{
+	std::vector<const PcmKernels *> res{&SCALAR_KERNELS};
+#if defined(HTTP_AUDIO_SERVER_PCM_SSE2)
+	res.push_back(&SSE2_KERNELS);
+#elif defined(HTTP_AUDIO_SERVER_PCM_NEON)
+	res.push_back(&NEON_KERNELS);
+#endif
+#ifdef HTTP_AUDIO_SERVER_PCM_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		res.push_back(&AVX2_KERNELS);
+	}
+#endif
+	return res;
+}
+
+/**
+ * Kernels used by the conversion functions, the last supported ones unless
+ * changed by set_pcm_isa().
+ */
+std::atomic<const PcmKernels *> &current_kernels()
+{
+	static std::atomic<const PcmKernels *> res{supported_kernels().back()};
+	return res;
+}
+
+const PcmKernels &kernels() { return *current_kernels().load(); }
+
+/*
+ * Helper functions for the formats without vectorized kernels
+ */
+
+bool host_little_endian()
+{
+	const uint16_t x = 1;
+	uint8_t b;
+	memcpy(&b, &x, 1);
+	return b == 1;
+}
+
+/**
+ * Reads a sample of the given size from src and reverses the byte order if
+ * requested.
+ */
+template <typename T>
+T load_swapped(const void *src, size_t i, bool swap)
+{
+	uint8_t buf[sizeof(T)];
+	memcpy(buf, static_cast<const uint8_t *>(src) + i * sizeof(T), sizeof(T));
+	if (swap) {
+		std::reverse(buf, buf + sizeof(T));
+	}
+	T res;
+	memcpy(&res, buf, sizeof(T));
+	return res;
+}
+
+template <typename T>
+void store_swapped(void *tar, size_t i, T value, bool swap)
+{
+	uint8_t buf[sizeof(T)];
+	memcpy(buf, &value, sizeof(T));
+	if (swap) {
+		std::reverse(buf, buf + sizeof(T));
+	}
+	memcpy(static_cast<uint8_t *>(tar) + i * sizeof(T), buf, sizeof(T));
+}
+}
+
+/*
+ * Functions
+ */
+
+SampleFormat sample_format(const AudioFormat &fmt)
+{
+	if (fmt.use_float) {
+		switch (fmt.bit_depth) {
+			case 32:
+				return SampleFormat::F32;
+			case 64:
+				return SampleFormat::F64;
+		}
+	}
+	else {
+		switch (fmt.bit_depth) {
+			case 8:
+				return SampleFormat::U8;
+			case 16:
+				return SampleFormat::S16;
+			case 24:
+				return SampleFormat::S24;
+			case 32:
+				return SampleFormat::S32;
+		}
+	}
+	throw std::invalid_argument("Unsupported sample format!");
+}
+
+size_t sample_size(SampleFormat fmt)
+{
+	switch (fmt) {
+		case SampleFormat::U8:
+			return 1;
+		case SampleFormat::S16:
+			return 2;
+		case SampleFormat::S24:
+			return 3;
+		case SampleFormat::S32:
+		case SampleFormat::F32:
+			return 4;
+		case SampleFormat::F64:
+			return 8;
+	}
+	return 0;
+}
+
+void pcm_to_float(const void *src, SampleFormat fmt, bool little_endian,
+                  float *tar, size_t n_samples)
+{
+	const bool swap = little_endian != host_little_endian();
+	const uint8_t *bytes = static_cast<const uint8_t *>(src);
+	switch (fmt) {
+		case SampleFormat::U8:
+			for (size_t i = 0; i < n_samples; i++) {
+				tar[i] = float(int(bytes[i]) - 128) * (1.0f / 128.0f);
+			}
+			break;
+		case SampleFormat::S16:
+			if (!swap) {
+				kernels().s16_to_f32(static_cast<const int16_t *>(src), tar,
+				                     n_samples);
+				break;
+			}
+			for (size_t i = 0; i < n_samples; i++) {
+				tar[i] = float(load_swapped<int16_t>(src, i, swap)) * S16_SCALE;
+			}
+			break;
+		case SampleFormat::S24:
+			for (size_t i = 0; i < n_samples; i++) {
+				const uint8_t *p = bytes + 3 * i;
+				const uint32_t x =
+				    little_endian ? (p[0] | (p[1] << 8) | (p[2] << 16))
+				                  : (p[2] | (p[1] << 8) | (p[0] << 16));
+				tar[i] = float(int32_t(x << 8) >> 8) * S24_SCALE;
+			}
+			break;
+		case SampleFormat::S32:
+			if (!swap) {
+				kernels().s32_to_f32(static_cast<const int32_t *>(src), tar,
+				                     n_samples);
+				break;
+			}
+			for (size_t i = 0; i < n_samples; i++) {
+				tar[i] = float(load_swapped<int32_t>(src, i, swap)) * S32_SCALE;
+			}
+			break;
+		case SampleFormat::F32:
+			for (size_t i = 0; i < n_samples; i++) {
+				tar[i] = load_swapped<float>(src, i, swap);
+			}
+			break;
+		case SampleFormat::F64:
+			if (!swap) {
+				kernels().f64_to_f32(static_cast<const double *>(src), tar,
+				                     n_samples);
+				break;
+			}
+			for (size_t i = 0; i < n_samples; i++) {
+				tar[i] = float(load_swapped<double>(src, i, swap));
+			}
+			break;
+	}
+}
+
+void float_to_pcm(const float *src, void *tar, SampleFormat fmt,
+                  bool little_endian, size_t n_samples)
+{
+	const bool swap = little_endian != host_little_endian();
+	uint8_t *bytes = static_cast<uint8_t *>(tar);
+	switch (fmt) {
+		case SampleFormat::U8:
+			for (size_t i = 0; i < n_samples; i++) {
+				bytes[i] = uint8_t(
+				    std::lrint(clip(src[i] * 128.0f, -128.0f, 127.0f)) + 128);
+			}
+			break;
+		case SampleFormat::S16:
+			if (!swap) {
+				kernels().f32_to_s16(src, static_cast<int16_t *>(tar),
+				                     n_samples);
+				break;
+			}
+			for (size_t i = 0; i < n_samples; i++) {
+				store_swapped(tar, i, f32_to_s16_sample(src[i]), swap);
+			}
+			break;
+		case SampleFormat::S24:
+			for (size_t i = 0; i < n_samples; i++) {
+				const uint32_t x = uint32_t(std::lrint(
+				    clip(src[i] * 8388608.0f, -8388608.0f, 8388607.0f)));
+				uint8_t *p = bytes + 3 * i;
+				p[little_endian ? 0 : 2] = x & 0xFF;
+				p[1] = (x >> 8) & 0xFF;
+				p[little_endian ? 2 : 0] = (x >> 16) & 0xFF;
+			}
+			break;
+		case SampleFormat::S32:
+			for (size_t i = 0; i < n_samples; i++) {
+				const int32_t x = int32_t(std::lrint(
+				    clip(src[i] * 2147483648.0f, -2147483648.0f, S32_MAX)));
+				store_swapped(tar, i, x, swap);
+			}
+			break;
+		case SampleFormat::F32:
+			for (size_t i = 0; i < n_samples; i++) {
+				store_swapped(tar, i, src[i], swap);
+			}
+			break;
+		case SampleFormat::F64:
+			for (size_t i = 0; i < n_samples; i++) {
+				store_swapped(tar, i, double(src[i]), swap);
+			}
+			break;
+	}
+}
+
+void deinterleave(const float *src, float *const *tar, size_t n_channels,
+                  size_t n_frames)
+{
+	if (n_channels == 2) {
+		kernels().deinterleave_stereo(src, tar[0], tar[1], n_frames);
+		return;
+	}
+	for (size_t i = 0; i < n_frames; i++) {
+		for (size_t c = 0; c < n_channels; c++) {
+			tar[c][i] = src[i * n_channels + c];
+		}
+	}
+}
+
+void interleave(const float *const *src, float *tar, size_t n_channels,
+                size_t n_frames)
+{
+	if (n_channels == 2) {
+		kernels().interleave_stereo(src[0], src[1], tar, n_frames);
+		return;
+	}
+	for (size_t i = 0; i < n_frames; i++) {
+		for (size_t c = 0; c < n_channels; c++) {
+			tar[i * n_channels + c] = src[c][i];
+		}
+	}
+}
+
+void remix(const float *src, size_t src_channels, float *tar,
+           size_t tar_channels, size_t n_frames)
+{
+	if (src_channels == tar_channels) {
+		std::copy(src, src + n_frames * src_channels, tar);
+	}
+	else if (src_channels == 2 && tar_channels == 1) {
+		kernels().stereo_to_mono(src, tar, n_frames);
+	}
+	else if (src_channels == 1 && tar_channels == 2) {
+		kernels().mono_to_stereo(src, tar, n_frames);
+	}
+	else if (src_channels == 1) {
+		for (size_t i = 0; i < n_frames; i++) {
+			std::fill(tar + i * tar_channels, tar + (i + 1) * tar_channels,
+			          src[i]);
+		}
+	}
+	else if (tar_channels == 1) {
+		const float scale = 1.0f / float(src_channels);
+		for (size_t i = 0; i < n_frames; i++) {
+			float sum = 0.0f;
+			for (size_t c = 0; c < src_channels; c++) {
+				sum += src[i * src_channels + c];
+			}
+			tar[i] = sum * scale;
+		}
+	}
+	else if (src_channels == 6 && tar_channels == 2) {
+		// Channel order FL, FR, FC, LFE, BL, BR; the LFE channel is dropped
+		// and the result is normalised to avoid clipping
+		const float scale = 1.0f / (1.0f + 2.0f * DOWNMIX_COEFF);
+		for (size_t i = 0; i < n_frames; i++) {
+			const float *s = src + 6 * i;
+			const float c = DOWNMIX_COEFF * s[2];
+			tar[2 * i] = (s[0] + c + DOWNMIX_COEFF * s[4]) * scale;
+			tar[2 * i + 1] = (s[1] + c + DOWNMIX_COEFF * s[5]) * scale;
+		}
+	}
+	else {
+		const size_t n = std::min(src_channels, tar_channels);
+		for (size_t i = 0; i < n_frames; i++) {
+			std::copy(src + i * src_channels, src + i * src_channels + n,
+			          tar + i * tar_channels);
+			std::fill(tar + i * tar_channels + n, tar + (i + 1) * tar_channels,
+			          0.0f);
+		}
+	}
+}
+
+const char *pcm_isa() { return kernels().name; }
+
+std::vector<std::string> pcm_isas()
+{
+	std::vector<std::string> res;
+	for (const PcmKernels *k : supported_kernels()) {
+		res.emplace_back(k->name);
+	}
+	return res;
+}
+
+void set_pcm_isa(const std::string &isa)
+{
+	for (const PcmKernels *k : supported_kernels()) {
+		if (isa == k->name) {
+			current_kernels() = k;
+			return;
+		}
+	}
+	throw std::invalid_argument("Unsupported instruction set " + isa);
+}
+}
@@ -0,0 +1,122 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file pcm.hpp
+ *
+ * Sample format conversion and channel remixing of raw PCM audio. The inner
+ * loops are vectorized using SSE2, AVX2 or NEON; the implementation is
+ * selected at runtime depending on the features supported by the CPU. All
+ * implementations produce bit-identical results.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_PCM_HPP
+#define HTTP_AUDIO_SERVER_PCM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/decoder.hpp>
+
+namespace http_audio_server {
+
+/**
+ * Sample formats supported by the conversion functions.
+ */
+enum class SampleFormat { U8, S16, S24, S32, F32, F64 };
+
+/**
+ * Returns the sample format described by the given AudioFormat.
+ *
+ * @throws std::invalid_argument if the bit depth is not supported.
+ */
+SampleFormat sample_format(const AudioFormat &fmt);
+
+/**
+ * Returns the size of a single sample in the given format in bytes.
+ */
+size_t sample_size(SampleFormat fmt);
+
+/**
+ * Converts n_samples samples in the given format to 32-bit floats in the range
+ * [-1, 1).
+ *
+ * @param src points at the samples that should be converted.
+ * @param fmt is the format of the source samples.
+ * @param little_endian specifies the byte order of the source samples.
+ * @param tar points at a buffer holding at least n_samples floats.
+ * @param n_samples is the number of samples.
+ */
+void pcm_to_float(const void *src, SampleFormat fmt, bool little_endian,
+                  float *tar, size_t n_samples);
+
+/**
+ * Converts n_samples 32-bit floats to the given format. Samples outside the
+ * range [-1, 1) are clipped, integer samples are rounded to the nearest value.
+ */
+void float_to_pcm(const float *src, void *tar, SampleFormat fmt,
+                  bool little_endian, size_t n_samples);
+
+/**
+ * Splits interleaved samples into one buffer per channel.
+ */
+void deinterleave(const float *src, float *const *tar, size_t n_channels,
+                  size_t n_frames);
+
+/**
+ * Interleaves one buffer per channel into a single buffer.
+ */
+void interleave(const float *const *src, float *tar, size_t n_channels,
+                size_t n_frames);
+
+/**
+ * Converts interleaved samples between channel layouts. Mono is copied to all
+ * output channels, multi-channel audio is averaged when mixed down to mono
+ * and 5.1 is mixed down to stereo following ITU-R BS.775. Otherwise the first
+ * channels are copied and additional output channels are silent. The source
+ * and target buffers must not overlap.
+ */
+void remix(const float *src, size_t src_channels, float *tar,
+           size_t tar_channels, size_t n_frames);
+
+/**
+ * Returns the name of the instruction set used by the conversion functions,
+ * i.e. "avx2", "sse2", "neon" or "scalar".
+ */
+const char *pcm_isa();
+
+/**
+ * Returns the names of the instruction sets supported by the build and the
+ * CPU, starting with "scalar".
+ */
+std::vector<std::string> pcm_isas();
+
+/**
+ * Selects the instruction set used by the conversion functions. Used to
+ * compare the implementations in tests and benchmarks.
+ *
+ * @throws std::invalid_argument if the instruction set is not supported.
+ */
+void set_pcm_isa(const std::string &isa);
+}
+
+#endif /* HTTP_AUDIO_SERVER_PCM_HPP */
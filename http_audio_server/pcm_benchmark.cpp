@@ -0,0 +1,132 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measures the throughput of the PCM conversion kernels for each instruction
+ * set supported by the CPU. Usage:
+ *
+ *     http_audio_server_pcm_benchmark [FRAMES]
+ *
+ * Each conversion is run repeatedly on a buffer of FRAMES stereo frames
+ * (default 4096, i.e. the size of a typical decoder read) for about 0.2
+ * seconds. The throughput is printed in millions of frames per second.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/pcm.hpp>
+
+using namespace http_audio_server;
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Minimum time spent per kernel and instruction set in seconds.
+ */
+static constexpr double MIN_DURATION = 0.2;
+
+/**
+ * Returns the number of frames processed per second by the given function,
+ * which processes n_frames frames per call.
+ */
+static double throughput(const std::function<void()> &f, size_t n_frames)
+{
+	f(); // Warm up the caches
+	size_t n_calls = 0;
+	const Clock::time_point t0 = Clock::now();
+	double elapsed = 0.0;
+	do {
+		for (size_t i = 0; i < 16; i++) {
+			f();
+		}
+		n_calls += 16;
+		elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+	} while (elapsed < MIN_DURATION);
+	return n_calls * n_frames / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t n_frames = (argc > 1) ? std::stoul(argv[1]) : 4096;
+	if (argc > 2 || n_frames == 0) {
+		std::cerr << "Usage: " << argv[0] << " [FRAMES]" << std::endl;
+		return 1;
+	}
+
+	const size_t n = 2 * n_frames;
+	std::vector<int16_t> s16(n);
+	std::vector<int32_t> s32(n);
+	std::vector<double> f64(n);
+	std::vector<float> f32(n), mono(n_frames), l(n_frames), r(n_frames);
+	for (size_t i = 0; i < n; i++) {
+		f32[i] = float(int(i % 2001) - 1000) / 900.0f;
+		f64[i] = f32[i];
+		s16[i] = int16_t(i * 31);
+		s32[i] = int32_t(i * 2654435761u);
+	}
+	float *channels[] = {l.data(), r.data()};
+	const float *const_channels[] = {l.data(), r.data()};
+
+	const std::vector<std::pair<std::string, std::function<void()>>> kernels{
+	    {"s16_to_float",
+	     [&] {
+		     pcm_to_float(s16.data(), SampleFormat::S16, true, f32.data(), n);
+		 }},
+	    {"s32_to_float",
+	     [&] {
+		     pcm_to_float(s32.data(), SampleFormat::S32, true, f32.data(), n);
+		 }},
+	    {"f64_to_float",
+	     [&] {
+		     pcm_to_float(f64.data(), SampleFormat::F64, true, f32.data(), n);
+		 }},
+	    {"float_to_s16",
+	     [&] {
+		     float_to_pcm(f32.data(), s16.data(), SampleFormat::S16, true, n);
+		 }},
+	    {"stereo_to_mono",
+	     [&] { remix(f32.data(), 2, mono.data(), 1, n_frames); }},
+	    {"mono_to_stereo",
+	     [&] { remix(mono.data(), 1, f32.data(), 2, n_frames); }},
+	    {"deinterleave",
+	     [&] { deinterleave(f32.data(), channels, 2, n_frames); }},
+	    {"interleave",
+	     [&] { interleave(const_channels, f32.data(), 2, n_frames); }}};
+
+	const std::vector<std::string> isas = pcm_isas();
+	std::cout << std::left << std::setw(16) << "Mframes/s";
+	for (const std::string &isa : isas) {
+		std::cout << std::right << std::setw(10) << isa;
+	}
+	std::cout << std::endl << std::fixed << std::setprecision(1);
+	for (const auto &kernel : kernels) {
+		std::cout << std::left << std::setw(16) << kernel.first;
+		for (const std::string &isa : isas) {
+			set_pcm_isa(isa);
+			std::cout << std::right << std::setw(10)
+			          << throughput(kernel.second, n_frames) * 1e-6;
+		}
+		std::cout << std::endl;
+	}
+	return 0;
+}
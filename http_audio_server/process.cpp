@@ -16,24 +16,46 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <condition_variable>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
+#include <errno.h>
 #include <ext/stdio_filebuf.h>
 #include <limits.h>
+#include <spawn.h>
+#include <string.h>
 #include <sys/fcntl.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <http_audio_server/metrics.hpp>
 #include <http_audio_server/process.hpp>
+#include <http_audio_server/reactor.hpp>
+#include <http_audio_server/supervisor.hpp>
 
 namespace http_audio_server {
 
+/*
+ * Metrics
+ */
+
+static Histogram &spawn_histogram()
+{
+	static Histogram &hist = global_metrics().histogram(
+	    "http_audio_server_process_spawn_seconds",
+	    "Time spent in posix_spawn() launching a child process");
+	return hist;
+}
+
 /*
  * Class ProcessImpl
  */
@@ -58,43 +80,13 @@ private:
 	std::unique_ptr<std::istream> m_child_stderr;
 	std::unique_ptr<std::ostream> m_child_stdin;
 
-	int m_exitcode = 0;
-
-	bool update_status(bool block)
-	{
-		// If we already know that the child process no longer exists, return
-		if (m_pid == 0) {
-			return false;
-		}
+	std::shared_ptr<ChildStatus> m_status;
 
-		// Otherweise query the child status using waitpid
-		int status;
-		pid_t res = waitpid(m_pid, &status, block ? 0 : WNOHANG);
-		if (res == -1) {
-			throw std::runtime_error("Error while querying child state!");
-		}
-		else if (res == 0) {
-			return true;  // No status change, the child process is still alive!
-		}
-		else {
-			if (WIFEXITED(status)) {
-				m_exitcode = WEXITSTATUS(status);
-				m_pid = 0;
-				return false;
-			}
-			else if (WIFSIGNALED(status)) {
-				m_exitcode = -WTERMSIG(status);
-				m_pid = 0;
-				return false;
-			}
-			// This was another state change
-			return true;
-		}
-	}
+	bool m_detached = false;
 
 public:
 	ProcessImpl(const std::string &cmd, const std::vector<std::string> &args,
-	            bool do_redirect = true)
+	            bool do_redirect, const ProcessLimits &limits)
 	    : m_do_redirect(do_redirect)
 	{
 		// Setup the stdin, stdout, stderr pipes
@@ -114,22 +106,39 @@ public:
 		}
 		argv[args.size() + 1] = nullptr;
 
-		m_pid = fork();  // Split the current process into two
-		if (m_pid == 0) {
-			// This is the child process -- redirect the child I/O to the pipe
-			if (m_do_redirect) {
-				dup2(m_child_stdout_pipe[1], STDOUT_FILENO);
-				dup2(m_child_stderr_pipe[1], STDERR_FILENO);
-				dup2(m_child_stdin_pipe[0], STDIN_FILENO);
-			}
+		// Redirect the child I/O to the pipes. All pipe ends are marked as
+		// O_CLOEXEC, so the original descriptors are closed in the child.
+		posix_spawn_file_actions_t file_actions;
+		posix_spawn_file_actions_init(&file_actions);
+		if (m_do_redirect) {
+			posix_spawn_file_actions_adddup2(
+			    &file_actions, m_child_stdout_pipe[1], STDOUT_FILENO);
+			posix_spawn_file_actions_adddup2(
+			    &file_actions, m_child_stderr_pipe[1], STDERR_FILENO);
+			posix_spawn_file_actions_adddup2(
+			    &file_actions, m_child_stdin_pipe[0], STDIN_FILENO);
+		}
 
-			// Launch the subprocessm, on success, there is no return from
-			// execvp
-			execvp(cmd.c_str(), (char *const *)&argv[0]);
-			std::cerr << "Command not found: " << cmd << std::endl;
-			exit(1);  // Panic!
+		// Launch the subprocess. In contrast to fork(), posix_spawn() does not
+		// copy the page tables of this process, so the cost of launching a
+		// child does not depend on our resident memory size.
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+		int err;
+		{
+			ScopedTimer timer(spawn_histogram());
+			err = posix_spawnp(&m_pid, cmd.c_str(), &file_actions, &attr,
+			                   (char *const *)&argv[0], environ);
 		}
-		else if (m_pid > 0) {
+		posix_spawnattr_destroy(&attr);
+		posix_spawn_file_actions_destroy(&file_actions);
+
+		if (err == 0) {
+			m_status = global_supervisor().watch(m_pid, limits);
+
 			// This is the parent process -- close the corresponding ends of
 			// the pipe
 			if (m_do_redirect) {
@@ -162,31 +171,66 @@ public:
 			    std::make_unique<std::ostream>(m_child_stdin_filebuf.get());
 		}
 		else {
-			throw std::runtime_error(
-			    "Cannot launch subprocess, error while forking!");
+			m_pid = 0;
+			if (m_do_redirect) {
+				for (int fd : {m_child_stdout_pipe[0], m_child_stdout_pipe[1],
+				               m_child_stderr_pipe[0], m_child_stderr_pipe[1],
+				               m_child_stdin_pipe[0], m_child_stdin_pipe[1]}) {
+					close(fd);
+				}
+			}
+			throw std::runtime_error("Cannot launch subprocess \"" + cmd +
+			                         "\": " + strerror(err));
 		}
 	}
 
-	~ProcessImpl() { wait(); }
+	~ProcessImpl()
+	{
+		if (m_detached) {
+			return;
+		}
+		wait();
+	}
 	std::istream &child_stdout() { return *m_child_stdout; }
 	std::istream &child_stderr() { return *m_child_stderr; }
 	std::ostream &child_stdin() { return *m_child_stdin; }
 	void close_child_stdin()
 	{
-		m_child_stdin->flush();
-		m_child_stdin = nullptr;
-		m_child_stdin_filebuf = nullptr;
+		if (m_child_stdin) {
+			m_child_stdin->flush();
+			m_child_stdin = nullptr;
+			m_child_stdin_filebuf = nullptr;
+		}
 	}
 
-	bool running() { return update_status(false); }
-	int exitcode() { return m_exitcode; }
-	int wait()
+	int child_stdout_fd() { return m_child_stdout_pipe[0]; }
+	int child_stderr_fd() { return m_child_stderr_pipe[0]; }
+	int child_stdin_fd() { return m_child_stdin_pipe[1]; }
+
+	bool running() { return !m_status->exited(); }
+	int exitcode() { return m_status->exitcode(); }
+	int wait() { return m_status->wait(); }
+
+	void detach(double timeout)
 	{
-		update_status(true);
-		return m_exitcode;
+		if (m_detached) {
+			return;
+		}
+		m_detached = true;
+
+		// Close our ends of the pipes, the child receives SIGPIPE or EOF
+		m_child_stdout = nullptr;
+		m_child_stderr = nullptr;
+		m_child_stdin = nullptr;
+		m_child_stdout_filebuf = nullptr;
+		m_child_stderr_filebuf = nullptr;
+		m_child_stdin_filebuf = nullptr;
+
+		// Let the supervisor terminate and reap the child
+		global_supervisor().terminate(m_status, timeout);
 	}
 
-	bool signal(int signal) { return kill(m_pid, signal) == 0; }
+	bool signal(int signal) { return m_status->signal(signal); }
 };
 
 /*
@@ -194,8 +238,8 @@ public:
  */
 
 Process::Process(const std::string &cmd, const std::vector<std::string> &args,
-                 bool do_redirect)
-    : impl(std::make_unique<ProcessImpl>(cmd, args, do_redirect))
+                 bool do_redirect, const ProcessLimits &limits)
+    : impl(std::make_unique<ProcessImpl>(cmd, args, do_redirect, limits))
 {
 }
 
@@ -208,9 +252,13 @@ std::istream &Process::child_stdout() { return impl->child_stdout(); }
 std::istream &Process::child_stderr() { return impl->child_stderr(); }
 std::ostream &Process::child_stdin() { return impl->child_stdin(); }
 void Process::close_child_stdin() { impl->close_child_stdin(); }
+int Process::child_stdout_fd() { return impl->child_stdout_fd(); }
+int Process::child_stderr_fd() { return impl->child_stderr_fd(); }
+int Process::child_stdin_fd() { return impl->child_stdin_fd(); }
 bool Process::running() { return impl->running(); }
 int Process::exitcode() { return impl->exitcode(); }
 int Process::wait() { return impl->wait(); }
+void Process::detach(double timeout) { impl->detach(timeout); }
 bool Process::signal(int signal) { return impl->signal(signal); }
 void Process::generic_writer(Process &proc, std::istream &input)
 {
@@ -246,18 +294,93 @@ int Process::exec(const std::string &cmd, const std::vector<std::string> &args,
 {
 	Process proc(cmd, args);
 
-	std::thread t1(generic_writer, std::ref(proc), std::ref(cin));
-	std::thread t2(generic_pipe, std::ref(proc.child_stdout()), std::ref(cout));
-	std::thread t3(generic_pipe, std::ref(proc.child_stderr()), std::ref(cerr));
-
-	int res = proc.wait();
+	// The input data is written to the child process by the reactor thread
+	const std::string input{std::istreambuf_iterator<char>(cin),
+	                        std::istreambuf_iterator<char>()};
+
+	// State shared with the reactor callbacks
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t input_ptr = 0;
+	bool stdin_done = input.empty();
+	bool stdout_done = false, stderr_done = false;
+
+	// Reads all available data from the given fd into the given stream
+	auto reader = [&](int fd, std::ostream *os, bool *done) {
+		return [&, fd, os, done]() {
+			char buf[4096];
+			while (true) {
+				const ssize_t n = read(fd, buf, sizeof(buf));
+				if (n > 0) {
+					os->write(buf, n);
+					continue;
+				}
+				if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+					return true;
+				}
+				std::lock_guard<std::mutex> lock(mtx);
+				*done = true;
+				cv.notify_all();
+				return false;
+			}
+		};
+	};
+	auto writer = [&]() {
+		const int fd = proc.child_stdin_fd();
+		while (input_ptr < input.size()) {
+			const ssize_t n =
+			    write(fd, &input[input_ptr], input.size() - input_ptr);
+			if (n > 0) {
+				input_ptr += n;
+			}
+			else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+				return true;
+			}
+			else {
+				break;  // The child closed its standard input
+			}
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		stdin_done = true;
+		cv.notify_all();
+		return false;
+	};
+
+	Reactor &reactor = global_reactor();
+	const int h_out = reactor.add(proc.child_stdout_fd(), false,
+	                              reader(proc.child_stdout_fd(), &cout,
+	                                     &stdout_done));
+	const int h_err = reactor.add(proc.child_stderr_fd(), false,
+	                              reader(proc.child_stderr_fd(), &cerr,
+	                                     &stderr_done));
+	int h_in = -1;
+	if (!stdin_done) {
+		h_in = reactor.add(proc.child_stdin_fd(), true, writer);
+	}
+	else {
+		proc.close_child_stdin();
+	}
 
-	// Wait for all threads to complete
-	t1.join();
-	t2.join();
-	t3.join();
+	// Close the child's standard input once all data has been written, then
+	// wait for standard output and error to be closed
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&] { return stdin_done; });
+	}
+	if (h_in >= 0) {
+		reactor.remove(h_in);
+		proc.close_child_stdin();
+	}
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&] { return stdout_done && stderr_done; });
+	}
+	reactor.remove(h_out);
+	reactor.remove(h_err);
+	cout.flush();
+	cerr.flush();
 
-	return res;
+	return proc.wait();
 }
 
 int Process::exec(const std::string &cmd, const std::vector<std::string> &args,
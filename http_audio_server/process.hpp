@@ -35,6 +35,8 @@
 #include <tuple>
 #include <vector>
 
+#include <http_audio_server/supervisor.hpp>
+
 namespace http_audio_server {
 
 /**
@@ -90,12 +92,17 @@ public:
 	 * @param cmd is the command that should be executed.
 	 * @param args is a vector of arguments that should be passed to the
 	 * command.
+	 * @param limits are the resource limits enforced by the supervisor.
+	 * @throws std::runtime_error if the command cannot be launched, e.g.
+	 * because it was not found.
 	 */
 	Process(const std::string &cmd, const std::vector<std::string> &args,
-	        bool do_redirect = true);
+	        bool do_redirect = true,
+	        const ProcessLimits &limits = ProcessLimits());
 
 	/**
-	 * Destroys the process instance. Waits for the child process to exit.
+	 * Destroys the process instance. Waits for the child process to exit,
+	 * unless detach() has been called.
 	 */
 	~Process();
 
@@ -129,6 +136,26 @@ public:
 	 */
 	void close_child_stdin();
 
+	/**
+	 * Returns the file descriptor connected to the standard output of the
+	 * child process. Only use either this file descriptor or the stream
+	 * returned by child_stdout(), not both. The file descriptor is owned by
+	 * the Process instance.
+	 */
+	int child_stdout_fd();
+
+	/**
+	 * Returns the file descriptor connected to the standard error of the
+	 * child process. See child_stdout_fd().
+	 */
+	int child_stderr_fd();
+
+	/**
+	 * Returns the file descriptor connected to the standard input of the
+	 * child process. See child_stdout_fd().
+	 */
+	int child_stdin_fd();
+
 	/**
 	 * Returns true if the child process is still running, false otherwise.
 	 */
@@ -152,6 +179,17 @@ public:
 	 */
 	int wait();
 
+	/**
+	 * Terminates the child process without blocking. Closes all pipes, sends
+	 * SIGTERM and hands the child over to a background thread which sends
+	 * SIGKILL if the child has not exited after the given timeout and reaps
+	 * it. The streams and file descriptors must no longer be used afterwards.
+	 *
+	 * @param timeout is the time in seconds the child is given to exit after
+	 * receiving SIGTERM.
+	 */
+	void detach(double timeout = 1.0);
+
 	/**
 	 * Sends a UNIX signal to the child process, corresponding to the kill
 	 * system call.
@@ -0,0 +1,289 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <http_audio_server/logger.hpp>
+#include <http_audio_server/reactor.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Class ReactorImpl
+ */
+
+class ReactorImpl {
+private:
+	static constexpr int MAX_EVENTS = 64;
+
+	/**
+	 * Handle used for the eventfd which wakes up the reactor thread.
+	 */
+	static constexpr int WAKEUP_HANDLE = 0;
+
+	struct Entry {
+		int fd;
+		uint32_t events;
+		Reactor::Callback cb;
+	};
+
+	int m_epoll_fd;
+	int m_wakeup_fd;
+
+	/**
+	 * Protects the m_entries map.
+	 */
+	std::mutex m_mtx;
+
+	/**
+	 * Held by the reactor thread while a callback is running.
+	 */
+	std::mutex m_dispatch_mtx;
+
+	std::unordered_map<int, Entry> m_entries;
+	int m_next_handle = WAKEUP_HANDLE + 1;
+	std::atomic<bool> m_stop{false};
+	std::thread m_thread;
+
+	/**
+	 * Updates the epoll set and returns zero on success or the errno value
+	 * on failure.
+	 */
+	int try_ctl(int op, int fd, uint32_t events, int handle)
+	{
+		epoll_event ev{};
+		ev.events = events | EPOLLONESHOT;
+		ev.data.u64 = handle;
+		while (epoll_ctl(m_epoll_fd, op, fd, &ev) != 0) {
+			if (errno != EINTR) {
+				return errno;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * Updates the epoll set, throws if this fails. Only used outside of the
+	 * reactor thread.
+	 */
+	void ctl(int op, int fd, uint32_t events, int handle)
+	{
+		if (try_ctl(op, fd, events, handle) != 0) {
+			throw std::runtime_error("Error while updating the epoll set");
+		}
+	}
+
+	/**
+	 * Watches the descriptor of the given entry again. The reactor thread
+	 * must not throw, so if this fails the error is logged and the entry is
+	 * dropped; its callback is not called again. Must be called with m_mtx
+	 * held.
+	 */
+	void rearm_or_drop(int handle, const Entry &entry)
+	{
+		const int err = try_ctl(EPOLL_CTL_MOD, entry.fd, entry.events, handle);
+		if (err != 0) {
+			global_logger().error(
+			    "reactor", "Cannot watch file descriptor " +
+			                   std::to_string(entry.fd) + " again, dropping "
+			                   "it: " + strerror(err));
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, entry.fd, nullptr);
+			m_entries.erase(handle);
+		}
+	}
+
+	void dispatch(int handle)
+	{
+		std::lock_guard<std::mutex> dispatch_lock(m_dispatch_mtx);
+
+		// Fetch the callback, the entry may have been removed in the meantime
+		Reactor::Callback cb;
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			auto it = m_entries.find(handle);
+			if (it == m_entries.end()) {
+				return;
+			}
+			cb = it->second.cb;
+		}
+
+		// Run the callback and watch the descriptor again if requested. The
+		// callback may have removed itself.
+		if (cb()) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			auto it = m_entries.find(handle);
+			if (it != m_entries.end()) {
+				rearm_or_drop(handle, it->second);
+			}
+		}
+	}
+
+	void run()
+	{
+		// Writing to a pipe whose reader has exited must not kill the server,
+		// block SIGPIPE so write() fails with EPIPE instead
+		sigset_t sigset;
+		sigemptyset(&sigset);
+		sigaddset(&sigset, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+		// Poll for m_stop if the wakeup eventfd can no longer be watched
+		int timeout = -1;
+		epoll_event events[MAX_EVENTS];
+		while (!m_stop) {
+			const int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, timeout);
+			if (n < 0) {
+				// Log the error instead of throwing on the reactor thread and
+				// back off so a persistent error does not spin
+				if (errno != EINTR) {
+					global_logger().error(
+					    "reactor", std::string("Error while waiting for "
+					                           "events: ") + strerror(errno));
+					std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				}
+				continue;
+			}
+			for (int i = 0; i < n; i++) {
+				const int handle = events[i].data.u64;
+				if (handle == WAKEUP_HANDLE) {
+					uint64_t value;
+					if (read(m_wakeup_fd, &value, sizeof(value)) < 0) {
+						// Nothing to do, the eventfd is non-blocking
+					}
+					const int err = try_ctl(EPOLL_CTL_MOD, m_wakeup_fd, EPOLLIN,
+					                        WAKEUP_HANDLE);
+					if (err != 0) {
+						global_logger().error(
+						    "reactor", std::string("Cannot watch the wakeup "
+						                           "eventfd again: ") +
+						                   strerror(err));
+						timeout = 100;
+					}
+					continue;
+				}
+				dispatch(handle);
+			}
+		}
+	}
+
+public:
+	ReactorImpl()
+	    : m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+	      m_wakeup_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+	{
+		if (m_epoll_fd < 0 || m_wakeup_fd < 0) {
+			throw std::runtime_error("Cannot create the reactor");
+		}
+		ctl(EPOLL_CTL_ADD, m_wakeup_fd, EPOLLIN, WAKEUP_HANDLE);
+		m_thread = std::thread(&ReactorImpl::run, this);
+	}
+
+	~ReactorImpl()
+	{
+		m_stop = true;
+		const uint64_t value = 1;
+		if (write(m_wakeup_fd, &value, sizeof(value)) < 0) {
+			// Cannot happen, the eventfd counter cannot overflow here
+		}
+		m_thread.join();
+		close(m_wakeup_fd);
+		close(m_epoll_fd);
+	}
+
+	int add(int fd, bool write, Reactor::Callback cb)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		const int handle = m_next_handle++;
+		const uint32_t events = write ? EPOLLOUT : EPOLLIN;
+		m_entries.emplace(handle, Entry{fd, events, std::move(cb)});
+		ctl(EPOLL_CTL_ADD, fd, events, handle);
+		return handle;
+	}
+
+	void rearm(int handle)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto it = m_entries.find(handle);
+		if (it != m_entries.end()) {
+			ctl(EPOLL_CTL_MOD, it->second.fd, it->second.events, handle);
+		}
+	}
+
+	void remove(int handle)
+	{
+		// Wait for a running callback to finish, unless we are called from
+		// within a callback
+		std::unique_lock<std::mutex> dispatch_lock(m_dispatch_mtx,
+		                                           std::defer_lock);
+		if (std::this_thread::get_id() != m_thread.get_id()) {
+			dispatch_lock.lock();
+		}
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto it = m_entries.find(handle);
+		if (it != m_entries.end()) {
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+			m_entries.erase(it);
+		}
+	}
+};
+
+/*
+ * Class Reactor
+ */
+
+Reactor::Reactor() : m_impl(std::make_unique<ReactorImpl>()) {}
+Reactor::~Reactor()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+int Reactor::add(int fd, bool write, Callback cb)
+{
+	return m_impl->add(fd, write, std::move(cb));
+}
+
+void Reactor::rearm(int handle) { m_impl->rearm(handle); }
+void Reactor::remove(int handle) { m_impl->remove(handle); }
+
+/*
+ * Functions
+ */
+
+Reactor &global_reactor()
+{
+	static Reactor reactor;
+	return reactor;
+}
+}
@@ -0,0 +1,100 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file reactor.hpp
+ *
+ * Contains the Reactor class, which multiplexes I/O on the pipes connected to
+ * child processes onto a single background thread using epoll.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_REACTOR_HPP
+#define HTTP_AUDIO_SERVER_REACTOR_HPP
+
+#include <functional>
+#include <memory>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class ReactorImpl;
+
+/**
+ * The Reactor class runs a single thread waiting for file descriptors to
+ * become readable or writable and calls the corresponding callbacks. File
+ * descriptors are watched in one-shot mode: after each callback the
+ * descriptor is only watched again if the callback returns true, or once
+ * rearm() is called. This allows consumers to apply backpressure.
+ */
+class Reactor {
+private:
+	std::unique_ptr<ReactorImpl> m_impl;
+
+public:
+	/**
+	 * Callback called on the reactor thread whenever the watched file
+	 * descriptor is ready (or has been closed by the other side). The callback
+	 * should perform non-blocking I/O until it would block and return true if
+	 * the file descriptor should be watched again.
+	 */
+	using Callback = std::function<bool()>;
+
+	Reactor();
+
+	/**
+	 * Stops the reactor thread.
+	 */
+	~Reactor();
+
+	/**
+	 * Starts watching the given file descriptor and returns a handle which
+	 * can be passed to rearm() and remove(). The file descriptor is switched
+	 * to non-blocking mode.
+	 *
+	 * @param fd is the file descriptor that should be watched.
+	 * @param write if true, waits for the file descriptor to become writable,
+	 * otherwise waits for it to become readable.
+	 * @param cb is the callback that should be called.
+	 */
+	int add(int fd, bool write, Callback cb);
+
+	/**
+	 * Watches the file descriptor belonging to the given handle again after
+	 * the callback returned false.
+	 */
+	void rearm(int handle);
+
+	/**
+	 * Stops watching the file descriptor belonging to the given handle. Once
+	 * this function returns the callback is guaranteed to no longer run. The
+	 * file descriptor is not closed.
+	 */
+	void remove(int handle);
+};
+
+/**
+ * Returns the reactor instance used for the communication with child
+ * processes.
+ */
+Reactor &global_reactor();
+}
+
+#endif /* HTTP_AUDIO_SERVER_REACTOR_HPP */
@@ -0,0 +1,426 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include <http_audio_server/pcm.hpp>
+#include <http_audio_server/resampler.hpp>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HTTP_AUDIO_SERVER_RESAMPLER_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define HTTP_AUDIO_SERVER_RESAMPLER_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HTTP_AUDIO_SERVER_RESAMPLER_NEON
+#include <arm_neon.h>
+#endif
+
+namespace http_audio_server {
+
+namespace {
+/*
+ * Filter design
+ */
+
+/**
+ * Number of filter taps on either side of the interpolated sample.
+ */
+constexpr size_t HALF_TAPS = 32;
+constexpr size_t N_TAPS = 2 * HALF_TAPS;
+
+/**
+ * Maximum number of precomputed filter phases. Ratios with a larger
+ * numerator use the nearest precomputed phase.
+ */
+constexpr uint32_t MAX_PHASES = 1024;
+
+/**
+ * Shape parameter of the Kaiser window, corresponds to a stopband attenuation
+ * of about 90 dB.
+ */
+constexpr double KAISER_BETA = 9.0;
+
+/**
+ * Filter cutoff relative to the lower of the two Nyquist frequencies.
+ */
+constexpr double ROLLOFF = 0.945;
+
+struct FilterTable {
+	uint32_t n_phases;
+	std::vector<float> coeffs;
+
+	const float *phase(size_t idx) const { return &coeffs[idx * N_TAPS]; }
+};
+
+double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 64 && term > 1e-12 * sum; k++) {
+		term *= (x * x) / (4.0 * k * k);
+		sum += term;
+	}
+	return sum;
+}
+
+std::shared_ptr<const FilterTable> make_filter_table(uint32_t L, uint32_t M)
+{
+	auto res = std::make_shared<FilterTable>();
+	res->n_phases = std::min(L, MAX_PHASES);
+	res->coeffs.resize(res->n_phases * N_TAPS);
+
+	// Cutoff frequency in cycles per input sample
+	const double cutoff = 0.5 * ROLLOFF * std::min(1.0, double(L) / double(M));
+	const double i0_beta = bessel_i0(KAISER_BETA);
+	for (size_t p = 0; p < res->n_phases; p++) {
+		// Tap j is multiplied with the input sample at offset j - HALF_TAPS + 1
+		// relative to the integer part of the output position
+		float *h = &res->coeffs[p * N_TAPS];
+		const double frac = double(p) / double(res->n_phases);
+		double sum = 0.0;
+		for (size_t j = 0; j < N_TAPS; j++) {
+			const double tau = double(j) - double(HALF_TAPS - 1) - frac;
+			const double x = 2.0 * cutoff * tau;
+			const double sinc =
+			    (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+			const double r = tau / double(HALF_TAPS);
+			const double window =
+			    (std::abs(r) >= 1.0)
+			        ? 0.0
+			        : bessel_i0(KAISER_BETA * std::sqrt(1.0 - r * r)) / i0_beta;
+			h[j] = 2.0 * cutoff * sinc * window;
+			sum += h[j];
+		}
+
+		// Normalise each phase to unity gain at DC
+		for (size_t j = 0; j < N_TAPS; j++) {
+			h[j] = h[j] / sum;
+		}
+	}
+	return res;
+}
+
+/**
+ * Returns the filter table for the given ratio, filter tables are computed
+ * once and shared between all resamplers.
+ */
+std::shared_ptr<const FilterTable> filter_table(uint32_t L, uint32_t M)
+{
+	static std::mutex mtx;
+	static std::map<std::pair<uint32_t, uint32_t>,
+	                std::shared_ptr<const FilterTable>>
+	    cache;
+	std::lock_guard<std::mutex> lock(mtx);
+	auto &res = cache[std::make_pair(L, M)];
+	if (!res) {
+		res = make_filter_table(L, M);
+	}
+	return res;
+}
+
+/*
+ * Dot product kernels
+ */
+
+using DotKernel = float (*)(const float *x, const float *h);
+
+#if !defined(HTTP_AUDIO_SERVER_RESAMPLER_SSE2) && \
+    !defined(HTTP_AUDIO_SERVER_RESAMPLER_NEON)
+float dot_scalar(const float *x, const float *h)
+{
+	float sum = 0.0f;
+	for (size_t j = 0; j < N_TAPS; j++) {
+		sum += x[j] * h[j];
+	}
+	return sum;
+}
+#endif
+
+#ifdef HTTP_AUDIO_SERVER_RESAMPLER_SSE2
+float dot_sse2(const float *x, const float *h)
+{
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	for (size_t j = 0; j < N_TAPS; j += 8) {
+		acc0 = _mm_add_ps(
+		    acc0, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(h + j)));
+		acc1 = _mm_add_ps(
+		    acc1, _mm_mul_ps(_mm_loadu_ps(x + j + 4), _mm_loadu_ps(h + j + 4)));
+	}
+	const __m128 acc = _mm_add_ps(acc0, acc1);
+	const __m128 shuf = _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(2, 3, 0, 1));
+	const __m128 sums = _mm_add_ps(acc, shuf);
+	return _mm_cvtss_f32(_mm_add_ss(sums, _mm_movehl_ps(shuf, sums)));
+}
+#endif
+
+#ifdef HTTP_AUDIO_SERVER_RESAMPLER_AVX2
+__attribute__((target("avx2,fma"))) float dot_avx2(const float *x,
+                                                   const float *h)
+{
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	for (size_t j = 0; j < N_TAPS; j += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(h + j),
+		                       acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j + 8),
+		                       _mm256_loadu_ps(h + j + 8), acc1);
+	}
+	const __m256 acc = _mm256_add_ps(acc0, acc1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+	                        _mm256_extractf128_ps(acc, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+#endif
+
+#ifdef HTTP_AUDIO_SERVER_RESAMPLER_NEON
+float dot_neon(const float *x, const float *h)
+{
+	float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+	for (size_t j = 0; j < N_TAPS; j += 8) {
+		acc0 = vmlaq_f32(acc0, vld1q_f32(x + j), vld1q_f32(h + j));
+		acc1 = vmlaq_f32(acc1, vld1q_f32(x + j + 4), vld1q_f32(h + j + 4));
+	}
+	return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+#endif
+
+DotKernel select_dot_kernel()
+{
+#ifdef HTTP_AUDIO_SERVER_RESAMPLER_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return dot_avx2;
+	}
+#endif
+#if defined(HTTP_AUDIO_SERVER_RESAMPLER_SSE2)
+	return dot_sse2;
+#elif defined(HTTP_AUDIO_SERVER_RESAMPLER_NEON)
+	return dot_neon;
+#else
+	return dot_scalar;
+#endif
+}
+
+DotKernel dot_kernel()
+{
+	static const DotKernel res = select_dot_kernel();
+	return res;
+}
+
+uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b != 0) {
+		const uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+}
+
+/*
+ * Class ResamplerImpl
+ */
+
+class ResamplerImpl {
+private:
+	int m_src_rate;
+	int m_tar_rate;
+	int m_n_channels;
+
+	/**
+	 * Reduced ratio between the target and the source rate.
+	 */
+	uint32_t m_L, m_M;
+
+	std::shared_ptr<const FilterTable> m_table;
+	DotKernel m_dot;
+
+	/**
+	 * Buffered input samples for each channel.
+	 */
+	std::vector<std::vector<float>> m_buf;
+
+	/**
+	 * Planar output samples for each channel.
+	 */
+	std::vector<std::vector<float>> m_out;
+
+	/**
+	 * Index of the input sample in m_buf preceding the next output sample
+	 * and the fractional position of the output sample in units of 1/L.
+	 */
+	size_t m_idx;
+	uint32_t m_phase;
+
+	uint64_t m_n_in;
+	uint64_t m_n_out;
+
+	bool passthrough() const { return m_L == m_M; }
+
+	void append(const float *src, size_t n_frames)
+	{
+		std::vector<float *> ptrs(m_n_channels);
+		const size_t old_size = m_buf[0].size();
+		for (int c = 0; c < m_n_channels; c++) {
+			m_buf[c].resize(old_size + n_frames);
+			ptrs[c] = &m_buf[c][old_size];
+		}
+		deinterleave(src, ptrs.data(), m_n_channels, n_frames);
+	}
+
+	/**
+	 * Computes all output samples for which enough input is available, but
+	 * at most until the output sample with index max_out.
+	 */
+	size_t run(std::vector<float> &tar, uint64_t max_out)
+	{
+		const size_t size = m_buf[0].size();
+		size_t n = 0;
+		while (m_idx + HALF_TAPS < size && m_n_out < max_out) {
+			const size_t p = uint64_t(m_phase) * m_table->n_phases / m_L;
+			const float *h = m_table->phase(p);
+			for (int c = 0; c < m_n_channels; c++) {
+				m_out[c].push_back(m_dot(&m_buf[c][m_idx + 1 - HALF_TAPS], h));
+			}
+			m_phase += m_M;
+			m_idx += m_phase / m_L;
+			m_phase %= m_L;
+			m_n_out++;
+			n++;
+		}
+
+		// Interleave the output
+		std::vector<const float *> ptrs(m_n_channels);
+		for (int c = 0; c < m_n_channels; c++) {
+			ptrs[c] = m_out[c].data();
+		}
+		const size_t old_size = tar.size();
+		tar.resize(old_size + n * m_n_channels);
+		interleave(ptrs.data(), &tar[old_size], m_n_channels, n);
+
+		// Discard input samples which are no longer needed
+		const size_t n_drop = std::min(m_idx + 1 - HALF_TAPS, size);
+		for (int c = 0; c < m_n_channels; c++) {
+			m_buf[c].erase(m_buf[c].begin(), m_buf[c].begin() + n_drop);
+			m_out[c].clear();
+		}
+		m_idx -= n_drop;
+		return n;
+	}
+
+public:
+	ResamplerImpl(int src_rate, int tar_rate, int n_channels)
+	    : m_src_rate(src_rate),
+	      m_tar_rate(tar_rate),
+	      m_n_channels(n_channels),
+	      m_dot(dot_kernel())
+	{
+		if (src_rate <= 0 || tar_rate <= 0 || n_channels <= 0) {
+			throw std::invalid_argument(
+			    "Sample rates and channel count must be positive!");
+		}
+		const uint32_t d = gcd(tar_rate, src_rate);
+		m_L = tar_rate / d;
+		m_M = src_rate / d;
+		if (!passthrough()) {
+			m_table = filter_table(m_L, m_M);
+		}
+		m_buf.resize(n_channels);
+		m_out.resize(n_channels);
+		reset();
+	}
+
+	size_t process(const float *src, size_t n_frames, std::vector<float> &tar)
+	{
+		m_n_in += n_frames;
+		if (passthrough()) {
+			tar.insert(tar.end(), src, src + n_frames * m_n_channels);
+			return n_frames;
+		}
+		append(src, n_frames);
+		return run(tar, std::numeric_limits<uint64_t>::max());
+	}
+
+	size_t flush(std::vector<float> &tar)
+	{
+		size_t res = 0;
+		if (!passthrough()) {
+			// Pad the input with silence and compute the remaining samples
+			const uint64_t n_total = (m_n_in * m_L + m_M - 1) / m_M;
+			const std::vector<float> zeros(HALF_TAPS * m_n_channels, 0.0f);
+			append(zeros.data(), HALF_TAPS);
+			res = run(tar, n_total);
+		}
+		reset();
+		return res;
+	}
+
+	void reset()
+	{
+		// Start with HALF_TAPS - 1 samples of silence preceding the input
+		for (auto &buf : m_buf) {
+			buf.assign(HALF_TAPS - 1, 0.0f);
+		}
+		m_idx = HALF_TAPS - 1;
+		m_phase = 0;
+		m_n_in = 0;
+		m_n_out = 0;
+	}
+
+	size_t latency() const { return passthrough() ? 0 : HALF_TAPS; }
+	int src_rate() const { return m_src_rate; }
+	int tar_rate() const { return m_tar_rate; }
+	int n_channels() const { return m_n_channels; }
+};
+
+/*
+ * Class Resampler
+ */
+
+Resampler::Resampler(int src_rate, int tar_rate, int n_channels)
+    : m_impl(std::make_unique<ResamplerImpl>(src_rate, tar_rate, n_channels))
+{
+}
+
+Resampler::~Resampler()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+size_t Resampler::process(const float *src, size_t n_frames,
+                          std::vector<float> &tar)
+{
+	return m_impl->process(src, n_frames, tar);
+}
+
+size_t Resampler::flush(std::vector<float> &tar) { return m_impl->flush(tar); }
+void Resampler::reset() { m_impl->reset(); }
+size_t Resampler::latency() const { return m_impl->latency(); }
+int Resampler::src_rate() const { return m_impl->src_rate(); }
+int Resampler::tar_rate() const { return m_impl->tar_rate(); }
+int Resampler::n_channels() const { return m_impl->n_channels(); }
+}
@@ -0,0 +1,100 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file resampler.hpp
+ *
+ * Sample rate conversion using a polyphase windowed-sinc filter.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_RESAMPLER_HPP
+#define HTTP_AUDIO_SERVER_RESAMPLER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class ResamplerImpl;
+
+/**
+ * Streaming sample rate converter. The ratio between the source and the
+ * target rate is reduced to a fraction L/M; for each of the L output phases a
+ * Kaiser-windowed sinc filter is precomputed. Filter tables are cached and
+ * shared between all resamplers with the same ratio. The filter state is
+ * carried across calls to process(), so audio can be converted in arbitrary
+ * chunks.
+ */
+class Resampler {
+private:
+	std::unique_ptr<ResamplerImpl> m_impl;
+
+public:
+	/**
+	 * Creates a new resampler.
+	 *
+	 * @param src_rate is the sample rate of the input in Hz.
+	 * @param tar_rate is the sample rate of the output in Hz.
+	 * @param n_channels is the number of interleaved channels.
+	 * @throws std::invalid_argument if a rate or the channel count is not
+	 * positive.
+	 */
+	Resampler(int src_rate, int tar_rate, int n_channels);
+	~Resampler();
+
+	/**
+	 * Converts the given interleaved frames and appends the result to tar.
+	 * Since the filter needs to look ahead, the output lags behind the input
+	 * by latency() input frames until flush() is called.
+	 *
+	 * @return the number of frames appended to tar.
+	 */
+	size_t process(const float *src, size_t n_frames, std::vector<float> &tar);
+
+	/**
+	 * Appends the remaining output frames to tar. The total number of frames
+	 * produced is ceil(n_input_frames * tar_rate / src_rate). Afterwards the
+	 * resampler is ready to process a new stream.
+	 *
+	 * @return the number of frames appended to tar.
+	 */
+	size_t flush(std::vector<float> &tar);
+
+	/**
+	 * Discards the filter state without producing any output.
+	 */
+	void reset();
+
+	/**
+	 * Returns the number of input frames the output lags behind.
+	 */
+	size_t latency() const;
+
+	int src_rate() const;
+	int tar_rate() const;
+	int n_channels() const;
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_RESAMPLER_HPP */
@@ -0,0 +1,98 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <http_audio_server/segment_ring.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Class SegmentRing
+ */
+
+SegmentRing::SegmentRing(size_t capacity) : m_capacity(capacity) {}
+
+void SegmentRing::write(const std::string &data,
+                        const std::vector<uint64_t> &cluster_starts)
+{
+	// Split the data at the cluster boundaries. Everything in front of the
+	// first cluster is the stream header.
+	m_pending.append(data);
+	for (uint64_t pos : cluster_starts) {
+		const size_t split = pos - m_pending_offs;
+		Data head = std::make_shared<const std::string>(m_pending, 0, split);
+		m_pending.erase(0, split);
+		m_pending_offs = pos;
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (!m_header) {
+			m_header = std::move(head);
+			continue;
+		}
+		m_segments.push_back(Segment{m_next_seq++, std::move(head),
+		                             std::move(m_pending_metadata), m_current});
+		m_pending_metadata.clear();
+		if (!m_segments.back().metadata.empty()) {
+			m_current = m_segments.back().metadata.back();
+		}
+		if (m_segments.size() > m_capacity) {
+			m_segments.pop_front();
+		}
+	}
+}
+
+void SegmentRing::annotate(const json &metadata)
+{
+	m_pending_metadata.emplace_back(metadata);
+}
+
+bool SegmentRing::read(uint64_t &cursor, std::vector<Data> &data,
+                       std::vector<json> &metadata) const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (!m_header || m_segments.empty()) {
+		return false;
+	}
+
+	if (cursor == 0) {
+		const Segment &latest = m_segments.back();
+		data.emplace_back(m_header);
+		if (!latest.current.is_null()) {
+			metadata.emplace_back(latest.current);
+		}
+		cursor = latest.seq;
+	}
+	cursor = std::max(cursor, m_segments.front().seq);
+	for (const Segment &segment : m_segments) {
+		if (segment.seq >= cursor) {
+			data.emplace_back(segment.data);
+			metadata.insert(metadata.end(), segment.metadata.begin(),
+			                segment.metadata.end());
+			cursor = segment.seq + 1;
+		}
+	}
+	return true;
+}
+
+uint64_t SegmentRing::n_segments() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_next_seq - 1;
+}
+}
@@ -0,0 +1,120 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file segment_ring.hpp
+ *
+ * Contains the SegmentRing class, which splits the output of a single WebM
+ * encoder into clusters and shares them between any number of listeners.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_SEGMENT_RING_HPP
+#define HTTP_AUDIO_SERVER_SEGMENT_RING_HPP
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/json.hpp>
+
+namespace http_audio_server {
+
+/**
+ * The SegmentRing class keeps the WebM stream header and the most recent
+ * clusters written by an encoder. Segments are reference counted and
+ * immutable, so listeners only hold the lock while collecting the references
+ * and write the data to their sockets afterwards. Listeners are represented
+ * by a cursor, the sequence number of the next segment they expect.
+ *
+ * The write side must only be used by a single thread.
+ */
+class SegmentRing {
+public:
+	using Data = std::shared_ptr<const std::string>;
+
+private:
+	struct Segment {
+		uint64_t seq;
+		Data data;
+		std::vector<json> metadata;
+
+		/**
+		 * Most recent metadata entry before this segment, sent to listeners
+		 * joining at this segment.
+		 */
+		json current;
+	};
+
+	size_t m_capacity;
+
+	std::string m_pending;
+	uint64_t m_pending_offs = 0;
+	std::vector<json> m_pending_metadata;
+	json m_current;
+
+	mutable std::mutex m_mtx;
+	Data m_header;
+	std::deque<Segment> m_segments;
+	uint64_t m_next_seq = 1;
+
+public:
+	/**
+	 * @param capacity is the number of clusters kept for listeners which
+	 * fall behind.
+	 */
+	explicit SegmentRing(size_t capacity = 16);
+
+	/**
+	 * Appends encoder output to the ring.
+	 *
+	 * @param data is the data written by the encoder.
+	 * @param cluster_starts are the offsets in the encoder output at which
+	 * new clusters start, as returned by Encoder::cluster_starts(). The data
+	 * in front of the first cluster is the stream header.
+	 */
+	void write(const std::string &data,
+	           const std::vector<uint64_t> &cluster_starts);
+
+	/**
+	 * Attaches a metadata entry to the segment currently being written.
+	 */
+	void annotate(const json &metadata);
+
+	/**
+	 * Collects the segments following the given cursor and advances the
+	 * cursor. A cursor of zero denotes a new listener, which receives the
+	 * stream header, the metadata of the current track and the most recent
+	 * segment. Listeners which fell behind skip the segments that are no
+	 * longer available. Returns false if no complete segment exists yet.
+	 */
+	bool read(uint64_t &cursor, std::vector<Data> &data,
+	          std::vector<json> &metadata) const;
+
+	/**
+	 * Returns the number of segments written so far.
+	 */
+	uint64_t n_segments() const;
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_SEGMENT_RING_HPP */
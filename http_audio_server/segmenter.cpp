@@ -0,0 +1,294 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <http_audio_server/decoder_pool.hpp>
+#include <http_audio_server/encoder.hpp>
+#include <http_audio_server/metadata.hpp>
+#include <http_audio_server/metrics.hpp>
+#include <http_audio_server/segmenter.hpp>
+#include <http_audio_server/thread_pool.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct SegmenterMetrics {
+	Histogram &segment = global_metrics().histogram(
+	    "http_audio_server_segmenter_segment_seconds",
+	    "Time spent decoding and encoding a single media segment");
+	Counter &segments = global_metrics().counter(
+	    "http_audio_server_segmenter_segments_total",
+	    "Number of media segments produced");
+};
+
+SegmenterMetrics &segmenter_metrics()
+{
+	static SegmenterMetrics metrics;
+	return metrics;
+}
+
+/**
+ * Maximum time to wait for the decoder pool to launch a decoder.
+ */
+constexpr double SPAWN_TIMEOUT = 10.0;
+
+/**
+ * Number of Opus frames encoded in front of each segment to bring the
+ * encoder into the same state as in a continuous encode. 80 ms is the
+ * convergence time recommended for Opus.
+ */
+constexpr size_t PREROLL_FRAMES = 2;
+}
+
+/*
+ * Class Segmenter
+ */
+
+constexpr size_t Segmenter::BITRATES[];
+constexpr size_t Segmenter::MIN_BITRATE;
+constexpr size_t Segmenter::MAX_BITRATE;
+
+Segmenter::Segmenter(DecoderPool &pool, double duration, size_t rate,
+                     size_t n_channels)
+    : Segmenter(
+          [this, &pool](const std::string &filename, uint64_t start,
+                        uint64_t n_samples, std::vector<uint8_t> &buf) {
+	          AudioFormat fmt;
+	          fmt.n_channels = m_n_channels;
+	          fmt.rate = m_rate;
+	          auto job = pool.submit(filename, double(start) / m_rate, fmt);
+	          if (!job->wait(SPAWN_TIMEOUT)) {
+		          throw std::runtime_error(
+		              "Timeout while launching the decoder");
+	          }
+	          job->decoder()->read(n_samples * m_n_channels * sizeof(float),
+	                               buf);
+	      },
+          duration, rate, n_channels)
+{
+}
+
+Segmenter::Segmenter(Source source, double duration, size_t rate,
+                     size_t n_channels)
+    : m_source(std::move(source)),
+      m_duration(duration),
+      m_rate(rate),
+      m_n_channels(n_channels)
+{
+}
+
+uint64_t Segmenter::segment_samples() const
+{
+	// The encoder uses 40 ms frames, segments must not split a frame
+	const uint64_t frame_size = m_rate / 25;
+	return std::max<uint64_t>(1, std::round(m_duration * m_rate / frame_size)) *
+	       frame_size;
+}
+
+size_t Segmenter::n_segments(const std::string &filename) const
+{
+	const Metadata meta = metadata_from_file(filename);
+	if (meta.duration <= 0.0) {
+		return 0;
+	}
+	return std::ceil(meta.duration * m_rate / segment_samples());
+}
+
+bool Segmenter::write_manifest(const std::string &filename,
+                               std::ostream &os) const
+{
+	const std::string version = file_version(filename);
+	const Metadata meta = metadata_from_file(filename);
+	if (version.empty() || meta.duration <= 0.0) {
+		return false;
+	}
+
+	char duration[32];
+	snprintf(duration, sizeof(duration), "PT%.3fS", meta.duration);
+	os << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	   << "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" type=\"static\" "
+	      "profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+	      "minBufferTime=\"PT"
+	   << m_duration << "S\" mediaPresentationDuration=\"" << duration
+	   << "\">\n"
+	   << "  <Period id=\"0\" start=\"PT0S\">\n"
+	   << "    <AdaptationSet mimeType=\"audio/webm\" codecs=\"opus\" "
+	      "audioSamplingRate=\""
+	   << m_rate << "\" segmentAlignment=\"true\">\n"
+	   << "      <AudioChannelConfiguration schemeIdUri=\"urn:mpeg:dash:"
+	      "23003:3:audio_channel_configuration:2011\" value=\""
+	   << m_n_channels << "\"/>\n"
+	   << "      <SegmentTemplate timescale=\"" << m_rate
+	   << "\" duration=\"" << segment_samples()
+	   << "\" startNumber=\"0\" initialization=\"init.webm\" "
+	      "media=\""
+	   << version << "/$Bandwidth$/$Number$.webm\"/>\n";
+	for (size_t bitrate : BITRATES) {
+		os << "      <Representation id=\"" << bitrate << "\" bandwidth=\""
+		   << bitrate << "\"/>\n";
+	}
+	os << "    </AdaptationSet>\n"
+	   << "  </Period>\n"
+	   << "</MPD>\n";
+	return true;
+}
+
+void Segmenter::write_init(std::ostream &os)
+{
+	// The header only depends on the sample rate and the number of channels.
+	// Encode a single frame of silence and keep the data in front of the
+	// first cluster.
+	std::call_once(m_init_flag, [this] {
+		const size_t n_samples = m_rate / 25;
+		std::vector<float> silence(n_samples * m_n_channels);
+		std::ostringstream ss;
+		Encoder encoder(m_rate, m_n_channels);
+		encoder.feed(&silence[0], n_samples, MIN_BITRATE, ss);
+		const std::vector<uint64_t> starts = encoder.cluster_starts();
+		if (starts.empty()) {
+			throw std::runtime_error("Encoder did not start a cluster");
+		}
+		m_init = ss.str().substr(0, starts[0]);
+	});
+	os.write(m_init.data(), m_init.size());
+}
+
+bool Segmenter::encode_segment(const std::string &filename, size_t idx,
+                               size_t bitrate,
+                               std::vector<std::string> &packets) const
+{
+	ScopedTimer timer(segmenter_metrics().segment);
+
+	// Decode the segment together with the pre-roll preceding it and one
+	// frame following it to detect the end of the track. The first segment
+	// starts with a cold encoder, just like a continuous encode.
+	const size_t frame_size = m_rate / 25;
+	const uint64_t n_samples = segment_samples();
+	const uint64_t start = idx * n_samples;
+	const uint64_t n_preroll =
+	    std::min<uint64_t>(start, PREROLL_FRAMES * frame_size);
+	std::vector<uint8_t> buf;
+	m_source(filename, start - n_preroll, n_preroll + n_samples + frame_size,
+	         buf);
+	const size_t n_samples_read = buf.size() / (m_n_channels * sizeof(float));
+	if (n_samples_read <= n_preroll) {
+		return false;
+	}
+
+	// Pad the last segment of the track to a full frame and append a frame
+	// of silence, the encoder only outputs the end of the track once its
+	// lookahead has been filled. Other segments end at the segment boundary.
+	size_t n_samples_padded = n_preroll + n_samples;
+	if (n_samples_read <= n_samples_padded) {
+		n_samples_padded =
+		    (n_samples_read + frame_size - 1) / frame_size * frame_size +
+		    frame_size;
+	}
+	buf.resize(n_samples_padded * m_n_channels * sizeof(float), 0);
+
+	// The packets only depend on the decoded samples, the bitrate and the
+	// segment index
+	Encoder encoder(m_rate, m_n_channels);
+	encoder.set_preroll(n_preroll);
+	encoder.encode_packets((float *)&buf[0], n_samples_padded, bitrate,
+	                       packets);
+	segmenter_metrics().segments.inc();
+	return true;
+}
+
+bool Segmenter::write_segment(const std::string &filename, size_t idx,
+                              size_t bitrate, std::ostream &os) const
+{
+	if (bitrate < MIN_BITRATE || bitrate > MAX_BITRATE) {
+		throw std::invalid_argument("Bitrate out of range");
+	}
+
+	std::vector<std::string> packets;
+	if (!encode_segment(filename, idx, bitrate, packets)) {
+		return false;
+	}
+
+	// The segment is a single cluster whose timestamps match the position in
+	// the track
+	std::ostringstream ss;
+	Encoder encoder(m_rate, m_n_channels);
+	encoder.set_position(idx * segment_samples());
+	encoder.mux_packets(packets, ss);
+	const std::vector<uint64_t> starts = encoder.cluster_starts();
+	if (starts.empty()) {
+		throw std::runtime_error("Encoder did not start a cluster");
+	}
+	const std::string data = ss.str();
+	os.write(data.data() + starts[0], data.size() - starts[0]);
+	return true;
+}
+
+bool Segmenter::write_track(const std::string &filename, size_t bitrate,
+                            std::ostream &os) const
+{
+	Encoder encoder(m_rate, m_n_channels);
+	return encode_track(filename, bitrate,
+	                    [&](const std::vector<std::string> &packets) {
+		                    encoder.mux_packets(packets, os);
+		                });
+}
+
+bool Segmenter::encode_track(const std::string &filename, size_t bitrate,
+                             const PacketSink &sink) const
+{
+	if (bitrate < MIN_BITRATE || bitrate > MAX_BITRATE) {
+		throw std::invalid_argument("Bitrate out of range");
+	}
+	const size_t n = n_segments(filename);
+	if (n == 0) {
+		return false;
+	}
+
+	// Encode the segments on the thread pool and pass them to the sink in
+	// order. Keep a bounded number of segments in flight to limit the memory
+	// usage.
+	ThreadPool &pool = global_thread_pool();
+	const size_t window = 2 * pool.size();
+	std::deque<std::future<std::vector<std::string>>> pending;
+	size_t next = 0;
+	while (next < n || !pending.empty()) {
+		for (; next < n && pending.size() < window; next++) {
+			pending.emplace_back(pool.submit([this, filename, next, bitrate] {
+				std::vector<std::string> packets;
+				encode_segment(filename, next, bitrate, packets);
+				return packets;
+			}));
+		}
+		sink(pending.front().get());
+		pending.pop_front();
+	}
+	return true;
+}
+}
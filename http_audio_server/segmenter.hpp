@@ -0,0 +1,175 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file segmenter.hpp
+ *
+ * Contains the Segmenter class, which cuts tracks into fixed-duration WebM
+ * media segments for DASH clients. Segments are addressed by the track, the
+ * bitrate and the segment index only, so they can be stored by any HTTP
+ * cache.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_SEGMENTER_HPP
+#define HTTP_AUDIO_SERVER_SEGMENTER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class DecoderPool;
+
+/**
+ * The Segmenter class produces the DASH manifest, the initialisation segment
+ * and the media segments of a track. It keeps no per-track state: each
+ * segment is decoded starting at its own offset and encoded by a fresh
+ * encoder into a single WebM cluster.
+ */
+class Segmenter {
+public:
+	/**
+	 * Callback reading up to n_samples interleaved float samples starting at
+	 * sample start of the given track into buf. Returns fewer samples at the
+	 * end of the track.
+	 */
+	using Source = std::function<void(const std::string &filename,
+	                                  uint64_t start, uint64_t n_samples,
+	                                  std::vector<uint8_t> &buf)>;
+
+private:
+	Source m_source;
+	double m_duration;
+	size_t m_rate;
+	size_t m_n_channels;
+
+	std::once_flag m_init_flag;
+	std::string m_init;
+
+	/**
+	 * Returns the number of samples per segment, a multiple of the Opus
+	 * frame size.
+	 */
+	uint64_t segment_samples() const;
+
+	/**
+	 * Decodes the segment with the given index and encodes it into Opus
+	 * packets. Returns false if the index is out of range.
+	 */
+	bool encode_segment(const std::string &filename, size_t idx,
+	                    size_t bitrate,
+	                    std::vector<std::string> &packets) const;
+
+public:
+	/**
+	 * Callback receiving the Opus packets of one segment.
+	 */
+	using PacketSink = std::function<void(const std::vector<std::string> &)>;
+
+	/**
+	 * Bitrates advertised in the manifest.
+	 */
+	static constexpr size_t BITRATES[] = {32000, 64000, 96000, 128000,
+	                                      196000};
+
+	/**
+	 * Minimum and maximum bitrate accepted for media segments.
+	 */
+	static constexpr size_t MIN_BITRATE = 6000;
+	static constexpr size_t MAX_BITRATE = 510000;
+
+	/**
+	 * Creates a new segmenter.
+	 *
+	 * @param pool is the decoder pool used to launch the decoders.
+	 * @param duration is the nominal segment duration in seconds.
+	 */
+	Segmenter(DecoderPool &pool, double duration = 4.0, size_t rate = 48000,
+	          size_t n_channels = 2);
+
+	/**
+	 * Creates a new segmenter reading the samples from the given source
+	 * instead of launching decoders.
+	 */
+	Segmenter(Source source, double duration = 4.0, size_t rate = 48000,
+	          size_t n_channels = 2);
+
+	/**
+	 * Returns the sample rate of the encoded streams.
+	 */
+	size_t rate() const { return m_rate; }
+
+	/**
+	 * Returns the number of channels of the encoded streams.
+	 */
+	size_t n_channels() const { return m_n_channels; }
+
+	/**
+	 * Returns the number of segments of the given track or zero if the track
+	 * cannot be read.
+	 */
+	size_t n_segments(const std::string &filename) const;
+
+	/**
+	 * Writes the DASH manifest for the given track. Segment URLs are relative
+	 * to the URL of the manifest and contain the file_version() of the track,
+	 * so replacing the file changes the URLs. Returns false if the track
+	 * cannot be read.
+	 */
+	bool write_manifest(const std::string &filename, std::ostream &os) const;
+
+	/**
+	 * Writes the initialisation segment, i.e. the WebM header. The header is
+	 * the same for all tracks and bitrates.
+	 */
+	void write_init(std::ostream &os);
+
+	/**
+	 * Decodes and encodes the segment with the given index. Returns false if
+	 * the index is out of range.
+	 */
+	bool write_segment(const std::string &filename, size_t idx,
+	                   size_t bitrate, std::ostream &os) const;
+
+	/**
+	 * Writes the complete track as a single WebM stream. The segments are
+	 * encoded in parallel on the global thread pool and muxed in order.
+	 * Returns false if the track cannot be read.
+	 */
+	bool write_track(const std::string &filename, size_t bitrate,
+	                 std::ostream &os) const;
+
+	/**
+	 * Encodes the complete track like write_track() above, but passes the
+	 * packets of each segment to the given sink in order instead of muxing
+	 * them. Returns false if the track cannot be read.
+	 */
+	bool encode_track(const std::string &filename, size_t bitrate,
+	                  const PacketSink &sink) const;
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_SEGMENTER_HPP */
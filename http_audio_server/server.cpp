@@ -17,21 +17,151 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <map>
 
 #include <lib/mongoose.h>
 
+#include <http_audio_server/access_log.hpp>
 #include <http_audio_server/json.hpp>
 #include <http_audio_server/logger.hpp>
+#include <http_audio_server/metrics.hpp>
 #include <http_audio_server/server.hpp>
 
 namespace http_audio_server {
 
+/*
+ * Metrics
+ */
+
+namespace {
+struct ServerMetrics {
+	Histogram &request = global_metrics().histogram(
+	    "http_audio_server_http_request_seconds",
+	    "Time spent handling a single HTTP request");
+	Histogram &send = global_metrics().histogram(
+	    "http_audio_server_http_send_seconds",
+	    "Time spent handing a single chunk to the socket layer");
+	Counter &requests = global_metrics().counter(
+	    "http_audio_server_http_requests_total",
+	    "Number of handled HTTP requests");
+	Counter &bytes_sent = global_metrics().counter(
+	    "http_audio_server_http_bytes_sent_total",
+	    "Number of HTTP payload bytes sent");
+	Counter &mux_requests = global_metrics().counter(
+	    "http_audio_server_http_mux_requests_total",
+	    "Number of requests multiplexed over WebSocket connections");
+#ifdef MG_ENABLE_SSL
+	Counter &tls_ktls = global_metrics().counter(
+	    "http_audio_server_tls_ktls_total",
+	    "Number of TLS connections whose records are sent via kernel TLS");
+#endif
+};
+
+ServerMetrics &server_metrics()
+{
+	static ServerMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * TLS
+ */
+
+#ifdef MG_ENABLE_SSL
+namespace {
+/**
+ * Number of sessions kept in the server-side session cache.
+ */
+constexpr long TLS_SESSION_CACHE_SIZE = 1 << 14;
+
+/**
+ * Lifetime of sessions and session tickets in seconds.
+ */
+constexpr long TLS_SESSION_TIMEOUT = 3600;
+
+void configure_tls(SSL_CTX *ctx)
+{
+	// Allow clients to resume sessions without a full handshake, either using
+	// a session ticket or the session cache shared by all connections
+	static const unsigned char sid_ctx[] = "http_audio_server";
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#endif
+
+	// Let the kernel encrypt the records if the kernel and OpenSSL support
+	// it, OpenSSL falls back to userspace encryption otherwise
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+/**
+ * Counts the connection if the kernel encrypts the records it sends, which
+ * is decided during the handshake. Kernel TLS only takes over the record
+ * layer: mongoose still reads files into its send buffer and passes them to
+ * SSL_write(), there is no SSL_sendfile() path.
+ */
+void count_ktls(mg_connection *nc)
+{
+	if (!nc->ssl || (nc->flags & MG_F_USER_1)) {
+		return;
+	}
+	nc->flags |= MG_F_USER_1;
+	if (BIO_get_ktls_send(SSL_get_wbio(nc->ssl))) {
+		server_metrics().tls_ktls.inc();
+	}
+}
+}
+#endif
+
+/*
+ * Multiplexing
+ */
+
+namespace {
+enum class MuxFrame : uint8_t { HEAD = 0, DATA = 1, END = 2 };
+
+/**
+ * Sends a binary WebSocket frame belonging to the given channel.
+ */
+void send_mux_frame(mg_connection *nc, int64_t channel, MuxFrame type,
+                    const char *data, size_t size)
+{
+	char hdr[5];
+	for (size_t i = 0; i < 4; i++) {
+		hdr[i] = char((uint64_t(channel) >> (8 * i)) & 0xFF);
+	}
+	hdr[4] = char(type);
+	const mg_str strs[2] = {mg_mk_str_n(hdr, sizeof(hdr)),
+	                        mg_mk_str_n(data, size)};
+	mg_send_websocket_framev(nc, WEBSOCKET_OP_BINARY, strs, 2);
+}
+
+/**
+ * Size of the chunks in which files are sent to multiplexed requests.
+ */
+constexpr size_t MUX_FILE_CHUNK_SIZE = 1 << 16;
+}
+
 /*
  * Class ChunkedHTTPResponseBuf
  */
 
-ChunkedHTTPResponseBuf::ChunkedHTTPResponseBuf(mg_connection *nc)
-    : m_nc(nc), m_buf(4096 + 1)
+ChunkedHTTPResponseBuf::ChunkedHTTPResponseBuf(mg_connection *nc,
+                                               int64_t channel)
+    : m_nc(nc), m_channel(channel), m_buf(4096 + 1)
 {
 	setp(&m_buf[0], &m_buf[4096]);
 }
@@ -52,17 +182,46 @@ ChunkedHTTPResponseBuf::int_type ChunkedHTTPResponseBuf::overflow(
 
 int ChunkedHTTPResponseBuf::sync()
 {
+	// An empty chunk terminates the response, only send non-empty chunks
 	const std::ptrdiff_t s = pptr() - pbase();
-	mg_send_http_chunk(m_nc, pbase(), s);
+	if (s == 0) {
+		return 0;
+	}
+	Stopwatch watch;
+	if (m_channel >= 0) {
+		send_mux_frame(m_nc, m_channel, MuxFrame::DATA, pbase(), s);
+	}
+	else {
+		mg_send_http_chunk(m_nc, pbase(), s);
+	}
+	const uint64_t send_ns = watch.elapsed();
+	server_metrics().send.record(send_ns);
+	server_metrics().bytes_sent.inc(s);
+	m_send_ns += send_ns;
+	m_bytes_sent += s;
 	pbump(-s);
 	return 0;
 }
 
+void ChunkedHTTPResponseBuf::end()
+{
+	if (m_channel >= 0) {
+		send_mux_frame(m_nc, m_channel, MuxFrame::END, nullptr, 0);
+	}
+	else {
+		mg_send_http_chunk(m_nc, nullptr, 0);
+	}
+}
+
 /*
  * Class Response
  */
 
-Response::Response(mg_connection *nc) : m_nc(nc), m_sbuf(nc), m_os(&m_sbuf) {}
+Response::Response(mg_connection *nc, http_message *hm, int64_t channel)
+    : m_nc(nc), m_hm(hm), m_channel(channel), m_sbuf(nc, channel), m_os(&m_sbuf)
+{
+}
+
 void Response::header(int code, const Headers &headers)
 {
 	// Ensure the header is only sent once
@@ -70,6 +229,16 @@ void Response::header(int code, const Headers &headers)
 		throw std::runtime_error("HTTP header already sent!");
 	}
 	m_header_sent = true;
+	m_status = code;
+
+	// Multiplexed responses send the header as JSON
+	if (m_channel >= 0) {
+		const std::string head =
+		    json{{"status", code}, {"headers", headers}}.dump();
+		send_mux_frame(m_nc, m_channel, MuxFrame::HEAD, head.data(),
+		               head.size());
+		return;
+	}
 
 	// Assemble the extra headers
 	bool first = true;
@@ -95,6 +264,102 @@ std::ostream &Response::stream()
 	return m_os;
 }
 
+/**
+ * Returns the status code of the response line mongoose wrote to the send
+ * buffer of the connection at the given offset, or 500 if there is none.
+ */
+static int sent_status(const mg_connection *nc, size_t offs)
+{
+	const mbuf &buf = nc->send_mbuf;
+	if (offs >= buf.len) {
+		return 500;
+	}
+	const char *line = buf.buf + offs;
+	const size_t len = buf.len - offs;
+	const char *space = static_cast<const char *>(memchr(line, ' ', len));
+	if (!space || space + 4 > line + len) {
+		return 500;
+	}
+	int res = 0;
+	for (const char *p = space + 1; p < space + 4; p++) {
+		if (*p < '0' || *p > '9') {
+			return 500;
+		}
+		res = res * 10 + (*p - '0');
+	}
+	return res;
+}
+
+void Response::file(const std::string &filename, const std::string &mime_type,
+                    const Headers &headers)
+{
+	if (m_header_sent) {
+		throw std::runtime_error("HTTP header already sent!");
+	}
+	if (!m_hm && m_channel < 0) {
+		throw std::runtime_error("Cannot serve files from a deferred reply");
+	}
+
+	// There is no range support for multiplexed requests, send the complete
+	// file in chunks from the event loop
+	if (m_channel >= 0) {
+		auto is = std::make_shared<std::ifstream>(filename, std::ios::binary);
+		if (!is->is_open()) {
+			error(404, "File not found");
+			return;
+		}
+		Headers all_headers = headers;
+		all_headers["Content-Type"] = mime_type;
+		header(200, all_headers);
+		defer([is](std::ostream &os) {
+			std::vector<char> buf(MUX_FILE_CHUNK_SIZE);
+			is->read(&buf[0], buf.size());
+			os.write(&buf[0], is->gcount());
+			return bool(*is);
+		});
+		return;
+	}
+
+	m_header_sent = true;
+	m_finished = true;
+
+	// Mongoose sends the file from the event loop
+	std::stringstream extra_headers;
+	bool first = true;
+	for (const auto &header : headers) {
+		if (!first) {
+			extra_headers << "\r\n";
+		}
+		extra_headers << header.first << ": " << header.second;
+		first = false;
+	}
+	const std::string extra = extra_headers.str();
+	const size_t offs = m_nc->send_mbuf.len;
+	mg_http_serve_file(m_nc, m_hm, filename.c_str(),
+	                   mg_mk_str(mime_type.c_str()), mg_mk_str(extra.c_str()));
+
+	// Mongoose decides between 200, 206, 416 and the error codes itself, log
+	// the status it actually wrote
+	m_status = sent_status(m_nc, offs);
+}
+
+void Response::defer(Body body)
+{
+	if (!m_header_sent) {
+		throw std::runtime_error(
+		    "HTTP header must be sent before deferring the payload!");
+	}
+	m_deferred = [body](Response &res) { return body(res.m_os); };
+}
+
+void Response::defer_reply(Reply reply)
+{
+	if (m_header_sent) {
+		throw std::runtime_error("HTTP header already sent!");
+	}
+	m_deferred = std::move(reply);
+}
+
 void Response::ok(int code, const std::string &msg)
 {
 	header(code, {{"Content-type", "application/json"}});
@@ -102,112 +367,433 @@ void Response::ok(int code, const std::string &msg)
 	         << std::endl;
 }
 
-void Response::error(int code, const std::string &msg)
+void Response::error(int code, const std::string &msg,
+                     const Headers &headers)
 {
-	header(code, {{"Content-type", "application/json"}});
+	Headers h = headers;
+	h.emplace("Content-type", "application/json");
+	header(code, h);
 	stream() << std::setw(4) << json{{"status", "error"}, {"msg", msg}}
 	         << std::endl;
 }
 
-Response::~Response()
+void Response::finish()
 {
-	if (m_header_sent) {
+	if (m_header_sent && !m_finished) {
+		// Deferred bodies are terminated once they are complete
 		m_os << std::flush;
-		mg_send_http_chunk(m_nc, nullptr, 0);
+		if (!m_deferred) {
+			m_sbuf.end();
+			m_finished = true;
+		}
 	}
 }
 
+Response::~Response() { finish(); }
+
 /*
  * Class HTTPServerImpl
  */
 
 class HTTPServerImpl {
 private:
+	/**
+	 * Maximum number of bytes queued in the send buffer of a connection
+	 * before a deferred body is asked for more data.
+	 */
+	static constexpr size_t DEFERRED_HIGH_WATER = 1 << 18;
+
+	/**
+	 * Poll timeout in milliseconds while deferred bodies are pending.
+	 */
+	static constexpr size_t DEFERRED_POLL_TIMEOUT = 20;
+
+	/**
+	 * Response whose body is produced from the event loop. The access log
+	 * record is written once the body is complete or the connection closes.
+	 */
+	struct Deferred {
+		std::unique_ptr<Response> res;
+		AccessLogRecord record;
+		Stopwatch watch;
+	};
+
 	std::vector<RequestMapEntry> m_request_map;
 	mg_mgr m_mgr;
 	mg_connection *m_nc;
+	std::shared_ptr<AccessLog> m_access_log;
+	int m_tls_collector_idx = -1;
+
+	/**
+	 * Pending deferred bodies by connection and multiplexing channel. Plain
+	 * HTTP responses use the channel -1.
+	 */
+	std::map<std::pair<mg_connection *, int64_t>, Deferred> m_deferred;
+
+	using DeferredIterator = decltype(m_deferred)::iterator;
+
+	std::pair<DeferredIterator, DeferredIterator> deferred_range(
+	    mg_connection *nc)
+	{
+		const int64_t min = std::numeric_limits<int64_t>::min();
+		const int64_t max = std::numeric_limits<int64_t>::max();
+		return {m_deferred.lower_bound({nc, min}),
+		        m_deferred.upper_bound({nc, max})};
+	}
+
+	static std::string url_decode(const char *src, size_t len)
+	{
+		std::string res(len + 1, '\0');
+		const int n = mg_url_decode(src, len, &res[0], res.size(), 1);
+		res.resize(std::max(n, 0));
+		return res;
+	}
 
 	static std::unordered_map<std::string, std::string> parse_query(
-	    const char *, size_t)
+	    const char *query, size_t len)
 	{
-		// TODO
-		return std::unordered_map<std::string, std::string>{};
+		std::unordered_map<std::string, std::string> res;
+		const char *end = query + len;
+		while (query < end) {
+			const char *amp = std::find(query, end, '&');
+			const char *eq = std::find(query, amp, '=');
+			if (eq != query) {
+				res[url_decode(query, eq - query)] =
+				    (eq == amp) ? std::string()
+				                : url_decode(eq + 1, amp - eq - 1);
+			}
+			query = (amp == end) ? end : amp + 1;
+		}
+		return res;
 	}
 
-	static void event_handler(mg_connection *nc, int ev, void *ev_data)
+	void log(AccessLogRecord &record, const Response &res,
+	         const Stopwatch &watch)
 	{
-		HTTPServerImpl &self = *((HTTPServerImpl *)(nc->mgr->user_data));
-		const http_message *hm = (http_message *)(ev_data);
+		record.status = res.status();
+		record.bytes_sent = res.bytes_sent();
+		record.send_ns = res.send_ns();
+		record.stream_id = res.m_trace.stream_id;
+		record.decode_ns = res.m_trace.decode_ns;
+		record.encode_ns = res.m_trace.encode_ns;
+		record.bitrate = res.m_trace.bitrate;
+		record.total_ns = watch.elapsed();
+		if (m_access_log) {
+			m_access_log->write(record);
+		}
+	}
 
-		// Only handle HTTP requests
-		if (ev != MG_EV_HTTP_REQUEST) {
+	/**
+	 * Logs and removes the deferred responses in the given range, e.g.
+	 * because their connection is closed.
+	 */
+	void drop_deferred(DeferredIterator begin, DeferredIterator end)
+	{
+		for (auto it = begin; it != end; it++) {
+			log(it->second.record, *it->second.res, it->second.watch);
+		}
+		m_deferred.erase(begin, end);
+	}
+
+	void continue_deferred(mg_connection *nc, int ev)
+	{
+		auto range = deferred_range(nc);
+		if (ev == MG_EV_CLOSE) {
+			drop_deferred(range.first, range.second);
 			return;
 		}
 
-		// Iterate over the request map to find a suitable handler
-		const std::string method(hm->method.p, hm->method.len);
-		const std::string uri(hm->uri.p, hm->uri.len);
+		// Give each body of the connection a turn, but only produce more
+		// data once the client has caught up
+		for (auto it = range.first; it != range.second;) {
+			if (nc->send_mbuf.len >= DEFERRED_HIGH_WATER) {
+				return;
+			}
+			Deferred &deferred = it->second;
+			Response &res = *deferred.res;
+			bool more;
+			try {
+				more = res.m_deferred(res);
+			}
+			catch (std::exception &e) {
+				global_logger().error(
+				    "server",
+				    std::string("Caught exception in deferred body: ") +
+				        e.what());
+
+				// Once the status has been sent the connection can only be
+				// aborted
+				if (res.header_sent()) {
+					nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+					drop_deferred(range.first, range.second);
+					return;
+				}
+				res.error(500, "Internal server error");
+				more = false;
+			}
+			res.m_os << std::flush;
+			if (!more) {
+				res.m_deferred = nullptr;
+				if (!res.header_sent()) {
+					res.error(500, "Internal server error");
+				}
+				res.finish();
+				log(deferred.record, res, deferred.watch);
+				it = m_deferred.erase(it);
+			}
+			else {
+				it++;
+			}
+		}
+	}
 
-		std::cerr << method << " " << uri << std::endl;
+#ifdef MG_ENABLE_SSL
+	void add_tls_collector(SSL_CTX *ctx)
+	{
+		m_tls_collector_idx =
+		    global_metrics().add_collector([ctx](std::ostream &os) {
+			    os << "# HELP http_audio_server_tls_handshakes_total Number "
+			          "of completed TLS handshakes\n"
+			       << "# TYPE http_audio_server_tls_handshakes_total counter\n"
+			       << "http_audio_server_tls_handshakes_total "
+			       << SSL_CTX_sess_accept_good(ctx) << "\n"
+			       << "# HELP http_audio_server_tls_resumed_total Number of "
+			          "TLS handshakes which resumed a session\n"
+			       << "# TYPE http_audio_server_tls_resumed_total counter\n"
+			       << "http_audio_server_tls_resumed_total "
+			       << SSL_CTX_sess_hits(ctx) << "\n";
+			});
+	}
+#endif
 
-		for (const RequestMapEntry &descr : self.m_request_map) {
+	void dispatch(const std::string &method, const std::string &uri,
+	              const std::string &query, const std::string &body,
+	              Response &res, std::string &route)
+	{
+		// Iterate over the request map to find a suitable handler
+		for (const RequestMapEntry &descr : m_request_map) {
 			std::smatch sm;
 			if (descr.method == method &&
 			    std::regex_match(uri, sm, descr.regex)) {
-				Request req{
-				    descr, uri, std::string{hm->body.p, hm->body.len},
-				    parse_query(hm->query_string.p, hm->query_string.len), sm};
-				Response res(nc);
+				route = descr.route;
+				Request req{descr, uri, body,
+				            parse_query(query.data(), query.size()), sm};
 				try {
 					descr.handler(req, res);
 				}
 				catch (std::exception &e) {
-					std::cerr
-					    << "Caught exception in event_handler: " << e.what()
-					    << std::endl;
-					Response(nc).error(500, "Internal server error");
+					global_logger().error(
+					    "server", std::string("Caught exception in "
+					                          "event_handler: ") +
+					                  e.what());
+					if (!res.header_sent()) {
+						res.error(500, "Internal server error");
+					}
 				}
 				return;
 			}
 		}
 
 		// Send a default error response
-		Response(nc).error(404, "Requested resource \"" + uri +
-		                            "\" not found for method " + method);
+		res.error(404, "Requested resource \"" + uri +
+		                   "\" not found for method " + method);
+	}
+
+	/**
+	 * Handles a request multiplexed over a WebSocket connection.
+	 */
+	void handle_mux_frame(mg_connection *nc, const websocket_message *wm)
+	{
+		if ((wm->flags & 0x0F) != WEBSOCKET_OP_TEXT) {
+			return;
+		}
+		int64_t channel = -1;
+		try {
+			const json msg = json::parse(
+			    std::string((const char *)wm->data, wm->size));
+			channel = msg.at("id");
+			if (channel < 0 || channel > 0xFFFFFFFF) {
+				channel = -1;
+				throw std::invalid_argument("Invalid channel");
+			}
+			if (m_deferred.count({nc, channel})) {
+				Response res(nc, nullptr, channel);
+				res.error(409, "Channel is still in use");
+				return;
+			}
+
+			// Split the query string from the path
+			const std::string uri = msg.value("uri", "/");
+			const size_t q = uri.find('?');
+			server_metrics().mux_requests.inc();
+			handle(nc, nullptr, msg.value("method", "GET"), uri.substr(0, q),
+			       q == std::string::npos ? "" : uri.substr(q + 1),
+			       msg.value("body", ""), channel);
+		}
+		catch (std::exception &e) {
+			if (channel >= 0) {
+				Response res(nc, nullptr, channel);
+				res.error(400, e.what());
+			}
+			else {
+				global_logger().warn("server",
+				                     std::string("Invalid mux request: ") +
+				                         e.what());
+			}
+		}
+	}
+
+	void handle(mg_connection *nc, http_message *hm, const std::string &method,
+	            const std::string &uri, const std::string &query,
+	            const std::string &body, int64_t channel)
+	{
+		Stopwatch watch;
+		server_metrics().requests.inc();
+
+		AccessLogRecord record;
+		record.time = time(nullptr);
+		record.method = method;
+		record.uri = uri;
+
+		global_logger().debug("server", record.method + " " + record.uri);
+
+		auto res = std::make_unique<Response>(nc, hm, channel);
+		dispatch(method, uri, query, body, *res, record.route);
+		res->finish();
+		server_metrics().request.record(watch.elapsed());
+
+		// Keep deferred responses alive until their body is complete, they
+		// are logged with the bytes and time of the whole transfer. The
+		// request message is only valid during this call.
+		if (res->m_deferred) {
+			res->m_hm = nullptr;
+			Deferred &deferred = m_deferred[{nc, channel}];
+			deferred.res = std::move(res);
+			deferred.record = std::move(record);
+			deferred.watch = watch;
+			return;
+		}
+		log(record, *res, watch);
+	}
+
+	static void event_handler(mg_connection *nc, int ev, void *ev_data)
+	{
+		HTTPServerImpl &self = *((HTTPServerImpl *)(nc->mgr->user_data));
+
+		// Continue deferred responses, otherwise only handle HTTP requests
+		// and multiplexed requests
+		switch (ev) {
+			case MG_EV_POLL:
+			case MG_EV_SEND:
+			case MG_EV_CLOSE:
+				self.continue_deferred(nc, ev);
+				break;
+			case MG_EV_HTTP_REQUEST: {
+				http_message *hm = (http_message *)(ev_data);
+#ifdef MG_ENABLE_SSL
+				count_ktls(nc);
+#endif
+				self.handle(nc, hm, std::string(hm->method.p, hm->method.len),
+				            std::string(hm->uri.p, hm->uri.len),
+				            std::string(hm->query_string.p,
+				                        hm->query_string.len),
+				            std::string(hm->body.p, hm->body.len), -1);
+				break;
+			}
+			case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST: {
+				http_message *hm = (http_message *)(ev_data);
+#ifdef MG_ENABLE_SSL
+				count_ktls(nc);
+#endif
+				if (mg_vcmp(&hm->uri, "/mux") != 0) {
+					nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+				}
+				break;
+			}
+			case MG_EV_WEBSOCKET_FRAME:
+				self.handle_mux_frame(nc, (websocket_message *)(ev_data));
+				break;
+		}
 	}
 
 public:
 	HTTPServerImpl(const std::vector<RequestMapEntry> &request_map,
-	               const std::string &host, size_t port)
+	               const std::string &host, size_t port,
+	               const TLSConfig &tls)
 	    : m_request_map(request_map)
 	{
 		const std::string addr = host + ":" + std::to_string(port);
 
+		mg_bind_opts opts;
+		memset(&opts, 0, sizeof(opts));
+		const char *error = nullptr;
+		opts.error_string = &error;
+		if (tls.enabled()) {
+#ifdef MG_ENABLE_SSL
+			opts.ssl_cert = tls.cert.c_str();
+			opts.ssl_key = tls.key.empty() ? nullptr : tls.key.c_str();
+#else
+			global_logger().fatal_error(
+			    "server", "Error, compiled without TLS support");
+			exit(1);
+#endif
+		}
+
 		mg_mgr_init(&m_mgr, this);
-		m_nc = mg_bind(&m_mgr, addr.c_str(), event_handler);
+		m_nc = mg_bind_opt(&m_mgr, addr.c_str(), event_handler, opts);
 		if (m_nc) {
 			mg_set_protocol_http_websocket(m_nc);
+#ifdef MG_ENABLE_SSL
+			if (tls.enabled()) {
+				configure_tls(m_nc->ssl_ctx);
+				add_tls_collector(m_nc->ssl_ctx);
+			}
+#endif
 			global_logger().info(
-			    "server", "Serving HTTP at " + addr + ", press CTRL+C to exit");
+			    "server", std::string("Serving ") +
+			                  (tls.enabled() ? "HTTPS" : "HTTP") + " at " +
+			                  addr + ", press CTRL+C to exit");
 		}
 		else {
-			global_logger().fatal_error("server",
-			                            "Error, cannot bind to " + addr);
+			global_logger().fatal_error(
+			    "server", "Error, cannot bind to " + addr +
+			                  (error ? std::string(": ") + error : ""));
 			exit(1);
 		}
 	}
 
-	~HTTPServerImpl() { mg_mgr_free(&m_mgr); }
-	void poll(size_t timeout) { mg_mgr_poll(&m_mgr, timeout); }
+	~HTTPServerImpl()
+	{
+		if (m_tls_collector_idx >= 0) {
+			global_metrics().remove_collector(m_tls_collector_idx);
+		}
+		mg_mgr_free(&m_mgr);
+	}
+	void poll(size_t timeout)
+	{
+		// Deferred bodies are fed from the poll events, keep them moving
+		if (!m_deferred.empty()) {
+			timeout = std::min(timeout, DEFERRED_POLL_TIMEOUT);
+		}
+		mg_mgr_poll(&m_mgr, timeout);
+	}
+	void access_log(std::shared_ptr<AccessLog> log)
+	{
+		m_access_log = std::move(log);
+	}
 };
 
+constexpr size_t HTTPServerImpl::DEFERRED_HIGH_WATER;
+constexpr size_t HTTPServerImpl::DEFERRED_POLL_TIMEOUT;
+
 /*
  * Class HTTPServer
  */
 
 HTTPServer::HTTPServer(const std::vector<RequestMapEntry> &request_map,
-                       const std::string &host, size_t port)
-    : m_impl(std::make_unique<HTTPServerImpl>(request_map, host, port))
+                       const std::string &host, size_t port,
+                       const TLSConfig &tls)
+    : m_impl(std::make_unique<HTTPServerImpl>(request_map, host, port, tls))
 {
 }
 
@@ -217,5 +803,9 @@ HTTPServer::~HTTPServer()
 }
 
 void HTTPServer::poll(size_t timeout) { m_impl->poll(timeout); }
+void HTTPServer::access_log(std::shared_ptr<AccessLog> log)
+{
+	m_impl->access_log(std::move(log));
+}
 }
 
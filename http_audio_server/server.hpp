@@ -19,14 +19,17 @@
 #ifndef HTTP_AUDIO_SERVER_SERVER
 #define HTTP_AUDIO_SERVER_SERVER
 
+#include <cstdint>
 #include <iosfwd>
 #include <functional>
+#include <memory>
 #include <regex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 struct mg_connection;
+struct http_message;
 
 namespace http_audio_server {
 
@@ -40,39 +43,131 @@ struct Request {
 	std::smatch matcher;
 };
 
+/**
+ * Stream buffer sending the response body in chunks. Plain HTTP responses
+ * use the chunked transfer encoding, responses to requests multiplexed over a
+ * WebSocket connection are sent as DATA frames of the corresponding channel.
+ */
 class ChunkedHTTPResponseBuf : public std::streambuf {
 private:
 	mg_connection *m_nc;
+	int64_t m_channel;
 	std::vector<char> m_buf;
+	uint64_t m_bytes_sent = 0;
+	uint64_t m_send_ns = 0;
 
 protected:
 	int_type overflow(int_type ch) override;
 	int sync() override;
 
 public:
-	ChunkedHTTPResponseBuf(mg_connection *nc);
+	/**
+	 * @param channel is the multiplexing channel, -1 for plain HTTP.
+	 */
+	ChunkedHTTPResponseBuf(mg_connection *nc, int64_t channel = -1);
 	~ChunkedHTTPResponseBuf() override;
+
+	/**
+	 * Terminates the response body.
+	 */
+	void end();
+
+	uint64_t bytes_sent() const { return m_bytes_sent; }
+	uint64_t send_ns() const { return m_send_ns; }
 };
 
+class HTTPServerImpl;
+
 struct Response {
+public:
+	using Headers = std::unordered_map<std::string, std::string>;
+
+	/**
+	 * Callback producing the remainder of a deferred response body. Called
+	 * from the event loop whenever the connection can take more data, writes
+	 * the data that is available without blocking and returns false once the
+	 * body is complete.
+	 */
+	using Body = std::function<bool(std::ostream &os)>;
+
+	/**
+	 * Callback producing a deferred response including its header. Called
+	 * from the event loop like Body until it returns false, may send the
+	 * header, e.g. with error(), once the outcome of the request is known.
+	 */
+	using Reply = std::function<bool(Response &res)>;
+
+	/**
+	 * Information about the request which is filled in by the request handler
+	 * and written to the access log.
+	 */
+	struct Trace {
+		std::string stream_id;
+		uint64_t decode_ns = 0;
+		uint64_t encode_ns = 0;
+		size_t bitrate = 0;
+	};
+
 private:
+	friend class HTTPServerImpl;
+
 	mg_connection *m_nc;
+	http_message *m_hm;
+	int64_t m_channel;
 	ChunkedHTTPResponseBuf m_sbuf;
 	std::ostream m_os;
+	Trace m_trace;
 
+	int m_status = 0;
 	bool m_header_sent = false;
+	bool m_finished = false;
+	Reply m_deferred;
 
 public:
-	using Headers = std::unordered_map<std::string, std::string>;
-
-	Response(mg_connection *nc);
+	Response(mg_connection *nc, http_message *hm = nullptr,
+	         int64_t channel = -1);
 	~Response();
 	void header(int code, const Headers &headers = Headers{});
 	std::ostream &stream();
 	void stream(const std::string &filename);
 
+	/**
+	 * Serves the given file, honouring Range requests. Sends the header.
+	 * Multiplexed requests receive the complete file.
+	 */
+	void file(const std::string &filename, const std::string &mime_type,
+	          const Headers &headers = Headers{});
+
+	/**
+	 * Continues the chunked response body from the event loop once the
+	 * request handler has returned. The header must already have been sent.
+	 */
+	void defer(Body body);
+
+	/**
+	 * Defers the whole response, including the header, to the event loop.
+	 * Used for responses whose status is only known once a background task
+	 * has finished. Sends a 500 error if the reply throws or completes
+	 * without sending a header. The header must not have been sent yet and
+	 * file() cannot be used from within the reply.
+	 */
+	void defer_reply(Reply reply);
+
 	void ok(int code, const std::string &msg);
-	void error(int code, const std::string &msg);
+	void error(int code, const std::string &msg,
+	           const Headers &headers = Headers{});
+
+	/**
+	 * Flushes the payload and terminates the chunked response. Called
+	 * automatically by the destructor.
+	 */
+	void finish();
+
+	Trace &trace() { return m_trace; }
+	bool header_sent() const { return m_header_sent; }
+	int status() const { return m_status; }
+	uint64_t bytes_sent() const { return m_sbuf.bytes_sent(); }
+	uint64_t send_ns() const { return m_sbuf.send_ns(); }
 };
 
 using RequestHandler =
@@ -80,26 +175,74 @@ using RequestHandler =
 
 struct RequestMapEntry {
 	std::string method;
+	std::string route;
 	std::regex regex;
 	RequestHandler handler;
 
 	RequestMapEntry(const std::string &method, const std::string &regex,
 	                RequestHandler handler)
-	    : method(method), regex(regex), handler(handler)
+	    : method(method), route(regex), regex(regex), handler(handler)
 	{
 	}
 };
 
-class HTTPServerImpl;
+class AccessLog;
+
+/**
+ * TLS settings of the HTTP server.
+ */
+struct TLSConfig {
+	/**
+	 * PEM file containing the certificate chain. TLS is disabled if empty.
+	 */
+	std::string cert;
+
+	/**
+	 * PEM file containing the private key. If empty, the key is read from
+	 * the certificate file.
+	 */
+	std::string key;
+
+	bool enabled() const { return !cert.empty(); }
+};
 
+/**
+ * HTTP server dispatching the requests to the handlers in the request map.
+ *
+ * Besides plain HTTP/1.1 requests, the server accepts WebSocket connections
+ * at /mux which multiplex any number of concurrent requests over a single
+ * connection. Each request is a text frame
+ *
+ * {"id": <channel>, "method": "POST", "uri": "/stream/<id>/advance",
+ *  "body": "..."}
+ *
+ * with a client chosen, non-negative channel number that must not be in use
+ * by a pending response. The response is sent as binary frames starting with
+ * the channel as 32 bit little endian integer and a frame type byte: HEAD (0)
+ * carries {"status": <code>, "headers": {...}} as JSON, followed by any
+ * number of DATA (1) frames and a single END (2) frame. Deferred response
+ * bodies of all channels are produced round-robin whenever the connection
+ * has drained its send buffer.
+ *
+ * If TLS is enabled, clients can resume sessions using session tickets or
+ * the server-side session cache. Kernel TLS is used if OpenSSL supports it.
+ */
 class HTTPServer {
 private:
 	std::unique_ptr<HTTPServerImpl> m_impl;
 
 public:
-	HTTPServer(const std::vector<RequestMapEntry> &request_map, const std::string &host = "localhost", size_t port = 4851);
+	HTTPServer(const std::vector<RequestMapEntry> &request_map,
+	           const std::string &host = "localhost", size_t port = 4851,
+	           const TLSConfig &tls = TLSConfig());
 	~HTTPServer();
 	void poll(size_t timeout);
+
+	/**
+	 * Writes a record for each handled request to the given access log.
+	 * Passing nullptr disables the access log.
+	 */
+	void access_log(std::shared_ptr<AccessLog> log);
 };
 }
 
@@ -0,0 +1,151 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares the cost of launching a child process with posix_spawnp(), as
+ * done by the Process class, and with fork() and execvp(), as done before,
+ * while the resident memory of this process grows. Usage:
+ *
+ *     http_audio_server_spawn_benchmark [MAX_MIB [STEP_MIB [RUNS]]]
+ *
+ * The resident memory is grown in steps of STEP_MIB (default 256) up to
+ * MAX_MIB (default 2048) mebibytes. At each step, `true` is launched RUNS
+ * times (default 50) with either method. The median time until the launching
+ * call returns in the parent is printed in microseconds; the time fork()
+ * spends copying the page tables grows with the resident memory.
+ */
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern char **environ;
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Returns the resident memory of this process in mebibytes.
+ */
+static double resident_mib()
+{
+	std::ifstream is("/proc/self/statm");
+	size_t size = 0, resident = 0;
+	is >> size >> resident;
+	return double(resident) * double(sysconf(_SC_PAGESIZE)) / (1 << 20);
+}
+
+/**
+ * Launches the given command with the same attributes as ProcessImpl and
+ * returns its process id.
+ */
+static pid_t launch_spawn(char *const argv[])
+{
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+	pid_t pid = 0;
+	const int err = posix_spawnp(&pid, argv[0], nullptr, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	return (err == 0) ? pid : -1;
+}
+
+/**
+ * Launches the given command the way ProcessImpl did before it used
+ * posix_spawnp() and returns its process id.
+ */
+static pid_t launch_fork(char *const argv[])
+{
+	const pid_t pid = fork();
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+/**
+ * Returns the median time in microseconds until launch() returns, the
+ * children are reaped outside of the measurement.
+ */
+static double median_launch_us(const std::function<pid_t()> &launch,
+                               size_t runs)
+{
+	std::vector<double> times;
+	for (size_t i = 0; i < runs; i++) {
+		const Clock::time_point t0 = Clock::now();
+		const pid_t pid = launch();
+		const Clock::time_point t1 = Clock::now();
+		if (pid < 0) {
+			throw std::runtime_error("Cannot launch child process");
+		}
+		waitpid(pid, nullptr, 0);
+		times.emplace_back(std::chrono::duration<double>(t1 - t0).count());
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2] * 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t max_mib = (argc > 1) ? std::stoul(argv[1]) : 2048;
+	const size_t step_mib = (argc > 2) ? std::stoul(argv[2]) : 256;
+	const size_t runs = (argc > 3) ? std::stoul(argv[3]) : 50;
+	if (argc > 4 || step_mib == 0 || runs == 0) {
+		std::cerr << "Usage: " << argv[0] << " [MAX_MIB [STEP_MIB [RUNS]]]"
+		          << std::endl;
+		return 1;
+	}
+
+	char cmd[] = "true";
+	char *const child_argv[] = {cmd, nullptr};
+
+	// Keep the allocated blocks alive, touching every page makes them count
+	// towards the resident memory
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::cout << std::right << std::setw(10) << "RSS MiB" << std::setw(16)
+	          << "posix_spawn us" << std::setw(10) << "fork us" << std::endl
+	          << std::fixed << std::setprecision(1);
+	for (size_t mib = 0; mib <= max_mib; mib += step_mib) {
+		if (mib > 0) {
+			const size_t n = step_mib << 20;
+			blocks.emplace_back(new char[n]);
+			memset(blocks.back().get(), 1, n);
+		}
+		const double spawn_us = median_launch_us(
+		    [&] { return launch_spawn(child_argv); }, runs);
+		const double fork_us =
+		    median_launch_us([&] { return launch_fork(child_argv); }, runs);
+		std::cout << std::setw(10) << resident_mib() << std::setw(16)
+		          << spawn_us << std::setw(10) << fork_us << std::endl;
+	}
+	return 0;
+}
@@ -16,7 +16,9 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdint>
 #include <random>
+#include <stdexcept>
 
 #include <http_audio_server/string_utils.hpp>
 
@@ -39,5 +41,66 @@ std::string random_alphanum_string(const int len)
 	return res;
 }
 
+static const char base64url_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789-_";
+
+std::string base64url_encode(const std::string &str)
+{
+	std::string res;
+	res.reserve((str.size() * 4 + 2) / 3);
+	uint32_t acc = 0;
+	int n_bits = 0;
+	for (unsigned char c : str) {
+		acc = (acc << 8) | c;
+		n_bits += 8;
+		while (n_bits >= 6) {
+			n_bits -= 6;
+			res.push_back(base64url_alphabet[(acc >> n_bits) & 0x3F]);
+		}
+	}
+	if (n_bits > 0) {
+		res.push_back(base64url_alphabet[(acc << (6 - n_bits)) & 0x3F]);
+	}
+	return res;
+}
+
+std::string base64url_decode(const std::string &str)
+{
+	std::string res;
+	res.reserve(str.size() * 3 / 4);
+	uint32_t acc = 0;
+	int n_bits = 0;
+	for (char c : str) {
+		uint32_t value;
+		if (c >= 'A' && c <= 'Z') {
+			value = c - 'A';
+		}
+		else if (c >= 'a' && c <= 'z') {
+			value = c - 'a' + 26;
+		}
+		else if (c >= '0' && c <= '9') {
+			value = c - '0' + 52;
+		}
+		else if (c == '-' || c == '_') {
+			value = (c == '-') ? 62 : 63;
+		}
+		else {
+			throw std::invalid_argument("Invalid character in base64 string");
+		}
+		acc = (acc << 6) | value;
+		n_bits += 6;
+		if (n_bits >= 8) {
+			n_bits -= 8;
+			res.push_back(char((acc >> n_bits) & 0xFF));
+		}
+	}
+	if (n_bits >= 6) {
+		throw std::invalid_argument("Invalid length of base64 string");
+	}
+	return res;
+}
+
 }
 
@@ -22,4 +22,16 @@ namespace http_audio_server {
 
 std::string random_alphanum_string(const int len = 16);
 
+/**
+ * Encodes the given string using the URL-safe base64 alphabet without
+ * padding, as used for the track identifiers in URLs.
+ */
+std::string base64url_encode(const std::string &str);
+
+/**
+ * Decodes a string produced by base64url_encode(). Throws
+ * std::invalid_argument if the string is not valid.
+ */
+std::string base64url_decode(const std::string &str);
+
 }
@@ -0,0 +1,452 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <http_audio_server/metrics.hpp>
+#include <http_audio_server/supervisor.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct SupervisorMetrics {
+	Gauge &children = global_metrics().gauge(
+	    "http_audio_server_child_processes",
+	    "Number of child processes which have not been reaped yet");
+	Counter &spawned = global_metrics().counter(
+	    "http_audio_server_process_spawned_total",
+	    "Number of child processes spawned");
+	Counter &exited = global_metrics().counter(
+	    "http_audio_server_process_exited_total",
+	    "Number of child processes reaped");
+	Counter &killed = global_metrics().counter(
+	    "http_audio_server_process_killed_total",
+	    "Number of child processes which had to be killed with SIGKILL");
+	Counter &wall_time_exceeded = global_metrics().counter(
+	    "http_audio_server_process_wall_time_exceeded_total",
+	    "Number of child processes terminated for exceeding their wall-clock "
+	    "time limit");
+	Counter &cpu_time_exceeded = global_metrics().counter(
+	    "http_audio_server_process_cpu_time_exceeded_total",
+	    "Number of child processes terminated for exceeding their CPU time "
+	    "limit");
+	Histogram &lifetime = global_metrics().histogram(
+	    "http_audio_server_process_lifetime_seconds",
+	    "Time between spawning and reaping a child process");
+	Histogram &reap = global_metrics().histogram(
+	    "http_audio_server_process_reap_seconds",
+	    "Time between asking a child process to terminate and it being reaped");
+};
+
+SupervisorMetrics &supervisor_metrics()
+{
+	static SupervisorMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * Class ChildStatus
+ */
+
+bool ChildStatus::exited() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_exited;
+}
+
+int ChildStatus::exitcode() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_exitcode;
+}
+
+int ChildStatus::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_cv.wait(lock, [this] { return m_exited; });
+	return m_exitcode;
+}
+
+bool ChildStatus::signal(int signal)
+{
+	// The supervisor only reaps the child while holding m_mtx, so the pid
+	// cannot have been reused here
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return !m_exited && kill(m_pid, signal) == 0;
+}
+
+/*
+ * Class SupervisorImpl
+ */
+
+class SupervisorImpl {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr int MAX_EVENTS = 64;
+
+	/**
+	 * Polling interval used for children without pidfd.
+	 */
+	static constexpr int POLL_INTERVAL_MS = 10;
+
+	struct Child {
+		std::shared_ptr<ChildStatus> status;
+		int pidfd;
+		ProcessLimits limits;
+		Clock::time_point spawned;
+		Clock::time_point terminated;
+
+		/**
+		 * Time at which the next signal is sent to the child.
+		 */
+		Clock::time_point deadline;
+		bool has_deadline;
+		bool terminating;
+		bool killed;
+	};
+
+	mutable std::mutex m_mtx;
+	std::unordered_map<pid_t, Child> m_children;
+	uint64_t m_n_spawned = 0;
+	bool m_stop = false;
+	int m_epoll_fd;
+	int m_wakeup_fd;
+	std::thread m_thread;
+
+	static int pidfd_open(pid_t pid)
+	{
+#ifdef SYS_pidfd_open
+		return syscall(SYS_pidfd_open, pid, 0);
+#else
+		(void)pid;
+		return -1;
+#endif
+	}
+
+	static Clock::duration seconds(double t)
+	{
+		return std::chrono::duration_cast<Clock::duration>(
+		    std::chrono::duration<double>(t));
+	}
+
+	static uint64_t nanoseconds(Clock::duration t)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+	}
+
+	void wake()
+	{
+		const uint64_t value = 1;
+		if (write(m_wakeup_fd, &value, sizeof(value)) < 0) {
+			// Nothing to do, the supervisor thread is already being woken up
+		}
+	}
+
+	/**
+	 * Reaps the given child if it has exited. Returns true if the child has
+	 * been reaped.
+	 */
+	bool reap(Child &child, Clock::time_point now)
+	{
+		ChildStatus &status = *child.status;
+		std::lock_guard<std::mutex> lock(status.m_mtx);
+		int wstatus;
+		const pid_t res = waitpid(status.m_pid, &wstatus, WNOHANG);
+		if (res == 0 || (res < 0 && errno == EINTR)) {
+			return false;
+		}
+
+		if (res > 0 && WIFEXITED(wstatus)) {
+			status.m_exitcode = WEXITSTATUS(wstatus);
+		}
+		else if (res > 0 && WIFSIGNALED(wstatus)) {
+			status.m_exitcode = -WTERMSIG(wstatus);
+			if (WTERMSIG(wstatus) == SIGXCPU) {
+				supervisor_metrics().cpu_time_exceeded.inc();
+			}
+		}
+		else if (res > 0) {
+			return false;  // Stopped or continued, the child is still alive
+		}
+		status.m_exited = true;
+		status.m_cv.notify_all();
+
+		supervisor_metrics().children.dec();
+		supervisor_metrics().exited.inc();
+		supervisor_metrics().lifetime.record(nanoseconds(now - child.spawned));
+		if (child.terminating) {
+			supervisor_metrics().reap.record(
+			    nanoseconds(now - child.terminated));
+		}
+		return true;
+	}
+
+	/**
+	 * Sends SIGTERM or SIGKILL to the child if its deadline has expired.
+	 */
+	void enforce(Child &child, Clock::time_point now)
+	{
+		if (!child.has_deadline || now < child.deadline) {
+			return;
+		}
+		if (!child.terminating) {
+			child.status->signal(SIGTERM);
+			child.terminating = true;
+			child.terminated = now;
+			child.deadline = now + seconds(child.limits.kill_timeout);
+			supervisor_metrics().wall_time_exceeded.inc();
+		}
+		else if (!child.killed) {
+			child.status->signal(SIGKILL);
+			child.killed = true;
+			child.has_deadline = false;
+			supervisor_metrics().killed.inc();
+		}
+	}
+
+	/**
+	 * Reaps all children which have exited and enforces the deadlines of the
+	 * remaining ones. Returns the epoll_wait() timeout until the next deadline.
+	 */
+	int update()
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		const Clock::time_point now = Clock::now();
+		int timeout = -1;
+		auto shorten = [&timeout](int ms) {
+			timeout = (timeout < 0) ? ms : std::min(timeout, ms);
+		};
+		for (auto it = m_children.begin(); it != m_children.end();) {
+			Child &child = it->second;
+			if (reap(child, now)) {
+				if (child.pidfd >= 0) {
+					epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, child.pidfd, nullptr);
+					close(child.pidfd);
+				}
+				it = m_children.erase(it);
+				continue;
+			}
+			enforce(child, now);
+			if (child.has_deadline) {
+				shorten(std::chrono::duration_cast<std::chrono::milliseconds>(
+				            child.deadline - now)
+				            .count() +
+				        1);
+			}
+			if (child.pidfd < 0) {
+				shorten(POLL_INTERVAL_MS);
+			}
+			++it;
+		}
+		return timeout;
+	}
+
+	void run()
+	{
+		epoll_event events[MAX_EVENTS];
+		while (true) {
+			const int timeout = update();
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				if (m_stop && m_children.empty()) {
+					break;
+				}
+			}
+
+			// Wait for a child to exit, a deadline or new children. The
+			// wakeup eventfd is drained, pidfds stay readable until the child
+			// has been reaped by update().
+			const int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, timeout);
+			for (int i = 0; i < n; i++) {
+				if (events[i].data.fd == m_wakeup_fd) {
+					uint64_t value;
+					if (read(m_wakeup_fd, &value, sizeof(value)) < 0) {
+						// Nothing to do, the eventfd is non-blocking
+					}
+				}
+			}
+		}
+	}
+
+public:
+	SupervisorImpl()
+	    : m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+	      m_wakeup_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+	{
+		if (m_epoll_fd < 0 || m_wakeup_fd < 0) {
+			throw std::runtime_error("Cannot create the process supervisor");
+		}
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = m_wakeup_fd;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev);
+		m_thread = std::thread(&SupervisorImpl::run, this);
+	}
+
+	~SupervisorImpl()
+	{
+		// Kill all remaining children and wait for them to be reaped
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+			for (auto &it : m_children) {
+				it.second.terminating = true;
+				it.second.has_deadline = true;
+				it.second.deadline = Clock::now();
+			}
+		}
+		wake();
+		m_thread.join();
+		close(m_wakeup_fd);
+		close(m_epoll_fd);
+	}
+
+	std::shared_ptr<ChildStatus> watch(pid_t pid, const ProcessLimits &limits)
+	{
+		// Let the kernel enforce the CPU time limit. The hard limit leaves
+		// the child one second to handle SIGXCPU before it is killed.
+		if (limits.cpu_time > 0.0) {
+			const rlim_t t = std::ceil(limits.cpu_time);
+			const rlimit rlim{t, t + 1};
+			prlimit(pid, RLIMIT_CPU, &rlim, nullptr);
+		}
+
+		const Clock::time_point now = Clock::now();
+		Child child;
+		child.status = std::make_shared<ChildStatus>(pid);
+		child.pidfd = pidfd_open(pid);
+		child.limits = limits;
+		child.spawned = now;
+		child.has_deadline = limits.wall_time > 0.0;
+		child.deadline = now + seconds(limits.wall_time);
+		child.terminating = false;
+		child.killed = false;
+		if (child.pidfd >= 0) {
+			epoll_event ev{};
+			ev.events = EPOLLIN;
+			ev.data.fd = child.pidfd;
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, child.pidfd, &ev);
+		}
+
+		std::shared_ptr<ChildStatus> res = child.status;
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_children.emplace(pid, std::move(child));
+			m_n_spawned++;
+		}
+		supervisor_metrics().children.inc();
+		supervisor_metrics().spawned.inc();
+		wake();
+		return res;
+	}
+
+	void terminate(const std::shared_ptr<ChildStatus> &status, double timeout)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			auto it = m_children.find(status->pid());
+			if (it == m_children.end() || it->second.status != status ||
+			    it->second.terminating) {
+				return;
+			}
+			Child &child = it->second;
+			const Clock::time_point now = Clock::now();
+			status->signal(SIGTERM);
+			child.terminating = true;
+			child.terminated = now;
+			child.has_deadline = true;
+			child.deadline = now + seconds(timeout);
+		}
+		wake();
+	}
+
+	size_t n_children() const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_children.size();
+	}
+
+	uint64_t n_spawned() const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_n_spawned;
+	}
+
+	uint64_t n_exited() const
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_n_spawned - m_children.size();
+	}
+};
+
+/*
+ * Class Supervisor
+ */
+
+Supervisor::Supervisor() : m_impl(std::make_unique<SupervisorImpl>()) {}
+Supervisor::~Supervisor()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+std::shared_ptr<ChildStatus> Supervisor::watch(pid_t pid,
+                                               const ProcessLimits &limits)
+{
+	return m_impl->watch(pid, limits);
+}
+
+void Supervisor::terminate(const std::shared_ptr<ChildStatus> &status,
+                           double timeout)
+{
+	m_impl->terminate(status, timeout);
+}
+
+size_t Supervisor::n_children() const { return m_impl->n_children(); }
+uint64_t Supervisor::n_spawned() const { return m_impl->n_spawned(); }
+uint64_t Supervisor::n_exited() const { return m_impl->n_exited(); }
+
+/*
+ * Functions
+ */
+
+Supervisor &global_supervisor()
+{
+	static Supervisor supervisor;
+	return supervisor;
+}
+}
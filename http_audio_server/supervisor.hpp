@@ -0,0 +1,164 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file supervisor.hpp
+ *
+ * Contains the Supervisor class, which keeps track of all child processes,
+ * reaps them as soon as they exit and enforces resource limits.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_SUPERVISOR_HPP
+#define HTTP_AUDIO_SERVER_SUPERVISOR_HPP
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class SupervisorImpl;
+
+/**
+ * Resource limits applied to a child process. A value of zero means that the
+ * corresponding resource is not limited.
+ */
+struct ProcessLimits {
+	/**
+	 * Maximum CPU time in seconds. Enforced by the kernel using RLIMIT_CPU,
+	 * the child receives SIGXCPU once the limit is exceeded.
+	 */
+	double cpu_time = 0.0;
+
+	/**
+	 * Maximum wall-clock time in seconds. Once the limit is exceeded the child
+	 * receives SIGTERM, followed by SIGKILL after kill_timeout seconds.
+	 */
+	double wall_time = 0.0;
+
+	/**
+	 * Time in seconds between SIGTERM and SIGKILL.
+	 */
+	double kill_timeout = 1.0;
+};
+
+/**
+ * State of a child process shared between the Supervisor and the owner of the
+ * child.
+ */
+class ChildStatus {
+private:
+	friend class SupervisorImpl;
+
+	pid_t m_pid;
+	mutable std::mutex m_mtx;
+	std::condition_variable m_cv;
+	bool m_exited = false;
+	int m_exitcode = 0;
+
+public:
+	ChildStatus(pid_t pid) : m_pid(pid) {}
+
+	/**
+	 * Returns the process id of the child. The id must not be used once the
+	 * child has exited, as it may have been reused.
+	 */
+	pid_t pid() const { return m_pid; }
+
+	/**
+	 * Returns true if the child has exited and has been reaped.
+	 */
+	bool exited() const;
+
+	/**
+	 * Returns the exit code of the child, or the number of the signal which
+	 * killed the child as a negative number. Only valid once exited() is true.
+	 */
+	int exitcode() const;
+
+	/**
+	 * Blocks until the child has exited and returns exitcode().
+	 */
+	int wait();
+
+	/**
+	 * Sends a signal to the child. Returns false if the child already exited.
+	 */
+	bool signal(int signal);
+};
+
+/**
+ * The Supervisor class runs a background thread which waits for child
+ * processes to exit using pidfds and epoll and reaps them. This is the only
+ * place in which waitpid() is called.
+ */
+class Supervisor {
+private:
+	std::unique_ptr<SupervisorImpl> m_impl;
+
+public:
+	Supervisor();
+
+	/**
+	 * Kills all remaining children and waits for them to be reaped.
+	 */
+	~Supervisor();
+
+	/**
+	 * Starts tracking the given freshly spawned child process and applies the
+	 * given limits.
+	 */
+	std::shared_ptr<ChildStatus> watch(
+	    pid_t pid, const ProcessLimits &limits = ProcessLimits());
+
+	/**
+	 * Asks the given child to exit by sending SIGTERM and sends SIGKILL if it
+	 * is still alive after the given timeout. Does not block.
+	 */
+	void terminate(const std::shared_ptr<ChildStatus> &status, double timeout);
+
+	/**
+	 * Returns the number of child processes which have not been reaped yet.
+	 */
+	size_t n_children() const;
+
+	/**
+	 * Returns the total number of child processes spawned.
+	 */
+	uint64_t n_spawned() const;
+
+	/**
+	 * Returns the total number of child processes reaped.
+	 */
+	uint64_t n_exited() const;
+};
+
+/**
+ * Returns the Supervisor instance tracking all children of this process.
+ */
+Supervisor &global_supervisor();
+}
+
+#endif /* HTTP_AUDIO_SERVER_SUPERVISOR_HPP */
@@ -0,0 +1,212 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <http_audio_server/metrics.hpp>
+#include <http_audio_server/thread_pool.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct ThreadPoolMetrics {
+	Counter &tasks = global_metrics().counter(
+	    "http_audio_server_thread_pool_tasks_total",
+	    "Number of tasks executed by the worker thread pool");
+	Counter &steals = global_metrics().counter(
+	    "http_audio_server_thread_pool_steals_total",
+	    "Number of tasks taken from the queue of another worker");
+};
+
+ThreadPoolMetrics &thread_pool_metrics()
+{
+	static ThreadPoolMetrics metrics;
+	return metrics;
+}
+}
+
+/*
+ * Class ThreadPoolImpl
+ */
+
+class ThreadPoolImpl {
+private:
+	struct Queue {
+		std::mutex mtx;
+		std::deque<ThreadPool::Task> tasks;
+	};
+
+	/**
+	 * Pool and index of the worker running on the current thread, used to
+	 * push tasks submitted by a worker to its own queue.
+	 */
+	static thread_local ThreadPoolImpl *t_pool;
+	static thread_local size_t t_idx;
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_next_queue{0};
+
+	/**
+	 * Number of queued tasks, protected by m_mtx. Workers sleep on m_cv
+	 * while there is nothing to do.
+	 */
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	size_t m_n_queued = 0;
+	bool m_stop = false;
+
+	bool pop(size_t idx, ThreadPool::Task &task)
+	{
+		// Take the most recent task from the own queue
+		{
+			Queue &queue = *m_queues[idx];
+			std::lock_guard<std::mutex> lock(queue.mtx);
+			if (!queue.tasks.empty()) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+				return true;
+			}
+		}
+
+		// Steal the oldest task from one of the other queues
+		for (size_t i = 1; i < m_queues.size(); i++) {
+			Queue &queue = *m_queues[(idx + i) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mtx);
+			if (!queue.tasks.empty()) {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+				thread_pool_metrics().steals.inc();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void worker(size_t idx)
+	{
+		t_pool = this;
+		t_idx = idx;
+		while (true) {
+			// Wait for a task to be queued, each queued task is claimed by
+			// exactly one worker
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				m_cv.wait(lock, [this] { return m_stop || m_n_queued > 0; });
+				if (m_n_queued == 0) {
+					break;
+				}
+				m_n_queued--;
+			}
+
+			// Claiming a task guarantees that one is in one of the queues
+			ThreadPool::Task task;
+			while (!pop(idx, task)) {
+				std::this_thread::yield();
+			}
+			task();
+			thread_pool_metrics().tasks.inc();
+		}
+	}
+
+public:
+	ThreadPoolImpl(size_t n_threads)
+	{
+		if (n_threads == 0) {
+			n_threads = std::max(1U, std::thread::hardware_concurrency());
+		}
+		for (size_t i = 0; i < n_threads; i++) {
+			m_queues.emplace_back(std::make_unique<Queue>());
+		}
+		for (size_t i = 0; i < n_threads; i++) {
+			m_threads.emplace_back(&ThreadPoolImpl::worker, this, i);
+		}
+	}
+
+	~ThreadPoolImpl()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (std::thread &thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	void push(ThreadPool::Task task)
+	{
+		const size_t idx = (t_pool == this)
+		                       ? t_idx
+		                       : m_next_queue++ % m_queues.size();
+		{
+			Queue &queue = *m_queues[idx];
+			std::lock_guard<std::mutex> lock(queue.mtx);
+			queue.tasks.emplace_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_n_queued++;
+		}
+		m_cv.notify_one();
+	}
+
+	size_t size() const { return m_threads.size(); }
+};
+
+thread_local ThreadPoolImpl *ThreadPoolImpl::t_pool = nullptr;
+thread_local size_t ThreadPoolImpl::t_idx = 0;
+
+/*
+ * Class ThreadPool
+ */
+
+ThreadPool::ThreadPool(size_t n_threads)
+    : m_impl(std::make_unique<ThreadPoolImpl>(n_threads))
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+void ThreadPool::push(Task task) { m_impl->push(std::move(task)); }
+size_t ThreadPool::size() const { return m_impl->size(); }
+
+/*
+ * Functions
+ */
+
+ThreadPool &global_thread_pool(size_t n_threads)
+{
+	static ThreadPool pool(n_threads);
+	return pool;
+}
+}
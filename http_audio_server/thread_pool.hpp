@@ -0,0 +1,104 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file thread_pool.hpp
+ *
+ * Contains the ThreadPool class, a work-stealing pool of worker threads used
+ * to spread CPU-bound work such as encoding the segments of a track over all
+ * cores.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_THREAD_POOL_HPP
+#define HTTP_AUDIO_SERVER_THREAD_POOL_HPP
+
+#include <functional>
+#include <future>
+#include <memory>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class ThreadPoolImpl;
+
+/**
+ * The ThreadPool class runs tasks on a fixed number of worker threads. Each
+ * worker owns a task queue; tasks submitted from a worker go to its own
+ * queue and are executed in LIFO order, idle workers steal the oldest tasks
+ * from the other queues. Tasks must not block waiting for other tasks.
+ */
+class ThreadPool {
+private:
+	std::unique_ptr<ThreadPoolImpl> m_impl;
+
+public:
+	using Task = std::function<void()>;
+
+	/**
+	 * Creates a new thread pool.
+	 *
+	 * @param n_threads is the number of worker threads. Zero selects the
+	 * number of hardware threads.
+	 */
+	explicit ThreadPool(size_t n_threads = 0);
+
+	/**
+	 * Waits for the queued tasks to finish and stops the worker threads.
+	 */
+	~ThreadPool();
+
+	/**
+	 * Queues the given task.
+	 */
+	void push(Task task);
+
+	/**
+	 * Queues the given callable and returns a future receiving its result or
+	 * the exception it threw.
+	 */
+	template <typename F>
+	auto submit(F f) -> std::future<decltype(f())>
+	{
+		using Result = decltype(f());
+		auto task =
+		    std::make_shared<std::packaged_task<Result()>>(std::move(f));
+		std::future<Result> res = task->get_future();
+		push([task] { (*task)(); });
+		return res;
+	}
+
+	/**
+	 * Returns the number of worker threads.
+	 */
+	size_t size() const;
+};
+
+/**
+ * Returns the thread pool shared by all CPU-bound background work.
+ *
+ * @param n_threads is the number of worker threads, zero selects the number
+ * of CPU cores. Only the first call creates the pool, later calls ignore the
+ * parameter.
+ */
+ThreadPool &global_thread_pool(size_t n_threads = 0);
+}
+
+#endif /* HTTP_AUDIO_SERVER_THREAD_POOL_HPP */
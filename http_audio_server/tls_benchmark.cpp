@@ -0,0 +1,262 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measures the server-side CPU time spent per Gbit of downloaded data, e.g.
+ * to compare a cached track served over plain HTTP, over the native TLS
+ * listener and through a TLS proxy. Usage:
+ *
+ *     http_audio_server_tls_benchmark [--duration SECONDS]
+ *                                     [--connections N]
+ *                                     NAME URL PID[,PID...]...
+ *
+ * Each setup named NAME is measured in turn: URL is downloaded repeatedly
+ * over N concurrent connections (default 4) for the given number of seconds
+ * (default 10), while the user and system CPU time of the listed processes,
+ * e.g. the server and the proxy in front of it, is sampled from /proc. TLS
+ * certificates are not verified. The client runs in this process and is not
+ * counted.
+ *
+ * Kernel TLS moves the record encryption from user into system time, the
+ * server counts the connections using it in http_audio_server_tls_ktls_total.
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <lib/mongoose.h>
+
+using Clock = std::chrono::steady_clock;
+
+struct Setup {
+	std::string name;
+	std::string url;
+	std::vector<pid_t> pids;
+};
+
+struct CpuTime {
+	double user = 0.0;
+	double sys = 0.0;
+};
+
+struct Downloads {
+	std::string host;
+	std::string path;
+	uint64_t n_bytes = 0;
+	size_t n_active = 0;
+	size_t n_failed = 0;
+};
+
+/**
+ * Returns the accumulated CPU time of all threads of the given processes.
+ */
+static CpuTime cpu_time(const std::vector<pid_t> &pids)
+{
+	CpuTime res;
+	const double tick = double(sysconf(_SC_CLK_TCK));
+	for (pid_t pid : pids) {
+		std::ifstream is("/proc/" + std::to_string(pid) + "/stat");
+		std::string stat((std::istreambuf_iterator<char>(is)),
+		                 std::istreambuf_iterator<char>());
+		if (stat.empty()) {
+			throw std::runtime_error("Process " + std::to_string(pid) +
+			                         " not found");
+		}
+
+		// utime and stime are the 14th and 15th field, the second field is
+		// the parenthesised command name, which may contain spaces
+		std::istringstream ss(stat.substr(stat.rfind(')') + 2));
+		std::string field;
+		for (size_t i = 3; i < 14; i++) {
+			ss >> field;
+		}
+		unsigned long long utime = 0, stime = 0;
+		ss >> utime >> stime;
+		res.user += utime / tick;
+		res.sys += stime / tick;
+	}
+	return res;
+}
+
+static void event_handler(mg_connection *nc, int ev, void *ev_data)
+{
+	Downloads &d = *static_cast<Downloads *>(nc->user_data);
+	switch (ev) {
+		case MG_EV_CONNECT:
+			if (*static_cast<int *>(ev_data) == 0) {
+				mg_printf(nc,
+				          "GET %s HTTP/1.1\r\nHost: %s\r\n"
+				          "Connection: close\r\n\r\n",
+				          d.path.c_str(), d.host.c_str());
+			}
+			break;
+		case MG_EV_RECV:
+			// Only count successful responses, the body is discarded
+			if (!(nc->flags & MG_F_USER_1)) {
+				const mbuf &buf = nc->recv_mbuf;
+				if (buf.len < 12) {
+					break;
+				}
+				if (memcmp(buf.buf + 8, " 200", 4) != 0) {
+					d.n_failed++;
+					nc->flags |= MG_F_CLOSE_IMMEDIATELY | MG_F_USER_2;
+					break;
+				}
+				nc->flags |= MG_F_USER_1;
+			}
+			d.n_bytes += nc->recv_mbuf.len;
+			mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+			break;
+		case MG_EV_CLOSE:
+			// Connections closed before receiving a response failed, unless
+			// they were already counted
+			d.n_active--;
+			if (!(nc->flags & (MG_F_USER_1 | MG_F_USER_2))) {
+				d.n_failed++;
+			}
+			break;
+	}
+}
+
+static bool start_download(mg_mgr *mgr, const std::string &url,
+                           Downloads &d)
+{
+	mg_str scheme, user_info, host, path, query, fragment;
+	unsigned int port = 0;
+	if (mg_parse_uri(mg_mk_str(url.c_str()), &scheme, &user_info, &host,
+	                 &port, &path, &query, &fragment) != 0) {
+		return false;
+	}
+	const bool tls = mg_vcmp(&scheme, "https") == 0;
+	if (port == 0) {
+		port = tls ? 443 : 80;
+	}
+	d.host = std::string(host.p, host.len);
+	d.path = std::string(path.p, path.len);
+	if (query.len > 0) {
+		d.path += "?" + std::string(query.p, query.len);
+	}
+
+	mg_connect_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.user_data = &d;
+#ifdef MG_ENABLE_SSL
+	if (tls) {
+		opts.ssl_ca_cert = "*";
+		opts.ssl_server_name = "*";
+	}
+#else
+	if (tls) {
+		return false;
+	}
+#endif
+	const std::string addr = "tcp://" + d.host + ":" + std::to_string(port);
+	if (!mg_connect_opt(mgr, addr.c_str(), event_handler, opts)) {
+		return false;
+	}
+	d.n_active++;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	double duration = 10.0;
+	size_t n_connections = 4;
+	std::vector<Setup> setups;
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg == "--duration" && i + 1 < argc) {
+			duration = std::stod(argv[++i]);
+		}
+		else if (arg == "--connections" && i + 1 < argc) {
+			n_connections = std::stoul(argv[++i]);
+		}
+		else if (arg.compare(0, 2, "--") == 0 || i + 2 >= argc) {
+			setups.clear();
+			break;
+		}
+		else {
+			Setup setup{arg, argv[i + 1], {}};
+			std::istringstream ss(argv[i + 2]);
+			std::string pid;
+			while (std::getline(ss, pid, ',')) {
+				setup.pids.push_back(std::stol(pid));
+			}
+			setups.push_back(setup);
+			i += 2;
+		}
+	}
+	if (setups.empty() || n_connections == 0 || !(duration > 0.0)) {
+		std::cerr << "Usage: " << argv[0]
+		          << " [--duration SECONDS] [--connections N] "
+		             "NAME URL PID[,PID...]..."
+		          << std::endl;
+		return 1;
+	}
+
+	std::cout << std::left << std::setw(16) << "setup" << std::right
+	          << std::setw(10) << "Gbit/s" << std::setw(14) << "user s/Gbit"
+	          << std::setw(14) << "sys s/Gbit" << std::setw(14)
+	          << "CPU s/Gbit" << std::setw(10) << "failed" << std::endl
+	          << std::fixed << std::setprecision(3);
+	for (const Setup &setup : setups) {
+		mg_mgr mgr;
+		mg_mgr_init(&mgr, nullptr);
+		Downloads d;
+		const CpuTime cpu0 = cpu_time(setup.pids);
+		const Clock::time_point t0 = Clock::now();
+		const Clock::time_point t_end =
+		    t0 + std::chrono::duration_cast<Clock::duration>(
+		             std::chrono::duration<double>(duration));
+		while (Clock::now() < t_end) {
+			while (d.n_active < n_connections) {
+				if (!start_download(&mgr, setup.url, d)) {
+					std::cerr << "Cannot connect to " << setup.url
+					          << std::endl;
+					return 1;
+				}
+			}
+			mg_mgr_poll(&mgr, 10);
+		}
+		const double elapsed =
+		    std::chrono::duration<double>(Clock::now() - t0).count();
+		const CpuTime cpu1 = cpu_time(setup.pids);
+		const size_t n_failed = d.n_failed;
+		mg_mgr_free(&mgr);
+
+		const double gbit = d.n_bytes * 8e-9;
+		std::cout << std::left << std::setw(16) << setup.name << std::right
+		          << std::setw(10) << gbit / elapsed << std::setw(14)
+		          << (cpu1.user - cpu0.user) / gbit << std::setw(14)
+		          << (cpu1.sys - cpu0.sys) / gbit << std::setw(14)
+		          << (cpu1.user + cpu1.sys - cpu0.user - cpu0.sys) / gbit
+		          << std::setw(10) << n_failed << std::endl;
+	}
+	return 0;
+}
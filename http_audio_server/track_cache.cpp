@@ -0,0 +1,443 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <http_audio_server/encoder.hpp>
+#include <http_audio_server/logger.hpp>
+#include <http_audio_server/metadata.hpp>
+#include <http_audio_server/metrics.hpp>
+#include <http_audio_server/segmenter.hpp>
+#include <http_audio_server/track_cache.hpp>
+
+namespace http_audio_server {
+
+/*
+ * Metrics
+ */
+
+namespace {
+struct TrackCacheMetrics {
+	Counter &hits = global_metrics().counter(
+	    "http_audio_server_track_cache_hits_total",
+	    "Number of track downloads served from the cache");
+	Counter &misses = global_metrics().counter(
+	    "http_audio_server_track_cache_misses_total",
+	    "Number of track downloads which started a transcode");
+	Histogram &transcode = global_metrics().histogram(
+	    "http_audio_server_track_cache_transcode_seconds",
+	    "Time spent transcoding a complete track into the cache");
+	Counter &evictions = global_metrics().counter(
+	    "http_audio_server_track_cache_evictions_total",
+	    "Number of cached tracks removed to stay within the size limit");
+	Gauge &bytes = global_metrics().gauge(
+	    "http_audio_server_track_cache_bytes",
+	    "Total size of the cached tracks");
+};
+
+TrackCacheMetrics &track_cache_metrics()
+{
+	static TrackCacheMetrics metrics;
+	return metrics;
+}
+
+/**
+ * Returns the bitrate advertised by the segmenter which is closest to the
+ * given one, so that clients cannot create a cache entry per bitrate.
+ */
+size_t closest_bitrate(size_t bitrate)
+{
+	size_t res = Segmenter::BITRATES[0];
+	for (size_t b : Segmenter::BITRATES) {
+		const size_t d = (b > bitrate) ? (b - bitrate) : (bitrate - b);
+		const size_t d_res =
+		    (res > bitrate) ? (res - bitrate) : (bitrate - res);
+		if (d < d_res) {
+			res = b;
+		}
+	}
+	return res;
+}
+
+bool ends_with(const std::string &s, const std::string &suffix)
+{
+	return s.size() >= suffix.size() &&
+	       s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+}
+
+/*
+ * Class TrackCacheReader
+ */
+
+TrackCacheReader::TrackCacheReader(std::shared_ptr<TrackCacheJob> job)
+    : m_job(std::move(job)), m_fd(open(m_job->path().c_str(), O_RDONLY))
+{
+	if (m_fd < 0) {
+		throw std::runtime_error("Cannot open " + m_job->path());
+	}
+}
+
+TrackCacheReader::~TrackCacheReader() { close(m_fd); }
+
+bool TrackCacheReader::read(std::ostream &os, size_t max_bytes)
+{
+	// Check for completion before reading, data written before the job was
+	// marked as done is visible to the read below
+	const bool done = m_job->done();
+	if (m_job->failed()) {
+		throw std::runtime_error("Transcode failed");
+	}
+
+	std::vector<char> buf(max_bytes);
+	const ssize_t n = ::read(m_fd, &buf[0], buf.size());
+	if (n < 0) {
+		throw std::runtime_error("Error while reading " + m_job->path());
+	}
+	os.write(&buf[0], n);
+	return n > 0 || !done;
+}
+
+/*
+ * Class TrackCacheImpl
+ */
+
+class TrackCacheImpl {
+private:
+	struct Transcode {
+		std::string filename;
+		size_t bitrate;
+		std::string path;
+		std::shared_ptr<TrackCacheJob> job;
+		std::shared_ptr<std::ofstream> os;
+	};
+
+	struct Worker {
+		std::thread thread;
+		bool finished = false;
+	};
+
+	struct Entry {
+		std::string path;
+		size_t size;
+	};
+
+	const Segmenter &m_segmenter;
+	std::string m_dir;
+	size_t m_max_transcodes;
+	size_t m_max_size;
+
+	std::mutex m_mtx;
+	std::unordered_map<std::string, std::shared_ptr<TrackCacheJob>> m_running;
+	std::deque<Transcode> m_queue;
+	std::list<Worker> m_workers;
+	size_t m_n_workers = 0;
+
+	/**
+	 * Complete cache files, the most recently used one first.
+	 */
+	std::list<Entry> m_lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> m_entries;
+	size_t m_size = 0;
+
+	/**
+	 * Adds the given complete file to the front of the LRU list or moves it
+	 * there if it is already known.
+	 */
+	void touch(const std::string &path)
+	{
+		auto it = m_entries.find(path);
+		if (it != m_entries.end()) {
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+			return;
+		}
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			return;
+		}
+		m_lru.emplace_front(Entry{path, size_t(st.st_size)});
+		m_entries.emplace(path, m_lru.begin());
+		m_size += st.st_size;
+		track_cache_metrics().bytes.inc(st.st_size);
+	}
+
+	/**
+	 * Removes the least recently used files until the cache fits into its
+	 * size limit. The most recently used file is always kept. Requests
+	 * currently serving an evicted file keep their file descriptor.
+	 */
+	void evict()
+	{
+		while (m_size > m_max_size && m_lru.size() > 1) {
+			const Entry &entry = m_lru.back();
+			global_logger().debug("track_cache", "Evicting " + entry.path);
+			unlink(entry.path.c_str());
+			m_size -= entry.size;
+			track_cache_metrics().bytes.dec(entry.size);
+			track_cache_metrics().evictions.inc();
+			m_entries.erase(entry.path);
+			m_lru.pop_back();
+		}
+	}
+
+	/**
+	 * Indexes the files left in the cache directory by a previous run,
+	 * ordered by their modification time.
+	 */
+	void scan()
+	{
+		DIR *dir = opendir(m_dir.c_str());
+		if (!dir) {
+			return;
+		}
+		std::vector<std::pair<uint64_t, std::string>> files;
+		while (dirent *ent = readdir(dir)) {
+			const std::string path = m_dir + "/" + ent->d_name;
+			struct stat st;
+			if (ends_with(path, ".webm") && stat(path.c_str(), &st) == 0 &&
+			    S_ISREG(st.st_mode)) {
+				files.emplace_back(uint64_t(st.st_mtim.tv_sec) * 1000000000 +
+				                       st.st_mtim.tv_nsec,
+				                   path);
+			}
+		}
+		closedir(dir);
+		std::sort(files.begin(), files.end());
+		for (const auto &file : files) {
+			touch(file.second);
+		}
+		evict();
+	}
+
+	/**
+	 * Returns the path of the cache entry, or an empty string if the source
+	 * file does not exist.
+	 */
+	std::string cache_path(const std::string &filename, size_t bitrate)
+	{
+		const std::string version = file_version(filename);
+		if (version.empty()) {
+			return std::string();
+		}
+		return m_dir + "/" + version + "_" + std::to_string(bitrate) + ".webm";
+	}
+
+	void transcode(const Transcode &t)
+	{
+		// Each segment is muxed twice: into the live stream read by the
+		// requests waiting for the transcode, and into the seekable cache
+		// file, which only becomes valid once the Cues have been written
+		const std::string part = t.path + ".part";
+		std::ofstream &os = *t.os;
+		bool ok = false;
+		try {
+			ScopedTimer timer(track_cache_metrics().transcode);
+			const size_t rate = m_segmenter.rate();
+			const size_t n_channels = m_segmenter.n_channels();
+			Encoder stream_encoder(rate, n_channels);
+			Encoder file_encoder(rate, n_channels, part);
+			std::ostringstream null_os;
+			ok = m_segmenter.encode_track(
+			    t.filename, t.bitrate,
+			    [&](const std::vector<std::string> &packets) {
+				    stream_encoder.mux_packets(packets, os);
+				    os.flush();
+				    file_encoder.mux_packets(packets, null_os);
+				});
+			stream_encoder.finalize(t.bitrate, os);
+			file_encoder.finalize(t.bitrate, null_os);
+			os.close();
+			ok = ok && !os.fail();
+		}
+		catch (std::exception &e) {
+			global_logger().error("track_cache", "Cannot transcode " +
+			                                         t.filename + ": " +
+			                                         e.what());
+		}
+
+		// Publish the complete file before removing the job, so no request
+		// in between starts another transcode. Readers of the live stream
+		// keep their file descriptors after it is unlinked.
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (ok && rename(part.c_str(), t.path.c_str()) == 0) {
+			t.job->m_done = true;
+			touch(t.path);
+			evict();
+		}
+		else {
+			unlink(part.c_str());
+			t.job->m_failed = true;
+		}
+		unlink(t.job->path().c_str());
+		m_running.erase(t.path);
+	}
+
+	/**
+	 * Runs the queued transcodes until the queue is empty.
+	 */
+	void work(Worker *worker)
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while (!m_queue.empty()) {
+			const Transcode t = std::move(m_queue.front());
+			m_queue.pop_front();
+			lock.unlock();
+			transcode(t);
+			lock.lock();
+		}
+		worker->finished = true;
+		m_n_workers--;
+	}
+
+	void reap()
+	{
+		for (auto it = m_workers.begin(); it != m_workers.end();) {
+			if (it->finished) {
+				it->thread.join();
+				it = m_workers.erase(it);
+			}
+			else {
+				it++;
+			}
+		}
+	}
+
+public:
+	TrackCacheImpl(const Segmenter &segmenter, const std::string &dir,
+	               size_t max_transcodes, size_t max_size)
+	    : m_segmenter(segmenter),
+	      m_dir(dir),
+	      m_max_transcodes(std::max<size_t>(1, max_transcodes)),
+	      m_max_size(max_size)
+	{
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+			throw std::runtime_error("Cannot create cache directory " + dir);
+		}
+		scan();
+	}
+
+	~TrackCacheImpl()
+	{
+		// Fail the queued transcodes, wait for the running ones
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			for (Transcode &t : m_queue) {
+				unlink(t.job->path().c_str());
+				t.job->m_failed = true;
+				m_running.erase(t.path);
+			}
+			m_queue.clear();
+		}
+		for (Worker &worker : m_workers) {
+			worker.thread.join();
+		}
+		track_cache_metrics().bytes.dec(m_size);
+	}
+
+	std::string get(const std::string &filename, size_t bitrate,
+	                std::shared_ptr<TrackCacheReader> &reader)
+	{
+		reader = nullptr;
+		if (bitrate < Segmenter::MIN_BITRATE ||
+		    bitrate > Segmenter::MAX_BITRATE) {
+			throw std::invalid_argument("Bitrate out of range");
+		}
+		bitrate = closest_bitrate(bitrate);
+		const std::string path = cache_path(filename, bitrate);
+		if (path.empty()) {
+			return std::string();
+		}
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		reap();
+
+		// Serve complete files directly
+		if (access(path.c_str(), R_OK) == 0) {
+			track_cache_metrics().hits.inc();
+			touch(path);
+			return path;
+		}
+
+		// Join a running transcode or start a new one. The live stream is
+		// created and opened while holding the lock, the transcode only
+		// unlinks it while holding the lock as well.
+		auto it = m_running.find(path);
+		if (it != m_running.end()) {
+			reader = std::make_shared<TrackCacheReader>(it->second);
+			return std::string();
+		}
+		track_cache_metrics().misses.inc();
+		auto job = std::make_shared<TrackCacheJob>(path + ".stream");
+		auto os = std::make_shared<std::ofstream>(
+		    job->path(), std::ios::binary | std::ios::trunc);
+		if (!os->is_open()) {
+			throw std::runtime_error("Cannot create " + job->path());
+		}
+		reader = std::make_shared<TrackCacheReader>(job);
+		m_running.emplace(path, job);
+
+		// Queue the transcode, at most m_max_transcodes run at the same time
+		m_queue.emplace_back(Transcode{filename, bitrate, path, job, os});
+		if (m_n_workers < m_max_transcodes) {
+			m_n_workers++;
+			m_workers.emplace_back();
+			Worker &worker = m_workers.back();
+			worker.thread = std::thread(&TrackCacheImpl::work, this, &worker);
+		}
+		return std::string();
+	}
+};
+
+/*
+ * Class TrackCache
+ */
+
+TrackCache::TrackCache(const Segmenter &segmenter, const std::string &dir,
+                       size_t max_transcodes, size_t max_size)
+    : m_impl(std::make_unique<TrackCacheImpl>(segmenter, dir, max_transcodes,
+                                              max_size))
+{
+}
+
+TrackCache::~TrackCache()
+{
+	// Do nothing here, just required for the unique_ptr destructor
+}
+
+std::string TrackCache::get(const std::string &filename, size_t bitrate,
+                            std::shared_ptr<TrackCacheReader> &reader)
+{
+	return m_impl->get(filename, bitrate, reader);
+}
+}
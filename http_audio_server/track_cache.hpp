@@ -0,0 +1,147 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file track_cache.hpp
+ *
+ * Contains the TrackCache class, which keeps complete transcodes of tracks on
+ * disk so downloads only have to be encoded once.
+ *
+ * @author Andreas Stöckel
+ */
+
+#ifndef HTTP_AUDIO_SERVER_TRACK_CACHE_HPP
+#define HTTP_AUDIO_SERVER_TRACK_CACHE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <string>
+
+namespace http_audio_server {
+/*
+ * Forward declarations.
+ */
+class Segmenter;
+class TrackCacheImpl;
+
+/**
+ * Progress of a transcode which is being written to the cache.
+ */
+class TrackCacheJob {
+private:
+	friend class TrackCacheImpl;
+
+	std::string m_path;
+	std::atomic<bool> m_done{false};
+	std::atomic<bool> m_failed{false};
+
+public:
+	explicit TrackCacheJob(const std::string &path) : m_path(path) {}
+
+	/**
+	 * Path of the live WebM stream the transcode is written to while it is
+	 * running. The file is removed once the transcode is complete, open file
+	 * descriptors stay valid.
+	 */
+	const std::string &path() const { return m_path; }
+
+	/**
+	 * Returns true once all data has been written to the file.
+	 */
+	bool done() const { return m_done; }
+
+	/**
+	 * Returns true if the transcode failed, the file is incomplete.
+	 */
+	bool failed() const { return m_failed; }
+};
+
+/**
+ * Reads the output of a transcode while it is being written. Readers are
+ * created by TrackCache::get(), which opens the live stream before the
+ * transcode may remove it.
+ */
+class TrackCacheReader {
+private:
+	std::shared_ptr<TrackCacheJob> m_job;
+	int m_fd;
+
+public:
+	explicit TrackCacheReader(std::shared_ptr<TrackCacheJob> job);
+	~TrackCacheReader();
+
+	TrackCacheReader(const TrackCacheReader &) = delete;
+	TrackCacheReader &operator=(const TrackCacheReader &) = delete;
+
+	/**
+	 * Writes at most the given number of bytes which are available without
+	 * waiting to the output stream. Returns false once the transcode is
+	 * complete and all data has been read. Throws std::runtime_error if the
+	 * transcode failed.
+	 */
+	bool read(std::ostream &os, size_t max_bytes);
+};
+
+/**
+ * The TrackCache class transcodes complete tracks into a cache directory on
+ * background threads. Cache entries are keyed by the filename, the size and
+ * the modification time of the source file and the bitrate. Cached files are
+ * seekable WebM files with Cues and a Duration; requests arriving while the
+ * transcode is running are served from a live stream instead. Only a limited
+ * number of transcodes run at the same time, the others are queued. Once the
+ * cached files exceed the size limit, the least recently used ones are
+ * removed.
+ */
+class TrackCache {
+private:
+	std::unique_ptr<TrackCacheImpl> m_impl;
+
+public:
+	/**
+	 * Creates a new track cache.
+	 *
+	 * @param segmenter is used to encode the tracks.
+	 * @param dir is the cache directory, it is created if it does not exist.
+	 * @param max_transcodes is the maximum number of concurrent transcodes.
+	 * @param max_size is the total size in bytes of the cached files above
+	 * which files are evicted.
+	 */
+	TrackCache(const Segmenter &segmenter, const std::string &dir,
+	           size_t max_transcodes = 2, size_t max_size = size_t(4) << 30);
+
+	/**
+	 * Waits for the running transcodes to finish, queued transcodes fail.
+	 */
+	~TrackCache();
+
+	/**
+	 * Looks up the transcode of the given track. Returns the path of the
+	 * cached file if it is complete. Otherwise returns an empty string and
+	 * sets reader to a reader of the running transcode, which is started or
+	 * queued if necessary. reader is set to nullptr if the track does not
+	 * exist. The bitrate is rounded to the closest of Segmenter::BITRATES.
+	 * Throws std::invalid_argument if the bitrate is out of range.
+	 */
+	std::string get(const std::string &filename, size_t bitrate,
+	                std::shared_ptr<TrackCacheReader> &reader);
+};
+}
+
+#endif /* HTTP_AUDIO_SERVER_TRACK_CACHE_HPP */
@@ -0,0 +1,202 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Checks that the vectorized PCM kernels produce bit-identical results to
+ * the scalar reference implementation. Lengths which are not a multiple of
+ * the vector width, unaligned buffers, NaN, infinities and samples outside
+ * of the valid range are covered.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/pcm.hpp>
+
+using namespace http_audio_server;
+
+/**
+ * Maximum number of frames per test, covers several iterations of the
+ * widest vector loop and all tail lengths.
+ */
+static constexpr size_t MAX_FRAMES = 67;
+
+/**
+ * Returns n pseudo-random bytes.
+ */
+static std::vector<uint8_t> random_bytes(size_t n, uint32_t &state)
+{
+	std::vector<uint8_t> res(n);
+	for (uint8_t &b : res) {
+		state = state * 1664525 + 1013904223;
+		b = state >> 24;
+	}
+	return res;
+}
+
+/**
+ * Returns n floats, mostly in [-1.5, 1.5], interspersed with values at and
+ * around the clipping boundaries and special values.
+ */
+static std::vector<float> random_floats(size_t n, uint32_t &state)
+{
+	static const float special[] = {
+	    std::numeric_limits<float>::quiet_NaN(),
+	    -std::numeric_limits<float>::quiet_NaN(),
+	    std::numeric_limits<float>::infinity(),
+	    -std::numeric_limits<float>::infinity(),
+	    1.0f,
+	    -1.0f,
+	    32767.0f / 32768.0f,
+	    32767.5f / 32768.0f,
+	    -32768.5f / 32768.0f,
+	    0.5f / 32768.0f,
+	    -0.5f / 32768.0f,
+	    1.5f / 32768.0f,
+	    -0.0f,
+	    1e30f,
+	    -1e30f};
+	constexpr size_t n_special = sizeof(special) / sizeof(special[0]);
+	std::vector<float> res(n);
+	for (float &x : res) {
+		state = state * 1664525 + 1013904223;
+		if ((state >> 30) == 0) {
+			x = special[(state >> 8) % n_special];
+		}
+		else {
+			x = ((state >> 8) / float(1 << 24) - 0.5f) * 3.0f;
+		}
+	}
+	return res;
+}
+
+/**
+ * Output of a single kernel invocation.
+ */
+using Kernel = std::function<std::vector<uint8_t>(size_t n_frames)>;
+
+template <typename T>
+static std::vector<uint8_t> bytes(const std::vector<T> &v)
+{
+	std::vector<uint8_t> res(v.size() * sizeof(T));
+	if (!res.empty()) {
+		memcpy(&res[0], &v[0], res.size());
+	}
+	return res;
+}
+
+int main()
+{
+	std::vector<std::pair<std::string, Kernel>> kernels;
+	uint32_t state = 1;
+
+	// The source buffers are offset by one sample so the kernels have to
+	// cope with unaligned input
+	const std::vector<uint8_t> raw = random_bytes(16 * MAX_FRAMES + 16, state);
+	const std::vector<float> floats = random_floats(2 * MAX_FRAMES + 1, state);
+	const std::vector<double> doubles(floats.begin(), floats.end());
+	const float *src = &floats[1];
+
+	struct {
+		const char *name;
+		SampleFormat fmt;
+		bool little_endian;
+	} const conversions[] = {{"s16le_to_float", SampleFormat::S16, true},
+	                         {"s16be_to_float", SampleFormat::S16, false},
+	                         {"s32le_to_float", SampleFormat::S32, true},
+	                         {"u8_to_float", SampleFormat::U8, true},
+	                         {"s24le_to_float", SampleFormat::S24, true}};
+	for (const auto &c : conversions) {
+		const SampleFormat fmt = c.fmt;
+		const bool little_endian = c.little_endian;
+		kernels.emplace_back(c.name, [&, fmt, little_endian](size_t n) {
+			std::vector<float> tar(n);
+			pcm_to_float(&raw[sample_size(fmt)], fmt, little_endian,
+			             tar.data(), n);
+			return bytes(tar);
+		});
+	}
+	kernels.emplace_back("f64_to_float", [&](size_t n) {
+		std::vector<float> tar(n);
+		pcm_to_float(&doubles[1], SampleFormat::F64, true, tar.data(), n);
+		return bytes(tar);
+	});
+	kernels.emplace_back("float_to_s16le", [&](size_t n) {
+		std::vector<int16_t> tar(n);
+		float_to_pcm(src, tar.data(), SampleFormat::S16, true, n);
+		return bytes(tar);
+	});
+	kernels.emplace_back("float_to_s16be", [&](size_t n) {
+		std::vector<int16_t> tar(n);
+		float_to_pcm(src, tar.data(), SampleFormat::S16, false, n);
+		return bytes(tar);
+	});
+	kernels.emplace_back("stereo_to_mono", [&](size_t n) {
+		std::vector<float> tar(n);
+		remix(src, 2, tar.data(), 1, n);
+		return bytes(tar);
+	});
+	kernels.emplace_back("mono_to_stereo", [&](size_t n) {
+		std::vector<float> tar(2 * n);
+		remix(src, 1, tar.data(), 2, n);
+		return bytes(tar);
+	});
+	kernels.emplace_back("deinterleave_stereo", [&](size_t n) {
+		std::vector<float> l(n), r(n);
+		float *tar[] = {l.data(), r.data()};
+		deinterleave(src, tar, 2, n);
+		l.insert(l.end(), r.begin(), r.end());
+		return bytes(l);
+	});
+	kernels.emplace_back("interleave_stereo", [&](size_t n) {
+		std::vector<float> tar(2 * n);
+		const float *channels[] = {src, src + MAX_FRAMES};
+		interleave(channels, tar.data(), 2, n);
+		return bytes(tar);
+	});
+
+	int res = 0;
+	const std::vector<std::string> isas = pcm_isas();
+	for (const auto &kernel : kernels) {
+		for (size_t n = 0; n <= MAX_FRAMES; n++) {
+			set_pcm_isa("scalar");
+			const std::vector<uint8_t> reference = kernel.second(n);
+			for (const std::string &isa : isas) {
+				set_pcm_isa(isa);
+				if (kernel.second(n) != reference) {
+					std::cerr << kernel.first << " (" << isa
+					          << ") differs from the scalar kernel for " << n
+					          << " frames" << std::endl;
+					res = 1;
+				}
+			}
+		}
+	}
+	std::cout << "Tested instruction sets:";
+	for (const std::string &isa : isas) {
+		std::cout << " " << isa;
+	}
+	std::cout << std::endl;
+	return res;
+}
@@ -0,0 +1,154 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Checks the quality and the throughput of the Resampler used by the decoder
+ * when the internal resampler is enabled. Sines are converted from common
+ * sample rates to 48 kHz; the THD+N of the result must stay below -90 dB,
+ * chunked conversion must match a conversion in one piece and the
+ * throughput must be far above real time. The measurements are printed.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <http_audio_server/resampler.hpp>
+
+using namespace http_audio_server;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int TAR_RATE = 48000;
+static constexpr int N_CHANNELS = 2;
+
+/**
+ * Maximum THD+N in dB.
+ */
+static constexpr double MAX_THD_N = -90.0;
+
+/**
+ * Minimum throughput in stereo frames per second of input, five times real
+ * time. Release builds are more than a hundred times faster, the margin
+ * covers unoptimised builds and loaded machines.
+ */
+static constexpr double MIN_THROUGHPUT = 5.0 * 48000.0;
+
+static std::vector<float> sine(int rate, double freq, size_t n_frames)
+{
+	std::vector<float> res(n_frames * N_CHANNELS);
+	for (size_t i = 0; i < n_frames; i++) {
+		const float x = 0.5 * std::sin(2.0 * M_PI * freq * i / rate);
+		for (int j = 0; j < N_CHANNELS; j++) {
+			res[i * N_CHANNELS + j] = x;
+		}
+	}
+	return res;
+}
+
+/**
+ * Returns the power of everything but the sine with the given frequency
+ * relative to the power of the sine in dB. The sine is fitted by least
+ * squares to the first channel, skipping the filter transients at both ends.
+ */
+static double thd_n(const std::vector<float> &pcm, double freq)
+{
+	const size_t n_frames = pcm.size() / N_CHANNELS;
+	const size_t begin = n_frames / 10, end = n_frames - n_frames / 10;
+	double ss = 0.0, sc = 0.0, cc = 0.0, xs = 0.0, xc = 0.0;
+	for (size_t i = begin; i < end; i++) {
+		const double phi = 2.0 * M_PI * freq * i / TAR_RATE;
+		const double s = std::sin(phi), c = std::cos(phi);
+		const double x = pcm[i * N_CHANNELS];
+		ss += s * s;
+		sc += s * c;
+		cc += c * c;
+		xs += x * s;
+		xc += x * c;
+	}
+	const double det = ss * cc - sc * sc;
+	const double a = (xs * cc - xc * sc) / det;
+	const double b = (xc * ss - xs * sc) / det;
+	double signal = 0.0, noise = 0.0;
+	for (size_t i = begin; i < end; i++) {
+		const double phi = 2.0 * M_PI * freq * i / TAR_RATE;
+		const double fit = a * std::sin(phi) + b * std::cos(phi);
+		const double x = pcm[i * N_CHANNELS];
+		signal += fit * fit;
+		noise += (x - fit) * (x - fit);
+	}
+	return 10.0 * std::log10(noise / signal);
+}
+
+int main()
+{
+	int res = 0;
+	std::cout << std::fixed << std::setprecision(1);
+	for (int src_rate : {22050, 32000, 44100, 88200, 96000}) {
+		for (double freq : {1000.0, 10000.0}) {
+			const size_t n_frames = src_rate;
+			const std::vector<float> src = sine(src_rate, freq, n_frames);
+
+			// Convert in one piece
+			std::vector<float> tar;
+			Resampler resampler(src_rate, TAR_RATE, N_CHANNELS);
+			const Clock::time_point t0 = Clock::now();
+			resampler.process(src.data(), n_frames, tar);
+			resampler.flush(tar);
+			const double elapsed =
+			    std::chrono::duration<double>(Clock::now() - t0).count();
+			const double throughput = n_frames / elapsed;
+
+			// Convert in chunks of varying size, as read by the decoder
+			std::vector<float> chunked;
+			for (size_t i = 0, n = 1; i < n_frames; i += n, n = n * 2 + 1) {
+				resampler.process(&src[i * N_CHANNELS],
+				                  std::min(n, n_frames - i), chunked);
+			}
+			resampler.flush(chunked);
+
+			const double distortion = thd_n(tar, freq);
+			const size_t n_expected =
+			    (uint64_t(n_frames) * TAR_RATE + src_rate - 1) / src_rate;
+			std::cout << src_rate << " Hz, " << freq << " Hz: THD+N "
+			          << distortion << " dB, " << throughput * 1e-6
+			          << " Mframes/s" << std::endl;
+			if (!(distortion < MAX_THD_N)) {
+				std::cerr << "THD+N above " << MAX_THD_N << " dB" << std::endl;
+				res = 1;
+			}
+			if (throughput < MIN_THROUGHPUT) {
+				std::cerr << "Throughput below " << MIN_THROUGHPUT * 1e-6
+				          << " Mframes/s" << std::endl;
+				res = 1;
+			}
+			if (tar.size() != n_expected * N_CHANNELS) {
+				std::cerr << "Expected " << n_expected << " frames, got "
+				          << tar.size() / N_CHANNELS << std::endl;
+				res = 1;
+			}
+			if (chunked != tar) {
+				std::cerr << "Chunked conversion differs" << std::endl;
+				res = 1;
+			}
+		}
+	}
+	return res;
+}
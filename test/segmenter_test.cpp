@@ -0,0 +1,138 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Checks that DASH media segments are byte-identical no matter how often and
+ * in which order they are encoded. The samples are read from a fixed
+ * synthetic signal instead of ffmpeg.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <http_audio_server/segmenter.hpp>
+
+using namespace http_audio_server;
+
+static constexpr size_t RATE = 48000;
+static constexpr size_t N_CHANNELS = 2;
+static constexpr double SEGMENT_DURATION = 1.0;
+static constexpr size_t BITRATE = 96000;
+
+/**
+ * Returns 5.3 seconds of a chord mixed with noise, so the last segment is
+ * shorter than the others and does not end on a frame boundary.
+ */
+static std::vector<float> make_signal()
+{
+	const size_t n_samples = 53 * RATE / 10;
+	std::vector<float> res(n_samples * N_CHANNELS);
+	uint32_t state = 1;
+	for (size_t i = 0; i < n_samples; i++) {
+		const double t = double(i) / RATE;
+		for (size_t j = 0; j < N_CHANNELS; j++) {
+			state = state * 1664525 + 1013904223;
+			const double noise = (state >> 8) / double(1 << 24) - 0.5;
+			res[i * N_CHANNELS + j] =
+			    0.3 * std::sin(2.0 * M_PI * 220.0 * (j + 1) * t) +
+			    0.2 * std::sin(2.0 * M_PI * 1375.0 * t) + 0.1 * noise;
+		}
+	}
+	return res;
+}
+
+/**
+ * Encodes the segments with the given indices and returns them in the same
+ * order.
+ */
+static std::vector<std::string> encode(const Segmenter &segmenter,
+                                       const std::vector<size_t> &indices)
+{
+	std::vector<std::string> res;
+	for (size_t idx : indices) {
+		std::ostringstream ss;
+		if (!segmenter.write_segment("signal", idx, BITRATE, ss)) {
+			throw std::runtime_error("Segment " + std::to_string(idx) +
+			                         " out of range");
+		}
+		res.emplace_back(ss.str());
+	}
+	return res;
+}
+
+int main()
+{
+	const std::vector<float> signal = make_signal();
+	const Segmenter::Source source = [&](const std::string &, uint64_t start,
+	                                     uint64_t n_samples,
+	                                     std::vector<uint8_t> &buf) {
+		const size_t n_total = signal.size() / N_CHANNELS;
+		const size_t begin = std::min<uint64_t>(start, n_total);
+		const size_t end = std::min<uint64_t>(start + n_samples, n_total);
+		buf.resize((end - begin) * N_CHANNELS * sizeof(float));
+		if (!buf.empty()) {
+			memcpy(&buf[0], &signal[begin * N_CHANNELS], buf.size());
+		}
+	};
+	Segmenter segmenter(source, SEGMENT_DURATION, RATE, N_CHANNELS);
+
+	const std::vector<size_t> in_order{0, 1, 2, 3, 4, 5};
+	const std::vector<size_t> reversed{5, 4, 3, 2, 1, 0};
+	const std::vector<size_t> shuffled{3, 0, 5, 1, 4, 2};
+
+	int res = 0;
+	const std::vector<std::string> reference = encode(segmenter, in_order);
+	std::ostringstream ss;
+	if (segmenter.write_segment("signal", in_order.size(), BITRATE, ss)) {
+		std::cerr << "Segment past the end of the track was encoded"
+		          << std::endl;
+		res = 1;
+	}
+
+	// Encode everything again, in order and with different neighbours
+	// preceding each segment, and once more with a fresh segmenter
+	const std::vector<std::string> again = encode(segmenter, in_order);
+	std::vector<std::string> backwards = encode(segmenter, reversed);
+	std::reverse(backwards.begin(), backwards.end());
+	std::vector<std::string> mixed(in_order.size());
+	const std::vector<std::string> encoded = encode(
+	    Segmenter(source, SEGMENT_DURATION, RATE, N_CHANNELS), shuffled);
+	for (size_t i = 0; i < shuffled.size(); i++) {
+		mixed[shuffled[i]] = encoded[i];
+	}
+
+	for (size_t i = 0; i < in_order.size(); i++) {
+		if (reference[i].empty()) {
+			std::cerr << "Segment " << i << " is empty" << std::endl;
+			res = 1;
+		}
+		if (again[i] != reference[i] || backwards[i] != reference[i] ||
+		    mixed[i] != reference[i]) {
+			std::cerr << "Segment " << i << " differs between encodes"
+			          << std::endl;
+			res = 1;
+		}
+	}
+	return res;
+}
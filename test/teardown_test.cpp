@@ -0,0 +1,169 @@
+/*
+ *  HTTP Streaming Audio Server
+ *  Copyright (C) 2016  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Checks that destroying a decoder whose ffmpeg process is still running
+ * returns immediately and that the process is reaped in the background
+ * within a bounded time, both for a process that exits when asked to and for
+ * one that ignores the termination signals and has to be killed. A shell
+ * script placed in front of the PATH stands in for ffmpeg and records its
+ * process id.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <http_audio_server/decoder.hpp>
+
+using namespace http_audio_server;
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Maximum time the destructor of a decoder may block the calling thread.
+ */
+static constexpr double MAX_DESTROY_TIME = 0.1;
+
+/**
+ * Maximum time until a cooperative child is reaped.
+ */
+static constexpr double MAX_REAP_TIME = 1.0;
+
+/**
+ * Maximum time until a child ignoring SIGINT and SIGTERM is reaped. The
+ * decoder gives ffmpeg one second before it is killed.
+ */
+static constexpr double MAX_KILL_TIME = 3.0;
+
+static double seconds_since(Clock::time_point t)
+{
+	return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+/**
+ * Waits for the stand-in ffmpeg to write its process id to the given file.
+ */
+static pid_t read_pid(const std::string &filename)
+{
+	const Clock::time_point t0 = Clock::now();
+	while (seconds_since(t0) < 5.0) {
+		std::ifstream is(filename);
+		pid_t pid = 0;
+		if (is >> pid && pid > 0) {
+			return pid;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return 0;
+}
+
+/**
+ * Starts a decoder running the given shell script as ffmpeg, reads some
+ * data, destroys the decoder and measures how long the destruction and the
+ * reaping of the process take. Returns false if a bound is exceeded.
+ */
+static bool check_teardown(const std::string &dir, const std::string &name,
+                           const std::string &script, double max_reap_time)
+{
+	const std::string pid_file = dir + "/pid";
+	unlink(pid_file.c_str());
+	{
+		const std::string path = dir + "/ffmpeg";
+		std::ofstream os(path);
+		os << "#!/bin/sh\n"
+		   << "echo $$ > " << pid_file << "\n"
+		   << script;
+		os.close();
+		chmod(path.c_str(), 0755);
+	}
+
+	auto decoder = std::make_unique<Decoder>("input.flac");
+	std::vector<uint8_t> buf;
+	decoder->read(4096, buf);
+	const pid_t pid = read_pid(pid_file);
+	if (pid == 0 || kill(pid, 0) != 0) {
+		std::cerr << name << ": child did not start" << std::endl;
+		return false;
+	}
+
+	// Destroy the decoder while the process is still producing output. The
+	// process is a zombie until it has been reaped, kill() only fails once
+	// it is gone.
+	const Clock::time_point t0 = Clock::now();
+	decoder.reset();
+	const double destroy_time = seconds_since(t0);
+	while (kill(pid, 0) == 0 && seconds_since(t0) < max_reap_time + 5.0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	const double reap_time = seconds_since(t0);
+
+	std::cout << name << ": destroyed after " << destroy_time * 1e3
+	          << " ms, reaped after " << reap_time * 1e3 << " ms"
+	          << std::endl;
+	bool res = true;
+	if (destroy_time > MAX_DESTROY_TIME) {
+		std::cerr << name << ": destructor blocked for more than "
+		          << MAX_DESTROY_TIME << " s" << std::endl;
+		res = false;
+	}
+	if (reap_time > max_reap_time) {
+		std::cerr << name << ": child not reaped within " << max_reap_time
+		          << " s" << std::endl;
+		res = false;
+	}
+	return res;
+}
+
+int main()
+{
+	char dir_template[] = "/tmp/http_audio_server_teardown_XXXXXX";
+	const char *dir = mkdtemp(dir_template);
+	if (!dir) {
+		std::cerr << "Cannot create temporary directory" << std::endl;
+		return 1;
+	}
+	const char *path = getenv("PATH");
+	setenv("PATH", (std::string(dir) + ":" + (path ? path : "")).c_str(), 1);
+
+	int res = 0;
+	if (!check_teardown(dir, "cooperative", "exec cat /dev/zero\n",
+	                    MAX_REAP_TIME)) {
+		res = 1;
+	}
+	if (!check_teardown(dir, "stubborn",
+	                    "trap '' INT TERM\n"
+	                    "while :; do head -c 65536 /dev/zero; done\n",
+	                    MAX_KILL_TIME)) {
+		res = 1;
+	}
+
+	unlink((std::string(dir) + "/pid").c_str());
+	unlink((std::string(dir) + "/ffmpeg").c_str());
+	rmdir(dir);
+	return res;
+}